@@ -717,6 +717,21 @@ static ggml_type kv_cache_type_from_str(const std::string & s) {
     throw std::runtime_error("Unsupported cache type: " + s);
 }
 
+// comma-separated list of KV cache types, TYPE:N repeats a type N times
+static std::vector<ggml_type> kv_cache_types_from_str(const std::string & s) {
+    std::vector<ggml_type> types;
+    for (const auto & item : string_split<std::string>(s, ',')) {
+        const size_t pos = item.find(':');
+        const ggml_type type = kv_cache_type_from_str(item.substr(0, pos));
+        const int n = pos == std::string::npos ? 1 : std::stoi(item.substr(pos + 1));
+        if (n < 1) {
+            throw std::invalid_argument("invalid repeat count in cache type list: " + item);
+        }
+        types.insert(types.end(), n, type);
+    }
+    return types;
+}
+
 static std::string get_all_kv_cache_types() {
     std::ostringstream msg;
     for (const auto & type : kv_cache_types) {
@@ -1331,6 +1346,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_keep = value;
         }
     ));
+    add_opt(common_arg(
+        {"--keep-heavy"}, "N",
+        string_format("max. number of tokens kept on context shift because they received the most attention, instead of the oldest of the kept tokens (needs flash attention off) (default: %d, 0 = disabled)", params.n_keep_heavy),
+        [](common_params & params, int value) {
+            params.n_keep_heavy = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KEEP_HEAVY"));
     add_opt(common_arg(
         {"--no-context-shift"},
         string_format("disables context shift on infinite text generation (default: %s)", params.ctx_shift ? "disabled" : "enabled"),
@@ -1982,6 +2004,23 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.cache_type_v = kv_cache_type_from_str(value);
         }
     ).set_env("LLAMA_ARG_CACHE_TYPE_V"));
+    add_opt(common_arg(
+        {"-ctkl", "--cache-type-k-layers"}, "TYPES",
+        "KV cache data types for K per layer, overrides --cache-type-k\n"
+        "comma-separated list with one type per layer, TYPE:N repeats a type for N layers\n"
+        "(e.g. f16:2,q4_0:28,f16:2)",
+        [](common_params & params, const std::string & value) {
+            params.cache_types_k_layer = kv_cache_types_from_str(value);
+        }
+    ).set_env("LLAMA_ARG_CACHE_TYPE_K_LAYERS"));
+    add_opt(common_arg(
+        {"-ctvl", "--cache-type-v-layers"}, "TYPES",
+        "KV cache data types for V per layer, overrides --cache-type-v\n"
+        "comma-separated list with one type per layer, TYPE:N repeats a type for N layers",
+        [](common_params & params, const std::string & value) {
+            params.cache_types_v_layer = kv_cache_types_from_str(value);
+        }
+    ).set_env("LLAMA_ARG_CACHE_TYPE_V_LAYERS"));
     add_opt(common_arg(
         {"--perplexity", "--all-logits"},
         string_format("return logits for all tokens in the batch (default: %s)", params.logits_all ? "true" : "false"),
@@ -2066,6 +2105,34 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(common_arg(
+        {"--defrag-step-us"}, "N",
+        string_format("max. duration of a KV cache defragmentation step in microseconds, the compaction is spread over several decode calls (default: %d, 0 = defragment in one step)", params.defrag_step_us),
+        [](common_params & params, int value) {
+            params.defrag_step_us = value;
+        }
+    ).set_env("LLAMA_ARG_DEFRAG_STEP_US"));
+    add_opt(common_arg(
+        {"-kvb", "--kv-block-size"}, "N",
+        string_format("cells per block of a paged KV cache, a power of 2, the sequences allocate blocks on demand (default: %d, 0 = contiguous KV cache)", params.kv_block_size),
+        [](common_params & params, int value) {
+            params.kv_block_size = value;
+        }
+    ).set_env("LLAMA_ARG_KV_BLOCK_SIZE"));
+    add_opt(common_arg(
+        {"--state-ckpt"}, "N",
+        string_format("recurrent models: max. number of state checkpoints kept per sequence, a sequence can be rolled back to them to reuse a prompt prefix (default: %d, 0 = disabled)", params.n_state_ckpt),
+        [](common_params & params, int value) {
+            params.n_state_ckpt = value;
+        }
+    ).set_env("LLAMA_ARG_STATE_CKPT"));
+    add_opt(common_arg(
+        {"--state-ckpt-step"}, "N",
+        string_format("recurrent models: min. number of tokens between two state checkpoints of a sequence (default: %d)", params.state_ckpt_step),
+        [](common_params & params, int value) {
+            params.state_ckpt_step = value;
+        }
+    ).set_env("LLAMA_ARG_STATE_CKPT_STEP"));
     add_opt(common_arg(
         {"-np", "--parallel"}, "N",
         string_format("number of parallel sequences to decode (default: %d)", params.n_parallel),
@@ -2094,6 +2161,34 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.cont_batching = false;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_NO_CONT_BATCHING"));
+    add_opt(common_arg(
+        {"--prefill-budget"}, "N",
+        string_format("max. number of prompt tokens per batch while other slots are generating, split evenly across the prompts being processed, 0 = n_batch (default: %d)", params.n_prefill_budget),
+        [](common_params & params, int value) {
+            params.n_prefill_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_BUDGET"));
+    add_opt(common_arg(
+        {"--sched-aging"}, "N",
+        string_format("time in ms that a task waits for a slot to raise its priority by one, 0 = no aging (default: %d)", params.sched_aging_ms),
+        [](common_params & params, int value) {
+            params.sched_aging_ms = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SCHED_AGING"));
+    add_opt(common_arg(
+        {"--priority-max"}, "N",
+        string_format("max. priority that a request can set, higher ones are lowered to it (default: %d, so requests cannot preempt each other)", params.priority_max),
+        [](common_params & params, int value) {
+            params.priority_max = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PRIORITY_MAX"));
+    add_opt(common_arg(
+        {"--embd-batch-window"}, "N",
+        string_format("time in ms to collect embedding and rerank requests that are then computed together, every input as a sequence of one batch, -1 = one slot per request (default: %d)", params.embd_batch_ms),
+        [](common_params & params, int value) {
+            params.embd_batch_ms = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_EMBD_BATCH_WINDOW"));
     add_opt(common_arg(
         {"--mmproj"}, "FILE",
         "path to a multimodal projector file for LLaVA. see examples/llava/README.md",
@@ -2658,6 +2753,51 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_cache_reuse = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_REUSE"));
+    add_opt(common_arg(
+        {"--cache-share"}, "N",
+        string_format("min prompt prefix size to share from the KV cache of another slot, 0 = disabled (default: %d)", params.n_cache_share),
+        [](common_params & params, int value) {
+            params.n_cache_share = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_SHARE"));
+    add_opt(common_arg(
+        {"--cache-spill"}, "N",
+        string_format("size in MiB of the file that the KV cache of idle slots is spilled to, 0 = disabled (default: %d)", params.n_cache_spill),
+        [](common_params & params, int value) {
+            params.n_cache_spill = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_SPILL"));
+    add_opt(common_arg(
+        {"--cache-spill-file"}, "FNAME",
+        "path of the KV cache spill file (default: temporary file)",
+        [](common_params & params, const std::string & value) {
+            params.cache_spill_file = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_SPILL_FILE"));
+    add_opt(common_arg(
+        {"--cache-dir"}, "PATH",
+        "directory of the persistent prompt cache, the KV cache of prompts is stored there and restored by later requests with the same prefix, also after a restart (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.cache_dir = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_DIR"));
+    add_opt(common_arg(
+        {"--cache-dir-size"}, "N",
+        string_format("max. size in MiB of the persistent prompt cache, 0 = unlimited (default: %d)", params.n_cache_dir_size),
+        [](common_params & params, int value) {
+            params.n_cache_dir_size = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_DIR_SIZE"));
+    add_opt(common_arg(
+        {"--cache-dir-chunk"}, "N",
+        string_format("granularity in tokens of the prompt prefixes found in the persistent prompt cache (default: %d)", params.n_cache_dir_chunk),
+        [](common_params & params, int value) {
+            if (value <= 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.n_cache_dir_chunk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_DIR_CHUNK"));
     add_opt(common_arg(
         {"--metrics"},
         string_format("enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled"),
@@ -2697,6 +2837,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--slot-save-compress"},
+        string_format("compress the KV cache of saved slots and of the persistent prompt cache (default: %s)", params.slot_save_compress ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.slot_save_compress = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLOT_SAVE_COMPRESS"));
     add_opt(common_arg(
         {"--jinja"},
         "use jinja template for chat (default: disabled)",
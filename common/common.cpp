@@ -901,6 +901,14 @@ struct common_init_result common_init_from_params(common_params & params) {
         }
     }
 
+    for (const auto * types : { &params.cache_types_k_layer, &params.cache_types_v_layer }) {
+        if (!types->empty() && (int32_t) types->size() != llama_model_n_layer(model)) {
+            LOG_ERR("%s: the per-layer KV cache type list has %zu types, but the model has %d layers\n", __func__, types->size(), llama_model_n_layer(model));
+            llama_model_free(model);
+            return iparams;
+        }
+    }
+
     auto cparams = common_context_params_to_llama(params);
 
     llama_context * lctx = llama_init_from_model(model, cparams);
@@ -1109,11 +1117,16 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.n_kv_block        = params.kv_block_size;
+    cparams.defrag_step_us    = params.defrag_step_us;
+    cparams.n_state_ckpt      = params.n_state_ckpt;
+    cparams.state_ckpt_step   = params.state_ckpt_step;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
     cparams.flash_attn        = params.flash_attn;
     cparams.no_perf           = params.no_perf;
+    cparams.kv_scores         = params.n_keep_heavy > 0;
 
     if (params.reranking) {
         cparams.embeddings    = true;
@@ -1123,6 +1136,9 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.type_k = params.cache_type_k;
     cparams.type_v = params.cache_type_v;
 
+    cparams.type_k_layer = params.cache_types_k_layer.empty() ? nullptr : params.cache_types_k_layer.data();
+    cparams.type_v_layer = params.cache_types_v_layer.empty() ? nullptr : params.cache_types_v_layer.data();
+
     return cparams;
 }
 
@@ -222,6 +222,7 @@ struct common_params {
     int32_t n_batch               =  2048; // logical batch size for prompt processing (must be >=32 to use BLAS)
     int32_t n_ubatch              =   512; // physical batch size for prompt processing (must be >=32 to use BLAS)
     int32_t n_keep                =     0; // number of tokens to keep from initial prompt
+    int32_t n_keep_heavy          =     0; // max. number of tokens kept by received attention on context shift (0 = disabled)
     int32_t n_chunks              =    -1; // max number of chunks to process (-1 = unlimited)
     int32_t n_parallel            =     1; // number of parallel sequences to decode
     int32_t n_sequences           =     1; // number of sequences to decode
@@ -236,6 +237,10 @@ struct common_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          =  0.1f; // KV cache defragmentation threshold
+    int32_t kv_block_size         =     0; // cells per block of the paged KV cache (0 = contiguous KV cache)
+    int32_t defrag_step_us        =     0; // max. duration of a KV cache defrag step in microseconds (0 = defragment in one step)
+    int32_t n_state_ckpt          =     0; // recurrent models: max. state checkpoints per sequence (0 = disabled)
+    int32_t state_ckpt_step       =   256; // recurrent models: min. tokens between two state checkpoints
 
     // offload params
     std::vector<ggml_backend_dev_t> devices; // devices to use for offloading
@@ -338,6 +343,9 @@ struct common_params {
     ggml_type cache_type_k = GGML_TYPE_F16; // KV cache data type for the K
     ggml_type cache_type_v = GGML_TYPE_F16; // KV cache data type for the V
 
+    std::vector<ggml_type> cache_types_k_layer; // per-layer KV cache data types for the K, empty = cache_type_k
+    std::vector<ggml_type> cache_types_v_layer; // per-layer KV cache data types for the V, empty = cache_type_v
+
     common_conversation_mode conversation_mode = COMMON_CONVERSATION_MODE_AUTO;
 
     // multimodal models (see examples/llava)
@@ -357,6 +365,14 @@ struct common_params {
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
+    int32_t n_cache_share  = 0;            // min prefix size to share from the cache of another slot, 0 = disabled
+    int32_t n_cache_spill  = 0;            // size of the spill file for the KV cache of idle slots in MiB, 0 = disabled
+    int32_t n_cache_dir_size  = 4096;      // max. size of the persistent prompt cache in MiB, 0 = unlimited
+    int32_t n_cache_dir_chunk = 256;       // tokens per chunk of the prompt prefixes indexed by the persistent prompt cache
+    int32_t n_prefill_budget  = 0;         // max. prompt tokens per batch while other slots are generating, 0 = n_batch
+    int32_t sched_aging_ms    = 1000;      // waiting time that raises the priority of a deferred task by one, 0 = no aging
+    int32_t priority_max      = 0;         // max. priority of a request, higher values are lowered to it
+    int32_t embd_batch_ms     = -1;        // time to collect embedding and rerank requests into one batch, -1 = one slot per request
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
@@ -379,6 +395,9 @@ struct common_params {
     bool log_json = false;
 
     std::string slot_save_path;
+    bool slot_save_compress = false;
+    std::string cache_spill_file = ""; // NOLINT
+    std::string cache_dir        = ""; // NOLINT
 
     float slot_prompt_similarity = 0.5f;
 
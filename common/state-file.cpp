@@ -0,0 +1,416 @@
+#include "state-file.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+using file_ptr = std::unique_ptr<FILE, decltype(&fclose)>;
+
+//
+// LZ4 block format
+//
+
+static uint32_t read_u32_le(const uint8_t * p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// greedy compression with a hash table of the last position of every 4-byte sequence
+// returns the compressed size, 0 if it does not fit in dst_cap
+static size_t lz4_compress(const uint8_t * src, size_t n_src, uint8_t * dst, size_t dst_cap) {
+    constexpr int      hash_log  = 16;
+    constexpr size_t   min_match = 4;
+    constexpr size_t   last_lits = 5;  // the last bytes are always literals
+    constexpr size_t   mf_limit  = 12; // no match starts in the last bytes
+    constexpr uint32_t max_off   = 65535;
+
+    std::vector<uint32_t> table(1u << hash_log, 0);
+
+    size_t op = 0;
+
+    auto write_len = [&](size_t len) {
+        for (; len >= 255; len -= 255) {
+            if (op >= dst_cap) {
+                return false;
+            }
+            dst[op++] = 255;
+        }
+        if (op >= dst_cap) {
+            return false;
+        }
+        dst[op++] = (uint8_t) len;
+        return true;
+    };
+
+    // token, literals and, if match_len > 0, the match
+    auto write_seq = [&](const uint8_t * lits, size_t n_lits, size_t match_len, uint32_t offset) {
+        if (op >= dst_cap) {
+            return false;
+        }
+
+        const size_t ml = match_len > 0 ? match_len - min_match : 0;
+
+        dst[op++] = (uint8_t) ((std::min<size_t>(n_lits, 15) << 4) | std::min<size_t>(ml, 15));
+
+        if (n_lits >= 15 && !write_len(n_lits - 15)) {
+            return false;
+        }
+
+        if (op + n_lits > dst_cap) {
+            return false;
+        }
+        memcpy(dst + op, lits, n_lits);
+        op += n_lits;
+
+        if (match_len == 0) {
+            return true;
+        }
+
+        if (op + 2 > dst_cap) {
+            return false;
+        }
+        dst[op++] = (uint8_t) (offset & 0xff);
+        dst[op++] = (uint8_t) (offset >> 8);
+
+        return ml < 15 || write_len(ml - 15);
+    };
+
+    size_t ip     = 0;
+    size_t anchor = 0;
+
+    if (n_src > mf_limit) {
+        const size_t ip_end = n_src - mf_limit;
+        const size_t ml_end = n_src - last_lits;
+
+        while (ip < ip_end) {
+            const uint32_t seq = read_u32_le(src + ip);
+            const uint32_t h   = (seq * 2654435761u) >> (32 - hash_log);
+
+            const size_t ref = table[h];
+            table[h] = (uint32_t) ip;
+
+            if (ref < ip && ip - ref <= max_off && read_u32_le(src + ref) == seq) {
+                size_t len = min_match;
+                while (ip + len < ml_end && src[ref + len] == src[ip + len]) {
+                    len++;
+                }
+
+                if (!write_seq(src + anchor, ip - anchor, len, (uint32_t) (ip - ref))) {
+                    return 0;
+                }
+
+                ip    += len;
+                anchor = ip;
+            } else {
+                ip++;
+            }
+        }
+    }
+
+    if (!write_seq(src + anchor, n_src - anchor, 0, 0)) {
+        return 0;
+    }
+
+    return op;
+}
+
+// returns false if the data is corrupted or does not decompress to exactly n_dst bytes
+static bool lz4_decompress(const uint8_t * src, size_t n_src, uint8_t * dst, size_t n_dst) {
+    size_t ip = 0;
+    size_t op = 0;
+
+    auto read_len = [&](size_t & len) {
+        uint8_t b;
+        do {
+            if (ip >= n_src) {
+                return false;
+            }
+            b = src[ip++];
+            len += b;
+        } while (b == 255);
+        return true;
+    };
+
+    while (ip < n_src) {
+        const uint8_t token = src[ip++];
+
+        size_t n_lits = token >> 4;
+        if (n_lits == 15 && !read_len(n_lits)) {
+            return false;
+        }
+
+        if (ip + n_lits > n_src || op + n_lits > n_dst) {
+            return false;
+        }
+        memcpy(dst + op, src + ip, n_lits);
+        ip += n_lits;
+        op += n_lits;
+
+        if (ip == n_src) {
+            break; // the last sequence has no match
+        }
+
+        if (ip + 2 > n_src) {
+            return false;
+        }
+        const size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !read_len(match_len)) {
+            return false;
+        }
+        match_len += 4;
+
+        if (offset == 0 || offset > op || op + match_len > n_dst) {
+            return false;
+        }
+
+        // the match can overlap the output
+        for (size_t i = 0; i < match_len; ++i, ++op) {
+            dst[op] = dst[op - offset];
+        }
+    }
+
+    return op == n_dst;
+}
+
+//
+// byte shuffle
+//
+
+// [a0 b0 a1 b1 ...] -> [a0 a1 ... b0 b1 ...], an odd trailing byte is left in place
+static void shuffle2(const uint8_t * src, uint8_t * dst, size_t n) {
+    const size_t h = n/2;
+    for (size_t i = 0; i < h; ++i) {
+        dst[i]     = src[2*i + 0];
+        dst[h + i] = src[2*i + 1];
+    }
+    if (n % 2) {
+        dst[n - 1] = src[n - 1];
+    }
+}
+
+static void unshuffle2(const uint8_t * src, uint8_t * dst, size_t n) {
+    const size_t h = n/2;
+    for (size_t i = 0; i < h; ++i) {
+        dst[2*i + 0] = src[i];
+        dst[2*i + 1] = src[h + i];
+    }
+    if (n % 2) {
+        dst[n - 1] = src[n - 1];
+    }
+}
+
+//
+// state files
+//
+
+size_t common_state_seq_save_file(const std::string & path, const std::vector<llama_token> & tokens, const std::vector<uint8_t> & state, bool compress) {
+    file_ptr file(fopen(path.c_str(), "wb"), fclose);
+    if (!file) {
+        LOG_ERR("%s: failed to open '%s'\n", __func__, path.c_str());
+        return 0;
+    }
+
+    size_t n_written = 0;
+
+    auto write = [&](const void * data, size_t size) {
+        if (fwrite(data, 1, size, file.get()) != size) {
+            return false;
+        }
+        n_written += size;
+        return true;
+    };
+
+    const uint32_t magic     = compress ? COMMON_STATE_SEQ_MAGIC_Z : LLAMA_STATE_SEQ_MAGIC;
+    const uint32_t version   = LLAMA_STATE_SEQ_VERSION;
+    const uint32_t n_tokens  = tokens.size();
+
+    bool ok = write(&magic, sizeof(magic)) && write(&version, sizeof(version)) &&
+              write(&n_tokens, sizeof(n_tokens)) && write(tokens.data(), n_tokens*sizeof(llama_token));
+
+    if (!compress) {
+        ok = ok && write(state.data(), state.size());
+    } else {
+        const uint64_t n_state = state.size();
+        ok = ok && write(&n_state, sizeof(n_state));
+
+        std::vector<uint8_t> buf_shuf(COMMON_STATE_SEQ_CHUNK);
+        std::vector<uint8_t> buf_comp(COMMON_STATE_SEQ_CHUNK);
+
+        for (size_t i0 = 0; ok && i0 < state.size(); i0 += COMMON_STATE_SEQ_CHUNK) {
+            const uint32_t n_raw = std::min<size_t>(COMMON_STATE_SEQ_CHUNK, state.size() - i0);
+
+            shuffle2(state.data() + i0, buf_shuf.data(), n_raw);
+
+            // chunks that do not get smaller are stored as is, without shuffle
+            const uint32_t n_comp = lz4_compress(buf_shuf.data(), n_raw, buf_comp.data(), n_raw - 1);
+            const uint32_t n_data = n_comp > 0 ? n_comp : n_raw;
+
+            ok = write(&n_raw, sizeof(n_raw)) && write(&n_data, sizeof(n_data)) &&
+                 write(n_comp > 0 ? buf_comp.data() : state.data() + i0, n_data);
+        }
+    }
+
+    if (!ok || fflush(file.get()) != 0) {
+        LOG_ERR("%s: failed to write '%s'\n", __func__, path.c_str());
+        return 0;
+    }
+
+    return n_written;
+}
+
+// size of the file from the current position to the end
+static size_t file_remaining(FILE * file) {
+    const long pos = ftell(file);
+    if (pos < 0 || fseek(file, 0, SEEK_END) != 0) {
+        return 0;
+    }
+    const long end = ftell(file);
+    if (end < pos || fseek(file, pos, SEEK_SET) != 0) {
+        return 0;
+    }
+    return end - pos;
+}
+
+// reads the magic, the version and the tokens, returns the number of bytes read, 0 on failure
+static size_t state_seq_read_header(FILE * file, const std::string & path, uint32_t & magic, std::vector<llama_token> & tokens, size_t n_token_capacity) {
+    size_t n_read = 0;
+
+    auto read = [&](void * data, size_t size) {
+        if (fread(data, 1, size, file) != size) {
+            return false;
+        }
+        n_read += size;
+        return true;
+    };
+
+    uint32_t version  = 0;
+    uint32_t n_tokens = 0;
+
+    if (!read(&magic, sizeof(magic)) || !read(&version, sizeof(version)) ||
+        (magic != LLAMA_STATE_SEQ_MAGIC && magic != COMMON_STATE_SEQ_MAGIC_Z) || version != LLAMA_STATE_SEQ_VERSION) {
+        LOG_ERR("%s: unknown (magic, version) for sequence state file '%s': %08x, %08x\n", __func__, path.c_str(), magic, version);
+        return 0;
+    }
+
+    if (!read(&n_tokens, sizeof(n_tokens))) {
+        return 0;
+    }
+
+    if (n_tokens > n_token_capacity || n_tokens > file_remaining(file)/sizeof(llama_token)) {
+        LOG_ERR("%s: invalid token count in sequence state file '%s': %u, capacity %zu\n", __func__, path.c_str(), n_tokens, n_token_capacity);
+        return 0;
+    }
+
+    tokens.resize(n_tokens);
+    if (!read(tokens.data(), n_tokens*sizeof(llama_token))) {
+        return 0;
+    }
+
+    return n_read;
+}
+
+size_t common_state_seq_load_file_tokens(const std::string & path, std::vector<llama_token> & tokens, size_t n_token_capacity) {
+    file_ptr file(fopen(path.c_str(), "rb"), fclose);
+    if (!file) {
+        LOG_ERR("%s: failed to open '%s'\n", __func__, path.c_str());
+        return 0;
+    }
+
+    uint32_t magic = 0;
+
+    return state_seq_read_header(file.get(), path, magic, tokens, n_token_capacity);
+}
+
+size_t common_state_seq_load_file(const std::string & path, std::vector<llama_token> & tokens, std::vector<uint8_t> & state, size_t n_token_capacity) {
+    file_ptr file(fopen(path.c_str(), "rb"), fclose);
+    if (!file) {
+        LOG_ERR("%s: failed to open '%s'\n", __func__, path.c_str());
+        return 0;
+    }
+
+    uint32_t magic = 0;
+
+    size_t n_read = state_seq_read_header(file.get(), path, magic, tokens, n_token_capacity);
+    if (n_read == 0) {
+        return 0;
+    }
+
+    auto read = [&](void * data, size_t size) {
+        if (fread(data, 1, size, file.get()) != size) {
+            return false;
+        }
+        n_read += size;
+        return true;
+    };
+
+    if (magic == LLAMA_STATE_SEQ_MAGIC) {
+        // the rest of the file is the state
+        state.clear();
+
+        for (size_t n = COMMON_STATE_SEQ_CHUNK; n == COMMON_STATE_SEQ_CHUNK; ) {
+            const size_t i0 = state.size();
+            state.resize(i0 + COMMON_STATE_SEQ_CHUNK);
+
+            n = fread(state.data() + i0, 1, COMMON_STATE_SEQ_CHUNK, file.get());
+            state.resize(i0 + n);
+            n_read += n;
+        }
+
+        return ferror(file.get()) ? 0 : n_read;
+    }
+
+    uint64_t n_state = 0;
+    if (!read(&n_state, sizeof(n_state))) {
+        return 0;
+    }
+
+    // every chunk takes at least its header and one byte of data in the file
+    const uint64_t n_chunks = (n_state + COMMON_STATE_SEQ_CHUNK - 1)/COMMON_STATE_SEQ_CHUNK;
+    if (n_chunks > file_remaining(file.get())/(2*sizeof(uint32_t) + 1)) {
+        LOG_ERR("%s: invalid state size in sequence state file '%s': %" PRIu64 "\n", __func__, path.c_str(), n_state);
+        return 0;
+    }
+
+    // the state grows with the chunks that are read, so that its size is bounded by the decompressed data
+    state.clear();
+
+    std::vector<uint8_t> buf_comp(COMMON_STATE_SEQ_CHUNK);
+    std::vector<uint8_t> buf_shuf(COMMON_STATE_SEQ_CHUNK);
+
+    for (size_t i0 = 0; i0 < n_state; ) {
+        uint32_t n_raw  = 0;
+        uint32_t n_data = 0;
+
+        if (!read(&n_raw, sizeof(n_raw)) || !read(&n_data, sizeof(n_data)) ||
+            n_raw == 0 || n_raw > COMMON_STATE_SEQ_CHUNK || n_data > n_raw || n_raw > n_state - i0) {
+            LOG_ERR("%s: invalid chunk in sequence state file '%s'\n", __func__, path.c_str());
+            return 0;
+        }
+
+        state.resize(i0 + n_raw);
+
+        if (n_data == n_raw) {
+            if (!read(state.data() + i0, n_raw)) {
+                return 0;
+            }
+        } else {
+            if (!read(buf_comp.data(), n_data) || !lz4_decompress(buf_comp.data(), n_data, buf_shuf.data(), n_raw)) {
+                LOG_ERR("%s: invalid chunk in sequence state file '%s'\n", __func__, path.c_str());
+                return 0;
+            }
+
+            unshuffle2(buf_shuf.data(), state.data() + i0, n_raw);
+        }
+
+        i0 += n_raw;
+    }
+
+    return n_read;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "llama.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define COMMON_STATE_SEQ_MAGIC_Z  0x6767737au // 'ggsz'
+#define COMMON_STATE_SEQ_CHUNK    (1u << 20)
+
+// Sequence state files that are written and read outside of the llama_context, e.g. on a worker thread.
+// The state is obtained with llama_state_seq_get_data beforehand and restored with llama_state_seq_set_data afterwards.
+//
+// Uncompressed files have the format of llama_state_seq_save_file.
+// Compressed files have the magic 'ggsz' and store the state in chunks of COMMON_STATE_SEQ_CHUNK bytes, every chunk
+// is byte-shuffled (the K/V data is mostly made of 16-bit values) and compressed in the LZ4 block format, or stored
+// as is if it does not compress.
+
+// Save a sequence state to a file, chunk by chunk.
+// path:     the path of the file.
+// tokens:   the tokens of the sequence.
+// state:    the state from llama_state_seq_get_data.
+// compress: whether to compress the state.
+// returns:  the number of bytes written, 0 on failure.
+size_t common_state_seq_save_file(const std::string & path, const std::vector<llama_token> & tokens, const std::vector<uint8_t> & state, bool compress);
+
+// Load a sequence state saved with common_state_seq_save_file or llama_state_seq_save_file.
+// The sizes in the file are checked against the size of the file before anything is allocated.
+// path:             the path of the file.
+// tokens:           the tokens of the sequence.
+// state:            the state for llama_state_seq_set_data.
+// n_token_capacity: the max. number of tokens, files with more tokens fail to load.
+// returns:          the number of bytes read, 0 on failure.
+size_t common_state_seq_load_file(const std::string & path, std::vector<llama_token> & tokens, std::vector<uint8_t> & state, size_t n_token_capacity);
+
+// Read only the tokens of a sequence state file.
+// returns:  the number of bytes read, 0 on failure.
+size_t common_state_seq_load_file_tokens(const std::string & path, std::vector<llama_token> & tokens, size_t n_token_capacity);
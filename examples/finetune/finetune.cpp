@@ -0,0 +1,289 @@
+#include "finetune.h"
+#include "llama.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <string>
+
+// Finetune command parameters
+struct finetune_cmd_params {
+    std::string model_in;
+    std::string model_out;
+    std::string dataset;
+    int epochs = 1;
+    int batch_size = 8;
+    int micro_batch_size = 4;
+    int seq_len = 256;
+    int n_ctx = 2048;
+    int n_threads = 4;
+    float learning_rate = 1e-5f;
+    int seed = 42;
+    bool adamw_8bit = false;
+    bool grad_checkpointing = false;
+    std::string checkpoint;
+    int checkpoint_interval = 0;
+    bool resume = false;
+    bool save_delta = false;
+    std::string dp_endpoint;
+    int dp_rank = 0;
+    int dp_n_ranks = 1;
+    std::string stats;
+    float eval_split = 0.0f;
+    int eval_interval = 0;
+    int eval_patience = 0;
+    bool use_graph_reasoning = false;
+    int group_size = 4;
+    int max_new_tokens = 64;
+    float temperature = 1.0f;
+    float kl_coef = 0.04f;
+};
+
+// Parse command line arguments, fails on unknown arguments
+static bool parse_finetune_params(int argc, char** argv, finetune_cmd_params& params) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--model-in") == 0 && i+1 < argc) {
+            params.model_in = argv[++i];
+        } else if (strcmp(argv[i], "--model-out") == 0 && i+1 < argc) {
+            params.model_out = argv[++i];
+        } else if (strcmp(argv[i], "--dataset") == 0 && i+1 < argc) {
+            params.dataset = argv[++i];
+        } else if (strcmp(argv[i], "--epochs") == 0 && i+1 < argc) {
+            params.epochs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--batch-size") == 0 && i+1 < argc) {
+            params.batch_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--micro-batch-size") == 0 && i+1 < argc) {
+            params.micro_batch_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seq-len") == 0 && i+1 < argc) {
+            params.seq_len = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ctx-size") == 0 && i+1 < argc) {
+            params.n_ctx = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc) {
+            params.n_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--learning-rate") == 0 && i+1 < argc) {
+            params.learning_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i+1 < argc) {
+            params.seed = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--adamw-8bit") == 0) {
+            params.adamw_8bit = true;
+        } else if (strcmp(argv[i], "--grad-checkpointing") == 0) {
+            params.grad_checkpointing = true;
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i+1 < argc) {
+            params.checkpoint = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-interval") == 0 && i+1 < argc) {
+            params.checkpoint_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--resume") == 0) {
+            params.resume = true;
+        } else if (strcmp(argv[i], "--save-delta") == 0) {
+            params.save_delta = true;
+        } else if (strcmp(argv[i], "--dp-endpoint") == 0 && i+1 < argc) {
+            params.dp_endpoint = argv[++i];
+        } else if (strcmp(argv[i], "--dp-rank") == 0 && i+1 < argc) {
+            params.dp_rank = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dp-ranks") == 0 && i+1 < argc) {
+            params.dp_n_ranks = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stats") == 0 && i+1 < argc) {
+            params.stats = argv[++i];
+        } else if (strcmp(argv[i], "--eval-split") == 0 && i+1 < argc) {
+            params.eval_split = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--eval-interval") == 0 && i+1 < argc) {
+            params.eval_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--eval-patience") == 0 && i+1 < argc) {
+            params.eval_patience = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--use-graph-reasoning") == 0) {
+            params.use_graph_reasoning = true;
+        } else if (strcmp(argv[i], "--group-size") == 0 && i+1 < argc) {
+            params.group_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-new-tokens") == 0 && i+1 < argc) {
+            params.max_new_tokens = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--temperature") == 0 && i+1 < argc) {
+            params.temperature = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--kl-coef") == 0 && i+1 < argc) {
+            params.kl_coef = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "error: unknown argument or missing value: '%s'\n", argv[i]);
+            return false;
+        }
+    }
+
+    return !params.model_in.empty() && !params.model_out.empty() && !params.dataset.empty();
+}
+
+// Load text file
+static std::string load_text_file(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return "";
+    }
+
+    fseek(f, 0, SEEK_END);
+    size_t size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    std::string result(size, '\0');
+    if (fread(&result[0], 1, size, f) != size) {
+        result.clear();
+    }
+    fclose(f);
+
+    return result;
+}
+
+// Tokenize text, appending to tokens
+static bool tokenize_append(const llama_vocab* vocab, const std::string& text, bool add_special, std::vector<llama_token>& tokens) {
+    const int n_max = text.size() + 2;
+    const size_t n_old = tokens.size();
+    tokens.resize(n_old + n_max);
+    const int n = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data() + n_old, n_max, add_special, false);
+    if (n < 0) {
+        tokens.resize(n_old);
+        return false;
+    }
+    tokens.resize(n_old + n);
+    return true;
+}
+
+// Finetune command implementation
+static int finetune_main(int argc, char** argv) {
+    finetune_cmd_params params;
+    if (!parse_finetune_params(argc, argv, params)) {
+        fprintf(stderr, "Usage: %s --model-in MODEL --model-out OUT --dataset FILE [--epochs N] [--batch-size N] [--micro-batch-size N] [--seq-len N] [--ctx-size N] [--threads N] [--learning-rate R] [--seed N] [--adamw-8bit] [--grad-checkpointing]\n"
+                        "       [--checkpoint FILE [--checkpoint-interval N] [--resume]] [--save-delta] [--stats FILE]\n"
+                        "       [--eval-split F [--eval-interval N] [--eval-patience N]]\n"
+                        "       [--dp-endpoint HOST:PORT --dp-rank R --dp-ranks N]\n"
+                        "       [--use-graph-reasoning [--group-size G] [--max-new-tokens N] [--temperature T] [--kl-coef B]]\n", argv[0]);
+        return 1;
+    }
+
+    llama_backend_init();
+
+    // Load model, the weights are updated in place so they must not be mmap-ed
+    llama_model_params mparams = llama_model_default_params();
+    mparams.use_mmap = false;
+
+    struct llama_model* model = llama_model_load_from_file(params.model_in.c_str(), mparams);
+    if (!model) {
+        fprintf(stderr, "Failed to load model '%s'\n", params.model_in.c_str());
+        return 1;
+    }
+
+    // Initialize for finetuning
+    if (!llama_model_finetune_init(model)) {
+        fprintf(stderr, "Failed to initialize model for finetuning\n");
+        llama_model_free(model);
+        return 1;
+    }
+
+    // Create context, used for the GRPO rollouts
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = params.n_ctx;
+    cparams.n_threads = params.n_threads;
+    cparams.n_threads_batch = params.n_threads;
+
+    struct llama_context* ctx = llama_init_from_model(model, cparams);
+    if (!ctx) {
+        fprintf(stderr, "Failed to create context\n");
+        llama_model_free(model);
+        return 1;
+    }
+
+    // Load dataset
+    std::string dataset_text = load_text_file(params.dataset);
+    if (dataset_text.empty()) {
+        fprintf(stderr, "Failed to load dataset '%s'\n", params.dataset.c_str());
+        llama_free(ctx);
+        llama_model_free(model);
+        return 1;
+    }
+
+    // Tokenize dataset
+    // with graph reasoning every line is a prompt, prompts are separated by EOS
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+    std::vector<llama_token> tokens;
+    bool tokenized = true;
+    if (params.use_graph_reasoning) {
+        size_t start = 0;
+        while (tokenized && start < dataset_text.size()) {
+            size_t end = dataset_text.find('\n', start);
+            if (end == std::string::npos) {
+                end = dataset_text.size();
+            }
+            const std::string line = dataset_text.substr(start, end - start);
+            if (!line.empty()) {
+                tokenized = tokenize_append(vocab, line, true, tokens);
+                tokens.push_back(llama_vocab_eos(vocab));
+            }
+            start = end + 1;
+        }
+    } else {
+        tokenized = tokenize_append(vocab, dataset_text, true, tokens);
+    }
+    if (!tokenized || tokens.empty()) {
+        fprintf(stderr, "Failed to tokenize dataset\n");
+        llama_free(ctx);
+        llama_model_free(model);
+        return 1;
+    }
+    const int n_tokens = tokens.size();
+
+    // Set up finetune parameters
+    struct llama_finetune_params ft_params = llama_finetune_default_params();
+    ft_params.learning_rate = params.learning_rate;
+    ft_params.epochs = params.epochs;
+    ft_params.batch_size = params.batch_size;
+    ft_params.micro_batch_size = params.micro_batch_size;
+    ft_params.seq_len = params.seq_len;
+    ft_params.seed = params.seed;
+    ft_params.adamw_8bit = params.adamw_8bit;
+    ft_params.grad_checkpointing = params.grad_checkpointing;
+    ft_params.checkpoint_path = params.checkpoint.empty() ? nullptr : params.checkpoint.c_str();
+    ft_params.checkpoint_interval = params.checkpoint_interval;
+    ft_params.checkpoint_resume = params.resume;
+    ft_params.dp_endpoint = params.dp_endpoint.empty() ? nullptr : params.dp_endpoint.c_str();
+    ft_params.dp_rank = params.dp_rank;
+    ft_params.dp_n_ranks = params.dp_n_ranks;
+    ft_params.stats_path = params.stats.empty() ? nullptr : params.stats.c_str();
+    ft_params.eval_split = params.eval_split;
+    ft_params.eval_interval = params.eval_interval;
+    ft_params.eval_patience = params.eval_patience;
+    ft_params.use_graph_reasoning = params.use_graph_reasoning;
+    ft_params.grpo_group_size = params.group_size;
+    ft_params.grpo_max_new_tokens = params.max_new_tokens;
+    ft_params.grpo_temperature = params.temperature;
+    ft_params.grpo_kl_coef = params.kl_coef;
+
+    // Run finetuning
+    printf("Finetuning model with %d tokens for %d epochs...\n", n_tokens, params.epochs);
+    if (!llama_finetune(ctx, tokens.data(), n_tokens, &ft_params)) {
+        fprintf(stderr, "Finetuning failed\n");
+        llama_free(ctx);
+        llama_model_free(model);
+        return 1;
+    }
+
+    // Save model, as an overlay of the input model with --save-delta
+    // with data parallelism the weights are the same on all ranks and only rank 0 saves them
+    if (params.dp_rank == 0) {
+        printf("Saving model to '%s'...\n", params.model_out.c_str());
+        const bool saved = params.save_delta ? llama_model_finetune_save_delta(model, params.model_out.c_str())
+                                             : llama_model_finetune_save(model, params.model_out.c_str());
+        if (!saved) {
+            fprintf(stderr, "Failed to save model\n");
+            llama_free(ctx);
+            llama_model_free(model);
+            return 1;
+        }
+    }
+
+    // Cleanup
+    llama_free(ctx);
+    llama_model_free(model);
+    llama_backend_free();
+
+    printf("Finetuning complete!\n");
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    return finetune_main(argc, argv);
+}
@@ -7,6 +7,7 @@
 #include "log.h"
 #include "sampling.h"
 #include "speculative.h"
+#include "state-file.h"
 
 // Change JSON_ASSERT from assert() to GGML_ASSERT:
 #define JSON_ASSERT GGML_ASSERT
@@ -68,6 +69,7 @@ enum server_task_type {
     SERVER_TASK_TYPE_SLOT_RESTORE,
     SERVER_TASK_TYPE_SLOT_ERASE,
     SERVER_TASK_TYPE_SET_LORA,
+    SERVER_TASK_TYPE_RESUME,
 };
 
 enum oaicompat_type {
@@ -100,6 +102,9 @@ struct slot_params {
 
     int64_t t_max_prompt_ms  = -1; // TODO: implement
     int64_t t_max_predict_ms = -1; // if positive, limit the generation phase to this time limit
+    int64_t t_max_latency_ms = -1; // if positive, target time from the arrival of the task to its start, waiting tasks with earlier deadlines start first
+
+    int32_t priority = 0; // waiting tasks with a higher priority start first, and can preempt generating slots with a lower priority
 
     std::vector<common_adapter_lora_info> lora;
 
@@ -167,6 +172,8 @@ struct slot_params {
             {"n_discard",                 n_discard},
             {"ignore_eos",                sampling.ignore_eos},
             {"stream",                    stream},
+            {"priority",                  priority},
+            {"t_max_latency_ms",          t_max_latency_ms},
             {"logit_bias",                format_logit_bias(sampling.logit_bias)},
             {"n_probs",                   sampling.n_probs},
             {"min_keep",                  sampling.min_keep},
@@ -192,9 +199,12 @@ struct server_task {
 
     server_task_type type;
 
-    // used by SERVER_TASK_TYPE_CANCEL
+    // used by SERVER_TASK_TYPE_CANCEL and SERVER_TASK_TYPE_RESUME
     int id_target = -1;
 
+    // time when the task was first posted, set by server_queue
+    int64_t t_queued = 0;
+
     // used by SERVER_TASK_TYPE_INFERENCE
     slot_params  params;
     llama_tokens prompt_tokens;
@@ -205,6 +215,10 @@ struct server_task {
         int slot_id;
         std::string filename;
         std::string filepath;
+
+        // SERVER_TASK_TYPE_SLOT_RESTORE: the state that was read from the file
+        llama_tokens tokens;
+        std::shared_ptr<const std::vector<uint8_t>> state;
     };
     slot_action slot_action;
 
@@ -216,6 +230,10 @@ struct server_task {
 
     server_task(server_task_type type) : type(type) {}
 
+    int64_t t_deadline() const {
+        return params.t_max_latency_ms > 0 ? t_queued + 1000*params.t_max_latency_ms : INT64_MAX;
+    }
+
     static slot_params params_from_json_cmpl(
             const llama_context * ctx,
             const common_params & params_base,
@@ -243,6 +261,8 @@ struct server_task {
         params.n_discard        = json_value(data, "n_discard",          defaults.n_discard);
       //params.t_max_prompt_ms  = json_value(data, "t_max_prompt_ms",    defaults.t_max_prompt_ms); // TODO: implement
         params.t_max_predict_ms = json_value(data, "t_max_predict_ms",   defaults.t_max_predict_ms);
+        params.t_max_latency_ms = json_value(data, "t_max_latency_ms",   defaults.t_max_latency_ms);
+        params.priority         = std::min(json_value(data, "priority",  defaults.priority), params_base.priority_max);
         params.response_fields  = json_value(data, "response_fields",   std::vector<std::string>());
 
         params.sampling.top_k              = json_value(data, "top_k",              defaults.sampling.top_k);
@@ -1152,6 +1172,8 @@ struct server_task_result_metrics : server_task_result {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    std::vector<server_histogram> histograms;
+
     // while we can also use std::vector<server_slot> this requires copying the slot object which can be quite messy
     // therefore, we use json to temporarily store the slot.to_json() result
     json slots_data = json::array();
@@ -1192,6 +1214,10 @@ struct server_task_result_slot_save_load : server_task_result {
     size_t n_bytes;
     double t_ms;
 
+    // save: the state of the slot, written to the file by the HTTP thread
+    llama_tokens         tokens;
+    std::vector<uint8_t> state;
+
     virtual json to_json() override {
         if (is_save) {
             return json {
@@ -1282,6 +1308,10 @@ struct server_slot {
 
     llama_tokens cache_tokens;
 
+    // number of leading cache tokens whose KV cells were computed at their current positions
+    // the cells after them were shifted and are not shared with other slots
+    size_t n_cache_unshifted = SIZE_MAX;
+
     std::vector<completion_token_output> generated_token_probs;
 
     bool has_next_token = true;
@@ -1303,8 +1333,10 @@ struct server_slot {
     // stats
     size_t n_sent_text        = 0; // number of sent text character
 
+    int64_t t_queued = 0; // arrival of the task
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
+    int64_t t_last_token = 0;
 
     double t_prompt_processing; // ms
     double t_token_generation;  // ms
@@ -1505,15 +1537,56 @@ struct server_metrics {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    // the histograms are never reset
+    server_histogram time_to_first_token {
+        "time_to_first_token_seconds", "Time from the arrival of a request to its first generated token.",
+        server_histogram::exponential(0.005, 1.5, 28) };
+    server_histogram inter_token_latency {
+        "inter_token_latency_seconds", "Time between two generated tokens of a request.",
+        server_histogram::exponential(0.001, 1.5, 22) };
+    server_histogram queue_wait {
+        "queue_wait_seconds", "Time from the arrival of a request to the start of its processing.",
+        server_histogram::exponential(0.001, 1.5, 30) };
+    server_histogram prompt_tokens_rate {
+        "prompt_tokens_per_second", "Prompt processing throughput of a request in tokens/s.",
+        server_histogram::exponential(1.0, 1.5, 30) };
+    server_histogram batch_occupancy {
+        "batch_occupancy_ratio", "Tokens per llama_decode() call relative to the batch size.",
+        server_histogram::linear(0.05, 0.05, 20) };
+    server_histogram kv_cache_usage {
+        "kv_cache_usage_ratio_per_decode", "KV-cache usage at every llama_decode() call. 1 means 100 percent usage.",
+        server_histogram::linear(0.05, 0.05, 20) };
+
     void init() {
         t_start = ggml_time_us();
     }
 
+    std::vector<server_histogram> histograms() const {
+        return { time_to_first_token, inter_token_latency, queue_wait, prompt_tokens_rate, batch_occupancy, kv_cache_usage };
+    }
+
+    void on_prompt_start(const server_slot & slot) {
+        queue_wait.observe((slot.t_start_process_prompt - slot.t_queued) / 1e6);
+    }
+
     void on_prompt_eval(const server_slot & slot) {
         n_prompt_tokens_processed_total += slot.n_prompt_tokens_processed;
         n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
         t_prompt_processing             += slot.t_prompt_processing;
         t_prompt_processing_total       += slot.t_prompt_processing;
+
+        time_to_first_token.observe((slot.t_start_generation - slot.t_queued) / 1e6);
+        if (slot.t_prompt_processing > 0) {
+            prompt_tokens_rate.observe(1e3 * slot.n_prompt_tokens_processed / slot.t_prompt_processing);
+        }
+    }
+
+    // n_tokens generated at once since the previous token of the slot
+    void on_tokens(const server_slot & slot, int64_t t_now, int n_tokens) {
+        const double t = (t_now - slot.t_last_token) / 1e6 / n_tokens;
+        for (int i = 0; i < n_tokens; i++) {
+            inter_token_latency.observe(t);
+        }
     }
 
     void on_prediction(const server_slot & slot) {
@@ -1523,13 +1596,28 @@ struct server_metrics {
         t_tokens_generation_total  += slot.t_token_generation;
     }
 
-    void on_decoded(const std::vector<server_slot> & slots) {
+    // embedding and rerank inputs computed together in one batch, without slots
+    void on_embd_batch(const std::vector<server_task> & tasks, int32_t n_tokens, int64_t t_start, int64_t t_end) {
+        n_prompt_tokens_processed_total += n_tokens;
+        n_prompt_tokens_processed       += n_tokens;
+        t_prompt_processing             += (t_end - t_start) / 1000;
+        t_prompt_processing_total       += (t_end - t_start) / 1000;
+
+        for (const auto & task : tasks) {
+            queue_wait.observe((t_start - task.t_queued) / 1e6);
+        }
+    }
+
+    void on_decoded(const std::vector<server_slot> & slots, int32_t n_tokens, int32_t n_batch, float kv_usage) {
         n_decode_total++;
         for (const auto & slot : slots) {
             if (slot.is_processing()) {
                 n_busy_slots_total++;
             }
         }
+
+        batch_occupancy.observe((double) n_tokens / n_batch);
+        kv_cache_usage.observe(kv_usage);
     }
 
     void reset_bucket() {
@@ -1548,6 +1636,13 @@ struct server_queue {
     std::deque<server_task> queue_tasks;
     std::deque<server_task> queue_tasks_deferred;
 
+    // waiting time that raises the priority of a deferred task by one, 0 = no aging
+    int64_t t_aging_us = 0;
+
+    // time at which the loop updates the slots again even without a new task, 0 = wait for a task
+    // only used by the callbacks, on the thread of the loop
+    int64_t t_wake_us = 0;
+
     std::mutex mutex_tasks;
     std::condition_variable condition_tasks;
 
@@ -1563,6 +1658,9 @@ struct server_queue {
         if (task.type == SERVER_TASK_TYPE_CANCEL) {
             cleanup_pending_task(task.id_target);
         }
+        if (task.t_queued == 0) {
+            task.t_queued = ggml_time_us();
+        }
         QUE_DBG("new task, id = %d, front = %d\n", task.id, front);
         if (front) {
             queue_tasks.push_front(std::move(task));
@@ -1584,6 +1682,9 @@ struct server_queue {
             if (task.type == SERVER_TASK_TYPE_CANCEL) {
                 cleanup_pending_task(task.id_target);
             }
+            if (task.t_queued == 0) {
+                task.t_queued = ggml_time_us();
+            }
             QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
             if (front) {
                 queue_tasks.push_front(std::move(task));
@@ -1598,7 +1699,10 @@ struct server_queue {
     // Add a new task, but defer until one slot is available
     void defer(server_task task) {
         std::unique_lock<std::mutex> lock(mutex_tasks);
-        QUE_DBG("defer task, id = %d\n", task.id);
+        if (task.t_queued == 0) {
+            task.t_queued = ggml_time_us();
+        }
+        QUE_DBG("defer task, id = %d, priority = %d\n", task.id, task.params.priority);
         queue_tasks_deferred.push_back(std::move(task));
         condition_tasks.notify_one();
     }
@@ -1620,12 +1724,35 @@ struct server_queue {
         callback_update_slots = std::move(callback);
     }
 
-    // Call when the state of one slot is changed, it will move one task from deferred to main queue
+    // the tasks are ordered by priority, raised by one for every t_aging_us of waiting, then by deadline and by arrival
+    bool is_more_urgent(const server_task & a, const server_task & b, int64_t t_now) const {
+        auto priority = [&](const server_task & task) {
+            return task.params.priority + (t_aging_us > 0 ? (t_now - task.t_queued) / t_aging_us : 0);
+        };
+
+        const int64_t pa = priority(a);
+        const int64_t pb = priority(b);
+        if (pa != pb) {
+            return pa > pb;
+        }
+        if (a.t_deadline() != b.t_deadline()) {
+            return a.t_deadline() < b.t_deadline();
+        }
+        return a.t_queued < b.t_queued;
+    }
+
+    // Call when the state of one slot is changed, it will move the most urgent deferred task to the front of the main queue
     void pop_deferred_task() {
         std::unique_lock<std::mutex> lock(mutex_tasks);
         if (!queue_tasks_deferred.empty()) {
-            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
+            const int64_t t_now = ggml_time_us();
+
+            const auto it = std::min_element(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), [&](const server_task & a, const server_task & b) {
+                return is_more_urgent(a, b, t_now);
+            });
+
+            queue_tasks.emplace_front(std::move(*it));
+            queue_tasks_deferred.erase(it);
         }
         condition_tasks.notify_one();
     }
@@ -1681,9 +1808,14 @@ struct server_queue {
                     return;
                 }
                 if (queue_tasks.empty()) {
-                    condition_tasks.wait(lock, [&]{
+                    const auto pred = [&]{
                         return (!queue_tasks.empty() || !running);
-                    });
+                    };
+                    if (t_wake_us > 0) {
+                        condition_tasks.wait_for(lock, std::chrono::microseconds(std::max<int64_t>(0, t_wake_us - ggml_time_us())), pred);
+                    } else {
+                        condition_tasks.wait(lock, pred);
+                    }
                 }
             }
         }
@@ -1872,6 +2004,28 @@ struct server_context {
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
+    // prompt prefixes in the KV cache of the slots, used with --cache-share
+    server_prefix_tree prefix_tree;
+
+    // KV cache of idle slots that was evicted to a file, used with --cache-spill
+    server_kv_spill kv_spill;
+
+    // KV cache of prompts stored in a directory, used with --cache-dir
+    server_prompt_cache prompt_cache;
+
+    // generating slots that were preempted by a task with a higher priority, keyed by their task id
+    // every one is resumed by a deferred SERVER_TASK_TYPE_RESUME task when a slot becomes available
+    struct server_slot_suspended {
+        server_slot slot; // owns its sampler
+
+        std::vector<uint8_t> state; // the sequence state of the KV cache
+    };
+
+    std::map<int, server_slot_suspended> slots_suspended;
+
+    // embedding and rerank tasks waiting for the next batch, used with --embd-batch-window
+    std::vector<server_task> embd_pending;
+
     common_chat_templates_ptr chat_templates;
 
     ~server_context() {
@@ -1889,6 +2043,10 @@ struct server_context {
             llama_batch_free(slot.batch_spec);
         }
 
+        for (auto & [id_task, suspended] : slots_suspended) {
+            common_sampler_free(suspended.slot.smpl);
+        }
+
         llama_batch_free(batch);
     }
 
@@ -1998,7 +2156,10 @@ struct server_context {
 
             slot.params.sampling = params_base.sampling;
 
-            slot.callback_on_release = [this](int) {
+            slot.callback_on_release = [this](int id) {
+                // the cache of an idle slot does not change until it is selected again
+                prefix_tree_insert(slots[id]);
+
                 queue_tasks.pop_deferred_task();
             };
 
@@ -2019,6 +2180,45 @@ struct server_context {
         }
 
         metrics.init();
+
+        if (params_base.n_cache_spill > 0) {
+            if (kv_spill.init(params_base.cache_spill_file, (size_t) params_base.n_cache_spill*1024*1024)) {
+                SRV_INF("spilling the KV cache of idle slots to a file with size %d MiB\n", params_base.n_cache_spill);
+            } else {
+                SRV_ERR("failed to open the KV cache spill file '%s'\n", params_base.cache_spill_file.c_str());
+            }
+        }
+
+        if (!params_base.cache_dir.empty()) {
+            const uint64_t model_hash = server_model_hash(model, params_base);
+
+            if (prompt_cache.init(params_base.cache_dir, model_hash, params_base.n_cache_dir_chunk, llama_n_ctx(ctx), (size_t) params_base.n_cache_dir_size*1024*1024, params_base.slot_save_compress)) {
+                SRV_INF("prompt cache in '%s' with %zu entries, model hash %016" PRIx64 "\n", params_base.cache_dir.c_str(), prompt_cache.entries.size(), model_hash);
+            } else {
+                SRV_ERR("failed to open the prompt cache directory '%s'\n", params_base.cache_dir.c_str());
+            }
+        }
+    }
+
+    // start reading the spilled or stored KV cache of a deferred task, so that it is ready when a slot becomes available
+    void prefetch_cached_prompt(const server_task & task) {
+        if (!task.params.cache_prompt) {
+            return;
+        }
+
+        if (kv_spill.enabled()) {
+            const auto [i, n_match] = kv_spill.find(task.prompt_tokens);
+            if (i >= 0) {
+                kv_spill.prefetch(i);
+            }
+        }
+
+        if (prompt_cache.enabled()) {
+            const auto [name, n_match] = prompt_cache.find(task.prompt_tokens);
+            if (n_match > 0) {
+                prompt_cache.prefetch(name);
+            }
+        }
     }
 
     server_slot * get_slot_by_id(int id) {
@@ -2036,36 +2236,31 @@ struct server_context {
 
         // find the slot that has at least n% prompt similarity
         if (ret == nullptr && slot_prompt_similarity != 0.0f) {
-            int lcs_len = 0;
+            int lcp_len = 0;
             float similarity = 0;
 
-            for (server_slot & slot : slots) {
+            // length of the common prefix of the input prompt with the cache of every slot, in a single walk of the prefix tree
+            for (const auto & [id, cur_lcp_len] : prefix_tree.match_all(task.prompt_tokens)) {
+                server_slot & slot = slots[id];
+
                 // skip the slot if it is not available
                 if (slot.is_processing()) {
                     continue;
                 }
 
-                // skip the slot if it does not contains cached tokens
-                if (slot.cache_tokens.empty()) {
-                    continue;
-                }
-
-                // length of the Longest Common Subsequence between the current slot's prompt and the input prompt
-                int cur_lcs_len = common_lcs(slot.cache_tokens, task.prompt_tokens);
-
-                // fraction of the common subsequence length compared to the current slot's prompt length
-                float cur_similarity = static_cast<float>(cur_lcs_len) / static_cast<int>(slot.cache_tokens.size());
+                // fraction of the common prefix length compared to the current slot's cache length
+                float cur_similarity = static_cast<float>(cur_lcp_len) / static_cast<int>(slot.cache_tokens.size());
 
                 // select the current slot if the criteria match
-                if (cur_lcs_len > lcs_len && cur_similarity > slot_prompt_similarity) {
-                    lcs_len = cur_lcs_len;
+                if ((int) cur_lcp_len > lcp_len && cur_similarity > slot_prompt_similarity) {
+                    lcp_len = cur_lcp_len;
                     similarity = cur_similarity;
                     ret = &slot;
                 }
             }
 
             if (ret != nullptr) {
-                SLT_DBG(*ret, "selected slot by lcs similarity, lcs_len = %d, similarity = %f\n", lcs_len, similarity);
+                SLT_DBG(*ret, "selected slot by prefix similarity, lcp_len = %d, similarity = %f\n", lcp_len, similarity);
             }
         }
 
@@ -2093,6 +2288,96 @@ struct server_context {
         return ret;
     }
 
+    // suspend the generating slot with the lowest priority below the priority of the task, the most recent one on a tie
+    // returns the slot, now idle, or nullptr if there is none
+    server_slot * preempt_slot(const server_task & task) {
+        server_slot * ret = nullptr;
+
+        for (server_slot & slot : slots) {
+            if (slot.state != SLOT_STATE_GENERATING || slot.params.priority >= task.params.priority) {
+                continue;
+            }
+
+            if (ret == nullptr || slot.params.priority < ret->params.priority ||
+                (slot.params.priority == ret->params.priority && slot.t_start_generation > ret->t_start_generation)) {
+                ret = &slot;
+            }
+        }
+
+        if (ret != nullptr) {
+            SLT_INF(*ret, "preempted by task %d, priority = %d > %d\n", task.id, task.params.priority, ret->params.priority);
+
+            suspend_slot(*ret, task.t_queued);
+        }
+
+        return ret;
+    }
+
+    // move the task of a generating slot and its KV cache out of the slot, the task continues when it is resumed
+    void suspend_slot(server_slot & slot, int64_t t_queued) {
+        server_slot_suspended suspended;
+
+        suspended.state.resize(llama_state_seq_get_size(ctx, slot.id));
+        suspended.state.resize(llama_state_seq_get_data(ctx, suspended.state.data(), suspended.state.size(), slot.id));
+        suspended.slot = slot;
+
+        // the sampler belongs to the suspended task now
+        slot.smpl = nullptr;
+
+        llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+        prefix_tree.remove(slot.id);
+
+        slot.cache_tokens.clear();
+        slot.id_task = -1;
+        slot.i_batch = -1;
+        slot.state   = SLOT_STATE_IDLE; // not released, the task is not done
+
+        server_task task(SERVER_TASK_TYPE_RESUME);
+        task.id              = queue_tasks.get_new_id();
+        task.id_target       = suspended.slot.id_task;
+        task.params.priority = suspended.slot.params.priority;
+        task.t_queued        = t_queued;
+
+        slots_suspended[task.id_target] = std::move(suspended);
+
+        queue_tasks.defer(std::move(task));
+    }
+
+    // continue a suspended task in an idle slot, which can be another slot than the one it was suspended from
+    void resume_slot(server_slot & slot, server_slot_suspended & suspended) {
+        llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+        prefix_tree.remove(slot.id);
+
+        slot.cache_tokens.clear();
+
+        if (llama_state_seq_set_data(ctx, suspended.state.data(), suspended.state.size(), slot.id) != suspended.state.size()) {
+            llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+
+            common_sampler_free(suspended.slot.smpl);
+
+            send_error(suspended.slot.id_task, "failed to resume the preempted task", ERROR_TYPE_SERVER);
+            return;
+        }
+
+        common_sampler_free(slot.smpl);
+
+        // the resources of the slot stay with it
+        const int id = slot.id;
+
+        llama_batch          batch_spec = slot.batch_spec;
+        llama_context      * ctx_dft    = slot.ctx_dft;
+        common_speculative * spec       = slot.spec;
+
+        slot = std::move(suspended.slot);
+
+        slot.id         = id;
+        slot.batch_spec = batch_spec;
+        slot.ctx_dft    = ctx_dft;
+        slot.spec       = spec;
+
+        SLT_INF(slot, "resumed preempted task, n_past = %d, n_decoded = %d\n", slot.n_past, slot.n_decoded);
+    }
+
     bool can_be_detokenized(const struct llama_context * ctx, const std::vector<llama_token> & tokens) {
         const llama_model * model = llama_get_model(ctx);
         const llama_vocab * vocab = llama_model_get_vocab(model);
@@ -2108,6 +2393,7 @@ struct server_context {
     bool launch_slot_with_task(server_slot & slot, const server_task & task) {
         slot.reset();
         slot.id_task       = task.id;
+        slot.t_queued      = task.t_queued;
         slot.index         = task.index;
         slot.task_type     = task.type;
         slot.params        = std::move(task.params);
@@ -2162,11 +2448,19 @@ struct server_context {
         return true;
     }
 
+    // only the cached tokens whose KV cells match their token prefix can be shared with other slots
+    void prefix_tree_insert(const server_slot & slot) {
+        const size_t n = std::min(slot.cache_tokens.size(), slot.n_cache_unshifted);
+
+        prefix_tree.insert(slot.id, llama_tokens(slot.cache_tokens.begin(), slot.cache_tokens.begin() + n));
+    }
+
     void kv_cache_clear() {
         SRV_DBG("%s", "clearing KV cache\n");
 
         // clear the entire KV cache
         llama_kv_self_clear(ctx);
+        prefix_tree.clear();
         clean_kv_cache = false;
     }
 
@@ -2461,18 +2755,26 @@ struct server_context {
     }
 
     void send_embedding(const server_slot & slot, const llama_batch & batch) {
+        send_embedding(slot.id_task, slot.index, slot.n_prompt_tokens, slot.params.oaicompat, slot.id, batch);
+    }
+
+    void send_embedding(const server_task & task, llama_seq_id seq_id, const llama_batch & batch) {
+        send_embedding(task.id, task.index, task.prompt_tokens.size(), task.params.oaicompat, seq_id, batch);
+    }
+
+    void send_embedding(const int id_task, const int index, const int n_tokens, const oaicompat_type oaicompat, const llama_seq_id seq_id, const llama_batch & batch) {
         auto res = std::make_unique<server_task_result_embd>();
-        res->id        = slot.id_task;
-        res->index     = slot.index;
-        res->n_tokens  = slot.n_prompt_tokens;
-        res->oaicompat = slot.params.oaicompat;
+        res->id        = id_task;
+        res->index     = index;
+        res->n_tokens  = n_tokens;
+        res->oaicompat = oaicompat;
 
         const int n_embd = llama_model_n_embd(model);
 
         std::vector<float> embd_res(n_embd, 0.0f);
 
         for (int i = 0; i < batch.n_tokens; ++i) {
-            if (!batch.logits[i] || batch.seq_id[i][0] != slot.id) {
+            if (!batch.logits[i] || batch.seq_id[i][0] != seq_id) {
                 continue;
             }
 
@@ -2482,7 +2784,7 @@ struct server_context {
             }
 
             if (embd == NULL) {
-                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i], batch.seq_id[i][0]);
+                SRV_ERR("failed to get embeddings, id_task = %d, token = %d, seq_id = %d\n", id_task, batch.token[i], batch.seq_id[i][0]);
 
                 res->embedding.push_back(std::vector<float>(n_embd, 0.0f));
                 continue;
@@ -2490,7 +2792,7 @@ struct server_context {
 
             // normalize only when there is pooling
             // TODO: configurable
-            if (llama_pooling_type(slot.ctx) != LLAMA_POOLING_TYPE_NONE) {
+            if (llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_NONE) {
                 common_embd_normalize(embd, embd_res.data(), n_embd, 2);
                 res->embedding.push_back(embd_res);
             } else {
@@ -2498,19 +2800,27 @@ struct server_context {
             }
         }
 
-        SLT_DBG(slot, "%s", "sending embeddings\n");
+        SRV_DBG("sending embeddings, id_task = %d\n", id_task);
 
         queue_results.send(std::move(res));
     }
 
     void send_rerank(const server_slot & slot, const llama_batch & batch) {
+        send_rerank(slot.id_task, slot.index, slot.n_prompt_tokens, slot.id, batch);
+    }
+
+    void send_rerank(const server_task & task, llama_seq_id seq_id, const llama_batch & batch) {
+        send_rerank(task.id, task.index, task.prompt_tokens.size(), seq_id, batch);
+    }
+
+    void send_rerank(const int id_task, const int index, const int n_tokens, const llama_seq_id seq_id, const llama_batch & batch) {
         auto res = std::make_unique<server_task_result_rerank>();
-        res->id    = slot.id_task;
-        res->index = slot.index;
-        res->n_tokens = slot.n_prompt_tokens;
+        res->id    = id_task;
+        res->index = index;
+        res->n_tokens = n_tokens;
 
         for (int i = 0; i < batch.n_tokens; ++i) {
-            if (!batch.logits[i] || batch.seq_id[i][0] != slot.id) {
+            if (!batch.logits[i] || batch.seq_id[i][0] != seq_id) {
                 continue;
             }
 
@@ -2520,7 +2830,7 @@ struct server_context {
             }
 
             if (embd == NULL) {
-                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i], batch.seq_id[i][0]);
+                SRV_ERR("failed to get embeddings, id_task = %d, token = %d, seq_id = %d\n", id_task, batch.token[i], batch.seq_id[i][0]);
 
                 res->score = -1e6;
                 continue;
@@ -2529,7 +2839,7 @@ struct server_context {
             res->score = embd[0];
         }
 
-        SLT_DBG(slot, "sending rerank result, res.score = %f\n", res->score);
+        SRV_DBG("sending rerank result, id_task = %d, res.score = %f\n", id_task, res->score);
 
         queue_results.send(std::move(res));
     }
@@ -2646,17 +2956,30 @@ struct server_context {
                 {
                     const int id_slot = task.id_selected_slot;
 
+                    // embeddings and reranking do not need a slot with --embd-batch-window
+                    const bool embd = task.type == SERVER_TASK_TYPE_EMBEDDING || task.type == SERVER_TASK_TYPE_RERANK;
+                    if (embd && params_base.embd_batch_ms >= 0 && id_slot == -1) {
+                        embd_pending.push_back(std::move(task));
+                        break;
+                    }
+
                     server_slot * slot = id_slot != -1 ? get_slot_by_id(id_slot) : get_available_slot(task);
 
+                    if (slot == nullptr && id_slot == -1) {
+                        slot = preempt_slot(task);
+                    }
+
                     if (slot == nullptr) {
                         // if no slot is available, we defer this task for processing later
                         SRV_DBG("no slot is available, defer task, id_task = %d\n", task.id);
+                        prefetch_cached_prompt(task);
                         queue_tasks.defer(task);
                         break;
                     }
                     if (slot->is_processing()) {
                         // if requested slot is unavailable, we defer this task for processing later
                         SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
+                        prefetch_cached_prompt(task);
                         queue_tasks.defer(task);
                         break;
                     }
@@ -2675,6 +2998,33 @@ struct server_context {
                             break;
                         }
                     }
+
+                    embd_pending.erase(std::remove_if(embd_pending.begin(), embd_pending.end(), [&](const server_task & t) {
+                        return t.id == task.id_target;
+                    }), embd_pending.end());
+
+                    // the resume task of a suspended slot was removed from the queue with the other pending tasks
+                    const auto it = slots_suspended.find(task.id_target);
+                    if (it != slots_suspended.end()) {
+                        common_sampler_free(it->second.slot.smpl);
+                        slots_suspended.erase(it);
+                    }
+                } break;
+            case SERVER_TASK_TYPE_RESUME:
+                {
+                    const auto it = slots_suspended.find(task.id_target);
+                    if (it == slots_suspended.end()) {
+                        break;
+                    }
+
+                    server_slot * slot = get_available_slot(task);
+                    if (slot == nullptr) {
+                        queue_tasks.defer(task);
+                        break;
+                    }
+
+                    resume_slot(*slot, it->second);
+                    slots_suspended.erase(it);
                 } break;
             case SERVER_TASK_TYPE_NEXT_RESPONSE:
                 {
@@ -2724,6 +3074,8 @@ struct server_context {
                     res->n_decode_total          = metrics.n_decode_total;
                     res->n_busy_slots_total      = metrics.n_busy_slots_total;
 
+                    res->histograms = metrics.histograms();
+
                     if (task.metrics_reset_bucket) {
                         metrics.reset_bucket();
                     }
@@ -2744,24 +3096,23 @@ struct server_context {
                         break;
                     }
 
-                    const size_t token_count = slot->cache_tokens.size();
                     const int64_t t_start = ggml_time_us();
 
-                    std::string filename = task.slot_action.filename;
-                    std::string filepath = task.slot_action.filepath;
-
-                    const size_t nwrite = llama_state_seq_save_file(ctx, filepath.c_str(), slot->id, slot->cache_tokens.data(), token_count);
+                    // only copy the state here, the file is written by the HTTP thread so that the other slots are not blocked
+                    auto res = std::make_unique<server_task_result_slot_save_load>();
+                    res->tokens = slot->cache_tokens;
+                    res->state.resize(llama_state_seq_get_size(ctx, slot->id));
+                    res->state.resize(llama_state_seq_get_data(ctx, res->state.data(), res->state.size(), slot->id));
 
                     const int64_t t_end = ggml_time_us();
                     const double t_save_ms = (t_end - t_start) / 1000.0;
 
-                    auto res = std::make_unique<server_task_result_slot_save_load>();
                     res->id       = task.id;
                     res->id_slot  = id_slot;
-                    res->filename = filename;
+                    res->filename = task.slot_action.filename;
                     res->is_save  = true;
-                    res->n_tokens = token_count;
-                    res->n_bytes  = nwrite;
+                    res->n_tokens = res->tokens.size();
+                    res->n_bytes  = res->state.size();
                     res->t_ms     = t_save_ms;
                     queue_results.send(std::move(res));
                 } break;
@@ -2782,18 +3133,26 @@ struct server_context {
 
                     const int64_t t_start = ggml_time_us();
 
-                    std::string filename = task.slot_action.filename;
-                    std::string filepath = task.slot_action.filepath;
+                    // the file has been read by the HTTP thread
+                    const auto & tokens = task.slot_action.tokens;
+                    const auto & state  = *task.slot_action.state;
+
+                    prefix_tree.remove(slot->id);
 
-                    slot->cache_tokens.resize(slot->n_ctx);
-                    size_t token_count = 0;
-                    size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, slot->cache_tokens.data(), slot->cache_tokens.size(), &token_count);
+                    size_t nread = 0;
+                    if (tokens.size() <= (size_t) slot->n_ctx) {
+                        nread = llama_state_seq_set_data(ctx, state.data(), state.size(), slot->id);
+                    }
                     if (nread == 0) {
                         slot->cache_tokens.resize(0);
                         send_error(task, "Unable to restore slot, no available space in KV cache or invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
                         break;
                     }
-                    slot->cache_tokens.resize(token_count);
+                    slot->cache_tokens = tokens;
+                    slot->n_cache_unshifted = SIZE_MAX;
+                    const size_t token_count = tokens.size();
+
+                    prefix_tree.insert(slot->id, slot->cache_tokens);
 
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
@@ -2801,7 +3160,7 @@ struct server_context {
                     auto res = std::make_unique<server_task_result_slot_save_load>();
                     res->id       = task.id;
                     res->id_slot  = id_slot;
-                    res->filename = filename;
+                    res->filename = task.slot_action.filename;
                     res->is_save  = false;
                     res->n_tokens = token_count;
                     res->n_bytes  = nread;
@@ -2827,6 +3186,7 @@ struct server_context {
                     const size_t n_erased = slot->cache_tokens.size();
                     llama_kv_self_seq_rm(ctx, slot->id, -1, -1);
                     slot->cache_tokens.clear();
+                    prefix_tree.remove(slot->id);
 
                     auto res = std::make_unique<server_task_result_slot_erase>();
                     res->id       = task.id;
@@ -2844,7 +3204,153 @@ struct server_context {
         }
     }
 
+    // compute the pending embedding and rerank tasks together, every input as a sequence of a single batch
+    // the batch is started when the oldest task has waited for --embd-batch-window ms, when a task reaches its deadline
+    // or when no more inputs fit, the inputs are taken in the order of the task queue
+    void update_embd_batch() {
+        queue_tasks.t_wake_us = 0;
+
+        if (embd_pending.empty()) {
+            return;
+        }
+
+        // non-causal attention and pooling need all the tokens of an input in the same ubatch
+        const int32_t n_ubatch = llama_n_ubatch(ctx);
+
+        int32_t n_tokens_pending = 0;
+        int64_t t_first          = embd_pending.front().t_queued;
+        int64_t t_deadline       = INT64_MAX;
+
+        for (auto it = embd_pending.begin(); it != embd_pending.end(); ) {
+            const int32_t n_tokens = it->prompt_tokens.size();
+
+            if (n_tokens == 0 || n_tokens > n_ubatch || n_tokens > n_ctx) {
+                send_error(*it, n_tokens == 0        ? "input is empty" :
+                                n_tokens > n_ubatch ? "input is too large to process. increase the physical batch size" :
+                                                      "input is larger than the max context size. skipping", ERROR_TYPE_SERVER);
+                it = embd_pending.erase(it);
+                continue;
+            }
+
+            n_tokens_pending += n_tokens;
+            t_first    = std::min(t_first,    it->t_queued);
+            t_deadline = std::min(t_deadline, it->t_deadline());
+            ++it;
+        }
+
+        // the inputs use the sequences of the idle slots, the empty ones first and then the least recently used
+        std::vector<server_slot *> slots_idle;
+        for (auto & slot : slots) {
+            if (!slot.is_processing()) {
+                slots_idle.push_back(&slot);
+            }
+        }
+
+        if (embd_pending.empty() || slots_idle.empty()) {
+            return;
+        }
+
+        std::stable_sort(slots_idle.begin(), slots_idle.end(), [](const server_slot * a, const server_slot * b) {
+            if (a->cache_tokens.empty() != b->cache_tokens.empty()) {
+                return a->cache_tokens.empty();
+            }
+            return a->t_last_used < b->t_last_used;
+        });
+
+        const int64_t t_now   = ggml_time_us();
+        const int64_t t_flush = std::min<int64_t>(t_first + 1000ll*params_base.embd_batch_ms, t_deadline);
+
+        // wait for more inputs while the batch is not full
+        if (t_now < t_flush && n_tokens_pending < n_ubatch && embd_pending.size() < slots_idle.size()) {
+            queue_tasks.t_wake_us = t_flush;
+            return;
+        }
+
+        std::stable_sort(embd_pending.begin(), embd_pending.end(), [&](const server_task & a, const server_task & b) {
+            return queue_tasks.is_more_urgent(a, b, t_now);
+        });
+
+        common_batch_clear(batch);
+
+        std::vector<server_task> tasks;
+
+        // first fit in the order of the queue, the most urgent input always fits
+        for (auto it = embd_pending.begin(); it != embd_pending.end() && tasks.size() < slots_idle.size(); ) {
+            const int32_t n_tokens = it->prompt_tokens.size();
+
+            // the LoRA adapters apply to the whole batch, an input with other adapters starts the next one
+            if (!tasks.empty() && !are_lora_equal(it->params.lora, tasks.front().params.lora)) {
+                break;
+            }
+
+            if (batch.n_tokens + n_tokens > n_ubatch) {
+                ++it;
+                continue;
+            }
+
+            server_slot & slot = *slots_idle[tasks.size()];
+
+            // the cache of the slot is lost, unless it can be kept in the spill file
+            if (kv_spill.enabled() && !slot.cache_tokens.empty()) {
+                if (kv_spill.store(ctx, slot.id, slot.cache_tokens)) {
+                    SLT_INF(slot, "spilled KV cache with %zu tokens\n", slot.cache_tokens.size());
+                }
+            }
+
+            llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+            slot.cache_tokens.clear();
+            prefix_tree.remove(slot.id);
+
+            // without pooling, we want to output the embeddings for all the tokens
+            const bool need_embd = it->type == SERVER_TASK_TYPE_EMBEDDING && llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_NONE;
+
+            for (int32_t i = 0; i < n_tokens; i++) {
+                common_batch_add(batch, it->prompt_tokens[i], i, { slot.id }, need_embd || i == n_tokens - 1);
+            }
+
+            tasks.push_back(std::move(*it));
+            it = embd_pending.erase(it);
+        }
+
+        SRV_DBG("decoding embedding batch, n_inputs = %zu, n_tokens = %d\n", tasks.size(), batch.n_tokens);
+
+        llama_set_embeddings(ctx, true);
+        common_set_adapter_lora(ctx, tasks.front().params.lora);
+
+        const int ret = llama_decode(ctx, batch);
+        metrics.on_decoded(slots, batch.n_tokens, n_ubatch, (float) llama_kv_self_used_cells(ctx) / llama_n_ctx(ctx));
+
+        if (ret != 0) {
+            SRV_ERR("failed to decode the embedding batch, n_tokens = %d, ret = %d\n", batch.n_tokens, ret);
+            for (const auto & task : tasks) {
+                send_error(task, "failed to compute the embeddings. try increasing the context size", ERROR_TYPE_SERVER);
+            }
+        } else {
+            metrics.on_embd_batch(tasks, batch.n_tokens, t_now, ggml_time_us());
+
+            for (size_t i = 0; i < tasks.size(); i++) {
+                if (tasks[i].type == SERVER_TASK_TYPE_EMBEDDING) {
+                    send_embedding(tasks[i], slots_idle[i]->id, batch);
+                } else {
+                    send_rerank(tasks[i], slots_idle[i]->id, batch);
+                }
+            }
+        }
+
+        // the embeddings have been sent, the cells of the inputs are not needed anymore
+        for (size_t i = 0; i < tasks.size(); i++) {
+            llama_kv_self_seq_rm(ctx, slots_idle[i]->id, -1, -1);
+        }
+
+        // the inputs that did not fit go into the next batch right away
+        if (!embd_pending.empty()) {
+            queue_tasks.t_wake_us = ggml_time_us();
+        }
+    }
+
     void update_slots() {
+        update_embd_batch();
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -2893,18 +3399,68 @@ struct server_context {
 
                 SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
 
-                llama_kv_self_seq_rm (ctx, slot.id, n_keep            , n_keep + n_discard);
-                llama_kv_self_seq_add(ctx, slot.id, n_keep + n_discard, slot.n_past,        -n_discard);
+                // only the kept tokens are still at their original positions
+                slot.n_cache_unshifted = std::min<size_t>(slot.n_cache_unshifted, n_keep);
 
                 if (slot.params.cache_prompt) {
-                    for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++) {
-                        slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
-                    }
+                    prefix_tree_insert(slot);
+                }
+
+                // keep the tokens that received the most attention instead of the oldest ones of the remaining window
+                const int n_heavy  = params_base.n_keep_heavy > 0 ? std::min(params_base.n_keep_heavy, (n_left - n_discard)/2) : 0;
+                const int n_recent = n_left - n_discard - n_heavy;
+
+                std::vector<llama_pos> pos_kept;
 
-                    slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
+                int n_kept = -1;
+                if (params_base.n_keep_heavy > 0) {
+                    pos_kept.resize(n_keep + n_heavy + n_recent);
+
+                    // -1 if the KV cache cannot be shifted, e.g. recurrent models
+                    n_kept = llama_kv_self_seq_evict(ctx, slot.id, n_keep, n_heavy, n_recent, pos_kept.data());
+                    if (n_kept < 0) {
+                        SLT_WRN(slot, "%s", "cannot evict KV cells, falling back to discarding the oldest tokens\n");
+                    }
                 }
 
-                slot.n_past -= n_discard;
+                if (n_kept >= 0) {
+                    SLT_DBG(slot, "evicted KV cells, n_heavy = %d, n_recent = %d, n_kept = %d\n", n_heavy, n_recent, n_kept);
+
+                    if (slot.params.cache_prompt) {
+                        llama_tokens cache_tokens;
+                        for (int i = 0; i < n_kept; i++) {
+                            if (pos_kept[i] < (llama_pos) slot.cache_tokens.size()) {
+                                cache_tokens.push_back(slot.cache_tokens[pos_kept[i]]);
+                            }
+                        }
+
+                        slot.cache_tokens = std::move(cache_tokens);
+                    }
+
+                    slot.n_past = n_kept;
+                } else {
+                    llama_kv_self_seq_rm (ctx, slot.id, n_keep            , n_keep + n_discard);
+                    if (!llama_kv_self_seq_add(ctx, slot.id, n_keep + n_discard, slot.n_past,        -n_discard)) {
+                        // the shared cells could not be copied, the remaining cells of the slot are not usable anymore
+                        llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+                        slot.cache_tokens.clear();
+                        prefix_tree.remove(slot.id);
+
+                        slot.release();
+                        send_error(slot, "failed to shift the context, the KV cache is full", ERROR_TYPE_SERVER);
+                        continue;
+                    }
+
+                    if (slot.params.cache_prompt) {
+                        for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++) {
+                            slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
+                        }
+
+                        slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
+                    }
+
+                    slot.n_past -= n_discard;
+                }
 
                 slot.truncated = true;
             }
@@ -2953,7 +3509,23 @@ struct server_context {
 
         // next, batch any pending prompts without exceeding n_batch
         if (params_base.cont_batching || batch.n_tokens == 0) {
+            // prompt tokens for this batch, limited while slots are generating so that a long prompt does not delay their tokens
+            int32_t n_prefill = n_batch - batch.n_tokens;
+            if (params_base.n_prefill_budget > 0 && batch.n_tokens > 0) {
+                n_prefill = std::min(n_prefill, params_base.n_prefill_budget);
+            }
+
+            // the budget is split evenly across the prompts, except for non-causal ones that must fit entirely
+            int32_t n_prefill_slots = std::count_if(slots.begin(), slots.end(), [](const server_slot & slot) {
+                return (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) && !slot.is_non_causal();
+            });
+
             for (auto & slot : slots) {
+                // a prompt leaves the split when its slot is visited, so that a slot skipped below does not hold back its share
+                if ((slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) && !slot.is_non_causal()) {
+                    n_prefill_slots--;
+                }
+
                 // check if we can batch this slot with the previous one
                 if (slot.is_processing()) {
                     if (!slot_batched) {
@@ -2972,10 +3544,15 @@ struct server_context {
                         slot.t_start_process_prompt = ggml_time_us();
                         slot.t_start_generation = 0;
 
+                        metrics.on_prompt_start(slot);
+
                         slot.n_past = 0;
                         slot.n_prompt_tokens = prompt_tokens.size();
                         slot.state = SLOT_STATE_PROCESSING_PROMPT;
 
+                        // the cache of the slot is about to change, it cannot be shared until the new prompt is processed
+                        prefix_tree.remove(slot.id);
+
                         SLT_INF(slot, "new prompt, n_ctx_slot = %d, n_keep = %d, n_prompt_tokens = %d\n", slot.n_ctx, slot.params.n_keep, slot.n_prompt_tokens);
 
                         // print prompt tokens (for debugging)
@@ -3059,6 +3636,56 @@ struct server_context {
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_lcp(slot.cache_tokens, prompt_tokens);
 
+                                if (kv_spill.enabled()) {
+                                    // the part of the cache that is not reused would be lost, keep it in the spill file
+                                    if (slot.n_past < (int) slot.cache_tokens.size()) {
+                                        if (kv_spill.store(ctx, slot.id, slot.cache_tokens)) {
+                                            SLT_INF(slot, "spilled KV cache with %zu tokens\n", slot.cache_tokens.size());
+                                        }
+                                    }
+
+                                    const auto [i, n_match] = kv_spill.find(prompt_tokens);
+
+                                    if ((int) n_match > slot.n_past) {
+                                        llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+
+                                        if (kv_spill.load(ctx, slot.id, i)) {
+                                            SLT_INF(slot, "restored spilled KV cache with %zu tokens, n_past = %zu\n", kv_spill.entries.at(i).tokens.size(), n_match);
+
+                                            slot.cache_tokens = kv_spill.entries.at(i).tokens;
+                                            slot.n_past = n_match;
+                                        } else {
+                                            SLT_WRN(slot, "%s", "failed to restore spilled KV cache\n");
+
+                                            llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+
+                                            slot.cache_tokens.clear();
+                                            slot.n_past = 0;
+                                        }
+                                    }
+                                }
+
+                                if (prompt_cache.enabled()) {
+                                    const auto [name, n_match] = prompt_cache.find(prompt_tokens);
+
+                                    if ((int) n_match > slot.n_past) {
+                                        llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+
+                                        if (prompt_cache.load(ctx, slot.id, name, slot.cache_tokens)) {
+                                            SLT_INF(slot, "restored prompt cache '%s' with %zu tokens, n_past = %zu\n", name.c_str(), slot.cache_tokens.size(), n_match);
+
+                                            slot.n_past = n_match;
+                                        } else {
+                                            SLT_WRN(slot, "failed to restore prompt cache '%s'\n", name.c_str());
+
+                                            llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+
+                                            slot.cache_tokens.clear();
+                                            slot.n_past = 0;
+                                        }
+                                    }
+                                }
+
                                 // reuse chunks from the cached prompt by shifting their KV cache in the new position
                                 if (params_base.n_cache_reuse > 0) {
                                     size_t head_c = slot.n_past; // cache
@@ -3086,7 +3713,12 @@ struct server_context {
                                             const int64_t kv_shift = (int64_t) head_p - (int64_t) head_c;
 
                                             llama_kv_self_seq_rm (ctx, slot.id, head_p, head_c);
-                                            llama_kv_self_seq_add(ctx, slot.id, head_c, head_c + n_match, kv_shift);
+                                            if (!llama_kv_self_seq_add(ctx, slot.id, head_c, head_c + n_match, kv_shift)) {
+                                                SLT_WRN(slot, "%s", "failed to shift the reused chunk, the rest of the cache is not reused\n");
+                                                break;
+                                            }
+
+                                            slot.n_cache_unshifted = std::min(slot.n_cache_unshifted, head_p);
 
                                             for (size_t i = 0; i < n_match; i++) {
                                                 slot.cache_tokens[head_p + i] = slot.cache_tokens[head_c + i];
@@ -3102,6 +3734,22 @@ struct server_context {
 
                                     SLT_DBG(slot, "after context reuse, new slot.n_past = %d\n", slot.n_past);
                                 }
+
+                                // share a longer prefix from the cache of another slot, the KV cells are shared by both sequences
+                                // and copied only if one of them shifts its positions
+                                if (params_base.n_cache_share > 0) {
+                                    const auto [id_src, n_match] = prefix_tree.match(prompt_tokens, slot.id);
+
+                                    if (n_match >= (size_t) params_base.n_cache_share && (int) n_match > slot.n_past) {
+                                        SLT_INF(slot, "sharing prefix with size %zu from slot %d, n_past = %d\n", n_match, id_src, slot.n_past);
+
+                                        llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+                                        llama_kv_self_seq_cp(ctx, id_src, slot.id, 0, n_match);
+
+                                        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_match);
+                                        slot.n_past = n_match;
+                                    }
+                                }
                             }
                         }
 
@@ -3123,6 +3771,9 @@ struct server_context {
                         }
                     }
 
+                    // recurrent models can only go back to the position of a state checkpoint
+                    slot.n_past = llama_kv_self_seq_pos_rollback(ctx, slot.id, slot.n_past - 1) + 1;
+
                     // keep only the common part
                     if (!llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1)) {
                         // could not partially delete (likely using a non-Transformer model)
@@ -3137,8 +3788,21 @@ struct server_context {
                     // remove the non-common part from the cache
                     slot.cache_tokens.resize(slot.n_past);
 
+                    // the tokens evaluated from here on are at their positions if all the reused ones are
+                    if ((size_t) slot.n_past <= slot.n_cache_unshifted) {
+                        slot.n_cache_unshifted = SIZE_MAX;
+                    }
+
+                    // share of the remaining budget, what a slot does not use goes to the next ones
+                    int32_t n_quota = n_batch;
+                    if (!slot.is_non_causal()) {
+                        n_quota = (n_prefill + n_prefill_slots) / (n_prefill_slots + 1);
+                    }
+
+                    const int32_t n_tokens_prev = batch.n_tokens;
+
                     // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch) {
+                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch && batch.n_tokens - n_tokens_prev < n_quota) {
                         // without pooling, we want to output the embeddings for all the tokens in the batch
                         const bool need_embd = slot.task_type == SERVER_TASK_TYPE_EMBEDDING && llama_pooling_type(slot.ctx) == LLAMA_POOLING_TYPE_NONE;
 
@@ -3152,6 +3816,8 @@ struct server_context {
                         slot.n_past++;
                     }
 
+                    n_prefill = std::max(0, n_prefill - (batch.n_tokens - n_tokens_prev));
+
                     SLT_INF(slot, "prompt processing progress, n_past = %d, n_tokens = %d, progress = %f\n", slot.n_past, batch.n_tokens, (float) slot.n_prompt_tokens_processed / slot.n_prompt_tokens);
 
                     // entire prompt has been processed
@@ -3212,7 +3878,7 @@ struct server_context {
             };
 
             const int ret = llama_decode(ctx, batch_view);
-            metrics.on_decoded(slots);
+            metrics.on_decoded(slots, n_tokens, n_batch, (float) llama_kv_self_used_cells(ctx) / llama_n_ctx(ctx));
 
             if (ret != 0) {
                 if (n_batch == 1 || ret < 0) {
@@ -3257,6 +3923,15 @@ struct server_context {
 
                     // prompt evaluated for next-token prediction
                     slot.state = SLOT_STATE_GENERATING;
+
+                    if (slot.params.cache_prompt) {
+                        prefix_tree_insert(slot);
+                    }
+
+                    // the KV cache holds exactly the prompt now
+                    if (prompt_cache.enabled() && slot.params.cache_prompt) {
+                        prompt_cache.store(ctx, slot.id, slot.cache_tokens);
+                    }
                 } else if (slot.state != SLOT_STATE_GENERATING) {
                     continue; // continue loop of slots
                 }
@@ -3277,8 +3952,12 @@ struct server_context {
                     slot.t_start_generation = t_current;
                     slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
                     metrics.on_prompt_eval(slot);
+                } else {
+                    metrics.on_tokens(slot, t_current, 1);
                 }
 
+                slot.t_last_token = t_current;
+
                 slot.t_token_generation = (t_current - slot.t_start_generation) / 1e3;
 
                 completion_token_output result;
@@ -3366,6 +4045,12 @@ struct server_context {
                 slot.n_past    += ids.size();
                 slot.n_decoded += ids.size();
 
+                const int64_t t_current = ggml_time_us();
+
+                metrics.on_tokens(slot, t_current, ids.size());
+
+                slot.t_last_token = t_current;
+
                 // update how many tokens out of draft was accepted
                 slot.n_draft_accepted += ids.size() - 1;
 
@@ -3540,6 +4225,7 @@ int main(int argc, char ** argv) {
 
     // Necessary similarity of prompt for slot selection
     ctx_server.slot_prompt_similarity = params.slot_prompt_similarity;
+    ctx_server.queue_tasks.t_aging_us = 1000ll*params.sched_aging_ms;
 
     //
     // Middlewares
@@ -3760,6 +4446,10 @@ int main(int argc, char ** argv) {
             }
         }
 
+        for (const auto & histogram : res_metrics->histograms) {
+            histogram.to_prometheus(prometheus, "llamacpp:");
+        }
+
         res.set_header("Process-Start-Time-Unix", std::to_string(res_metrics->t_start));
 
         res.set_content(prometheus.str(), "text/plain; version=0.0.4");
@@ -3792,6 +4482,21 @@ int main(int argc, char ** argv) {
             return;
         }
 
+        auto * res_save = dynamic_cast<server_task_result_slot_save_load*>(result.get());
+        GGML_ASSERT(res_save != nullptr);
+
+        // the state was copied by the main loop, write it from this thread
+        const int64_t t_start = ggml_time_us();
+
+        const size_t nwrite = common_state_seq_save_file(filepath, res_save->tokens, res_save->state, params.slot_save_compress);
+        if (nwrite == 0) {
+            res_error(res, format_error_response("Unable to write slot save file", ERROR_TYPE_SERVER));
+            return;
+        }
+
+        res_save->n_bytes = nwrite;
+        res_save->t_ms   += (ggml_time_us() - t_start) / 1000.0;
+
         res_ok(res, result->to_json());
     };
 
@@ -3804,11 +4509,25 @@ int main(int argc, char ** argv) {
         }
         std::string filepath = params.slot_save_path + filename;
 
+        // read the file from this thread, the main loop only sets the state of the slot
+        const int64_t t_start = ggml_time_us();
+
+        llama_tokens tokens;
+        auto state = std::make_shared<std::vector<uint8_t>>();
+
+        const size_t nread = common_state_seq_load_file(filepath, tokens, *state, llama_n_ctx(ctx_server.ctx));
+        if (nread == 0) {
+            res_error(res, format_error_response("Unable to restore slot, invalid slot save file", ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
         server_task task(SERVER_TASK_TYPE_SLOT_RESTORE);
         task.id = ctx_server.queue_tasks.get_new_id();
         task.slot_action.slot_id  = id_slot;
         task.slot_action.filename = filename;
         task.slot_action.filepath = filepath;
+        task.slot_action.tokens   = std::move(tokens);
+        task.slot_action.state    = std::move(state);
 
         ctx_server.queue_results.add_waiting_task_id(task.id);
         ctx_server.queue_tasks.post(task);
@@ -3821,7 +4540,12 @@ int main(int argc, char ** argv) {
             return;
         }
 
-        GGML_ASSERT(dynamic_cast<server_task_result_slot_save_load*>(result.get()) != nullptr);
+        auto * res_restore = dynamic_cast<server_task_result_slot_save_load*>(result.get());
+        GGML_ASSERT(res_restore != nullptr);
+
+        res_restore->n_bytes = nread;
+        res_restore->t_ms    = (ggml_time_us() - t_start) / 1000.0;
+
         res_ok(res, result->to_json());
     };
 
@@ -4277,6 +5001,9 @@ int main(int argc, char ** argv) {
                 task.index         = i;
                 task.prompt_tokens = std::move(tokenized_prompts[i]);
 
+                task.params.priority         = std::min(json_value(body, "priority", 0), ctx_server.params_base.priority_max);
+                task.params.t_max_latency_ms = json_value(body, "t_max_latency_ms", (int64_t) -1);
+
                 // OAI-compat
                 task.params.oaicompat = oaicompat;
 
@@ -4376,6 +5103,8 @@ int main(int argc, char ** argv) {
                 task.id            = ctx_server.queue_tasks.get_new_id();
                 task.index         = i;
                 task.prompt_tokens = format_rerank(ctx_server.vocab, tokenized_query, tokenized_docs[i]);
+                task.params.priority         = std::min(json_value(body, "priority", 0), ctx_server.params_base.priority_max);
+                task.params.t_max_latency_ms = json_value(body, "t_max_latency_ms", (int64_t) -1);
                 tasks.push_back(task);
             }
 
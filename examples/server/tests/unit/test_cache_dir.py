@@ -0,0 +1,93 @@
+import os
+import time
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+CACHE_DIR = "./tmp/prompt-cache"
+
+PROMPT = "Once upon a time, there was a little girl named Lily who loved to play in the park with her friends every day"
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 1
+    server.temperature = 0.0
+    server.cache_dir = CACHE_DIR
+    server.cache_dir_chunk = 8
+
+
+@pytest.fixture(autouse=True)
+def clear_cache_dir():
+    os.makedirs(CACHE_DIR, exist_ok=True)
+    for name in os.listdir(CACHE_DIR):
+        os.remove(os.path.join(CACHE_DIR, name))
+
+
+def complete(prompt: str):
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "n_predict": 8,
+        "cache_prompt": True,
+        "return_tokens": True,
+    })
+    assert res.status_code == 200
+    return res.body
+
+
+def cache_files() -> list[str]:
+    # the files are written on a worker thread, wait until their sizes settle
+    sizes = None
+    for _ in range(50):
+        cur = {name: os.path.getsize(os.path.join(CACHE_DIR, name)) for name in os.listdir(CACHE_DIR)}
+        if cur and cur == sizes:
+            break
+        sizes = cur
+        time.sleep(0.1)
+    assert sizes
+    return sorted(sizes)
+
+
+def test_cache_dir_restore_after_restart():
+    global server
+    server.start()
+    res = complete(PROMPT)
+    assert len(cache_files()) == 1
+    server.stop()
+
+    server.start()
+    res2 = complete(PROMPT)
+    assert res2["timings"]["prompt_n"] < res["timings"]["prompt_n"]
+    assert res2["tokens"] == res["tokens"]
+
+
+@pytest.mark.parametrize("corruption", ["truncated", "garbage"])
+def test_cache_dir_corrupt_file(corruption: str):
+    global server
+    server.start()
+    res = complete(PROMPT)
+    name = cache_files()[0]
+    server.stop()
+
+    path = os.path.join(CACHE_DIR, name)
+    if corruption == "truncated":
+        # the tokens are still readable, the state is not
+        with open(path, "r+b") as f:
+            f.truncate(os.path.getsize(path) // 2)
+    else:
+        with open(path, "wb") as f:
+            f.write(os.urandom(1000))
+
+    # the file is forgotten and the prompt is processed again
+    server.start()
+    res2 = complete(PROMPT)
+    assert res2["timings"]["prompt_n"] == res["timings"]["prompt_n"]
+    assert res2["tokens"] == res["tokens"]
+
+    # the server still works and caches the prompt again
+    res3 = server.make_request("GET", "/health")
+    assert res3.status_code == 200
+    assert len(cache_files()) == 1
@@ -0,0 +1,91 @@
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+# long enough that the context shift of a slot moves cells of the shared prefix
+PREFIX = "Once upon a time, there was a little girl named Lily. She loved to play outside in the park with her friends. " * 4
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.temperature = 0.0
+    server.n_slots = 2
+    server.n_ctx = 256
+    server.cache_share = 16
+
+
+def complete(id_slot: int, prompt: str, n_predict: int) -> ServerResponse:
+    global server
+    return server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "id_slot": id_slot,
+        "n_predict": n_predict,
+        "ignore_eos": True,
+        "cache_prompt": True,
+    })
+
+
+def test_cache_share_context_shift_keeps_other_slot():
+    global server
+    server.start()
+
+    res = complete(0, PREFIX, 16)
+    assert res.status_code == 200
+    expected = res.body["content"]
+
+    # slot 1 shares the prefix of slot 0 and generates past its context, shifting the shared cells
+    res = complete(1, PREFIX + "One day", 128)
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] < 16
+    assert res.body["truncated"]
+
+    # the cells of slot 0 must still be at their positions
+    res = complete(0, PREFIX, 16)
+    assert res.status_code == 200
+    assert res.body["content"] == expected
+
+
+def test_cache_share_skips_shifted_cells():
+    global server
+    server.start()
+
+    res = server.make_request("POST", "/tokenize", data={"content": PREFIX, "add_special": True})
+    assert res.status_code == 200
+    tokens = res.body["tokens"]
+
+    # one context shift that discards the tokens [1, 33) of the prompt
+    res = server.make_request("POST", "/completion", data={
+        "prompt": PREFIX + "One day",
+        "id_slot": 1,
+        "n_predict": 48,
+        "n_discard": 32,
+        "ignore_eos": True,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    assert res.body["truncated"]
+
+    # a prefix of the shifted cache of slot 1, its cells must not be shared
+    prompt = tokens[:1] + tokens[33:73]
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "id_slot": 0,
+        "n_predict": 16,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == len(prompt)
+    content = res.body["content"]
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "id_slot": 0,
+        "n_predict": 16,
+        "cache_prompt": False,
+    })
+    assert res.status_code == 200
+    assert res.body["content"] == content
@@ -0,0 +1,48 @@
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+PROMPT_A = "Once upon a time, there was a little girl named Lily who loved to play in the park with her friends every day"
+PROMPT_B = "The quick brown fox jumps over the lazy dog while the cat sleeps on the warm mat next to the fire"
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 1
+    server.temperature = 0.0
+
+
+def complete(prompt: str):
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "n_predict": 8,
+        "cache_prompt": True,
+        "return_tokens": True,
+    })
+    assert res.status_code == 200
+    return res.body
+
+
+@pytest.mark.parametrize("cache_spill", [None, 64])
+def test_cache_spill_restore(cache_spill: int | None):
+    global server
+    server.cache_spill = cache_spill
+    server.start()
+    res_a = complete(PROMPT_A)
+    n_prompt = res_a["timings"]["prompt_n"]
+    # the only slot is reused by another prompt, its cache of PROMPT_A is spilled
+    res_b = complete(PROMPT_B)
+    res_a2 = complete(PROMPT_A)
+    # the cache of PROMPT_B is spilled in turn
+    res_b2 = complete(PROMPT_B)
+    if cache_spill:
+        assert res_a2["timings"]["prompt_n"] < n_prompt // 2
+        assert res_b2["timings"]["prompt_n"] < n_prompt // 2
+    else:
+        assert res_a2["timings"]["prompt_n"] > n_prompt // 2
+        assert res_b2["timings"]["prompt_n"] > n_prompt // 2
+    assert res_a2["tokens"] == res_a["tokens"]
+    assert res_b2["tokens"] == res_b["tokens"]
@@ -65,3 +65,47 @@ def test_ctx_shift_disabled_long_prompt():
     assert res.status_code != 200
     assert "error" in res.body
     assert "exceeds the available context size" in res.body["error"]["message"]
+
+
+@pytest.mark.parametrize("n_discard", [0, 20])
+def test_ctx_shift_keep_heavy(n_discard: int):
+    # the context is shifted several times, the evicted tokens are chosen by attention instead of age
+    # but the number of kept tokens, and so n_past, is the same as with the plain context shift
+    global server
+    server.disable_ctx_shift = False
+    server.n_predict = -1
+    results = []
+    for keep_heavy in [None, 16]:
+        server.keep_heavy = keep_heavy
+        server.start()
+        res = server.make_request("POST", "/completion", data={
+            "prompt": "Hi how are you",
+            "n_predict": 200,
+            "n_keep": 4,
+            "n_discard": n_discard,
+            "ignore_eos": True,
+            "temperature": 0.0,
+            "cache_prompt": True,
+            "return_tokens": True,
+        })
+        assert res.status_code == 200
+        assert res.body["timings"]["predicted_n"] == 200
+        assert res.body["truncated"] is True
+        assert 0 < res.body["tokens_cached"] < 128
+        # the kept prompt tokens are still cached at their positions
+        res2 = server.make_request("POST", "/completion", data={
+            "prompt": "Hi how are you",
+            "n_predict": 8,
+            "n_keep": 4,
+            "id_slot": res.body["id_slot"],
+            "temperature": 0.0,
+            "cache_prompt": True,
+            "return_tokens": True,
+        })
+        assert res2.status_code == 200
+        assert res2.body["timings"]["prompt_n"] < res.body["timings"]["prompt_n"]
+        assert res2.body["tokens"] == res.body["tokens"][:8]
+        results.append(res.body["tokens_cached"])
+        server.stop()
+    server.keep_heavy = None
+    assert results[0] == results[1]
@@ -255,3 +255,32 @@ def test_embedding_openai_library_base64():
     # make sure the decoded data is the same as the original
     for x, y in zip(floats, vec0):
         assert abs(x - y) < EPSILON
+
+
+def test_embedding_batch_window_same_result():
+    global server
+    server.pooling = 'last'
+    inputs = [
+        "I believe the meaning of life is",
+        "Write a joke about AI from a very long prompt which will not be truncated",
+        "This is a test",
+        "This is another test",
+    ]
+    server.start()
+    expected = [
+        server.make_request("POST", "/v1/embeddings", data={"input": input}).body['data'][0]['embedding']
+        for input in inputs
+    ]
+    server.stop()
+
+    # the concurrent requests are computed together, every input as a sequence of the same batch
+    server.embd_batch_window = 100
+    server.start()
+    results = parallel_function_calls([
+        (server.make_request, ("POST", "/v1/embeddings", {"input": input}))
+        for input in inputs
+    ])
+    for res, vec in zip(results, expected):
+        assert res.status_code == 200
+        for x, y in zip(res.body['data'][0]['embedding'], vec):
+            assert abs(x - y) < EPSILON
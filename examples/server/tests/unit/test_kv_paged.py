@@ -0,0 +1,54 @@
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+PROMPTS = [
+    "Once upon a time, there was a little girl named Lily",
+    "Once upon a time, there was a big dog",
+    "The sun was shining and the birds were singing in the park",
+    "Tom and his friend went to the beach to play",
+]
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.temperature = 0.0
+    server.fa = True
+    server.n_slots = 2
+    server.n_ctx = 512
+
+
+def run_requests() -> List[str]:
+    global server
+    contents = []
+    # the second prompt of each slot reuses a part of the first one, its other cells are removed
+    for prompts in [PROMPTS[0:2], PROMPTS[2:4], PROMPTS[1:3]]:
+        # both slots allocate at the same time, their blocks are interleaved in the cache
+        tasks = [(
+            server.make_request,
+            ("POST", "/completion", {
+                "prompt": prompt,
+                "id_slot": i,
+                "n_predict": 24,
+                "cache_prompt": True,
+            })
+        ) for i, prompt in enumerate(prompts)]
+        for res in parallel_function_calls(tasks):
+            assert res.status_code == 200
+            contents.append(res.body["content"])
+    return contents
+
+
+@pytest.mark.parametrize("kv_block_size", [16, 32])
+def test_kv_paged_same_output_as_contiguous(kv_block_size: int):
+    global server
+    server.start()
+    expected = run_requests()
+    server.stop()
+
+    server.kv_block_size = kv_block_size
+    server.start()
+    assert run_requests() == expected
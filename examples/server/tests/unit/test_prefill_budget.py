@@ -0,0 +1,82 @@
+import pytest
+from concurrent.futures import ThreadPoolExecutor
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+GENERATING = {
+    "prompt": "Once upon a time, there was a little girl named Lily",
+    "n_predict": 300,
+    "ignore_eos": True,
+}
+
+LONG_PROMPT = {
+    "prompt": "The sun was shining and the birds were singing in the tall green trees. " * 12,
+    "n_predict": 1,
+}
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.temperature = 0.0
+    server.n_slots = 2
+    server.n_ctx = 1024
+    server.n_predict = -1
+    server.server_metrics = True
+
+
+def get_metrics() -> dict[str, float]:
+    res = requests.get(f"http://{server.server_host}:{server.server_port}/metrics")
+    assert res.status_code == 200
+    metrics = {}
+    for line in res.text.splitlines():
+        if line.startswith("llamacpp:"):
+            name, value = line.split(" ")
+            metrics[name[len("llamacpp:"):]] = float(value)
+    return metrics
+
+
+def get_decodes() -> Tuple[int, int]:
+    metrics = get_metrics()
+    n_decode = int(metrics["n_decode_total"])
+    return n_decode, round(metrics["n_busy_slots_per_decode"] * n_decode)
+
+
+@pytest.mark.parametrize("prefill_budget", [None, 4])
+def test_prefill_budget_split(prefill_budget: int | None):
+    global server
+    server.prefill_budget = prefill_budget
+    server.start()
+    n_decode_0, n_busy_0 = get_decodes()
+
+    n_generated = 0
+    with ThreadPoolExecutor(max_workers=1) as executor:
+        future = None
+        for data in server.make_stream_request("POST", "/completion", data={**GENERATING, "stream": True}):
+            n_generated += 1
+            if future is None:
+                # the first slot is generating, the long prompt goes to the second one
+                future = executor.submit(server.make_request, "POST", "/completion", LONG_PROMPT)
+        # the prompt was processed while the first slot was still generating
+        assert future.done()
+        res = future.result()
+    assert res.status_code == 200
+    assert n_generated == GENERATING["n_predict"]
+
+    n_decode_1, n_busy_1 = get_decodes()
+    n_decode = n_decode_1 - n_decode_0
+    n_busy   = n_busy_1 - n_busy_0
+
+    # every decode with the long prompt also had a token of the generating slot, which was busy for all of its tokens
+    n_prompt_steps = n_busy - n_decode
+    assert n_decode == GENERATING["n_predict"]
+
+    # the prompt is split in chunks of the budget, without a budget it fills the rest of the batch
+    n_prompt = res.body["timings"]["prompt_n"]
+    assert n_prompt > 100
+    if prefill_budget:
+        assert n_prompt_steps == (n_prompt + prefill_budget - 1) // prefill_budget
+    else:
+        assert 1 < n_prompt_steps < n_prompt // 4
@@ -0,0 +1,66 @@
+import pytest
+from concurrent.futures import ThreadPoolExecutor
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+LOW = {
+    "prompt": "Once upon a time, there was a little girl named Lily",
+    "n_predict": 400,
+    "ignore_eos": True,
+}
+
+HIGH = {
+    "prompt": "The sun was shining and the birds were singing",
+    "n_predict": 16,
+    "priority": 10,
+}
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.temperature = 0.0
+    server.n_slots = 1
+    server.n_ctx = 512
+    server.n_predict = -1
+
+
+def run_preempted() -> Tuple[str, bool, ServerResponse]:
+    global server
+    content = ""
+    with ThreadPoolExecutor(max_workers=1) as executor:
+        future = None
+        for data in server.make_stream_request("POST", "/completion", data={**LOW, "stream": True}):
+            content += data["content"]
+            if future is None and content:
+                # the low-priority request is generating, the only slot is busy
+                future = executor.submit(server.make_request, "POST", "/completion", HIGH)
+        # the high-priority request finished before the low-priority one only if it preempted it
+        high_first = future.done()
+        return content, high_first, future.result()
+
+
+def test_preempted_request_same_output():
+    global server
+    server.priority_max = 10
+    server.start()
+    expected = server.make_request("POST", "/completion", data=LOW).body["content"]
+    expected_high = server.make_request("POST", "/completion", data=HIGH).body["content"]
+
+    content, high_first, res = run_preempted()
+    assert high_first
+    assert res.status_code == 200
+    assert res.body["content"] == expected_high
+    assert content == expected
+
+
+def test_priority_clamped():
+    global server
+    # default --priority-max 0, the priority of the request is lowered and it waits for the slot
+    server.priority_max = None
+    server.start()
+    content, high_first, res = run_preempted()
+    assert not high_first
+    assert res.status_code == 200
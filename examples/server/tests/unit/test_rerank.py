@@ -102,3 +102,27 @@ def test_rerank_usage(query, doc1, doc2, n_tokens):
     assert res.status_code == 200
     assert res.body['usage']['prompt_tokens'] == res.body['usage']['total_tokens']
     assert res.body['usage']['prompt_tokens'] == n_tokens
+
+
+def test_rerank_batch_window_same_result():
+    global server
+    queries = ["Machine learning is", "Paris is", "Learning is"]
+    server.start()
+    expected = [
+        server.make_request("POST", "/rerank", data={"query": query, "documents": TEST_DOCUMENTS}).body["results"]
+        for query in queries
+    ]
+    server.stop()
+
+    # the concurrent requests are computed together, every document as a sequence of the same batch
+    server.embd_batch_window = 100
+    server.start()
+    results = parallel_function_calls([
+        (server.make_request, ("POST", "/rerank", {"query": query, "documents": TEST_DOCUMENTS}))
+        for query in queries
+    ])
+    for res, exp in zip(results, expected):
+        assert res.status_code == 200
+        scores = {doc["index"]: doc["relevance_score"] for doc in res.body["results"]}
+        for doc in exp:
+            assert abs(scores[doc["index"]] - doc["relevance_score"]) < 1e-3
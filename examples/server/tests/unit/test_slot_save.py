@@ -96,3 +96,59 @@ def test_slot_erase():
     assert res.status_code == 200
     assert match_regex("(Whiskers|Flana)+", res.body["content"])
     assert res.body["timings"]["prompt_n"] == 21  # all tokens are processed
+
+
+def test_slot_save_restore_compressed():
+    global server
+    server.start()
+
+    prompt = "What is the capital of France?"
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "id_slot": 1,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    expected = res.body["content"]
+
+    res = server.make_request("POST", "/slots/1?action=save", data={
+        "filename": "slot1.bin",
+    })
+    assert res.status_code == 200
+    n_saved = res.body["n_saved"]
+    n_written = res.body["n_written"]
+    server.stop()
+
+    server.slot_save_compress = True
+    server.start()
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "id_slot": 1,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+
+    res = server.make_request("POST", "/slots/1?action=save", data={
+        "filename": "slot1z.bin",
+    })
+    assert res.status_code == 200
+    assert res.body["n_saved"] == n_saved
+    assert res.body["n_written"] < n_written
+
+    # the restored cache gives the same output, only the last token of the prompt is evaluated
+    res = server.make_request("POST", "/slots/0?action=restore", data={
+        "filename": "slot1z.bin",
+    })
+    assert res.status_code == 200
+    assert res.body["n_restored"] == n_saved
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "id_slot": 0,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == 1
+    assert res.body["content"] == expected
@@ -64,6 +64,7 @@ class ServerProcess:
     n_predict: int | None = None
     n_prompts: int | None = 0
     slot_save_path: str | None = None
+    slot_save_compress: bool | None = None
     id_slot: int | None = None
     cache_prompt: bool | None = None
     n_slots: int | None = None
@@ -88,6 +89,15 @@ class ServerProcess:
     chat_template: str | None = None
     chat_template_file: str | None = None
     server_path: str | None = None
+    kv_block_size: int | None = None
+    cache_share: int | None = None
+    priority_max: int | None = None
+    embd_batch_window: int | None = None
+    keep_heavy: int | None = None
+    cache_spill: int | None = None
+    cache_dir: str | None = None
+    cache_dir_chunk: int | None = None
+    prefill_budget: int | None = None
 
     # session variables
     process: subprocess.Popen | None = None
@@ -167,6 +177,8 @@ class ServerProcess:
             server_args.extend(["--n-predict", self.n_predict])
         if self.slot_save_path:
             server_args.extend(["--slot-save-path", self.slot_save_path])
+        if self.slot_save_compress:
+            server_args.append("--slot-save-compress")
         if self.n_ga:
             server_args.extend(["--grp-attn-n", self.n_ga])
         if self.n_ga_w:
@@ -194,6 +206,24 @@ class ServerProcess:
             server_args.extend(["--chat-template", self.chat_template])
         if self.chat_template_file:
             server_args.extend(["--chat-template-file", self.chat_template_file])
+        if self.kv_block_size:
+            server_args.extend(["--kv-block-size", self.kv_block_size])
+        if self.cache_share:
+            server_args.extend(["--cache-share", self.cache_share])
+        if self.priority_max is not None:
+            server_args.extend(["--priority-max", self.priority_max])
+        if self.embd_batch_window is not None:
+            server_args.extend(["--embd-batch-window", self.embd_batch_window])
+        if self.keep_heavy:
+            server_args.extend(["--keep-heavy", self.keep_heavy])
+        if self.cache_spill:
+            server_args.extend(["--cache-spill", self.cache_spill])
+        if self.cache_dir:
+            server_args.extend(["--cache-dir", self.cache_dir])
+        if self.cache_dir_chunk:
+            server_args.extend(["--cache-dir-chunk", self.cache_dir_chunk])
+        if self.prefill_budget:
+            server_args.extend(["--prefill-budget", self.prefill_budget])
 
         args = [str(arg) for arg in [server_path, *server_args]]
         print(f"tests: starting server with: {' '.join(args)}")
@@ -15,12 +15,22 @@
 #define JSON_ASSERT GGML_ASSERT
 #include "json.hpp"
 #include "chat.h"
+#include "state-file.h"
 
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <filesystem>
+#include <future>
 #include <random>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <map>
+#include <set>
+#include <unordered_map>
 
 #define DEFAULT_OAICOMPAT_MODEL "gpt-3.5-turbo"
 
@@ -527,6 +537,704 @@ static bool server_sent_event(httplib::DataSink & sink, const char * event, cons
     return sink.write(str.c_str(), str.size());
 }
 
+//
+// metrics utils
+//
+
+// cumulative histogram in the Prometheus format
+// it is only updated and read on the main loop, so recording a value takes no lock
+struct server_histogram {
+    std::string name;
+    std::string help;
+
+    std::vector<double>   bounds; // upper bounds of the buckets, followed by the +Inf bucket
+    std::vector<uint64_t> counts;
+
+    double   sum   = 0.0;
+    uint64_t count = 0;
+
+    server_histogram(std::string name, std::string help, std::vector<double> bounds)
+        : name(std::move(name)), help(std::move(help)), bounds(std::move(bounds)), counts(this->bounds.size() + 1, 0) {}
+
+    // n buckets, the first one up to start and every next one factor times larger
+    static std::vector<double> exponential(double start, double factor, int n) {
+        std::vector<double> res(n);
+        for (int i = 0; i < n; i++) {
+            res[i] = start * std::pow(factor, i);
+        }
+        return res;
+    }
+
+    // n buckets, the first one up to start and every next one width larger
+    static std::vector<double> linear(double start, double width, int n) {
+        std::vector<double> res(n);
+        for (int i = 0; i < n; i++) {
+            res[i] = start + width*i;
+        }
+        return res;
+    }
+
+    void observe(double value) {
+        counts[std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin()]++;
+        sum += value;
+        count++;
+    }
+
+    void to_prometheus(std::ostream & os, const std::string & prefix) const {
+        os << "# HELP " << prefix << name << " " << help << "\n"
+           << "# TYPE " << prefix << name << " histogram\n";
+
+        uint64_t n = 0;
+        for (size_t i = 0; i < bounds.size(); i++) {
+            n += counts[i];
+            os << prefix << name << "_bucket{le=\"" << bounds[i] << "\"} " << n << "\n";
+        }
+
+        os << prefix << name << "_bucket{le=\"+Inf\"} " << count << "\n"
+           << prefix << name << "_sum "   << sum   << "\n"
+           << prefix << name << "_count " << count << "\n";
+    }
+};
+
+//
+// prompt cache utils
+//
+
+// radix tree of the token prefixes that are in the KV cache of the slots
+// every node holds the ids of the slots whose cached tokens pass through it, a slot is in at most one leaf-to-root path
+struct server_prefix_tree {
+    struct node {
+        llama_tokens tokens; // edge from the parent
+        std::set<int> ids;
+        std::map<llama_token, std::unique_ptr<node>> children; // keyed by the first token of the edge
+    };
+
+    node root;
+
+    void clear() {
+        root.children.clear();
+    }
+
+    void remove(int id) {
+        node * cur = &root;
+
+        while (true) {
+            auto it = std::find_if(cur->children.begin(), cur->children.end(), [id](const auto & child) {
+                return child.second->ids.count(id) > 0;
+            });
+
+            if (it == cur->children.end()) {
+                return;
+            }
+
+            node * child = it->second.get();
+            child->ids.erase(id);
+
+            if (child->ids.empty()) {
+                cur->children.erase(it);
+                return;
+            }
+
+            cur = child;
+        }
+    }
+
+    // replace the tokens of slot id
+    void insert(int id, const llama_tokens & tokens) {
+        remove(id);
+
+        node * cur = &root;
+
+        for (size_t i = 0; i < tokens.size(); ) {
+            auto & child = cur->children[tokens[i]];
+
+            if (!child) {
+                child = std::make_unique<node>();
+                child->tokens.assign(tokens.begin() + i, tokens.end());
+            }
+
+            size_t n = 0;
+            while (n < child->tokens.size() && i + n < tokens.size() && child->tokens[n] == tokens[i + n]) {
+                n++;
+            }
+
+            // split the edge at the first mismatch
+            if (n < child->tokens.size()) {
+                auto mid = std::make_unique<node>();
+                mid->tokens.assign(child->tokens.begin(), child->tokens.begin() + n);
+                mid->ids = child->ids;
+
+                child->tokens.erase(child->tokens.begin(), child->tokens.begin() + n);
+
+                const llama_token key = child->tokens[0];
+                mid->children[key] = std::move(child);
+                child = std::move(mid);
+            }
+
+            child->ids.insert(id);
+
+            cur = child.get();
+            i += n;
+        }
+    }
+
+    // longest prefix of tokens that is cached in a slot other than id_exclude
+    // returns the slot id (-1 if none) and the length of the prefix
+    std::pair<int, size_t> match(const llama_tokens & tokens, int id_exclude = -1) const {
+        std::pair<int, size_t> res = { -1, 0 };
+
+        const node * cur = &root;
+
+        for (size_t i = 0; i < tokens.size(); ) {
+            const auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                break;
+            }
+
+            const node * child = it->second.get();
+
+            const auto id = std::find_if(child->ids.begin(), child->ids.end(), [id_exclude](int id) {
+                return id != id_exclude;
+            });
+            if (id == child->ids.end()) {
+                break;
+            }
+
+            size_t n = 0;
+            while (n < child->tokens.size() && i + n < tokens.size() && child->tokens[n] == tokens[i + n]) {
+                n++;
+            }
+
+            res = { *id, i + n };
+
+            if (n < child->tokens.size()) {
+                break;
+            }
+
+            cur = child;
+            i += n;
+        }
+
+        return res;
+    }
+
+    // length of the common prefix of tokens with the tokens of every slot that has at least one token in common with them
+    // walks the tree once, in O(tokens.size() + number of slots on the path)
+    std::map<int, size_t> match_all(const llama_tokens & tokens) const {
+        std::map<int, size_t> res;
+
+        const node * cur = &root;
+
+        for (size_t i = 0; i < tokens.size(); ) {
+            const auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                break;
+            }
+
+            const node * child = it->second.get();
+
+            size_t n = 0;
+            while (n < child->tokens.size() && i + n < tokens.size() && child->tokens[n] == tokens[i + n]) {
+                n++;
+            }
+
+            // the slots of a node are a subset of the slots of its parent
+            for (const int id : child->ids) {
+                res[id] = i + n;
+            }
+
+            if (n < child->tokens.size()) {
+                break;
+            }
+
+            cur = child;
+            i += n;
+        }
+
+        return res;
+    }
+};
+
+// file that the KV cache of idle slots is spilled to
+// the sequence states are serialized with llama_state_seq_get_data and written on a worker thread, they are restored
+// when a prompt with the same prefix comes back, the least recently used entries are dropped when the file is full
+struct server_kv_spill {
+    struct entry {
+        llama_tokens tokens;
+
+        size_t  offset;
+        size_t  size;
+        int64_t t_last;
+
+        std::shared_future<bool>                 written; // result of the write, pending while the state is written
+        std::shared_future<std::vector<uint8_t>> data;    // valid while a prefetch is pending or done
+    };
+
+    FILE * file     = nullptr;
+    size_t capacity = 0;
+
+    std::mutex mutex_file; // the file is written and read by the worker threads
+
+    int n_id = 0;
+
+    std::map<int, entry> entries; // keyed by id
+
+    server_prefix_tree index; // the tokens of the entries, by id
+
+    server_kv_spill() = default;
+    server_kv_spill(const server_kv_spill &) = delete;
+
+    ~server_kv_spill() {
+        entries.clear(); // wait for the pending writes and prefetches
+
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    // an empty path uses a temporary file
+    bool init(const std::string & path, size_t size) {
+        file = path.empty() ? tmpfile() : fopen(path.c_str(), "w+b");
+        capacity = size;
+
+        return file != nullptr;
+    }
+
+    bool enabled() const {
+        return file != nullptr;
+    }
+
+    // entry with the longest common prefix with tokens
+    // returns the id (-1 if none) and the length of the prefix
+    std::pair<int, size_t> find(const llama_tokens & tokens) const {
+        return index.match(tokens);
+    }
+
+    // copy the state of seq_id with the given tokens and write it on a worker thread, entries that are a prefix of
+    // tokens are replaced
+    bool store(llama_context * ctx, llama_seq_id seq_id, const llama_tokens & tokens) {
+        const auto [id_match, n_match] = index.match(tokens);
+        if (id_match >= 0 && n_match == tokens.size()) {
+            // already stored
+            entries.at(id_match).t_last = ggml_time_us();
+            return true;
+        }
+
+        for (const auto & [id, n] : index.match_all(tokens)) {
+            if (n == entries.at(id).tokens.size()) {
+                erase(id);
+            }
+        }
+
+        std::vector<uint8_t> buf(llama_state_seq_get_size(ctx, seq_id));
+        if (buf.empty() || buf.size() > capacity) {
+            return false;
+        }
+
+        buf.resize(llama_state_seq_get_data(ctx, buf.data(), buf.size(), seq_id));
+
+        const size_t n_write = buf.size();
+
+        size_t offset;
+        while (!alloc(n_write, offset)) {
+            // evict the least recently used entry
+            const auto lru = std::min_element(entries.begin(), entries.end(), [](const auto & a, const auto & b) {
+                return a.second.t_last < b.second.t_last;
+            });
+            erase(lru->first);
+        }
+
+        const int id = n_id++;
+
+        entry & e = entries[id];
+        e.tokens = tokens;
+        e.offset = offset;
+        e.size   = n_write;
+        e.t_last = ggml_time_us();
+
+        e.written = std::async(std::launch::async, [this, offset, buf = std::move(buf)]() {
+            std::lock_guard<std::mutex> lock(mutex_file);
+
+            return seek(offset) && fwrite(buf.data(), 1, buf.size(), file) == buf.size() && fflush(file) == 0;
+        }).share();
+
+        index.insert(id, tokens);
+
+        return true;
+    }
+
+    // start reading entry id on a worker thread
+    void prefetch(int id) {
+        entry & e = entries.at(id);
+
+        if (e.data.valid()) {
+            return;
+        }
+
+        e.data = std::async(std::launch::async, [this, written = e.written, offset = e.offset, size = e.size]() {
+            return written.get() ? read(offset, size) : std::vector<uint8_t>();
+        }).share();
+    }
+
+    // restore entry id into seq_id, the sequence must be empty
+    // an entry that cannot be read is dropped
+    bool load(llama_context * ctx, llama_seq_id seq_id, int id) {
+        entry & e = entries.at(id);
+
+        const std::vector<uint8_t> buf = e.data.valid() ? e.data.get() : e.written.get() ? read(e.offset, e.size) : std::vector<uint8_t>();
+        e.data = {};
+        e.t_last = ggml_time_us();
+
+        if (buf.size() != e.size) {
+            erase(id);
+            return false;
+        }
+
+        return llama_state_seq_set_data(ctx, buf.data(), buf.size(), seq_id) == buf.size();
+    }
+
+private:
+    // waits for the pending write and prefetch of the entry
+    void erase(int id) {
+        index.remove(id);
+        entries.erase(id);
+    }
+
+    bool seek(size_t offset) {
+#ifdef _WIN32
+        return _fseeki64(file, (__int64) offset, SEEK_SET) == 0;
+#else
+        return fseeko(file, (off_t) offset, SEEK_SET) == 0;
+#endif
+    }
+
+    std::vector<uint8_t> read(size_t offset, size_t size) {
+        std::vector<uint8_t> buf(size);
+
+        std::lock_guard<std::mutex> lock(mutex_file);
+
+        if (!seek(offset) || fread(buf.data(), 1, size, file) != size) {
+            buf.clear();
+        }
+
+        return buf;
+    }
+
+    // first gap of the file that fits size bytes
+    bool alloc(size_t size, size_t & offset) const {
+        std::vector<std::pair<size_t, size_t>> used;
+        for (const auto & [id, e] : entries) {
+            used.emplace_back(e.offset, e.offset + e.size);
+        }
+        std::sort(used.begin(), used.end());
+
+        offset = 0;
+        for (const auto & u : used) {
+            if (u.first - offset >= size) {
+                return true;
+            }
+            offset = u.second;
+        }
+
+        return capacity - offset >= size;
+    }
+};
+
+static uint64_t fnv1a_hash(const void * data, size_t size, uint64_t h = 0xcbf29ce484222325ull) {
+    const uint8_t * p = (const uint8_t *) data;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// identifies the model by its metadata and size, together with the settings that change the layout of a sequence state
+static uint64_t server_model_hash(const llama_model * model, const common_params & params) {
+    // the weights of a finetuned model differ from its base model, but its metadata and size are the same
+    std::string id = string_format("%" PRIu64 " %" PRIu64 " %" PRIu64 " %s %s", llama_model_file_hash(params.model.path.c_str()),
+            llama_model_n_params(model), llama_model_size(model), ggml_type_name(params.cache_type_k), ggml_type_name(params.cache_type_v));
+
+    for (const auto type : params.cache_types_k_layer) {
+        id += std::string(" k:") + ggml_type_name(type);
+    }
+    for (const auto type : params.cache_types_v_layer) {
+        id += std::string(" v:") + ggml_type_name(type);
+    }
+
+    char buf[1024];
+    for (int32_t i = 0; i < llama_model_meta_count(model); i++) {
+        if (llama_model_meta_key_by_index(model, i, buf, sizeof(buf)) >= 0) {
+            id += std::string("\n") + buf;
+        }
+        if (llama_model_meta_val_str_by_index(model, i, buf, sizeof(buf)) >= 0) {
+            id += std::string("=") + buf;
+        }
+    }
+
+    return fnv1a_hash(id.data(), id.size());
+}
+
+// persistent prompt cache: sequence states in a directory, shared by later requests and by restarts of the server
+// every state is stored with its tokens in a file named after the model and the tokens, and is indexed by the hashes of
+// all its chunk-aligned token prefixes, so a prompt that shares only the first chunks with the state can restore it
+// the least recently used files are deleted when the directory is full
+struct server_prompt_cache {
+    struct entry {
+        llama_tokens tokens;
+
+        size_t   size;   // counted against the capacity
+        uint64_t t_last; // use counter, for the LRU eviction
+
+        std::shared_future<void>                 written; // valid while the file is written
+        std::shared_future<std::vector<uint8_t>> data;    // valid while a prefetch is pending or done
+    };
+
+    std::string dir;
+    std::string prefix; // model hash, the start of the file names
+
+    size_t n_chunk  = 0;
+    size_t n_ctx    = 0; // files with more tokens are skipped
+    size_t capacity = 0; // bytes, 0 = unlimited
+    size_t total    = 0;
+    bool   compress = false;
+
+    uint64_t n_use = 0;
+
+    std::map<std::string, entry> entries; // keyed by the file name
+
+    std::unordered_multimap<uint64_t, std::string> index; // hash of a token prefix -> file name
+
+    server_prompt_cache() = default;
+    server_prompt_cache(const server_prompt_cache &) = delete;
+
+    ~server_prompt_cache() {
+        entries.clear(); // wait for the pending writes and prefetches
+    }
+
+    // index the files of the same model that are already in the directory
+    bool init(const std::string & path, uint64_t model_hash, size_t chunk, size_t n_ctx_max, size_t size, bool compress_state) {
+        dir = path;
+        if (dir.back() != DIRECTORY_SEPARATOR) {
+            dir += DIRECTORY_SEPARATOR;
+        }
+
+        if (!fs_create_directory_with_parents(dir)) {
+            return false;
+        }
+
+        prefix   = string_format("%016" PRIx64 "-", model_hash);
+        n_chunk  = chunk;
+        n_ctx    = n_ctx_max;
+        capacity = size;
+        compress = compress_state;
+
+        // the oldest files get the lowest use counters
+        std::vector<std::pair<std::filesystem::file_time_type, std::string>> files;
+
+        std::error_code ec;
+        for (const auto & f : std::filesystem::directory_iterator(dir, ec)) {
+            const std::string name = f.path().filename().string();
+            if (name.rfind(prefix, 0) == 0 && f.is_regular_file(ec)) {
+                files.emplace_back(f.last_write_time(ec), name);
+            }
+        }
+        std::sort(files.begin(), files.end());
+
+        for (const auto & [t, name] : files) {
+            llama_tokens tokens;
+            if (common_state_seq_load_file_tokens(dir + name, tokens, n_ctx) == 0) {
+                continue;
+            }
+
+            add(name, std::move(tokens), std::filesystem::file_size(dir + name, ec));
+        }
+
+        return !ec;
+    }
+
+    bool enabled() const {
+        return n_chunk > 0;
+    }
+
+    // entry with the longest common prefix with tokens, at least one chunk
+    // returns the file name (empty if none) and the length of the prefix
+    std::pair<std::string, size_t> find(const llama_tokens & tokens) const {
+        std::pair<std::string, size_t> res = { "", 0 };
+
+        const auto hashes = prefix_hashes(tokens);
+
+        for (size_t i = hashes.size(); i-- > 0 && res.second == 0; ) {
+            const auto range = index.equal_range(hashes[i]);
+            for (auto it = range.first; it != range.second; ++it) {
+                const size_t n = common_lcp(entries.at(it->second).tokens, tokens);
+                if (n >= (i + 1)*n_chunk && n > res.second) {
+                    res = { it->second, n };
+                }
+            }
+        }
+
+        return res;
+    }
+
+    // store the state of seq_id with the given tokens unless their chunks are already stored
+    // the state is obtained here and the file is written on a worker thread, entries that are a prefix of tokens are replaced
+    bool store(llama_context * ctx, llama_seq_id seq_id, const llama_tokens & tokens) {
+        const size_t n_full = (tokens.size()/n_chunk)*n_chunk;
+        if (n_full == 0) {
+            return false;
+        }
+
+        const auto [name_old, n_match] = find(tokens);
+        if (n_match >= n_full) {
+            touch(entries.at(name_old), name_old);
+            return true;
+        }
+
+        for (auto it = entries.begin(); it != entries.end(); ) {
+            it = common_lcp(it->second.tokens, tokens) == it->second.tokens.size() ? remove(it) : std::next(it);
+        }
+
+        std::vector<uint8_t> state(llama_state_seq_get_size(ctx, seq_id));
+        if (state.empty() || (capacity > 0 && state.size() > capacity)) {
+            return false;
+        }
+
+        state.resize(llama_state_seq_get_data(ctx, state.data(), state.size(), seq_id));
+
+        while (capacity > 0 && total + state.size() > capacity) {
+            const auto lru = std::min_element(entries.begin(), entries.end(), [](const auto & a, const auto & b) {
+                return a.second.t_last < b.second.t_last;
+            });
+            remove(lru);
+        }
+
+        const std::string name = prefix + string_format("%016" PRIx64 ".bin", prefix_hashes(tokens).back());
+
+        // a hash collision
+        if (const auto it = entries.find(name); it != entries.end()) {
+            remove(it);
+        }
+
+        entry & e = add(name, tokens, state.size());
+
+        e.written = std::async(std::launch::async, [path = dir + name, tokens, state = std::move(state), compress = compress]() {
+            common_state_seq_save_file(path, tokens, state, compress);
+        }).share();
+
+        return true;
+    }
+
+    // start reading an entry on a worker thread
+    void prefetch(const std::string & name) {
+        entry & e = entries.at(name);
+
+        if (e.data.valid()) {
+            return;
+        }
+
+        e.data = std::async(std::launch::async, [path = dir + name, written = e.written, n_ctx = n_ctx]() {
+            if (written.valid()) {
+                written.wait();
+            }
+
+            llama_tokens tokens;
+            std::vector<uint8_t> state;
+            if (common_state_seq_load_file(path, tokens, state, n_ctx) == 0) {
+                state.clear();
+            }
+
+            return state;
+        }).share();
+    }
+
+    // restore an entry into seq_id, the sequence must be empty
+    // entries that cannot be restored are forgotten, their file is kept
+    bool load(llama_context * ctx, llama_seq_id seq_id, const std::string & name, llama_tokens & tokens) {
+        prefetch(name);
+
+        auto it = entries.find(name);
+        entry & e = it->second;
+
+        const std::vector<uint8_t> state = e.data.get();
+        e.data = {};
+
+        if (state.empty() || llama_state_seq_set_data(ctx, state.data(), state.size(), seq_id) != state.size()) {
+            forget(it);
+            return false;
+        }
+
+        touch(e, name);
+        tokens = e.tokens;
+
+        return true;
+    }
+
+private:
+    // hashes of the chunk-aligned prefixes of tokens, the i-th hash covers the first (i + 1)*n_chunk tokens
+    std::vector<uint64_t> prefix_hashes(const llama_tokens & tokens) const {
+        std::vector<uint64_t> res;
+
+        uint64_t h = fnv1a_hash(nullptr, 0);
+        for (size_t i = n_chunk; i <= tokens.size(); i += n_chunk) {
+            h = fnv1a_hash(tokens.data() + i - n_chunk, n_chunk*sizeof(llama_token), h);
+            res.push_back(h);
+        }
+
+        return res;
+    }
+
+    entry & add(const std::string & name, llama_tokens tokens, size_t size) {
+        for (const uint64_t h : prefix_hashes(tokens)) {
+            index.emplace(h, name);
+        }
+
+        total += size;
+
+        entry & e = entries[name];
+        e.tokens = std::move(tokens);
+        e.size   = size;
+        e.t_last = ++n_use;
+
+        return e;
+    }
+
+    // the modification time of the files keeps the LRU order across restarts
+    void touch(entry & e, const std::string & name) {
+        e.t_last = ++n_use;
+
+        std::error_code ec;
+        std::filesystem::last_write_time(dir + name, std::filesystem::file_time_type::clock::now(), ec);
+    }
+
+    std::map<std::string, entry>::iterator forget(std::map<std::string, entry>::iterator it) {
+        for (const uint64_t h : prefix_hashes(it->second.tokens)) {
+            const auto range = index.equal_range(h);
+            for (auto ii = range.first; ii != range.second; ++ii) {
+                if (ii->second == it->first) {
+                    index.erase(ii);
+                    break;
+                }
+            }
+        }
+
+        total -= it->second.size;
+
+        return entries.erase(it); // waits for the pending write or prefetch
+    }
+
+    std::map<std::string, entry>::iterator remove(std::map<std::string, entry>::iterator it) {
+        const std::string path = dir + it->first;
+
+        auto next = forget(it);
+
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+
+        return next;
+    }
+};
+
 //
 // OAI utils
 //
@@ -85,6 +85,12 @@ extern "C" {
     // userdata is not used
     GGML_API struct ggml_opt_optimizer_params ggml_opt_get_default_optimizer_params(void * userdata);
 
+    // callback for the accumulated gradients before an optimizer step,
+    // called during the backward pass for each parameter as soon as its gradient is final,
+    // then once with param == NULL and grad == NULL after the backward pass, the gradients can be modified until this call returns
+    // e.g. for data-parallel training the gradients can be all-reduced while the backward pass of the remaining layers continues
+    typedef void (*ggml_opt_grad_callback)(struct ggml_tensor * param, struct ggml_tensor * grad, void * userdata);
+
     // parameters for initializing a new optimization context
     struct ggml_opt_params {
         ggml_backend_sched_t backend_sched; // defines which backends are used to construct the compute graphs
@@ -101,8 +107,28 @@ extern "C" {
 
         int32_t opt_period; // after how many gradient accumulation steps an optimizer step should be done
 
+        size_t graph_size; // max. number of nodes in the forward/backward graphs, must be large enough for the backward pass
+
+        // activation checkpointing, optional:
+        // only these forward tensors (plus inputs, params and outputs) are kept alive for the backward pass,
+        // all other intermediate results are recomputed from the nearest checkpoints when they are needed
+        struct ggml_tensor ** checkpoints;
+        int32_t               n_checkpoints;
+
+        // store the AdamW moments as blockwise-quantized 8-bit values with one f32 absmax per GGML_OPT_ADAMW_8BIT_BLOCK elements,
+        // ~1/4 of the f32 moment memory, only supported by the CPU backend
+        bool adamw_8bit;
+
         ggml_opt_get_optimizer_params get_opt_pars; // callback for calculating optimizer parameters
         void * get_opt_pars_ud;                     // userdata for calculating optimizer parameters
+
+        // optional, the gradients are accumulated in static tensors and the optimizer step is evaluated as a separate graph
+        ggml_opt_grad_callback grad_callback;
+        void * grad_callback_ud;
+
+        // measure the forward pass, backward pass and optimizer step separately, see ggml_opt_get_timings
+        // the graphs are evaluated in one part per phase, which adds a synchronization at each phase boundary
+        bool timings;
     };
 
     // get parameters for an optimization context with defaults set where possible
@@ -130,6 +156,27 @@ extern "C" {
 
     GGML_API struct ggml_tensor * ggml_opt_grad_acc(ggml_opt_context_t opt_ctx, struct ggml_tensor * node);
 
+    // optimizer state, e.g. for saving and restoring training checkpoints
+    // the state tensors are the AdamW moments of the parameters (with 8-bit moments also their scales),
+    // named "<param name>.adamw_m", "<param name>.adamw_v" (and ".adamw_m_scale", ".adamw_v_scale")
+    GGML_API int64_t ggml_opt_get_iter(ggml_opt_context_t opt_ctx); // number of optimizer steps done + 1
+    GGML_API void    ggml_opt_set_iter(ggml_opt_context_t opt_ctx, int64_t iter);
+    GGML_API int     ggml_opt_n_state  (ggml_opt_context_t opt_ctx);
+    GGML_API struct ggml_tensor * ggml_opt_get_state(ggml_opt_context_t opt_ctx, int i);
+
+    // work done by the graph evaluations since the last ggml_opt_reset_timings
+    // with activation checkpointing the recomputation of the forward pass is part of the backward pass
+    struct ggml_opt_timings {
+        int64_t t_forward_us;  // only measured with ggml_opt_params.timings
+        int64_t t_backward_us;
+        int64_t t_opt_us;
+        int64_t n_eval;        // number of graph evaluations
+        double  flops;         // floating point operations, estimated from the shapes of the graph nodes
+    };
+
+    GGML_API void ggml_opt_get_timings  (ggml_opt_context_t opt_ctx, struct ggml_opt_timings * timings);
+    GGML_API void ggml_opt_reset_timings(ggml_opt_context_t opt_ctx);
+
     // ====== Optimization Result ======
 
     GGML_API ggml_opt_result_t ggml_opt_result_init();
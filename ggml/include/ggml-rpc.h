@@ -25,6 +25,17 @@ GGML_BACKEND_API ggml_backend_reg_t ggml_backend_rpc_reg(void);
 
 GGML_BACKEND_API ggml_backend_dev_t ggml_backend_rpc_add_device(const char * endpoint);
 
+// all-reduce between the processes of a data-parallel job, e.g. for the gradients in training
+// rank 0 listens on endpoint and the other ranks connect to it, init blocks until all ranks are connected
+typedef struct ggml_rpc_allreduce * ggml_rpc_allreduce_t;
+
+GGML_BACKEND_API ggml_rpc_allreduce_t ggml_rpc_allreduce_init(const char * endpoint, int rank, int n_ranks);
+GGML_BACKEND_API void ggml_rpc_allreduce_free(ggml_rpc_allreduce_t ar);
+
+// sums data over all ranks in place, all ranks must call it with the same n in the same order
+// the sum is computed in rank order on rank 0, so the result is bitwise identical on all ranks
+GGML_BACKEND_API bool ggml_rpc_allreduce_sum(ggml_rpc_allreduce_t ar, float * data, int64_t n);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -228,6 +228,8 @@
 #define GGML_DEFAULT_N_THREADS  4
 #define GGML_DEFAULT_GRAPH_SIZE 2048
 
+#define GGML_OPT_ADAMW_8BIT_BLOCK 64
+
 #if UINTPTR_MAX == 0xFFFFFFFF
     #define GGML_MEM_ALIGN 4
 #else
@@ -516,6 +518,7 @@ extern "C" {
         GGML_OP_CROSS_ENTROPY_LOSS,
         GGML_OP_CROSS_ENTROPY_LOSS_BACK,
         GGML_OP_OPT_STEP_ADAMW,
+        GGML_OP_OPT_STEP_ADAMW_8BIT,
 
         GGML_OP_COUNT,
     };
@@ -2019,6 +2022,20 @@ extern "C" {
             struct ggml_tensor  * v,
             struct ggml_tensor  * adamw_params); // parameters such a the learning rate
 
+    // AdamW optimizer step with blockwise-quantized 8-bit moments
+    // m and v are GGML_TYPE_I8 with the shape of a, m_scale and v_scale are GGML_TYPE_F32 with one absmax
+    // per GGML_OPT_ADAMW_8BIT_BLOCK elements of each row of a: [ceil(ne0/GGML_OPT_ADAMW_8BIT_BLOCK), ne1, ne2, ne3]
+    // the moments are dequantized, updated and requantized with a new absmax in a single pass
+    GGML_API struct ggml_tensor * ggml_opt_step_adamw_8bit(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * grad,
+            struct ggml_tensor  * m,
+            struct ggml_tensor  * v,
+            struct ggml_tensor  * m_scale,
+            struct ggml_tensor  * v_scale,
+            struct ggml_tensor  * adamw_params);
+
     //
     // automatic differentiation
     //
@@ -3390,11 +3390,11 @@ static void ggml_compute_forward_rms_norm_back_f32(
                 float * dx = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
 
                 // dx[i00] = (x*(-sum_xdz/sum_eps) + dz) / sqrtf(mean_eps)
-                ggml_vec_cpy_f32  (ne00, dx, x);
-                // ggml_vec_scale_f32(ne00, dx, -mean_xdz/mean_eps);
-                ggml_vec_scale_f32(ne00, dx, (float)(-sum_xdz)/sum_eps);
-                ggml_vec_acc_f32  (ne00, dx, dz);
-                ggml_vec_scale_f32(ne00, dx, rrms);
+                // the allocator may compute this op in place, dx can alias either dz or x
+                const float scale_x = (float)(-sum_xdz)/sum_eps;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    dx[i00] = (x[i00]*scale_x + dz[i00])*rrms;
+                }
             }
         }
     }
@@ -8635,3 +8635,156 @@ void ggml_compute_forward_opt_step_adamw(
             }
     }
 }
+
+// ggml_compute_forward_opt_step_adamw_8bit
+
+// The moments are stored as 8-bit floats relative to the absmax of their block, code 0 is 0:
+// m as sign + 4 bit exponent + 3 bit mantissa of |m|/absmax(m), v as 4 bit exponent + 4 bit mantissa of sqrt(v/absmax(v)).
+// With a float code the small moments of a block keep their relative precision, with a linear code
+// the small second moments would round to 0 and blow up the update.
+// The codes are computed with integer arithmetic on the f32 bits so that the loops have no branches and can be vectorized.
+
+// y in [0, 1] -> code in [0, nmax], rounded to nearest with nm mantissa bits
+static inline int32_t ggml_adamw_8bit_encode(const float y, const int nm, const int32_t nmax) {
+    uint32_t bits;
+    memcpy(&bits, &y, sizeof(bits));
+    const int32_t code = (int32_t) ((bits + (1u << (22 - nm))) >> (23 - nm)) - (127 << nm) + nmax;
+    return MAX(0, MIN(code, nmax));
+}
+
+static inline float ggml_adamw_8bit_decode(const int32_t code, const int nm, const int32_t nmax) {
+    const uint32_t bits = (uint32_t) (code - nmax + (127 << nm)) << (23 - nm);
+    float y;
+    memcpy(&y, &bits, sizeof(y));
+    return code > 0 ? y : 0.0f;
+}
+
+static void ggml_compute_forward_opt_step_adamw_8bit_f32(
+        const ggml_compute_params * params,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * src0         = dst->src[0];
+    const ggml_tensor * src0_grad    = dst->src[1];
+    const ggml_tensor * src0_grad_m  = dst->src[2];
+    const ggml_tensor * src0_grad_v  = dst->src[3];
+    const ggml_tensor * adamw_params = dst->src[4];
+    const ggml_tensor * m_scale      = dst->src[5];
+    const ggml_tensor * v_scale      = dst->src[6];
+
+    GGML_ASSERT(ggml_are_same_shape(src0, src0_grad));
+    GGML_ASSERT(ggml_are_same_shape(src0, src0_grad_m));
+    GGML_ASSERT(ggml_are_same_shape(src0, src0_grad_v));
+    GGML_ASSERT(ggml_are_same_shape(m_scale, v_scale));
+    GGML_ASSERT(ggml_nelements(adamw_params) == 7);
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nr  = ggml_nrows(src0);
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+    GGML_ASSERT(nb00 == sizeof(float));
+    GGML_ASSERT(src0_grad_m->nb[0] == sizeof(int8_t) && src0_grad_v->nb[0] == sizeof(int8_t));
+    GGML_ASSERT(m_scale->nb[0] == sizeof(float) && v_scale->nb[0] == sizeof(float));
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    const float * adamw_params_ptr = ggml_get_data_f32(adamw_params);
+    const float alpha  = adamw_params_ptr[0];
+    const float beta1  = adamw_params_ptr[1];
+    const float beta2  = adamw_params_ptr[2];
+    const float eps    = adamw_params_ptr[3];
+    const float wd     = adamw_params_ptr[4];
+    const float beta1h = adamw_params_ptr[5];
+    const float beta2h = adamw_params_ptr[6];
+
+    constexpr int64_t qk = GGML_OPT_ADAMW_8BIT_BLOCK;
+
+    const float beta2h_sqrt = sqrtf(beta2h);
+
+    // updated moments of the current block, requantized once the new absmax is known
+    float mb[qk];
+    float vb[qk];
+    float sb[qk]; // sqrt(vb)
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        const size_t offset = i03*nb03 + i02*nb02 + i01*nb01;
+
+        float       * w  = (float       *) ((char       *) src0->data      + offset); // weight
+        const float * g  = (const float *) ((const char *) src0_grad->data + offset); // grad
+        int8_t      * mq = (int8_t      *) ((char       *) src0_grad_m->data + i03*src0_grad_m->nb[3] + i02*src0_grad_m->nb[2] + i01*src0_grad_m->nb[1]);
+        int8_t      * vq = (int8_t      *) ((char       *) src0_grad_v->data + i03*src0_grad_v->nb[3] + i02*src0_grad_v->nb[2] + i01*src0_grad_v->nb[1]);
+        float       * ms = (float       *) ((char       *) m_scale->data     + i03*m_scale->nb[3]     + i02*m_scale->nb[2]     + i01*m_scale->nb[1]);
+        float       * vs = (float       *) ((char       *) v_scale->data     + i03*v_scale->nb[3]     + i02*v_scale->nb[2]     + i01*v_scale->nb[1]);
+
+        for (int64_t ib = 0; ib*qk < ne00; ++ib) {
+            const int64_t i0 = ib*qk;
+            const int64_t n  = MIN(qk, ne00 - i0);
+
+            const float m_scale_old = ms[ib];
+            const float s_scale_old = sqrtf(vs[ib]);
+
+            float m_max = 0.0f;
+            float s_max = 0.0f;
+
+            for (int64_t j = 0; j < n; ++j) {
+                const float gj = g[i0 + j];
+                const float mj = m_scale_old*ggml_adamw_8bit_decode(abs(mq[i0 + j]), 3, 127);
+                const float sj = s_scale_old*ggml_adamw_8bit_decode((uint8_t) vq[i0 + j], 4, 255);
+
+                mb[j] = (mq[i0 + j] < 0 ? -mj : mj)*beta1 +    gj*(1.0f - beta1);
+                vb[j] =                       sj*sj*beta2 + gj*gj*(1.0f - beta2);
+                sb[j] = sqrtf(vb[j]);
+
+                const float mh = mb[j]*beta1h;
+                const float vh = sb[j]*beta2h_sqrt + eps;
+
+                // decoupled weight decay, see ggml_compute_forward_opt_step_adamw_f32
+                w[i0 + j] = w[i0 + j]*(1.0f - alpha*wd) - alpha*mh/vh;
+
+                m_max = MAX(m_max, fabsf(mb[j]));
+                s_max = MAX(s_max, sb[j]);
+            }
+
+            const float m_iscale = m_max > 0.0f ? 1.0f/m_max : 0.0f;
+            const float s_iscale = s_max > 0.0f ? 1.0f/s_max : 0.0f;
+
+            for (int64_t j = 0; j < n; ++j) {
+                const int32_t qm = ggml_adamw_8bit_encode(fabsf(mb[j])*m_iscale, 3, 127);
+                const int32_t qv = ggml_adamw_8bit_encode(      sb[j] *s_iscale, 4, 255);
+
+                mq[i0 + j] = (int8_t) (mb[j] < 0.0f ? -qm : qm);
+                vq[i0 + j] = (int8_t) (uint8_t) qv;
+            }
+            ms[ib] = m_max;
+            vs[ib] = s_max*s_max;
+        }
+    }
+}
+
+void ggml_compute_forward_opt_step_adamw_8bit(
+        const ggml_compute_params * params,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = dst->src[0];
+
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_opt_step_adamw_8bit_f32(params, dst);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
@@ -27,6 +27,12 @@ struct ggml_opt_dataset {
     std::vector<int64_t> permutation;
 };
 
+enum ggml_opt_phase {
+    GGML_OPT_PHASE_FORWARD,
+    GGML_OPT_PHASE_BACKWARD,
+    GGML_OPT_PHASE_OPT,
+};
+
 struct ggml_opt_context {
     ggml_backend_sched_t    backend_sched        = nullptr;
     ggml_cgraph           * allocated_graph      = nullptr;
@@ -59,6 +65,28 @@ struct ggml_opt_context {
     ggml_opt_get_optimizer_params get_opt_pars = nullptr;
     void * get_opt_pars_ud                     = nullptr;
     struct ggml_tensor * adamw_params          = nullptr;
+
+    std::vector<struct ggml_tensor *> state; // optimizer state for checkpointing, allocated in ctx_static
+
+    ggml_opt_grad_callback grad_callback    = nullptr;
+    void                 * grad_callback_ud = nullptr;
+
+    std::vector<std::pair<int, struct ggml_tensor *>> grad_nodes; // index of the final gradient node in gb_grad and its param
+    std::map<struct ggml_tensor *, struct ggml_tensor *> grad_node_params; // final gradient nodes of allocated_graph_copy -> params
+    bool grad_callback_pending = false; // the next evaluation of gb_grad is the last one before an optimizer step
+
+    // timings and work of the graph evaluations, the phases are only timed separately with timings set
+    bool    timings               = false;
+    int64_t t_phase_us[3]         = {0, 0, 0}; // indexed by ggml_opt_phase
+    int64_t n_eval                = 0;
+    double  flops                 = 0.0;
+    double  allocated_graph_flops = 0.0;
+
+    // the phase that allocated_graph_copy starts with and its last nodes of the forward and backward pass, if it contains them
+    int                  phase_first      = 0;
+    struct ggml_tensor * phase_ends[2]    = {nullptr, nullptr};
+    int                  phase            = 0; // phase of the evaluation in progress
+    int64_t              t_phase_start_us = 0;
 };
 
 struct ggml_opt_result {
@@ -201,8 +229,15 @@ struct ggml_opt_params ggml_opt_default_params(
         /*loss_type       =*/ loss_type,
         /*build_type      =*/ GGML_OPT_BUILD_TYPE_OPT,
         /*opt_period      =*/ 1,
+        /*graph_size      =*/ GGML_DEFAULT_GRAPH_SIZE,
+        /*checkpoints     =*/ nullptr,
+        /*n_checkpoints   =*/ 0,
+        /*adamw_8bit      =*/ false,
         /*get_opt_pars    =*/ ggml_opt_get_default_optimizer_params,
         /*get_opt_pars_ud =*/ nullptr,
+        /*grad_callback   =*/ nullptr,
+        /*grad_callback_ud=*/ nullptr,
+        /*timings         =*/ false,
     };
 }
 
@@ -266,6 +301,120 @@ static ggml_cgraph * dup_graph(ggml_context * ctx, ggml_cgraph * src) {
     return dst;
 }
 
+// returns a tensor that recomputes the forward node from the tensors in replacements, creating clones for all intermediate nodes
+static ggml_tensor * recompute_tensor(
+        std::map<ggml_tensor *, ggml_tensor *> & replacements, ggml_context * ctx, const ggml_cgraph * gf, ggml_tensor * tensor) {
+    if (!tensor) {
+        return nullptr;
+    }
+
+    // leafs, inputs and params are never recomputed, neither are tensors that are not part of the forward graph
+    if (tensor->op == GGML_OP_NONE || (tensor->flags & (GGML_TENSOR_FLAG_PARAM | GGML_TENSOR_FLAG_OUTPUT))) {
+        return tensor;
+    }
+    if (!ggml_hash_contains(&gf->visited_hash_set, tensor)) {
+        return tensor;
+    }
+
+    if (replacements.find(tensor) != replacements.end()) {
+        return replacements[tensor];
+    }
+
+    ggml_tensor * clone = ggml_new_tensor(ctx, tensor->type, GGML_MAX_DIMS, tensor->ne);
+    replacements[tensor] = clone;
+
+    clone->op = tensor->op;
+    for (int i = 0; i < GGML_MAX_DIMS; i++) {
+        clone->nb[i] = tensor->nb[i];
+    }
+    memcpy(clone->op_params, tensor->op_params, sizeof(tensor->op_params));
+    ggml_format_name(clone, "%s (recomputed)", tensor->name);
+    clone->view_offs = tensor->view_offs;
+    clone->view_src  = recompute_tensor(replacements, ctx, gf, tensor->view_src);
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        clone->src[i] = recompute_tensor(replacements, ctx, gf, tensor->src[i]);
+    }
+
+    return clone;
+}
+
+// builds a backward graph that only keeps the checkpoints of the forward pass alive:
+// the gradient nodes are rewritten to use clones of the forward nodes that are recomputed from the checkpoints,
+// since the clones are added to the graph right before their first use, only one segment between two checkpoints is live at a time
+static ggml_cgraph * build_backward_checkpointed(
+        ggml_context * ctx_static, ggml_context * ctx_compute, ggml_cgraph * gf,
+        ggml_tensor ** checkpoints, int32_t n_checkpoints, bool accumulate) {
+    // the unmodified backward graph is only needed to find the gradient nodes
+    ggml_context * ctx_tmp;
+    {
+        ggml_init_params params = {
+            /*.mem_size   =*/ ggml_graph_overhead_custom(gf->size, /*grads =*/ true),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+        ctx_tmp = ggml_init(params);
+    }
+    ggml_cgraph * gb_tmp = ggml_new_graph_custom(ctx_tmp, gf->size, /*grads =*/ true);
+    ggml_graph_cpy(gf, gb_tmp);
+    ggml_build_backward_expand(ctx_static, ctx_compute, gb_tmp, accumulate);
+
+    std::map<ggml_tensor *, ggml_tensor *> replacements;
+    for (int32_t i = 0; i < n_checkpoints; i++) {
+        replacements[checkpoints[i]] = checkpoints[i];
+    }
+
+    ggml_cgraph * gb = ggml_graph_dup(ctx_compute, gf);
+    for (int i = gf->n_nodes; i < gb_tmp->n_nodes; i++) {
+        ggml_tensor * node = gb_tmp->nodes[i];
+        node->view_src = recompute_tensor(replacements, ctx_compute, gf, node->view_src);
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            node->src[j] = recompute_tensor(replacements, ctx_compute, gf, node->src[j]);
+        }
+        ggml_build_forward_expand(gb, node);
+    }
+
+    // the gradients are only tracked for the original forward nodes
+    for (int i = 0; i < gf->n_nodes; i++) {
+        const size_t igrad_tmp = ggml_hash_find(&gb_tmp->visited_hash_set, gf->nodes[i]);
+        const size_t igrad     = ggml_hash_find(&gb->visited_hash_set,     gf->nodes[i]);
+
+        GGML_ASSERT(igrad_tmp != GGML_HASHSET_FULL && igrad != GGML_HASHSET_FULL);
+
+        gb->grads[igrad]     = gb_tmp->grads[igrad_tmp];
+        gb->grad_accs[igrad] = gb_tmp->grad_accs[igrad_tmp];
+    }
+
+    ggml_free(ctx_tmp);
+
+    return gb;
+}
+
+// floating point operations of a graph, 2 per multiply-add of the matrix products and 1 per element of the other results
+static double ggml_opt_graph_flops(const ggml_cgraph * graph) {
+    double flops = 0.0;
+    for (int i = 0; i < graph->n_nodes; ++i) {
+        const struct ggml_tensor * node = graph->nodes[i];
+        switch (node->op) {
+            case GGML_OP_NONE:
+            case GGML_OP_VIEW:
+            case GGML_OP_RESHAPE:
+            case GGML_OP_PERMUTE:
+            case GGML_OP_TRANSPOSE:
+                break;
+            case GGML_OP_MUL_MAT:
+                flops += 2.0*ggml_nelements(node)*node->src[0]->ne[0];
+                break;
+            case GGML_OP_OUT_PROD:
+                flops += 2.0*ggml_nelements(node)*node->src[0]->ne[1];
+                break;
+            default:
+                flops += ggml_nelements(node);
+                break;
+        }
+    }
+    return flops;
+}
+
 static void ggml_opt_alloc_graph(ggml_opt_context_t opt_ctx, ggml_cgraph * graph) {
     GGML_ASSERT(graph);
     if (opt_ctx->allocated_graph == graph) {
@@ -276,7 +425,7 @@ static void ggml_opt_alloc_graph(ggml_opt_context_t opt_ctx, ggml_cgraph * graph
 
     {
         ggml_init_params params = {
-            /*.mem_size   =*/ ggml_tensor_overhead() * GGML_DEFAULT_GRAPH_SIZE,
+            /*.mem_size   =*/ ggml_tensor_overhead()*graph->size + ggml_graph_overhead_custom(graph->size, /*grads =*/ true),
             /*.mem_buffer =*/ nullptr,
             /*.no_alloc   =*/ true,
         };
@@ -288,6 +437,56 @@ static void ggml_opt_alloc_graph(ggml_opt_context_t opt_ctx, ggml_cgraph * graph
 
     ggml_backend_sched_alloc_graph(opt_ctx->backend_sched, opt_ctx->allocated_graph_copy);
     opt_ctx->allocated_graph = graph;
+
+    opt_ctx->grad_node_params.clear();
+    if (graph == opt_ctx->gb_grad) {
+        for (const auto & it : opt_ctx->grad_nodes) {
+            opt_ctx->grad_node_params[opt_ctx->allocated_graph_copy->nodes[it.first]] = it.second;
+        }
+    }
+
+    // the forward pass is a prefix of gb_grad, which is a prefix of gb_opt unless the optimizer step is a separate graph
+    opt_ctx->allocated_graph_flops = ggml_opt_graph_flops(graph);
+    opt_ctx->phase_first   = graph == opt_ctx->gb_opt && opt_ctx->grad_callback ? GGML_OPT_PHASE_OPT : GGML_OPT_PHASE_FORWARD;
+    opt_ctx->phase_ends[0] = nullptr;
+    opt_ctx->phase_ends[1] = nullptr;
+    if (opt_ctx->phase_first == GGML_OPT_PHASE_FORWARD && graph != opt_ctx->gf) {
+        opt_ctx->phase_ends[0] = opt_ctx->allocated_graph_copy->nodes[opt_ctx->gf->n_nodes - 1];
+        if (graph == opt_ctx->gb_opt) {
+            opt_ctx->phase_ends[1] = opt_ctx->allocated_graph_copy->nodes[opt_ctx->gb_grad->n_nodes - 1];
+        }
+    }
+}
+
+// observes the ends of the forward and backward pass for the timings
+// and the final gradient nodes of gb_grad to pass the gradients to the user callback
+static bool ggml_opt_eval_callback(struct ggml_tensor * t, bool ask, void * user_data) {
+    ggml_opt_context_t opt_ctx = (ggml_opt_context_t) user_data;
+
+    const bool phase_end = opt_ctx->timings && opt_ctx->phase < GGML_OPT_PHASE_OPT && t == opt_ctx->phase_ends[opt_ctx->phase];
+
+    auto it = opt_ctx->grad_node_params.end();
+    if (opt_ctx->grad_callback_pending) {
+        it = opt_ctx->grad_node_params.find(t);
+    }
+    const bool grad_final = it != opt_ctx->grad_node_params.end();
+
+    if (!phase_end && !grad_final) {
+        return false;
+    }
+    if (ask) {
+        return true;
+    }
+    if (phase_end) {
+        const int64_t t_now_us = ggml_time_us();
+        opt_ctx->t_phase_us[opt_ctx->phase] += t_now_us - opt_ctx->t_phase_start_us;
+        opt_ctx->t_phase_start_us = t_now_us;
+        opt_ctx->phase++;
+    }
+    if (grad_final) {
+        opt_ctx->grad_callback(it->second, ggml_graph_get_grad_acc(opt_ctx->gb_grad, it->second), opt_ctx->grad_callback_ud);
+    }
+    return true;
 }
 
 ggml_opt_context_t ggml_opt_init(struct ggml_opt_params params) {
@@ -299,17 +498,20 @@ ggml_opt_context_t ggml_opt_init(struct ggml_opt_params params) {
     result->opt_period      = params.opt_period;
     result->get_opt_pars    = params.get_opt_pars;
     result->get_opt_pars_ud = params.get_opt_pars_ud;
+    result->grad_callback    = params.build_type == GGML_OPT_BUILD_TYPE_OPT ? params.grad_callback : nullptr;
+    result->grad_callback_ud = params.grad_callback_ud;
+    result->timings          = params.timings;
 
     GGML_ASSERT(result->inputs->data && "the inputs must be allocated statically");
     GGML_ASSERT(result->opt_period >= 1);
 
     const bool accumulate = params.build_type == GGML_OPT_BUILD_TYPE_GRAD ||
-        (params.build_type == GGML_OPT_BUILD_TYPE_OPT && result->opt_period > 1);
+        (params.build_type == GGML_OPT_BUILD_TYPE_OPT && (result->opt_period > 1 || result->grad_callback));
 
     ggml_set_input(result->inputs);
     ggml_set_output(result->outputs);
 
-    result->gf = ggml_new_graph_custom(result->ctx_compute, GGML_DEFAULT_GRAPH_SIZE, /*grads =*/ true); // Forward pass.
+    result->gf = ggml_new_graph_custom(result->ctx_compute, params.graph_size, /*grads =*/ true); // Forward pass.
     ggml_build_forward_expand(result->gf, result->outputs);
 
     int n_param = 0;
@@ -322,12 +524,13 @@ ggml_opt_context_t ggml_opt_init(struct ggml_opt_params params) {
     {
         // The static context is used for:
         //   - gradients (1 tensor per param if using gradient accumulation)
-        //   - optimizer momenta (2 tensors per param)
+        //   - optimizer momenta (2 tensors per param, 4 with 8-bit momenta and their scales)
         //   - labels
         //   - loss + its gradient (up to 5 tensors)
         //   - pred
         //   - ncorrect (2 tensors).
-        const size_t tensors_per_param = (accumulate ? 1 : 0) + (params.build_type == GGML_OPT_BUILD_TYPE_OPT ? 2 : 0);
+        const size_t tensors_per_param = (accumulate ? 1 : 0) +
+            (params.build_type == GGML_OPT_BUILD_TYPE_OPT ? (params.adamw_8bit ? 4 : 2) : 0);
         const size_t size_meta = (tensors_per_param*n_param + 9) * ggml_tensor_overhead();
         struct ggml_init_params params = {
             /*.mem_size   =*/ size_meta,
@@ -419,8 +622,13 @@ ggml_opt_context_t ggml_opt_init(struct ggml_opt_params params) {
     }
 
     // gb_grad == graph backward gradients, forward pass, then backward pass to calculate gradients.
-    result->gb_grad = ggml_graph_dup(result->ctx_compute, result->gf);
-    ggml_build_backward_expand(result->ctx_static, result->ctx_compute, result->gb_grad, accumulate);
+    if (params.n_checkpoints > 0) {
+        result->gb_grad = build_backward_checkpointed(
+            result->ctx_static, result->ctx_compute, result->gf, params.checkpoints, params.n_checkpoints, accumulate);
+    } else {
+        result->gb_grad = ggml_graph_dup(result->ctx_compute, result->gf);
+        ggml_build_backward_expand(result->ctx_static, result->ctx_compute, result->gb_grad, accumulate);
+    }
 
     if (params.build_type == GGML_OPT_BUILD_TYPE_GRAD) {
         result->buf_static = ggml_backend_alloc_ctx_tensors(result->ctx_static, ggml_backend_sched_get_backend(result->backend_sched, 0));
@@ -431,20 +639,60 @@ ggml_opt_context_t ggml_opt_init(struct ggml_opt_params params) {
     GGML_ASSERT(params.build_type == GGML_OPT_BUILD_TYPE_OPT);
 
     // gb_opt == graph backward optimize, forward pass, then backward pass to calculate gradients, then optimizer step.
-    result->gb_opt = ggml_graph_dup(result->ctx_compute, result->gb_grad);
+    // with a gradient callback only the optimizer step, the gradients are taken from the accumulators filled by gb_grad
+    if (result->grad_callback) {
+        std::map<ggml_tensor *, int> node_index;
+        for (int i = 0; i < result->gb_grad->n_nodes; ++i) {
+            node_index[result->gb_grad->nodes[i]] = i;
+        }
+        for (int i = 0; i < result->gf->n_nodes; ++i) {
+            struct ggml_tensor * node = result->gf->nodes[i];
+            if (!(node->flags & GGML_TENSOR_FLAG_PARAM)) {
+                continue;
+            }
+            auto it = node_index.find(ggml_graph_get_grad(result->gb_grad, node));
+            if (it != node_index.end()) {
+                result->grad_nodes.emplace_back(it->second, node);
+            }
+        }
+        result->gb_opt = ggml_new_graph_custom(result->ctx_compute, params.graph_size, /*grads =*/ true);
+    } else {
+        result->gb_opt = ggml_graph_dup(result->ctx_compute, result->gb_grad);
+    }
 
     result->adamw_params = ggml_new_tensor_1d(result->ctx_static_cpu, GGML_TYPE_F32, 7);
     ggml_set_input(result->adamw_params);
     ggml_set_name(result->adamw_params, "adamw_params");
 
     for (int i = result->gf->n_nodes-1; i >= 0; --i) {
-        struct ggml_tensor * node = result->gb_opt->nodes[i];
-        struct ggml_tensor * grad = ggml_graph_get_grad(result->gb_opt, node);
+        struct ggml_tensor * node = result->gf->nodes[i];
+        struct ggml_tensor * grad = result->grad_callback ?
+            ggml_graph_get_grad_acc(result->gb_grad, node) : ggml_graph_get_grad(result->gb_opt, node);
 
         if (node->flags & GGML_TENSOR_FLAG_PARAM) {
-            struct ggml_tensor * m        = ggml_dup_tensor(result->ctx_static, node);
-            struct ggml_tensor * v        = ggml_dup_tensor(result->ctx_static, node);
-            struct ggml_tensor * opt_step = ggml_opt_step_adamw(result->ctx_compute, node, grad, m, v, result->adamw_params);
+            struct ggml_tensor * opt_step;
+            if (params.adamw_8bit) {
+                const int64_t nblock = (node->ne[0] + GGML_OPT_ADAMW_8BIT_BLOCK - 1)/GGML_OPT_ADAMW_8BIT_BLOCK;
+
+                struct ggml_tensor * m       = ggml_new_tensor(result->ctx_static, GGML_TYPE_I8, GGML_MAX_DIMS, node->ne);
+                struct ggml_tensor * v       = ggml_new_tensor(result->ctx_static, GGML_TYPE_I8, GGML_MAX_DIMS, node->ne);
+                struct ggml_tensor * m_scale = ggml_new_tensor_4d(result->ctx_static, GGML_TYPE_F32, nblock, node->ne[1], node->ne[2], node->ne[3]);
+                struct ggml_tensor * v_scale = ggml_new_tensor_4d(result->ctx_static, GGML_TYPE_F32, nblock, node->ne[1], node->ne[2], node->ne[3]);
+                ggml_format_name(m_scale, "%s.adamw_m_scale", node->name);
+                ggml_format_name(v_scale, "%s.adamw_v_scale", node->name);
+                result->state.push_back(m_scale);
+                result->state.push_back(v_scale);
+                opt_step = ggml_opt_step_adamw_8bit(result->ctx_compute, node, grad, m, v, m_scale, v_scale, result->adamw_params);
+            } else {
+                struct ggml_tensor * m = ggml_dup_tensor(result->ctx_static, node);
+                struct ggml_tensor * v = ggml_dup_tensor(result->ctx_static, node);
+                opt_step = ggml_opt_step_adamw(result->ctx_compute, node, grad, m, v, result->adamw_params);
+            }
+            // m and v are src[2] and src[3] of both optimizer ops
+            ggml_format_name(opt_step->src[2], "%s.adamw_m", node->name);
+            ggml_format_name(opt_step->src[3], "%s.adamw_v", node->name);
+            result->state.push_back(opt_step->src[2]);
+            result->state.push_back(opt_step->src[3]);
             ggml_build_forward_expand(result->gb_opt, opt_step);
         }
     }
@@ -455,6 +703,9 @@ ggml_opt_context_t ggml_opt_init(struct ggml_opt_params params) {
     result->buf_static_cpu = ggml_backend_alloc_ctx_tensors_from_buft(result->ctx_static_cpu, ggml_backend_cpu_buffer_type());
 
     ggml_graph_reset(result->gb_opt);
+    if (result->grad_callback) {
+        ggml_graph_reset(result->gb_grad);
+    }
 
     return result;
 }
@@ -504,7 +755,41 @@ struct ggml_tensor * ggml_opt_ncorrect(ggml_opt_context_t opt_ctx) {
 }
 
 struct ggml_tensor * ggml_opt_grad_acc(ggml_opt_context_t opt_ctx, struct ggml_tensor * node) {
-    return ggml_graph_get_grad_acc(opt_ctx->gb_opt, node);
+    return ggml_graph_get_grad_acc(opt_ctx->grad_callback ? opt_ctx->gb_grad : opt_ctx->gb_opt, node);
+}
+
+int64_t ggml_opt_get_iter(ggml_opt_context_t opt_ctx) {
+    return opt_ctx->iter;
+}
+
+void ggml_opt_set_iter(ggml_opt_context_t opt_ctx, int64_t iter) {
+    GGML_ASSERT(iter >= 1);
+    opt_ctx->iter = iter;
+}
+
+int ggml_opt_n_state(ggml_opt_context_t opt_ctx) {
+    return opt_ctx->state.size();
+}
+
+struct ggml_tensor * ggml_opt_get_state(ggml_opt_context_t opt_ctx, int i) {
+    GGML_ASSERT(i >= 0 && i < (int) opt_ctx->state.size());
+    return opt_ctx->state[i];
+}
+
+void ggml_opt_get_timings(ggml_opt_context_t opt_ctx, struct ggml_opt_timings * timings) {
+    timings->t_forward_us  = opt_ctx->t_phase_us[GGML_OPT_PHASE_FORWARD];
+    timings->t_backward_us = opt_ctx->t_phase_us[GGML_OPT_PHASE_BACKWARD];
+    timings->t_opt_us      = opt_ctx->t_phase_us[GGML_OPT_PHASE_OPT];
+    timings->n_eval        = opt_ctx->n_eval;
+    timings->flops         = opt_ctx->flops;
+}
+
+void ggml_opt_reset_timings(ggml_opt_context_t opt_ctx) {
+    for (int64_t & t : opt_ctx->t_phase_us) {
+        t = 0;
+    }
+    opt_ctx->n_eval = 0;
+    opt_ctx->flops  = 0.0;
 }
 
 // ====== Optimization Result ======
@@ -610,7 +895,23 @@ static void ggml_opt_eval_graph(ggml_opt_context_t opt_ctx, ggml_cgraph * graph,
     }
 
     ggml_opt_alloc_graph(opt_ctx, graph);
-    ggml_backend_sched_graph_compute(opt_ctx->backend_sched, opt_ctx->allocated_graph_copy);
+
+    opt_ctx->phase            = opt_ctx->phase_first;
+    opt_ctx->t_phase_start_us = ggml_time_us();
+    if (opt_ctx->timings || (opt_ctx->grad_callback_pending && graph == opt_ctx->gb_grad)) {
+        ggml_backend_sched_set_eval_callback(opt_ctx->backend_sched, ggml_opt_eval_callback, opt_ctx);
+        ggml_backend_sched_graph_compute(opt_ctx->backend_sched, opt_ctx->allocated_graph_copy);
+        ggml_backend_sched_set_eval_callback(opt_ctx->backend_sched, nullptr, nullptr);
+    } else {
+        ggml_backend_sched_graph_compute(opt_ctx->backend_sched, opt_ctx->allocated_graph_copy);
+    }
+    opt_ctx->grad_callback_pending = false;
+    if (opt_ctx->timings) {
+        opt_ctx->t_phase_us[opt_ctx->phase] += ggml_time_us() - opt_ctx->t_phase_start_us;
+    }
+    opt_ctx->n_eval++;
+    opt_ctx->flops += opt_ctx->allocated_graph_flops;
+
     opt_ctx->iter += opt_ctx->allocated_graph == opt_ctx->gb_opt;
 
     if (!result) {
@@ -657,6 +958,19 @@ void ggml_opt_forward(ggml_opt_context_t opt_ctx, ggml_opt_result * result) {
 }
 
 void ggml_opt_forward_backward(ggml_opt_context_t opt_ctx, ggml_opt_result * result) {
+    if (opt_ctx->grad_callback) {
+        const int32_t opt_i_next = (opt_ctx->opt_i + 1) % opt_ctx->opt_period;
+        opt_ctx->grad_callback_pending = opt_i_next == 0;
+        ggml_opt_eval_graph(opt_ctx, opt_ctx->gb_grad, result);
+        if (opt_i_next == 0) {
+            opt_ctx->grad_callback(nullptr, nullptr, opt_ctx->grad_callback_ud);
+            ggml_opt_eval_graph(opt_ctx, opt_ctx->gb_opt, nullptr);
+            ggml_opt_reset(opt_ctx, /*optimizer =*/ false);
+        }
+        opt_ctx->opt_i = opt_i_next;
+        return;
+    }
+
     if (opt_ctx->opt_period == 1) {
         ggml_opt_eval_graph(opt_ctx, opt_ctx->gb_opt, result);
         return;
@@ -2,8 +2,10 @@
 #include "ggml-impl.h"
 #include "ggml-backend-impl.h"
 
+#include <chrono>
 #include <cinttypes>
 #include <string>
+#include <thread>
 #include <vector>
 #include <memory>
 #include <mutex>
@@ -1509,6 +1511,115 @@ void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint
 #endif
 }
 
+// all-reduce
+
+struct ggml_rpc_allreduce {
+    int rank;
+    int n_ranks;
+    std::vector<std::shared_ptr<socket_t>> sockets; // rank 0: the other ranks in rank order, otherwise: rank 0
+    std::vector<float> buf;
+};
+
+struct rpc_msg_allreduce_hello {
+    uint32_t rank;
+    uint32_t n_ranks;
+};
+
+ggml_rpc_allreduce_t ggml_rpc_allreduce_init(const char * endpoint, int rank, int n_ranks) {
+    if (rank < 0 || rank >= n_ranks) {
+        fprintf(stderr, "Invalid rank %d for %d ranks\n", rank, n_ranks);
+        return nullptr;
+    }
+    std::string host;
+    int port;
+    if (!parse_endpoint(endpoint, host, port)) {
+        fprintf(stderr, "Invalid endpoint: %s\n", endpoint);
+        return nullptr;
+    }
+#ifdef _WIN32
+    {
+        WSADATA wsaData;
+        int res = WSAStartup(MAKEWORD(2, 2), &wsaData);
+        if (res != 0) {
+            fprintf(stderr, "WSAStartup failed: %d\n", res);
+            return nullptr;
+        }
+    }
+#endif
+    std::unique_ptr<ggml_rpc_allreduce> ar(new ggml_rpc_allreduce { rank, n_ranks, {}, {} });
+
+    if (rank == 0) {
+        ar->sockets.resize(n_ranks - 1);
+        if (n_ranks == 1) {
+            return ar.release();
+        }
+        auto server_socket = create_server_socket(host.c_str(), port);
+        if (server_socket == nullptr) {
+            fprintf(stderr, "Failed to create server socket on %s\n", endpoint);
+            return nullptr;
+        }
+        for (int i = 1; i < n_ranks; i++) {
+            auto sock = socket_accept(server_socket->fd);
+            rpc_msg_allreduce_hello hello;
+            if (sock == nullptr || !recv_msg(sock->fd, &hello, sizeof(hello))) {
+                fprintf(stderr, "Failed to accept a connection from another rank\n");
+                return nullptr;
+            }
+            if ((int) hello.n_ranks != n_ranks || hello.rank == 0 || (int) hello.rank >= n_ranks || ar->sockets[hello.rank - 1]) {
+                fprintf(stderr, "Unexpected connection from rank %u of %u\n", hello.rank, hello.n_ranks);
+                return nullptr;
+            }
+            ar->sockets[hello.rank - 1] = sock;
+        }
+        return ar.release();
+    }
+
+    // rank 0 may not be listening yet
+    std::shared_ptr<socket_t> sock;
+    for (int i = 0; i < 600 && sock == nullptr; i++) {
+        sock = socket_connect(host.c_str(), port);
+        if (sock == nullptr) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+    if (sock == nullptr) {
+        fprintf(stderr, "Failed to connect to rank 0 at %s\n", endpoint);
+        return nullptr;
+    }
+    rpc_msg_allreduce_hello hello = { (uint32_t) rank, (uint32_t) n_ranks };
+    if (!send_msg(sock->fd, &hello, sizeof(hello))) {
+        return nullptr;
+    }
+    ar->sockets.push_back(sock);
+    return ar.release();
+}
+
+void ggml_rpc_allreduce_free(ggml_rpc_allreduce_t ar) {
+    delete ar;
+}
+
+bool ggml_rpc_allreduce_sum(ggml_rpc_allreduce_t ar, float * data, int64_t n) {
+    const size_t size = n*sizeof(float);
+    if (ar->rank != 0) {
+        return send_msg(ar->sockets[0]->fd, data, size) && recv_msg(ar->sockets[0]->fd, data, size);
+    }
+    ar->buf.resize(n);
+    for (const auto & sock : ar->sockets) {
+        if (!recv_msg(sock->fd, ar->buf.data(), size)) {
+            return false;
+        }
+        for (int64_t i = 0; i < n; i++) {
+            data[i] += ar->buf[i];
+        }
+    }
+    for (const auto & sock : ar->sockets) {
+        if (!send_msg(sock->fd, data, size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 // device interface
 
 struct ggml_backend_rpc_device_context {
@@ -1631,6 +1742,15 @@ static void * ggml_backend_rpc_get_proc_address(ggml_backend_reg_t reg, const ch
     if (std::strcmp(name, "ggml_backend_rpc_add_device") == 0) {
         return (void *)ggml_backend_rpc_add_device;
     }
+    if (std::strcmp(name, "ggml_rpc_allreduce_init") == 0) {
+        return (void *)ggml_rpc_allreduce_init;
+    }
+    if (std::strcmp(name, "ggml_rpc_allreduce_free") == 0) {
+        return (void *)ggml_rpc_allreduce_free;
+    }
+    if (std::strcmp(name, "ggml_rpc_allreduce_sum") == 0) {
+        return (void *)ggml_rpc_allreduce_sum;
+    }
     return NULL;
 
     GGML_UNUSED(reg);
@@ -991,9 +991,10 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS",
     "CROSS_ENTROPY_LOSS_BACK",
     "OPT_STEP_ADAMW",
+    "OPT_STEP_ADAMW_8BIT",
 };
 
-static_assert(GGML_OP_COUNT == 81, "GGML_OP_COUNT != 81");
+static_assert(GGML_OP_COUNT == 82, "GGML_OP_COUNT != 82");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -1085,9 +1086,10 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss(x,y)",
     "cross_entropy_loss_back(x,y)",
     "adamw(x)",
+    "adamw_8bit(x)",
 };
 
-static_assert(GGML_OP_COUNT == 81, "GGML_OP_COUNT != 81");
+static_assert(GGML_OP_COUNT == 82, "GGML_OP_COUNT != 82");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -5106,6 +5108,43 @@ struct ggml_tensor * ggml_opt_step_adamw(
     return result;
 }
 
+// opt_step_adamw_8bit
+
+struct ggml_tensor * ggml_opt_step_adamw_8bit(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * grad,
+        struct ggml_tensor  * m,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * m_scale,
+        struct ggml_tensor  * v_scale,
+        struct ggml_tensor  * adamw_params) {
+    GGML_ASSERT(a->flags & GGML_TENSOR_FLAG_PARAM);
+    GGML_ASSERT(ggml_are_same_shape(a, grad));
+    GGML_ASSERT(ggml_are_same_shape(a, m));
+    GGML_ASSERT(ggml_are_same_shape(a, v));
+    GGML_ASSERT(m->type == GGML_TYPE_I8 && v->type == GGML_TYPE_I8);
+    GGML_ASSERT(m_scale->type == GGML_TYPE_F32 && v_scale->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_are_same_shape(m_scale, v_scale));
+    GGML_ASSERT(m_scale->ne[0] == (a->ne[0] + GGML_OPT_ADAMW_8BIT_BLOCK - 1)/GGML_OPT_ADAMW_8BIT_BLOCK);
+    GGML_ASSERT(m_scale->ne[1] == a->ne[1] && m_scale->ne[2] == a->ne[2] && m_scale->ne[3] == a->ne[3]);
+    GGML_ASSERT(adamw_params->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_nelements(adamw_params) == 7);
+
+    struct ggml_tensor * result = ggml_view_tensor(ctx, a);
+
+    result->op     = GGML_OP_OPT_STEP_ADAMW_8BIT;
+    result->src[0] = a;
+    result->src[1] = grad;
+    result->src[2] = m;
+    result->src[3] = v;
+    result->src[4] = adamw_params;
+    result->src[5] = m_scale;
+    result->src[6] = v_scale;
+
+    return result;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 struct ggml_hash_set ggml_hash_set_new(size_t size) {
@@ -6035,6 +6074,13 @@ void ggml_graph_reset(struct ggml_cgraph * cgraph) {
             ggml_set_zero(node->src[2]);
             ggml_set_zero(node->src[3]);
         }
+        if (node->op == GGML_OP_OPT_STEP_ADAMW_8BIT) {
+            // clear quantized momenta and their scales
+            ggml_set_zero(node->src[2]);
+            ggml_set_zero(node->src[3]);
+            ggml_set_zero(node->src[5]);
+            ggml_set_zero(node->src[6]);
+        }
 
         // initial gradients of loss should be 1, 0 otherwise
         if (grad_acc) {
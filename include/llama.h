@@ -326,7 +326,7 @@ extern "C" {
         uint32_t n_ctx;             // text context, 0 = from model
         uint32_t n_batch;           // logical maximum batch size that can be submitted to llama_decode
         uint32_t n_ubatch;          // physical maximum batch size
-        uint32_t n_seq_max;         // max number of sequences (i.e. distinct states for recurrent models)
+        uint32_t n_seq_max;         // max number of sequences (i.e. distinct states for recurrent models), at most LLAMA_MAX_SEQ of the build (default: 64)
         int32_t  n_threads;         // number of threads to use for generation
         int32_t  n_threads_batch;   // number of threads to use for batch processing
 
@@ -343,6 +343,11 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, < 0 disabled (default)
+        uint32_t n_kv_block;       // cells per block of the paged KV cache, power of 2, 0 = contiguous KV cache (default)
+        uint32_t defrag_step_us;   // max. duration of a KV cache defrag step in microseconds, the cells are moved over several
+                                   // updates, 0 = defragment in one update (default)
+        uint32_t n_state_ckpt;     // recurrent models: max. number of state checkpoints kept per sequence, 0 = disabled (default)
+        uint32_t state_ckpt_step;  // recurrent models: min. number of tokens between two checkpoints of a sequence
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -350,6 +355,10 @@ extern "C" {
         enum ggml_type type_k; // data type for K cache [EXPERIMENTAL]
         enum ggml_type type_v; // data type for V cache [EXPERIMENTAL]
 
+        // per-layer data types for the K and V cache, arrays of n_layer types, NULL = type_k/type_v for all layers [EXPERIMENTAL]
+        const enum ggml_type * type_k_layer;
+        const enum ggml_type * type_v_layer;
+
         // Keep the booleans together and at the end of the struct to avoid misalignment during copy-by-value.
         // TODO: move at the end of the struct
         bool logits_all;  // the llama_decode() call computes all logits, not just the last one (DEPRECATED - set llama_batch.logits instead)
@@ -357,6 +366,8 @@ extern "C" {
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
         bool flash_attn;  // whether to use flash attention [EXPERIMENTAL]
         bool no_perf;     // whether to measure performance timings
+        bool kv_scores;   // accumulate the attention received by each KV cell, used by llama_kv_self_seq_evict
+                          // (not with flash attention)
 
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
@@ -443,6 +454,12 @@ extern "C" {
                                  size_t    n_paths,
               struct llama_model_params    params);
 
+    // Returns a hash of the GGUF header, of the first bytes of every tensor, and of the size and modification time of a model file,
+    // or 0 if it cannot be read
+    // The tensor data is only sampled: models with the same metadata get different hashes when their files differ in size or mtime,
+    // a file that is rewritten in place with different weights and the same mtime keeps its hash
+    LLAMA_API uint64_t llama_model_file_hash(const char * path_model);
+
     DEPRECATED(LLAMA_API void llama_free_model(struct llama_model * model),
             "use llama_model_free instead");
 
@@ -701,9 +718,11 @@ extern "C" {
     // If the KV cache is RoPEd, the KV data is updated accordingly:
     //   - lazily on next llama_decode()
     //   - explicitly with llama_kv_self_update()
+    // Cells shared with other sequences are copied first, so that only the positions of this sequence change
+    // Returns false if there are not enough free cells for the copies, the positions are not changed then
     // p0 < 0 : [0,  p1]
     // p1 < 0 : [p0, inf)
-    LLAMA_API void llama_kv_self_seq_add(
+    LLAMA_API bool llama_kv_self_seq_add(
             struct llama_context * ctx,
                     llama_seq_id   seq_id,
                        llama_pos   p0,
@@ -714,9 +733,10 @@ extern "C" {
     // If the KV cache is RoPEd, the KV data is updated accordingly:
     //   - lazily on next llama_decode()
     //   - explicitly with llama_kv_self_update()
+    // Returns false if there are not enough free cells to copy the shared cells, like llama_kv_self_seq_add
     // p0 < 0 : [0,  p1]
     // p1 < 0 : [p0, inf)
-    LLAMA_API void llama_kv_self_seq_div(
+    LLAMA_API bool llama_kv_self_seq_div(
             struct llama_context * ctx,
                     llama_seq_id   seq_id,
                        llama_pos   p0,
@@ -728,6 +748,31 @@ extern "C" {
             struct llama_context * ctx,
                      llama_seq_id   seq_id);
 
+    // Returns the largest position p <= pos such that llama_kv_self_seq_rm(ctx, seq_id, p + 1, -1) succeeds, or -1
+    // This is pos if the KV cache of the sequence can be partially removed, otherwise (recurrent models) the position of
+    // the current state or of the last state checkpoint before it, see llama_context_params.n_state_ckpt
+    LLAMA_API llama_pos llama_kv_self_seq_pos_rollback(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   pos);
+
+    // Evict cells of the sequence to bound its KV cache size, keeps:
+    //   - the n_sink cells with the lowest positions (attention sinks)
+    //   - the n_recent cells with the highest positions
+    //   - the n_heavy cells in between that received the most attention (requires kv_scores, otherwise the most recent)
+    // The kept cells are shifted to close the gaps, like llama_kv_self_seq_add
+    // The old positions of the kept cells are written in order to pos_kept if it is not NULL, it must hold
+    // n_sink + n_heavy + n_recent positions
+    // Returns the number of kept cells, or -1 if the KV cache cannot be shifted or there are not enough free cells
+    // to copy the kept cells that are shared with other sequences
+    LLAMA_API int32_t llama_kv_self_seq_evict(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                         int32_t   n_sink,
+                         int32_t   n_heavy,
+                         int32_t   n_recent,
+                       llama_pos * pos_kept);
+
     // Defragment the KV cache
     // This will be applied:
     //   - lazily on next llama_decode()
@@ -1,36 +1,1607 @@
 #include "finetune.h"
 #include "graph_reasoning.h"
+
+#include "llama-impl.h"
+#include "llama-model.h"
+#include "llama-model-loader.h"
+
+#include "ggml.h"
+#include "ggml-backend.h"
+#include "ggml-cpp.h"
+#include "ggml-opt.h"
+#include "ggml-rpc.h"
+#include "gguf.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
 #include <cmath>
+#include <condition_variable>
+#include <cstdio>
 #include <cstring>
-#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
-// Define tensor structure based on typical llama.cpp implementation
-struct tensor_ext {
-    float* data;
-    float* grad;
-    int* dims;
-    int n_dims;
+//
+// training graph
+//
+
+// the subset of the model weights used by the training graph
+// the same graph builder is used for the live weights (policy) and for a frozen copy of them (reference)
+struct llama_ft_layer {
+    ggml_tensor * attn_norm  = nullptr;
+    ggml_tensor * wq         = nullptr;
+    ggml_tensor * wk         = nullptr;
+    ggml_tensor * wv         = nullptr;
+    ggml_tensor * wo         = nullptr;
+    ggml_tensor * bq         = nullptr;
+    ggml_tensor * bk         = nullptr;
+    ggml_tensor * bv         = nullptr;
+    ggml_tensor * bo         = nullptr;
+    ggml_tensor * ffn_norm   = nullptr;
+    ggml_tensor * ffn_gate   = nullptr;
+    ggml_tensor * ffn_up     = nullptr;
+    ggml_tensor * ffn_down   = nullptr;
+    ggml_tensor * rope_freqs = nullptr; // never trained
 };
 
-// Helper to extend model tensors for finetuning
-static bool extend_model_tensors(struct llama_model* model) {
-    // Get model tensors
-    // This is a placeholder - actual implementation needs to access 
-    // the model's tensor structure
-    
-    // For each parameter tensor, allocate gradient storage
-    // In a real implementation, we'd loop through model tensors:
-    // for (tensor in model->tensors) {
-    //     if (tensor is a parameter) {
-    //         tensor.grad = allocate_memory(tensor.size);
-    //         zero_gradient(tensor.grad, tensor.size);
-    //     }
-    // }
-    
+struct llama_ft_weights {
+    ggml_tensor * tok_embd    = nullptr;
+    ggml_tensor * output_norm = nullptr;
+    ggml_tensor * output      = nullptr;
+
+    std::vector<llama_ft_layer> layers;
+
+    // calls fn for every weight that is a candidate for training
+    template <typename F>
+    void foreach(F && fn) {
+        fn(tok_embd);
+        fn(output_norm);
+        if (output != tok_embd) {
+            fn(output);
+        }
+        for (auto & layer : layers) {
+            for (ggml_tensor ** t : {
+                    &layer.attn_norm, &layer.wq, &layer.wk, &layer.wv, &layer.wo,
+                    &layer.bq, &layer.bk, &layer.bv, &layer.bo,
+                    &layer.ffn_norm, &layer.ffn_gate, &layer.ffn_up, &layer.ffn_down}) {
+                if (*t) {
+                    fn(*t);
+                }
+            }
+        }
+    }
+};
+
+static bool llama_ft_arch_supported(llm_arch arch) {
+    switch (arch) {
+        case LLM_ARCH_LLAMA:
+        case LLM_ARCH_QWEN2:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// only F32 weights are updated, quantized weights stay frozen and gradients are only propagated through them
+static bool llama_ft_is_trainable(const ggml_tensor * t) {
+    return t->type == GGML_TYPE_F32;
+}
+
+static llama_ft_weights llama_ft_weights_from_model(const llama_model & model) {
+    llama_ft_weights w;
+
+    w.tok_embd    = model.tok_embd;
+    w.output_norm = model.output_norm;
+    w.output      = model.output ? model.output : model.tok_embd;
+
+    w.layers.resize(model.layers.size());
+    for (size_t il = 0; il < model.layers.size(); ++il) {
+        const llama_layer & src = model.layers[il];
+        llama_ft_layer    & dst = w.layers[il];
+
+        dst.attn_norm  = src.attn_norm;
+        dst.wq         = src.wq;
+        dst.wk         = src.wk;
+        dst.wv         = src.wv;
+        dst.wo         = src.wo;
+        dst.bq         = src.bq;
+        dst.bk         = src.bk;
+        dst.bv         = src.bv;
+        dst.bo         = src.bo;
+        dst.ffn_norm   = src.ffn_norm;
+        dst.ffn_gate   = src.ffn_gate;
+        dst.ffn_up     = src.ffn_up;
+        dst.ffn_down   = src.ffn_down;
+        dst.rope_freqs = src.rope_freqs;
+    }
+
+    return w;
+}
+
+// returns an empty string if the model can be trained in place, otherwise the reason why it cannot
+static std::string llama_ft_check_model(const llama_model & model) {
+    if (!llama_ft_arch_supported(model.arch)) {
+        return format("architecture '%s' is not supported for finetuning", model.arch_name().c_str());
+    }
+    if (model.params.use_mmap) {
+        return "the weights are updated in place, load the model with use_mmap = false";
+    }
+
+    ggml_backend_dev_t dev_cpu = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (!dev_cpu) {
+        return "no CPU backend available";
+    }
+    ggml_backend_buffer_type_t buft_cpu = ggml_backend_dev_buffer_type(dev_cpu);
+
+    llama_ft_weights w = llama_ft_weights_from_model(model);
+
+    if (!w.tok_embd || !w.output_norm) {
+        return "missing token embeddings or output norm";
+    }
+
+    std::string err;
+    for (const auto & layer : w.layers) {
+        if (!layer.attn_norm || !layer.wq || !layer.wk || !layer.wv || !layer.wo ||
+            !layer.ffn_norm || !layer.ffn_gate || !layer.ffn_up || !layer.ffn_down) {
+            return "unsupported layer layout (fused QKV, MoE or missing tensors)";
+        }
+    }
+    w.foreach([&](ggml_tensor * t) {
+        if (!err.empty()) {
+            return;
+        }
+        if (!t->buffer || ggml_backend_buffer_get_type(t->buffer) != buft_cpu) {
+            err = format("tensor '%s' is not in a CPU buffer (offloaded or repacked weights cannot be trained)", t->name);
+            return;
+        }
+        // the backward pass of ggml_mul_mat needs ggml_out_prod, which has no F16/BF16 kernel
+        if (t->type == GGML_TYPE_F16 || t->type == GGML_TYPE_BF16) {
+            err = format("tensor '%s' has type %s, convert the model to F32 or a quantized type", t->name, ggml_type_name(t->type));
+        }
+    });
+
+    return err;
+}
+
+// expands the K/V heads of grouped-query attention to n_head
+// done explicitly since the backward pass of ggml_mul_mat cannot broadcast across more than one batch dimension
+static ggml_tensor * llama_ft_repeat_kv(ggml_context * ctx, ggml_tensor * cur, int64_t n_head) {
+    const int64_t n_head_kv = cur->ne[2];
+    if (n_head_kv == n_head) {
+        return cur;
+    }
+
+    ggml_tensor * tmp = ggml_reshape_4d(ctx, cur, cur->ne[0]*cur->ne[1], 1, n_head_kv, cur->ne[3]);
+    tmp = ggml_repeat(ctx, tmp, ggml_new_tensor_4d(ctx, cur->type, tmp->ne[0], n_head/n_head_kv, n_head_kv, cur->ne[3]));
+
+    return ggml_reshape_4d(ctx, tmp, cur->ne[0], cur->ne[1], n_head, cur->ne[3]);
+}
+
+// builds the causal LM graph for a batch of equal-length sequences without a KV cache:
+//   tokens:  I32 [n_tokens, n_seqs]
+//   pos:     I32 [n_tokens], the same positions are used for every sequence
+//   out_ids: I32 [n_outputs], optional rows of the flattened batch for which the logits are computed
+// returns the logits, F32 [n_vocab, n_outputs]
+// if checkpoints is set, the residual stream at every layer boundary is appended to it for activation checkpointing
+static ggml_tensor * llama_ft_build_logits(
+        ggml_context               * ctx,
+        const llama_model          & model,
+        const llama_ft_weights     & w,
+        ggml_tensor                * tokens,
+        ggml_tensor                * pos,
+        ggml_tensor                * out_ids,
+        std::vector<ggml_tensor *> * checkpoints = nullptr) {
+    const auto & hparams = model.hparams;
+
+    const int64_t n_tokens    = tokens->ne[0];
+    const int64_t n_seqs      = tokens->ne[1];
+    const int64_t n_embd_head = hparams.n_embd_head_k;
+    const float   kq_scale    = 1.0f/sqrtf(float(n_embd_head));
+    const int     rope_type   = llama_model_rope_type(&model);
+
+    ggml_tensor * inpL = ggml_get_rows(ctx, w.tok_embd, ggml_reshape_1d(ctx, tokens, n_tokens*n_seqs));
+
+    for (size_t il = 0; il < w.layers.size(); ++il) {
+        const llama_ft_layer & layer = w.layers[il];
+
+        const int64_t n_head    = hparams.n_head(il);
+        const int64_t n_head_kv = hparams.n_head_kv(il);
+
+        ggml_tensor * cur = ggml_rms_norm(ctx, inpL, hparams.f_norm_rms_eps);
+        cur = ggml_mul(ctx, cur, layer.attn_norm);
+
+        // self-attention
+        {
+            ggml_tensor * Qcur = ggml_mul_mat(ctx, layer.wq, cur);
+            ggml_tensor * Kcur = ggml_mul_mat(ctx, layer.wk, cur);
+            ggml_tensor * Vcur = ggml_mul_mat(ctx, layer.wv, cur);
+
+            if (layer.bq) {
+                Qcur = ggml_add(ctx, Qcur, layer.bq);
+            }
+            if (layer.bk) {
+                Kcur = ggml_add(ctx, Kcur, layer.bk);
+            }
+            if (layer.bv) {
+                Vcur = ggml_add(ctx, Vcur, layer.bv);
+            }
+
+            Qcur = ggml_reshape_4d(ctx, Qcur, n_embd_head, n_head,    n_tokens, n_seqs);
+            Kcur = ggml_reshape_4d(ctx, Kcur, n_embd_head, n_head_kv, n_tokens, n_seqs);
+            Vcur = ggml_reshape_4d(ctx, Vcur, n_embd_head, n_head_kv, n_tokens, n_seqs);
+
+            Qcur = ggml_rope_ext(ctx, Qcur, pos, layer.rope_freqs, hparams.n_rot, rope_type, hparams.n_ctx_orig_yarn,
+                    hparams.rope_freq_base_train, hparams.rope_freq_scale_train, 0.0f, 1.0f, 32.0f, 1.0f);
+            Kcur = ggml_rope_ext(ctx, Kcur, pos, layer.rope_freqs, hparams.n_rot, rope_type, hparams.n_ctx_orig_yarn,
+                    hparams.rope_freq_base_train, hparams.rope_freq_scale_train, 0.0f, 1.0f, 32.0f, 1.0f);
+
+            // [n_embd_head, n_tokens, n_head, n_seqs]
+            ggml_tensor * q = ggml_permute(ctx, Qcur, 0, 2, 1, 3);
+            ggml_tensor * k = llama_ft_repeat_kv(ctx, ggml_cont(ctx, ggml_permute(ctx, Kcur, 0, 2, 1, 3)), n_head);
+
+            // [n_tokens, n_embd_head, n_head, n_seqs]
+            ggml_tensor * v = llama_ft_repeat_kv(ctx, ggml_cont(ctx, ggml_permute(ctx, Vcur, 1, 2, 0, 3)), n_head);
+
+            ggml_tensor * kq = ggml_mul_mat(ctx, k, q);
+            kq = ggml_scale(ctx, kq, kq_scale);
+            kq = ggml_diag_mask_inf(ctx, kq, 0);
+            kq = ggml_soft_max(ctx, kq);
+
+            ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
+
+            cur = ggml_cont(ctx, ggml_permute(ctx, kqv, 0, 2, 1, 3));
+            cur = ggml_reshape_2d(ctx, cur, n_embd_head*n_head, n_tokens*n_seqs);
+
+            cur = ggml_mul_mat(ctx, layer.wo, cur);
+            if (layer.bo) {
+                cur = ggml_add(ctx, cur, layer.bo);
+            }
+        }
+
+        ggml_tensor * ffn_inp = ggml_add(ctx, cur, inpL);
+
+        // feed-forward network
+        cur = ggml_rms_norm(ctx, ffn_inp, hparams.f_norm_rms_eps);
+        cur = ggml_mul(ctx, cur, layer.ffn_norm);
+        {
+            ggml_tensor * gate = ggml_silu(ctx, ggml_mul_mat(ctx, layer.ffn_gate, cur));
+            ggml_tensor * up   = ggml_mul_mat(ctx, layer.ffn_up, cur);
+
+            cur = ggml_mul_mat(ctx, layer.ffn_down, ggml_mul(ctx, gate, up));
+        }
+
+        inpL = ggml_add(ctx, cur, ffn_inp);
+        if (checkpoints) {
+            checkpoints->push_back(inpL);
+        }
+    }
+
+    if (out_ids) {
+        inpL = ggml_get_rows(ctx, inpL, out_ids);
+    }
+
+    ggml_tensor * cur = ggml_rms_norm(ctx, inpL, hparams.f_norm_rms_eps);
+    cur = ggml_mul(ctx, cur, w.output_norm);
+
+    return ggml_mul_mat(ctx, w.output, cur);
+}
+
+//
+// file output
+//
+
+// streams a GGUF file to disk without holding all of its data in memory, get_data returns the data of the i-th tensor in meta
+// the file is written under a temporary name and renamed at the end so that an interrupted write leaves an existing file intact
+static void llama_ft_write_gguf(
+        const std::string  & fname,
+        const gguf_context * meta,
+        const std::function<const void * (int64_t i, std::vector<uint8_t> & buf)> & get_data) {
+    const std::string fname_tmp = fname + ".tmp";
+    {
+        std::ofstream fout(fname_tmp, std::ios::binary);
+        if (!fout) {
+            throw std::runtime_error(format("failed to open '%s' for writing", fname_tmp.c_str()));
+        }
+        fout.exceptions(std::ofstream::failbit); // fail fast on write errors
+
+        std::vector<uint8_t> buf(gguf_get_meta_size(meta));
+        gguf_get_meta_data(meta, buf.data());
+        fout.write((const char *) buf.data(), buf.size());
+
+        const size_t align = gguf_get_alignment(meta);
+        const std::vector<char> zeros(align, 0);
+
+        for (int64_t i = 0; i < gguf_get_n_tensors(meta); ++i) {
+            const size_t nbytes = gguf_get_tensor_size(meta, i);
+            fout.write((const char *) get_data(i, buf), nbytes);
+            fout.write(zeros.data(), GGML_PAD(nbytes, align) - nbytes);
+        }
+    }
+    if (std::rename(fname_tmp.c_str(), fname.c_str()) != 0) {
+        throw std::runtime_error(format("failed to rename '%s' to '%s'", fname_tmp.c_str(), fname.c_str()));
+    }
+}
+
+//
+// training checkpoints
+//
+// a checkpoint is a GGUF file with the trainable weights, the optimizer state and the position in the dataset,
+// training that is resumed from it continues exactly where it left off
+//
+
+#define LLAMA_FT_KV_TYPE       "training.type"       // "sft" or "grpo"
+#define LLAMA_FT_KV_ITER       "training.iter"       // ggml_opt iteration, number of optimizer steps + 1
+#define LLAMA_FT_KV_EPOCH      "training.epoch"
+#define LLAMA_FT_KV_STEP       "training.step"       // next batch (SFT) or prompt (GRPO) in the epoch
+#define LLAMA_FT_KV_RNG        "training.rng"        // state of the data shuffling RNG at the start of the epoch
+#define LLAMA_FT_KV_LOSS_SUM   "training.loss_sum"   // running loss of the epoch
+#define LLAMA_FT_KV_LOSS_N     "training.loss_n"
+#define LLAMA_FT_KV_N_DATA     "training.n_data"     // number of windows (SFT) or prompts (GRPO), to detect a changed dataset
+#define LLAMA_FT_KV_BATCH_SIZE "training.batch_size" // sequences per optimizer step (SFT) or group size (GRPO), times the data-parallel ranks
+#define LLAMA_FT_KV_SEQ_LEN    "training.seq_len"
+#define LLAMA_FT_KV_EVAL_BEST  "training.eval_best"  // best held-out loss so far
+#define LLAMA_FT_KV_EVAL_WORSE "training.eval_worse" // evaluations since the best held-out loss, for eval_patience
+
+// position in the training run, everything besides the tensors that is needed to resume it
+struct llama_ft_progress {
+    int32_t     epoch    = 0;
+    int64_t     step     = 0;   // next batch (SFT) or prompt (GRPO) in the epoch
+    std::string rng;            // state of the shuffling RNG at the start of the epoch, the data order is derived from it
+    double      loss_sum = 0.0; // sum of the losses of the epoch so far
+    int64_t     loss_n   = 0;
+
+    double      eval_best    = INFINITY;
+    int64_t     eval_n_worse = 0;
+};
+
+static std::string llama_ft_rng_state(const std::mt19937 & rng) {
+    std::ostringstream ss;
+    ss << rng;
+    return ss.str();
+}
+
+// host copy of tensors, taken synchronously and written to disk in the background
+struct llama_ft_snapshot {
+    gguf_context_ptr                  meta;
+    std::vector<std::vector<uint8_t>> data; // in the order of the tensors in meta
+};
+
+struct llama_ft_checkpoint_writer {
+    ~llama_ft_checkpoint_writer() {
+        wait();
+    }
+
+    // the training loop only blocks if the previous checkpoint is still being written
+    void write_async(const std::string & fname, llama_ft_snapshot && snapshot) {
+        wait();
+        worker = std::thread([this, fname, snapshot = std::move(snapshot)]() {
+            const int64_t t_start_us = ggml_time_us();
+            try {
+                llama_ft_write_gguf(fname, snapshot.meta.get(), [&](int64_t i, std::vector<uint8_t> &) {
+                    return (const void *) snapshot.data[i].data();
+                });
+                LLAMA_LOG_INFO("%s: saved checkpoint to '%s' in %.2f s\n", __func__, fname.c_str(), 1e-6*(ggml_time_us() - t_start_us));
+            } catch (const std::exception & err) {
+                LLAMA_LOG_ERROR("%s: failed to save checkpoint: %s\n", __func__, err.what());
+                failed = true;
+            }
+        });
+    }
+
+    // returns false if any write has failed
+    bool wait() {
+        if (worker.joinable()) {
+            worker.join();
+        }
+        return !failed;
+    }
+
+    std::thread       worker;
+    std::atomic<bool> failed{false};
+};
+
+//
+// data parallelism
+//
+// every process trains on its shard of the data and the gradients are averaged over all processes before each
+// optimizer step, so that the weights stay identical everywhere
+// the transport is the all-reduce of the RPC backend, which is looked up at runtime like the RPC devices
+//
+
+struct llama_ft_allreduce {
+    typedef ggml_rpc_allreduce_t (*init_t)(const char * endpoint, int rank, int n_ranks);
+    typedef void                 (*free_t)(ggml_rpc_allreduce_t ar);
+    typedef bool                 (*sum_t) (ggml_rpc_allreduce_t ar, float * data, int64_t n);
+
+    ~llama_ft_allreduce() {
+        if (!ar) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        worker.join();
+        free_fn(ar);
+    }
+
+    void init(const char * endpoint, int rank, int n_ranks) {
+        ggml_backend_reg_t rpc_reg = ggml_backend_reg_by_name("RPC");
+        if (!rpc_reg) {
+            throw std::runtime_error("data-parallel training needs the RPC backend");
+        }
+        auto init_fn = (init_t) ggml_backend_reg_get_proc_address(rpc_reg, "ggml_rpc_allreduce_init");
+        free_fn      = (free_t) ggml_backend_reg_get_proc_address(rpc_reg, "ggml_rpc_allreduce_free");
+        sum_fn       = (sum_t)  ggml_backend_reg_get_proc_address(rpc_reg, "ggml_rpc_allreduce_sum");
+        if (!init_fn || !free_fn || !sum_fn) {
+            throw std::runtime_error("the RPC backend does not support all-reduce");
+        }
+
+        LLAMA_LOG_INFO("%s: rank %d of %d, connecting to %s\n", __func__, rank, n_ranks, endpoint);
+        ar = init_fn(endpoint, rank, n_ranks);
+        if (!ar) {
+            throw std::runtime_error(format("failed to set up the all-reduce on %s", endpoint));
+        }
+        this->n_ranks = n_ranks;
+
+        worker = std::thread([this]() { run(); });
+    }
+
+    // ggml_opt gradient callback: the gradients are queued as they become final and averaged by the worker thread,
+    // the final call waits until all of them are done
+    static void grad_callback(ggml_tensor * param, ggml_tensor * grad, void * userdata) {
+        llama_ft_allreduce * self = (llama_ft_allreduce *) userdata;
+        std::unique_lock<std::mutex> lock(self->mutex);
+        if (param) {
+            GGML_ASSERT(grad->type == GGML_TYPE_F32);
+            self->queue.push_back(grad);
+            self->cv.notify_all();
+            return;
+        }
+        self->cv.wait(lock, [self]() { return self->queue.empty() && !self->busy; });
+    }
+
+    // mean of a scalar over all ranks, only valid between optimizer steps
+    double mean(double x) {
+        float v = x;
+        if (!sum_fn(ar, &v, 1)) {
+            failed = true;
+        }
+        return v/n_ranks;
+    }
+
+    void run() {
+        std::vector<float> buf;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [this]() { return stop || !queue.empty(); });
+            if (stop) {
+                return;
+            }
+            ggml_tensor * grad = queue.front();
+            queue.pop_front();
+            busy = true;
+            lock.unlock();
+
+            // the CPU backend computes the remaining layers meanwhile, the gradient itself is final and not accessed by the graph
+            buf.resize(ggml_nelements(grad));
+            ggml_backend_tensor_get(grad, buf.data(), 0, ggml_nbytes(grad));
+            if (!sum_fn(ar, buf.data(), buf.size())) {
+                failed = true;
+            }
+            for (float & g : buf) {
+                g /= n_ranks;
+            }
+            ggml_backend_tensor_set(grad, buf.data(), 0, ggml_nbytes(grad));
+
+            lock.lock();
+            busy = false;
+            cv.notify_all();
+        }
+    }
+
+    ggml_rpc_allreduce_t ar      = nullptr;
+    free_t               free_fn = nullptr;
+    sum_t                sum_fn  = nullptr;
+    int                  n_ranks = 1;
+
+    std::thread                 worker;
+    std::mutex                  mutex;
+    std::condition_variable     cv;
+    std::deque<ggml_tensor *>   queue;
+    bool                        busy = false;
+    bool                        stop = false;
+    std::atomic<bool>           failed{false};
+};
+
+//
+// instrumentation
+//
+// with stats_path set, every optimizer step is written as one JSON object per line:
+// the wall time of the step split into its phases, the tokens and floating point operations of this process
+// and the peak size of the compute buffers
+//
+
+// host-side timings of one optimizer step, the graph timings are collected by ggml_opt
+struct llama_ft_step_stats {
+    int64_t t_start_us   = 0;
+    int64_t t_data_us    = 0; // assembling the batches and uploading them
+    int64_t t_rollout_us = 0; // GRPO: sampling and scoring the completions
+    int64_t t_ref_us     = 0; // GRPO: logits of the reference model
+    int64_t n_tokens     = 0; // tokens of the trained sequences
+};
+
+//
+// trainer
+//
+
+static ggml_opt_optimizer_params llama_ft_get_opt_pars(void * userdata) {
+    const llama_finetune_params * params = (const llama_finetune_params *) userdata;
+
+    ggml_opt_optimizer_params result = ggml_opt_get_default_optimizer_params(nullptr);
+    result.adamw.alpha = params->learning_rate;
+    result.adamw.wd    = params->weight_decay;
+
+    return result;
+}
+
+struct llama_ft_trainer {
+    llama_ft_trainer(llama_context * lctx, const llama_finetune_params & params);
+    ~llama_ft_trainer();
+
+    bool train_sft (const llama_token * tokens, int n_tokens);
+    bool train_grpo(const llama_token * tokens, int n_tokens);
+
+    // creates the optimization context for the graph that computes outputs from the tensors in ctx_input
+    // the optimizer steps after the gradients of opt_period forward/backward passes have been accumulated
+    void init_opt(ggml_tensor * inputs, ggml_tensor * outputs, ggml_opt_loss_type loss_type, int32_t opt_period);
+
+    // creates a frozen copy of the trainable weights, used as the reference policy
+    void init_reference();
+
+    void log_compute_buffer_size() const;
+
+    // checkpoints of the trainable weights, the optimizer state and the progress
+    // the data geometry is stored along to reject checkpoints of a different run
+    // load_checkpoint returns false if there is no checkpoint to resume from
+    bool load_checkpoint(const char * type, int64_t n_data, int64_t batch_size, int64_t seq_len);
+    void save_checkpoint(const char * type, int64_t n_data, int64_t batch_size, int64_t seq_len);
+
+    // called before and after every optimizer step, saves a checkpoint every checkpoint_interval steps and writes the stats
+    void on_step_begin();
+    void on_step_done(const char * type, int64_t n_data, int64_t batch_size, int64_t seq_len, double loss);
+
+    void write_stats(const char * type, double loss, int64_t t_checkpoint_us);
+
+    llama_context       * lctx;
+    const llama_model   & model;
+    llama_finetune_params params;
+
+    llama_ft_weights weights;     // live weights, the trainable ones are updated in place
+    llama_ft_weights weights_ref; // frozen reference weights
+
+    std::vector<ggml_tensor *> trainable;
+    std::vector<ggml_tensor *> checkpoints; // layer boundaries of the trained graph, empty without activation checkpointing
+
+    size_t graph_size = 0;
+
+    ggml_backend_ptr       backend;
+    ggml_backend_sched_ptr sched;     // used by ggml_opt
+    ggml_backend_sched_ptr sched_fwd; // forward-only graphs that must not evict the ggml_opt allocation
+
+    ggml_context_ptr        ctx_input;   // statically allocated graph inputs
+    ggml_backend_buffer_ptr buf_input;
+    ggml_context_ptr        ctx_compute; // graph tensors, allocated by the scheduler
+    ggml_context_ptr        ctx_ref;     // reference weights
+    ggml_backend_buffer_ptr buf_ref;
+
+    ggml_opt_context_t opt_ctx    = nullptr;
+    ggml_opt_result_t  opt_result = nullptr;
+
+    std::mt19937 rng;
+
+    llama_ft_progress          progress;
+    llama_ft_checkpoint_writer writer;
+
+    // data-parallel training, rank 0 writes the checkpoints
+    int rank    = 0;
+    int n_ranks = 1;
+    llama_ft_allreduce allreduce;
+
+    FILE              * stats_file = nullptr;
+    llama_ft_step_stats stats;
+    size_t              compute_buffer_peak = 0;
+};
+
+llama_ft_trainer::llama_ft_trainer(llama_context * lctx, const llama_finetune_params & params) :
+    lctx(lctx), model(*llama_get_model(lctx)), params(params), rng(params.seed) {
+    const std::string err = llama_ft_check_model(model);
+    if (!err.empty()) {
+        throw std::runtime_error(err);
+    }
+
+    weights = llama_ft_weights_from_model(model);
+    weights.foreach([&](ggml_tensor * t) {
+        if (llama_ft_is_trainable(t)) {
+            ggml_set_param(nullptr, t);
+            trainable.push_back(t);
+        }
+    });
+    if (trainable.empty()) {
+        throw std::runtime_error("the model has no F32 weights that could be trained");
+    }
+
+    if (params.dp_endpoint && params.dp_n_ranks > 1) {
+        rank    = params.dp_rank;
+        n_ranks = params.dp_n_ranks;
+        allreduce.init(params.dp_endpoint, rank, n_ranks);
+    }
+
+    // forward + backward + optimizer nodes, the backward pass roughly triples the forward graph
+    // and activation checkpointing adds a recomputed copy of the forward graph
+    graph_size = std::max<size_t>(GGML_DEFAULT_GRAPH_SIZE, 256*model.layers.size() + 1024);
+
+    backend.reset(ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr));
+    if (!backend) {
+        throw std::runtime_error("failed to initialize the CPU backend");
+    }
+    {
+        ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(ggml_backend_get_device(backend.get()));
+        auto * set_n_threads_fn = (ggml_backend_set_n_threads_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_n_threads");
+        if (set_n_threads_fn) {
+            set_n_threads_fn(backend.get(), llama_n_threads_batch(lctx));
+        }
+    }
+
+    ggml_backend_t backends[] = { backend.get() };
+    sched    .reset(ggml_backend_sched_new(backends, nullptr, 1, graph_size, false));
+    sched_fwd.reset(ggml_backend_sched_new(backends, nullptr, 1, graph_size, false));
+
+    {
+        ggml_init_params ip = {
+            /*.mem_size   =*/ 16*ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+        ctx_input.reset(ggml_init(ip));
+    }
+    {
+        // forward, gradient and optimizer graphs of ggml_opt + one forward-only graph
+        ggml_init_params ip = {
+            /*.mem_size   =*/ 2*graph_size*ggml_tensor_overhead() + 4*ggml_graph_overhead_custom(graph_size, true),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+        ctx_compute.reset(ggml_init(ip));
+    }
+
+    opt_result = ggml_opt_result_init();
+
+    // a resumed run continues the stats of the interrupted one
+    if (params.stats_path) {
+        stats_file = ggml_fopen(params.stats_path, params.checkpoint_resume ? "a" : "w");
+        if (!stats_file) {
+            throw std::runtime_error(format("failed to open '%s' for writing", params.stats_path));
+        }
+    }
+
+    LLAMA_LOG_INFO("%s: %zu trainable tensors, %d threads\n", __func__, trainable.size(), llama_n_threads_batch(lctx));
+}
+
+llama_ft_trainer::~llama_ft_trainer() {
+    ggml_opt_free(opt_ctx);
+    ggml_opt_result_free(opt_result);
+
+    if (stats_file) {
+        fclose(stats_file);
+    }
+
+    // the flags are part of the model tensors, leave the model as it was for inference
+    for (ggml_tensor * t : trainable) {
+        t->flags &= ~GGML_TENSOR_FLAG_PARAM;
+    }
+}
+
+void llama_ft_trainer::log_compute_buffer_size() const {
+    LLAMA_LOG_INFO("%s: compute buffer size = %.2f MiB%s\n", __func__,
+            ggml_backend_sched_get_buffer_size(sched.get(), backend.get())/1024.0/1024.0,
+            checkpoints.empty() ? "" : " (activation checkpointing)");
+}
+
+void llama_ft_trainer::init_opt(ggml_tensor * inputs, ggml_tensor * outputs, ggml_opt_loss_type loss_type, int32_t opt_period) {
+    buf_input.reset(ggml_backend_alloc_ctx_tensors(ctx_input.get(), backend.get()));
+    if (!buf_input) {
+        throw std::runtime_error("failed to allocate the input buffer");
+    }
+
+    ggml_opt_params opt_params = ggml_opt_default_params(sched.get(), ctx_compute.get(), inputs, outputs, loss_type);
+    opt_params.graph_size      = graph_size;
+    opt_params.opt_period      = opt_period;
+    opt_params.adamw_8bit      = params.adamw_8bit;
+    opt_params.checkpoints     = checkpoints.data();
+    opt_params.n_checkpoints   = checkpoints.size();
+    opt_params.get_opt_pars    = llama_ft_get_opt_pars;
+    opt_params.get_opt_pars_ud = &params;
+    opt_params.timings         = stats_file != nullptr;
+    if (n_ranks > 1) {
+        opt_params.grad_callback    = llama_ft_allreduce::grad_callback;
+        opt_params.grad_callback_ud = &allreduce;
+    }
+
+    opt_ctx = ggml_opt_init(opt_params);
+}
+
+static int64_t llama_ft_get_i64(const gguf_context * meta, const char * key) {
+    const int64_t id = gguf_find_key(meta, key);
+    if (id < 0 || gguf_get_kv_type(meta, id) != GGUF_TYPE_INT64) {
+        throw std::runtime_error(format("checkpoint is missing the key '%s'", key));
+    }
+    return gguf_get_val_i64(meta, id);
+}
+
+static double llama_ft_get_f64(const gguf_context * meta, const char * key) {
+    const int64_t id = gguf_find_key(meta, key);
+    if (id < 0 || gguf_get_kv_type(meta, id) != GGUF_TYPE_FLOAT64) {
+        throw std::runtime_error(format("checkpoint is missing the key '%s'", key));
+    }
+    return gguf_get_val_f64(meta, id);
+}
+
+static std::string llama_ft_get_str(const gguf_context * meta, const char * key) {
+    const int64_t id = gguf_find_key(meta, key);
+    if (id < 0 || gguf_get_kv_type(meta, id) != GGUF_TYPE_STRING) {
+        throw std::runtime_error(format("checkpoint is missing the key '%s'", key));
+    }
+    return gguf_get_val_str(meta, id);
+}
+
+bool llama_ft_trainer::load_checkpoint(const char * type, int64_t n_data, int64_t batch_size, int64_t seq_len) {
+    if (!params.checkpoint_path || !params.checkpoint_resume) {
+        return false;
+    }
+    if (!std::ifstream(params.checkpoint_path).good()) {
+        LLAMA_LOG_INFO("%s: no checkpoint at '%s', starting from scratch\n", __func__, params.checkpoint_path);
+        return false;
+    }
+
+    ggml_context * ctx_data = nullptr;
+    gguf_init_params gparams = {
+        /*.no_alloc =*/ false,
+        /*.ctx      =*/ &ctx_data,
+    };
+    gguf_context_ptr meta(gguf_init_from_file(params.checkpoint_path, gparams));
+    if (!meta) {
+        throw std::runtime_error(format("failed to read checkpoint '%s'", params.checkpoint_path));
+    }
+    ggml_context_ptr ctx_data_ptr(ctx_data);
+
+    if (llama_ft_get_str(meta.get(), LLAMA_FT_KV_TYPE) != type) {
+        throw std::runtime_error(format("checkpoint '%s' was not written by %s training", params.checkpoint_path, type));
+    }
+    if (llama_ft_get_i64(meta.get(), LLAMA_FT_KV_N_DATA)     != n_data     ||
+        llama_ft_get_i64(meta.get(), LLAMA_FT_KV_BATCH_SIZE) != batch_size ||
+        llama_ft_get_i64(meta.get(), LLAMA_FT_KV_SEQ_LEN)    != seq_len) {
+        throw std::runtime_error(format("checkpoint '%s' was written for a different dataset, batch size or sequence length", params.checkpoint_path));
+    }
+
+    std::vector<ggml_tensor *> tensors = trainable;
+    for (int i = 0; i < ggml_opt_n_state(opt_ctx); ++i) {
+        tensors.push_back(ggml_opt_get_state(opt_ctx, i));
+    }
+    for (ggml_tensor * t : tensors) {
+        const ggml_tensor * src = ggml_get_tensor(ctx_data, t->name);
+        if (!src || src->type != t->type || !ggml_are_same_shape(src, t)) {
+            throw std::runtime_error(format("checkpoint '%s' has no matching tensor '%s' (different model or optimizer settings)",
+                    params.checkpoint_path, t->name));
+        }
+        ggml_backend_tensor_set(t, src->data, 0, ggml_nbytes(t));
+    }
+
+    ggml_opt_set_iter(opt_ctx, llama_ft_get_i64(meta.get(), LLAMA_FT_KV_ITER));
+
+    progress.epoch    = llama_ft_get_i64(meta.get(), LLAMA_FT_KV_EPOCH);
+    progress.step     = llama_ft_get_i64(meta.get(), LLAMA_FT_KV_STEP);
+    progress.rng      = llama_ft_get_str(meta.get(), LLAMA_FT_KV_RNG);
+    progress.loss_n   = llama_ft_get_i64(meta.get(), LLAMA_FT_KV_LOSS_N);
+    progress.loss_sum = llama_ft_get_f64(meta.get(), LLAMA_FT_KV_LOSS_SUM);
+
+    progress.eval_best    = llama_ft_get_f64(meta.get(), LLAMA_FT_KV_EVAL_BEST);
+    progress.eval_n_worse = llama_ft_get_i64(meta.get(), LLAMA_FT_KV_EVAL_WORSE);
+
+    std::istringstream(progress.rng) >> rng;
+
+    LLAMA_LOG_INFO("%s: resuming from '%s' at epoch %d, step %" PRId64 " (%" PRId64 " optimizer steps done)\n", __func__,
+            params.checkpoint_path, progress.epoch + 1, progress.step, ggml_opt_get_iter(opt_ctx) - 1);
+
     return true;
 }
 
+void llama_ft_trainer::save_checkpoint(const char * type, int64_t n_data, int64_t batch_size, int64_t seq_len) {
+    // the weights and the optimizer state are the same on all ranks
+    if (rank != 0) {
+        return;
+    }
+
+    llama_ft_snapshot snapshot;
+    snapshot.meta.reset(gguf_init_empty());
+
+    gguf_context * meta = snapshot.meta.get();
+    gguf_set_val_str(meta, LLAMA_FT_KV_TYPE,       type);
+    gguf_set_val_i64(meta, LLAMA_FT_KV_ITER,       ggml_opt_get_iter(opt_ctx));
+    gguf_set_val_i64(meta, LLAMA_FT_KV_EPOCH,      progress.epoch);
+    gguf_set_val_i64(meta, LLAMA_FT_KV_STEP,       progress.step);
+    gguf_set_val_str(meta, LLAMA_FT_KV_RNG,        progress.rng.c_str());
+    gguf_set_val_f64(meta, LLAMA_FT_KV_LOSS_SUM,   progress.loss_sum);
+    gguf_set_val_i64(meta, LLAMA_FT_KV_LOSS_N,     progress.loss_n);
+    gguf_set_val_i64(meta, LLAMA_FT_KV_N_DATA,     n_data);
+    gguf_set_val_i64(meta, LLAMA_FT_KV_BATCH_SIZE, batch_size);
+    gguf_set_val_i64(meta, LLAMA_FT_KV_SEQ_LEN,    seq_len);
+    gguf_set_val_f64(meta, LLAMA_FT_KV_EVAL_BEST,  progress.eval_best);
+    gguf_set_val_i64(meta, LLAMA_FT_KV_EVAL_WORSE, progress.eval_n_worse);
+
+    std::vector<ggml_tensor *> tensors = trainable;
+    for (int i = 0; i < ggml_opt_n_state(opt_ctx); ++i) {
+        tensors.push_back(ggml_opt_get_state(opt_ctx, i));
+    }
+    for (ggml_tensor * t : tensors) {
+        gguf_add_tensor(meta, t);
+        snapshot.data.emplace_back(ggml_nbytes(t));
+        ggml_backend_tensor_get(t, snapshot.data.back().data(), 0, ggml_nbytes(t));
+    }
+
+    writer.write_async(params.checkpoint_path, std::move(snapshot));
+}
+
+void llama_ft_trainer::on_step_begin() {
+    stats = {};
+    stats.t_start_us = ggml_time_us();
+    ggml_opt_reset_timings(opt_ctx);
+}
+
+void llama_ft_trainer::on_step_done(const char * type, int64_t n_data, int64_t batch_size, int64_t seq_len, double loss) {
+    if (allreduce.failed) {
+        throw std::runtime_error("the all-reduce with the other ranks failed");
+    }
+
+    const int64_t t_checkpoint_start_us = ggml_time_us();
+
+    const int64_t n_opt_steps = ggml_opt_get_iter(opt_ctx) - 1;
+    if (params.checkpoint_path && params.checkpoint_interval > 0 && n_opt_steps % params.checkpoint_interval == 0) {
+        save_checkpoint(type, n_data, batch_size, seq_len);
+    }
+
+    if (stats_file) {
+        write_stats(type, loss, ggml_time_us() - t_checkpoint_start_us);
+    }
+}
+
+void llama_ft_trainer::write_stats(const char * type, double loss, int64_t t_checkpoint_us) {
+    ggml_opt_timings timings;
+    ggml_opt_get_timings(opt_ctx, &timings);
+
+    const int64_t t_step_us    = ggml_time_us() - stats.t_start_us;
+    const int64_t t_compute_us = timings.t_forward_us + timings.t_backward_us + timings.t_opt_us;
+
+    // the allocations of the scheduler only grow, their current size is the peak so far
+    size_t compute_buffer_size = ggml_backend_sched_get_buffer_size(sched.get(), backend.get());
+    if (sched_fwd) {
+        compute_buffer_size += ggml_backend_sched_get_buffer_size(sched_fwd.get(), backend.get());
+    }
+    compute_buffer_peak = std::max(compute_buffer_peak, compute_buffer_size);
+
+    fprintf(stats_file,
+            "{\"type\": \"%s\", \"rank\": %d, \"epoch\": %d, \"step\": %" PRId64 ", \"iter\": %" PRId64 ", \"loss\": %.6f, "
+            "\"t_step_ms\": %.3f, \"t_data_ms\": %.3f, \"t_rollout_ms\": %.3f, \"t_ref_ms\": %.3f, "
+            "\"t_forward_ms\": %.3f, \"t_backward_ms\": %.3f, \"t_opt_ms\": %.3f, \"t_checkpoint_ms\": %.3f, "
+            "\"tokens\": %" PRId64 ", \"tokens_per_s\": %.2f, \"flops\": %.6e, \"flops_per_s\": %.6e, \"compute_buffer_peak_bytes\": %zu}\n",
+            type, rank, progress.epoch + 1, progress.step, ggml_opt_get_iter(opt_ctx) - 1, loss,
+            1e-3*t_step_us, 1e-3*stats.t_data_us, 1e-3*stats.t_rollout_us, 1e-3*stats.t_ref_us,
+            1e-3*timings.t_forward_us, 1e-3*timings.t_backward_us, 1e-3*timings.t_opt_us, 1e-3*t_checkpoint_us,
+            stats.n_tokens, t_step_us > 0 ? 1e6*stats.n_tokens/t_step_us : 0.0,
+            timings.flops, t_compute_us > 0 ? 1e6*timings.flops/t_compute_us : 0.0, compute_buffer_peak);
+    fflush(stats_file);
+}
+
+void llama_ft_trainer::init_reference() {
+    {
+        ggml_init_params ip = {
+            /*.mem_size   =*/ trainable.size()*ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+        ctx_ref.reset(ggml_init(ip));
+    }
+
+    std::unordered_map<ggml_tensor *, ggml_tensor *> ref_map;
+    for (ggml_tensor * t : trainable) {
+        ggml_tensor * t_ref = ggml_dup_tensor(ctx_ref.get(), t);
+        ggml_format_name(t_ref, "%s (ref)", t->name);
+        ref_map[t] = t_ref;
+    }
+
+    buf_ref.reset(ggml_backend_alloc_ctx_tensors(ctx_ref.get(), backend.get()));
+    if (!buf_ref) {
+        throw std::runtime_error("failed to allocate the reference weights");
+    }
+    for (const auto & it : ref_map) {
+        ggml_backend_tensor_set(it.second, it.first->data, 0, ggml_nbytes(it.first));
+    }
+
+    weights_ref = weights;
+    weights_ref.foreach([&](ggml_tensor *& t) {
+        auto it = ref_map.find(t);
+        if (it != ref_map.end()) {
+            t = it->second;
+        }
+    });
+    if (weights.output == weights.tok_embd) {
+        weights_ref.output = weights_ref.tok_embd;
+    }
+}
+
+//
+// supervised finetuning: next-token prediction on fixed-length windows of the token stream
+//
+// with eval_split set, the last windows are held out and their loss is computed with a forward-only graph
+// that shares the weights and the inputs of the training graph, evaluated on sched_fwd to keep the training allocation
+//
+
+// copies the windows to the token buffer and the next tokens as one-hot labels to the label buffer
+static void llama_ft_fill_sft_batch(
+        const llama_token * tokens, const int64_t * windows, int64_t n_seqs, int64_t n_ctx, int64_t n_vocab,
+        int32_t * batch_tokens, float * batch_labels) {
+    std::fill(batch_labels, batch_labels + n_vocab*n_ctx*n_seqs, 0.0f);
+    for (int64_t s = 0; s < n_seqs; ++s) {
+        const llama_token * src = tokens + windows[s]*n_ctx;
+        for (int64_t i = 0; i < n_ctx; ++i) {
+            batch_tokens[s*n_ctx + i] = src[i];
+            batch_labels[(s*n_ctx + i)*n_vocab + src[i + 1]] = 1.0f;
+        }
+    }
+}
+
+bool llama_ft_trainer::train_sft(const llama_token * tokens, int n_tokens) {
+    const int64_t n_vocab = model.vocab.n_tokens();
+    const int64_t n_ctx   = params.seq_len > 0 ? params.seq_len : llama_n_ctx(lctx);
+    const int64_t n_seqs  = params.batch_size;
+    const int64_t n_micro = std::min<int64_t>(params.micro_batch_size > 0 ? params.micro_batch_size : n_seqs, n_seqs);
+
+    if (n_seqs % n_micro != 0) {
+        LLAMA_LOG_ERROR("%s: batch size %" PRId64 " is not a multiple of the micro-batch size %" PRId64 "\n", __func__, n_seqs, n_micro);
+        return false;
+    }
+    const int64_t n_accum = n_seqs / n_micro;
+
+    // the held-out windows are evaluated in micro-batches, so they are rounded to whole micro-batches
+    const int64_t n_windows_all = (n_tokens - 1) / n_ctx;
+    int64_t n_eval = 0;
+    if (params.eval_split > 0.0f) {
+        n_eval = std::max<int64_t>(1, std::llround(params.eval_split*n_windows_all/n_micro))*n_micro;
+    }
+
+    // with data parallelism every rank takes its own batch of each global batch
+    const int64_t n_windows = n_windows_all - n_eval;
+    if (n_windows < n_seqs*n_ranks) {
+        LLAMA_LOG_ERROR("%s: need at least %" PRId64 " tokens for one batch of %" PRId64 " sequences of %" PRId64 " tokens%s, got %d\n",
+                __func__, (n_seqs*n_ranks + n_eval)*n_ctx + 1, n_seqs*n_ranks, n_ctx, n_eval > 0 ? " and the held-out split" : "", n_tokens);
+        return false;
+    }
+    const int64_t n_steps = n_windows / (n_seqs*n_ranks);
+
+    // the graph only holds one micro-batch, the optimizer steps once the gradients of a full batch have been accumulated
+    ggml_tensor * inp_tokens = ggml_new_tensor_2d(ctx_input.get(), GGML_TYPE_I32, n_ctx, n_micro);
+    ggml_tensor * inp_pos    = ggml_new_tensor_1d(ctx_input.get(), GGML_TYPE_I32, n_ctx);
+    ggml_set_name(inp_tokens, "inp_tokens");
+    ggml_set_name(inp_pos,    "inp_pos");
+    ggml_set_input(inp_pos);
+
+    ggml_tensor * logits = llama_ft_build_logits(ctx_compute.get(), model, weights, inp_tokens, inp_pos, nullptr,
+            params.grad_checkpointing ? &checkpoints : nullptr);
+    init_opt(inp_tokens, logits, GGML_OPT_LOSS_TYPE_CROSS_ENTROPY, n_accum);
+
+    {
+        std::vector<int32_t> pos(n_ctx);
+        std::iota(pos.begin(), pos.end(), 0);
+        ggml_backend_tensor_set(inp_pos, pos.data(), 0, ggml_nbytes(inp_pos));
+    }
+
+    ggml_cgraph * gf_eval   = nullptr;
+    ggml_tensor * loss_eval = nullptr;
+    if (n_eval > 0) {
+        ggml_tensor * logits_eval = llama_ft_build_logits(ctx_compute.get(), model, weights, inp_tokens, inp_pos, nullptr);
+        loss_eval = ggml_cross_entropy_loss(ctx_compute.get(), logits_eval, ggml_opt_labels(opt_ctx));
+        ggml_set_name(loss_eval, "loss_eval");
+        ggml_set_output(loss_eval);
+
+        gf_eval = ggml_new_graph_custom(ctx_compute.get(), graph_size, false);
+        ggml_build_forward_expand(gf_eval, loss_eval);
+    }
+
+    std::vector<int64_t> order(n_windows);
+
+    std::vector<int32_t> batch_tokens(n_ctx*n_micro);
+    std::vector<float>   batch_labels(n_vocab*n_ctx*n_micro);
+
+    load_checkpoint("sft", n_windows, n_seqs*n_ranks, n_ctx);
+    const int64_t iter_start = ggml_opt_get_iter(opt_ctx);
+
+    // mean loss of the held-out windows, every rank evaluates every n_ranks-th micro-batch
+    // returns true if training should stop because the loss has not improved for eval_patience evaluations
+    // the best loss and the evaluations since are part of the progress so that a resumed run keeps them
+    double  & eval_best    = progress.eval_best;
+    int64_t & eval_n_worse = progress.eval_n_worse;
+    const char * func = __func__;
+    auto evaluate = [&]() {
+        const int64_t t_start_us = ggml_time_us();
+
+        std::vector<int64_t> windows(n_micro);
+        double  loss_sum = 0.0;
+        int64_t n_loss   = 0;
+        for (int64_t ib = rank; ib < n_eval/n_micro; ib += n_ranks) {
+            std::iota(windows.begin(), windows.end(), n_windows + ib*n_micro);
+            llama_ft_fill_sft_batch(tokens, windows.data(), n_micro, n_ctx, n_vocab, batch_tokens.data(), batch_labels.data());
+            ggml_backend_tensor_set(inp_tokens,                batch_tokens.data(), 0, ggml_nbytes(inp_tokens));
+            ggml_backend_tensor_set(ggml_opt_labels(opt_ctx), batch_labels.data(), 0, ggml_nbytes(ggml_opt_labels(opt_ctx)));
+
+            ggml_backend_sched_reset(sched_fwd.get());
+            if (ggml_backend_sched_graph_compute(sched_fwd.get(), gf_eval) != GGML_STATUS_SUCCESS) {
+                throw std::runtime_error("failed to compute the held-out loss");
+            }
+            float loss;
+            ggml_backend_tensor_get(loss_eval, &loss, 0, sizeof(loss));
+            loss_sum += loss;
+            n_loss   += 1;
+        }
+        if (n_ranks > 1) {
+            loss_sum = allreduce.mean(loss_sum)*n_ranks;
+            n_loss   = n_eval/n_micro;
+        }
+        const double  loss      = loss_sum/n_loss;
+        const int64_t t_eval_us = ggml_time_us() - t_start_us;
+
+        if (loss < eval_best) {
+            eval_best    = loss;
+            eval_n_worse = 0;
+        } else {
+            eval_n_worse++;
+        }
+
+        LLAMA_LOG_INFO("%s: eval after %" PRId64 " optimizer steps: loss = %.5f, ppl = %.3f, best = %.5f, t = %.2f s\n",
+                func, ggml_opt_get_iter(opt_ctx) - 1, loss, exp(loss), eval_best, 1e-6*t_eval_us);
+        if (stats_file) {
+            fprintf(stats_file,
+                    "{\"type\": \"eval\", \"rank\": %d, \"epoch\": %d, \"step\": %" PRId64 ", \"iter\": %" PRId64 ", \"loss\": %.6f, \"ppl\": %.6f, "
+                    "\"t_eval_ms\": %.3f, \"tokens\": %" PRId64 "}\n",
+                    rank, progress.epoch + 1, progress.step, ggml_opt_get_iter(opt_ctx) - 1, loss, exp(loss),
+                    1e-3*t_eval_us, n_eval*n_ctx);
+            fflush(stats_file);
+        }
+
+        if (params.eval_patience > 0 && eval_n_worse >= params.eval_patience) {
+            LLAMA_LOG_INFO("%s: stopping early, the held-out loss has not improved for %" PRId64 " evaluations\n", func, eval_n_worse);
+            return true;
+        }
+        return false;
+    };
+
+    bool stop = false;
+    for (int epoch = progress.epoch; epoch < params.epochs && !stop; ++epoch) {
+        // the order of an epoch only depends on the RNG state at its start, a resumed run reproduces it
+        progress.epoch = epoch;
+        progress.rng   = llama_ft_rng_state(rng);
+        std::iota(order.begin(), order.end(), 0);
+        std::shuffle(order.begin(), order.end(), rng);
+
+        const int64_t t_start_us = ggml_time_us();
+
+        for (int64_t step = progress.step; step < n_steps && !stop; ++step) {
+            on_step_begin();
+            ggml_opt_result_reset(opt_result);
+            for (int64_t ia = 0; ia < n_accum; ++ia) {
+                const int64_t t_data_start_us = ggml_time_us();
+                llama_ft_fill_sft_batch(tokens, order.data() + (step*n_ranks + rank)*n_seqs + ia*n_micro, n_micro, n_ctx, n_vocab,
+                        batch_tokens.data(), batch_labels.data());
+                ggml_backend_tensor_set(inp_tokens,                batch_tokens.data(), 0, ggml_nbytes(inp_tokens));
+                ggml_backend_tensor_set(ggml_opt_labels(opt_ctx), batch_labels.data(), 0, ggml_nbytes(ggml_opt_labels(opt_ctx)));
+                stats.t_data_us += ggml_time_us() - t_data_start_us;
+                stats.n_tokens  += n_micro*n_ctx;
+
+                // evaluates the gradient-only graph for all but the last micro-batch
+                ggml_opt_forward_backward(opt_ctx, opt_result);
+            }
+            if (ggml_opt_get_iter(opt_ctx) == iter_start + 1) {
+                log_compute_buffer_size();
+            }
+
+            double loss;
+            ggml_opt_result_loss(opt_result, &loss, nullptr);
+            if (n_ranks > 1) {
+                loss = allreduce.mean(loss);
+            }
+
+            progress.step      = step + 1;
+            progress.loss_sum += loss;
+            progress.loss_n   += 1;
+
+            LLAMA_LOG_INFO("%s: epoch %d/%d, step %" PRId64 "/%" PRId64 ", loss = %.5f, t = %.2f s\n",
+                    __func__, epoch + 1, params.epochs, step + 1, n_steps, progress.loss_sum/progress.loss_n, 1e-6*(ggml_time_us() - t_start_us));
+
+            // evaluated before a checkpoint of this step is written, so that it holds the result
+            if (n_eval > 0 && params.eval_interval > 0 && (ggml_opt_get_iter(opt_ctx) - 1) % params.eval_interval == 0) {
+                stop = evaluate();
+            }
+
+            on_step_done("sft", n_windows, n_seqs*n_ranks, n_ctx, loss);
+        }
+        if (n_eval > 0 && params.eval_interval <= 0 && !stop) {
+            stop = evaluate();
+        }
+
+        progress.step     = 0;
+        progress.loss_sum = 0.0;
+        progress.loss_n   = 0;
+    }
+
+    // after an early stop the training is complete, a resumed run does not continue it
+    if (params.checkpoint_path) {
+        progress.epoch = params.epochs;
+        progress.rng   = llama_ft_rng_state(rng);
+        save_checkpoint("sft", n_windows, n_seqs*n_ranks, n_ctx);
+    }
+
+    return writer.wait();
+}
+
+//
+// group-relative policy optimization with the graph reasoning reward
+//
+// for every prompt, grpo_group_size completions are sampled as separate sequences of one batch that share the prompt KV,
+// each completion is scored with llama_graph_compute_reward and the advantages are normalized within the group
+// the policy gradient uses the k3 estimator of KL(pi || pi_ref) against the frozen initial weights:
+//
+//   d loss / d log pi(o_t) = (-A + beta*(1 - pi_ref(o_t)/pi(o_t))) / (G*|o|)
+//
+// since a single optimizer step is made per group, pi equals the rollout policy and the importance ratio is 1
+// the coefficients are computed on the host and the graph minimizes sum_t c_t*log pi(o_t)
+//
+
+static float llama_ft_log_softmax_at(const float * logits, int64_t n_vocab, llama_token token, float * max_out) {
+    float max = -INFINITY;
+    for (int64_t i = 0; i < n_vocab; ++i) {
+        max = std::max(max, logits[i]);
+    }
+    double sum = 0.0;
+    for (int64_t i = 0; i < n_vocab; ++i) {
+        sum += expf(logits[i] - max);
+    }
+    if (max_out) {
+        *max_out = max;
+    }
+    return logits[token] - max - (float) log(sum);
+}
+
+static float llama_ft_graph_reward(llama_context * lctx, const std::string & text) {
+    llama_graph_reasoning * gr = llama_graph_reasoning_init();
+    llama_graph_extract(gr, lctx, text.c_str(), text.size());
+    const float reward = llama_graph_compute_reward(gr);
+    llama_graph_reasoning_free(gr);
+    return reward;
+}
+
+bool llama_ft_trainer::train_grpo(const llama_token * tokens, int n_tokens) {
+    const llama_vocab & vocab = model.vocab;
+
+    const int64_t n_vocab = vocab.n_tokens();
+    const int64_t n_group = params.grpo_group_size;
+    const int64_t n_new   = params.grpo_max_new_tokens;
+    const int64_t n_batch = llama_n_batch(lctx);
+    const int64_t n_micro = std::min<int64_t>(params.micro_batch_size > 0 ? params.micro_batch_size : n_group, n_group);
+
+    if (n_group < 2 || n_new < 1) {
+        LLAMA_LOG_ERROR("%s: GRPO needs a group size of at least 2 and at least 1 new token\n", __func__);
+        return false;
+    }
+    if (n_group % n_micro != 0) {
+        LLAMA_LOG_ERROR("%s: group size %" PRId64 " is not a multiple of the micro-batch size %" PRId64 "\n", __func__, n_group, n_micro);
+        return false;
+    }
+    const int64_t n_accum = n_group / n_micro;
+
+    // the prompt KV is shared, each completion needs its own cells
+    const int64_t n_prompt_max = (int64_t) llama_n_ctx(lctx) - n_group*n_new;
+    if (n_prompt_max < 1) {
+        LLAMA_LOG_ERROR("%s: n_ctx = %u is too small for %" PRId64 " completions of %" PRId64 " tokens\n",
+                __func__, llama_n_ctx(lctx), n_group, n_new);
+        return false;
+    }
+
+    std::vector<std::vector<llama_token>> prompts;
+    {
+        std::vector<llama_token> cur;
+        for (int i = 0; i <= n_tokens; ++i) {
+            if (i == n_tokens || vocab.is_eog(tokens[i])) {
+                if (!cur.empty()) {
+                    if ((int64_t) cur.size() > n_prompt_max) {
+                        cur.erase(cur.begin(), cur.end() - n_prompt_max);
+                    }
+                    prompts.push_back(std::move(cur));
+                }
+                cur.clear();
+                continue;
+            }
+            cur.push_back(tokens[i]);
+        }
+    }
+    if (prompts.empty()) {
+        LLAMA_LOG_ERROR("%s: no prompts found in the dataset\n", __func__);
+        return false;
+    }
+
+    int64_t n_prompt_longest = 0;
+    for (const auto & prompt : prompts) {
+        n_prompt_longest = std::max<int64_t>(n_prompt_longest, prompt.size());
+    }
+
+    // every sequence is laid out as [prompt, completion, padding], the padding comes last and is masked out by causality
+    // the graphs hold one micro-batch of the group, the gradients of the whole group are accumulated before the optimizer step
+    const int64_t n_ctx  = n_prompt_longest + n_new;
+    const int64_t n_rows = n_micro*n_new; // one row per completion token, unused rows have a zero coefficient
+
+    ggml_tensor * inp_tokens  = ggml_new_tensor_2d(ctx_input.get(), GGML_TYPE_I32, n_ctx, n_micro);
+    ggml_tensor * inp_pos     = ggml_new_tensor_1d(ctx_input.get(), GGML_TYPE_I32, n_ctx);
+    ggml_tensor * inp_out_ids = ggml_new_tensor_1d(ctx_input.get(), GGML_TYPE_I32, n_rows);
+    ggml_tensor * inp_targets = ggml_new_tensor_2d(ctx_input.get(), GGML_TYPE_F32, n_vocab, n_rows); // c_t at the sampled token
+    ggml_tensor * inp_shift   = ggml_new_tensor_2d(ctx_input.get(), GGML_TYPE_F32, 1, n_rows);       // max. rollout logit
+    ggml_tensor * inp_coef    = ggml_new_tensor_2d(ctx_input.get(), GGML_TYPE_F32, 1, n_rows);       // c_t
+    ggml_set_name(inp_tokens,  "inp_tokens");
+    ggml_set_name(inp_pos,     "inp_pos");
+    ggml_set_name(inp_out_ids, "inp_out_ids");
+    ggml_set_name(inp_targets, "inp_targets");
+    ggml_set_name(inp_shift,   "inp_shift");
+    ggml_set_name(inp_coef,    "inp_coef");
+    for (ggml_tensor * t : { inp_pos, inp_out_ids, inp_targets, inp_shift, inp_coef }) {
+        ggml_set_input(t);
+    }
+
+    init_reference();
+
+    // policy objective, log pi(o_t) = x[o_t] - shift - log(sum(exp(x - shift)))
+    // the shift keeps exp() finite and its contribution c_t*shift is a constant
+    ggml_tensor * objective;
+    {
+        ggml_context * ctx = ctx_compute.get();
+
+        ggml_tensor * logits = llama_ft_build_logits(ctx, model, weights, inp_tokens, inp_pos, inp_out_ids,
+                params.grad_checkpointing ? &checkpoints : nullptr);
+
+        ggml_tensor * logit_sel = ggml_sum_rows(ctx, ggml_mul(ctx, logits, inp_targets));
+        ggml_tensor * lse       = ggml_log(ctx, ggml_sum_rows(ctx, ggml_exp(ctx, ggml_sub(ctx, logits, inp_shift))));
+
+        objective = ggml_sub(ctx, logit_sel, ggml_mul(ctx, lse, inp_coef));
+        ggml_set_name(objective, "grpo_objective");
+    }
+
+    ggml_cgraph * gf_ref;
+    ggml_tensor * logits_ref;
+    {
+        logits_ref = llama_ft_build_logits(ctx_compute.get(), model, weights_ref, inp_tokens, inp_pos, inp_out_ids);
+        ggml_set_name(logits_ref, "logits_ref");
+        ggml_set_output(logits_ref);
+
+        gf_ref = ggml_new_graph_custom(ctx_compute.get(), graph_size, false);
+        ggml_build_forward_expand(gf_ref, logits_ref);
+    }
+
+    init_opt(inp_tokens, objective, GGML_OPT_LOSS_TYPE_SUM, n_accum);
+
+    {
+        std::vector<int32_t> pos(n_ctx);
+        std::iota(pos.begin(), pos.end(), 0);
+        ggml_backend_tensor_set(inp_pos, pos.data(), 0, ggml_nbytes(inp_pos));
+    }
+
+    // the samplers of a prompt are seeded from (seed, epoch, prompt, g): every prompt and epoch draws its own random
+    // numbers and a resumed run samples the same completions
+    std::vector<llama_sampler *> smpls(n_group, nullptr);
+
+    auto init_samplers = [&](int epoch, size_t ip) {
+        for (int64_t g = 0; g < n_group; ++g) {
+            std::seed_seq seq = { params.seed, (uint32_t) epoch, (uint32_t) ip, (uint32_t) g };
+
+            uint32_t seed;
+            seq.generate(&seed, &seed + 1);
+
+            llama_sampler_free(smpls[g]);
+
+            smpls[g] = llama_sampler_chain_init(llama_sampler_chain_default_params());
+            llama_sampler_chain_add(smpls[g], llama_sampler_init_temp(params.grpo_temperature));
+            llama_sampler_chain_add(smpls[g], llama_sampler_init_dist(seed));
+        }
+    };
+
+    llama_batch batch = llama_batch_init(std::max(n_batch, n_group), 0, 1);
+
+    std::vector<std::vector<llama_token>> completions(n_group);
+    std::vector<std::vector<float>>       logp_pol   (n_group); // log pi(o_t) during the rollout
+    std::vector<std::vector<float>>       shift      (n_group);
+    std::vector<float>                    rewards    (n_group);
+    std::vector<float>                    advantages (n_group);
+
+    std::vector<int32_t> h_tokens (n_ctx*n_micro);
+    std::vector<int32_t> h_out_ids(n_rows);
+    std::vector<float>   h_targets(n_vocab*n_rows);
+    std::vector<float>   h_shift  (n_rows);
+    std::vector<float>   h_coef   (n_rows);
+    std::vector<float>   h_logits (n_vocab*n_rows);
+
+    // with data parallelism every optimizer step takes one prompt per rank
+    const int64_t n_steps = prompts.size() / n_ranks;
+    if (n_steps < 1) {
+        LLAMA_LOG_ERROR("%s: need at least one prompt per rank, got %zu prompts for %d ranks\n", __func__, prompts.size(), n_ranks);
+        return false;
+    }
+
+    load_checkpoint("grpo", prompts.size(), n_group*n_ranks, n_ctx);
+    const int64_t iter_start = ggml_opt_get_iter(opt_ctx);
+
+    bool ok = true;
+
+    for (int epoch = progress.epoch; epoch < params.epochs && ok; ++epoch) {
+        progress.epoch = epoch;
+        for (int64_t step = progress.step; step < n_steps && ok; ++step) {
+            const size_t ip = step*n_ranks + rank;
+            const std::vector<llama_token> & prompt = prompts[ip];
+            const int64_t n_prompt = prompt.size();
+
+            on_step_begin();
+            const int64_t t_start_us = stats.t_start_us;
+
+            // rollouts: decode the prompt once on seq 0, share its cells with the other sequences,
+            // then sample all completions together with one token per sequence per decode
+            llama_kv_self_clear(lctx);
+
+            int32_t i_last = -1;
+            for (int64_t i0 = 0; i0 < n_prompt; i0 += n_batch) {
+                batch.n_tokens = 0;
+                for (int64_t i = i0; i < std::min(i0 + n_batch, n_prompt); ++i) {
+                    const int32_t j = batch.n_tokens++;
+                    batch.token   [j]    = prompt[i];
+                    batch.pos     [j]    = i;
+                    batch.n_seq_id[j]    = 1;
+                    batch.seq_id  [j][0] = 0;
+                    batch.logits  [j]    = i == n_prompt - 1;
+                    i_last = j;
+                }
+                if (llama_decode(lctx, batch) != 0) {
+                    LLAMA_LOG_ERROR("%s: failed to decode the prompt\n", __func__);
+                    ok = false;
+                    break;
+                }
+            }
+            if (!ok) {
+                break;
+            }
+            for (int64_t g = 1; g < n_group; ++g) {
+                llama_kv_self_seq_cp(lctx, 0, g, -1, -1);
+            }
+
+            std::vector<int32_t> i_batch(n_group, i_last);
+            std::vector<bool>    done   (n_group, false);
+            for (int64_t g = 0; g < n_group; ++g) {
+                completions[g].clear();
+                logp_pol   [g].clear();
+                shift      [g].clear();
+            }
+            init_samplers(epoch, ip);
+
+            for (int64_t t = 0; t < n_new; ++t) {
+                for (int64_t g = 0; g < n_group; ++g) {
+                    if (done[g]) {
+                        continue;
+                    }
+                    const float * logits = llama_get_logits_ith(lctx, i_batch[g]);
+
+                    const llama_token token = llama_sampler_sample(smpls[g], lctx, i_batch[g]);
+
+                    float max;
+                    logp_pol   [g].push_back(llama_ft_log_softmax_at(logits, n_vocab, token, &max));
+                    shift      [g].push_back(max);
+                    completions[g].push_back(token);
+
+                    done[g] = vocab.is_eog(token);
+                }
+
+                if (t == n_new - 1) {
+                    break;
+                }
+
+                batch.n_tokens = 0;
+                for (int64_t g = 0; g < n_group; ++g) {
+                    if (done[g]) {
+                        continue;
+                    }
+                    const int32_t j = batch.n_tokens++;
+                    batch.token   [j]    = completions[g].back();
+                    batch.pos     [j]    = n_prompt + t;
+                    batch.n_seq_id[j]    = 1;
+                    batch.seq_id  [j][0] = g;
+                    batch.logits  [j]    = true;
+                    i_batch[g] = j;
+                }
+                if (batch.n_tokens == 0) {
+                    break;
+                }
+                if (llama_decode(lctx, batch) != 0) {
+                    LLAMA_LOG_ERROR("%s: failed to decode the completions\n", __func__);
+                    ok = false;
+                    break;
+                }
+            }
+            if (!ok) {
+                break;
+            }
+
+            const int64_t t_rollout_us = ggml_time_us();
+
+            // rewards and group-normalized advantages
+            double reward_mean = 0.0;
+            for (int64_t g = 0; g < n_group; ++g) {
+                std::string text(8*completions[g].size() + 16, '\0');
+                const int32_t n_chars = vocab.detokenize(completions[g].data(), completions[g].size(), &text[0], text.size(), true, false);
+                text.resize(std::max(n_chars, 0));
+
+                rewards[g] = llama_ft_graph_reward(lctx, text);
+                reward_mean += rewards[g];
+            }
+            reward_mean /= n_group;
+
+            double reward_var = 0.0;
+            for (int64_t g = 0; g < n_group; ++g) {
+                reward_var += (rewards[g] - reward_mean)*(rewards[g] - reward_mean);
+            }
+            const double reward_std = sqrt(reward_var/n_group);
+
+            for (int64_t g = 0; g < n_group; ++g) {
+                advantages[g] = (rewards[g] - reward_mean)/(reward_std + 1e-4);
+            }
+            stats.t_rollout_us = ggml_time_us() - t_start_us;
+
+            // the coefficients are normalized by the whole group, the gradients of the micro-batches sum up to the group gradient
+            ggml_opt_result_reset(opt_result);
+
+            double  kl_sum = 0.0;
+            int64_t n_kl   = 0;
+            for (int64_t ia = 0; ia < n_accum && ok; ++ia) {
+                const int64_t g0 = ia*n_micro;
+
+                int64_t t_phase_start_us = ggml_time_us();
+
+                // sequences and output rows, unused rows point at the first completion row of their sequence
+                for (int64_t s = 0; s < n_micro; ++s) {
+                    const int64_t g       = g0 + s;
+                    const int64_t n_compl = completions[g].size();
+                    for (int64_t i = 0; i < n_ctx; ++i) {
+                        llama_token token = prompt.back();
+                        if (i < n_prompt) {
+                            token = prompt[i];
+                        } else if (i - n_prompt < n_compl) {
+                            token = completions[g][i - n_prompt];
+                        }
+                        h_tokens[s*n_ctx + i] = token;
+                    }
+                    for (int64_t t = 0; t < n_new; ++t) {
+                        h_out_ids[s*n_new + t] = s*n_ctx + n_prompt - 1 + (t < n_compl ? t : 0);
+                    }
+                    stats.n_tokens += n_prompt + n_compl;
+                }
+                ggml_backend_tensor_set(inp_tokens,  h_tokens.data(),  0, ggml_nbytes(inp_tokens));
+                ggml_backend_tensor_set(inp_out_ids, h_out_ids.data(), 0, ggml_nbytes(inp_out_ids));
+                stats.t_data_us += ggml_time_us() - t_phase_start_us;
+
+                // reference log-probs of the sampled tokens
+                t_phase_start_us = ggml_time_us();
+                ggml_backend_sched_reset(sched_fwd.get());
+                if (ggml_backend_sched_graph_compute(sched_fwd.get(), gf_ref) != GGML_STATUS_SUCCESS) {
+                    LLAMA_LOG_ERROR("%s: failed to compute the reference logits\n", __func__);
+                    ok = false;
+                    break;
+                }
+                ggml_backend_tensor_get(logits_ref, h_logits.data(), 0, ggml_nbytes(logits_ref));
+                stats.t_ref_us += ggml_time_us() - t_phase_start_us;
+
+                t_phase_start_us = ggml_time_us();
+                std::fill(h_targets.begin(), h_targets.end(), 0.0f);
+                for (int64_t s = 0; s < n_micro; ++s) {
+                    const int64_t g       = g0 + s;
+                    const int64_t n_compl = completions[g].size();
+                    for (int64_t t = 0; t < n_new; ++t) {
+                        const int64_t row = s*n_new + t;
+                        if (t >= n_compl) {
+                            h_shift[row] = shift[g][0];
+                            h_coef [row] = 0.0f;
+                            continue;
+                        }
+                        const llama_token token = completions[g][t];
+
+                        const float logp_ref = llama_ft_log_softmax_at(h_logits.data() + row*n_vocab, n_vocab, token, nullptr);
+                        const float ratio    = expf(logp_ref - logp_pol[g][t]); // pi_ref/pi
+
+                        kl_sum += ratio - (logp_ref - logp_pol[g][t]) - 1.0f;
+                        n_kl++;
+
+                        const float coef = (-advantages[g] + params.grpo_kl_coef*(1.0f - ratio)) / (n_group*n_compl);
+
+                        h_shift  [row] = shift[g][t];
+                        h_coef   [row] = coef;
+                        h_targets[row*n_vocab + token] = coef;
+                    }
+                }
+                ggml_backend_tensor_set(inp_targets, h_targets.data(), 0, ggml_nbytes(inp_targets));
+                ggml_backend_tensor_set(inp_shift,   h_shift.data(),   0, ggml_nbytes(inp_shift));
+                ggml_backend_tensor_set(inp_coef,    h_coef.data(),    0, ggml_nbytes(inp_coef));
+                stats.t_data_us += ggml_time_us() - t_phase_start_us;
+
+                // evaluates the gradient-only graph for all but the last micro-batch
+                ggml_opt_forward_backward(opt_ctx, opt_result);
+            }
+            if (!ok) {
+                break;
+            }
+            if (ggml_opt_get_iter(opt_ctx) == iter_start + 1) {
+                log_compute_buffer_size();
+            }
+
+            double loss;
+            ggml_opt_result_loss(opt_result, &loss, nullptr);
+            if (n_ranks > 1) {
+                loss = allreduce.mean(loss);
+            }
+
+            progress.step      = step + 1;
+            progress.loss_sum += loss;
+            progress.loss_n   += 1;
+
+            LLAMA_LOG_INFO("%s: epoch %d/%d, prompt %zu/%zu, reward = %.4f +- %.4f, kl = %.5f, loss = %.5f, t_rollout = %.2f s, t_update = %.2f s\n",
+                    __func__, epoch + 1, params.epochs, ip + 1, prompts.size(), reward_mean, reward_std,
+                    n_kl > 0 ? kl_sum/n_kl : 0.0, loss, 1e-6*(t_rollout_us - t_start_us), 1e-6*(ggml_time_us() - t_rollout_us));
+
+            on_step_done("grpo", prompts.size(), n_group*n_ranks, n_ctx, loss);
+        }
+        if (ok) {
+            progress.step     = 0;
+            progress.loss_sum = 0.0;
+            progress.loss_n   = 0;
+        }
+    }
+
+    if (ok && params.checkpoint_path) {
+        progress.epoch = params.epochs;
+        save_checkpoint("grpo", prompts.size(), n_group*n_ranks, n_ctx);
+    }
+
+    // the cached KV was computed with the weights before the last update
+    llama_kv_self_clear(lctx);
+
+    llama_batch_free(batch);
+    for (llama_sampler * smpl : smpls) {
+        llama_sampler_free(smpl);
+    }
+
+    return writer.wait() && ok;
+}
+
 extern "C" {
 
 struct llama_finetune_params llama_finetune_default_params() {
@@ -38,57 +1609,176 @@ struct llama_finetune_params llama_finetune_default_params() {
     params.learning_rate = 1e-5f;
     params.weight_decay = 0.01f;
     params.batch_size = 32;
+    params.micro_batch_size = 4;
     params.epochs = 1;
+    params.seq_len = 256;
+    params.seed = 42;
+    params.adamw_8bit = false;
+    params.grad_checkpointing = false;
     params.use_graph_reasoning = false;
+    params.checkpoint_path = nullptr;
+    params.checkpoint_interval = 0;
+    params.checkpoint_resume = false;
+    params.dp_endpoint = nullptr;
+    params.dp_rank = 0;
+    params.dp_n_ranks = 1;
+    params.stats_path = nullptr;
+    params.eval_split = 0.0f;
+    params.eval_interval = 0;
+    params.eval_patience = 0;
+    params.grpo_group_size = 4;
+    params.grpo_max_new_tokens = 64;
+    params.grpo_temperature = 1.0f;
+    params.grpo_kl_coef = 0.04f;
     return params;
 }
 
 bool llama_model_finetune_init(struct llama_model* model) {
-    // Mark model as trainable
-    // model->training = true; // Would need to add this field
-    
-    // Extend tensors with gradient storage
-    return extend_model_tensors(model);
+    if (!model) {
+        return false;
+    }
+
+    const std::string err = llama_ft_check_model(*model);
+    if (!err.empty()) {
+        LLAMA_LOG_ERROR("%s: %s\n", __func__, err.c_str());
+        return false;
+    }
+
+    return true;
 }
 
-bool llama_finetune(struct llama_context* ctx, 
+bool llama_finetune(struct llama_context* ctx,
                    const int* tokens, int n_tokens,
                    const struct llama_finetune_params* params) {
     if (!ctx || !tokens || n_tokens <= 1 || !params) {
         return false;
     }
-    
-    // Get graph reasoning if used
-    llama_graph_reasoning* gr = nullptr;
-    if (params->use_graph_reasoning) {
-        // In a real implementation, we'd get this from context:
-        // gr = ctx->graph_reasoning;
-    }
-    
-    // Placeholder for actual finetuning implementation
-    // In a real implementation, we'd:
-    // 1. Process tokens in batches
-    // 2. Forward pass through model
-    // 3. Calculate loss
-    // 4. If using graph reasoning, modify loss with reward
-    // 5. Backward pass to compute gradients 
-    // 6. Update weights using optimizer
-    
-    return true;
+
+    try {
+        llama_ft_trainer trainer(ctx, *params);
+
+        return params->use_graph_reasoning ?
+            trainer.train_grpo(tokens, n_tokens) :
+            trainer.train_sft (tokens, n_tokens);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: %s\n", __func__, err.what());
+        return false;
+    }
 }
 
 bool llama_model_finetune_save(struct llama_model* model, const char* filename) {
     if (!model || !filename) {
         return false;
     }
-    
-    // Placeholder for saving implementation
-    // In a real implementation, we'd:
-    // 1. Open file
-    // 2. Write model format header
-    // 3. Write all model weights
-    // 4. Close file
-    
+
+    // the metadata and the tensor layout are copied from the file the model was loaded from
+    if (model->paths.size() != 1) {
+        LLAMA_LOG_ERROR("%s: saving is only supported for models loaded from a single file\n", __func__);
+        return false;
+    }
+    const std::string & fname_base = model->paths[0];
+
+    try {
+        ggml_context * ctx_base = nullptr;
+        gguf_init_params gparams = {
+            /*.no_alloc =*/ true,
+            /*.ctx      =*/ &ctx_base,
+        };
+        gguf_context_ptr meta_base(gguf_init_from_file(fname_base.c_str(), gparams));
+        if (!meta_base) {
+            throw std::runtime_error(format("failed to read '%s'", fname_base.c_str()));
+        }
+        ggml_context_ptr ctx_base_ptr(ctx_base);
+
+        std::unordered_map<std::string, ggml_tensor *> model_tensors;
+        for (const auto & it : model->tensors_by_name) {
+            model_tensors[it.first] = it.second;
+        }
+
+        gguf_context_ptr meta(gguf_init_empty());
+        gguf_set_kv(meta.get(), meta_base.get());
+
+        // tensors that the model did not load are copied unchanged from the base file
+        const int64_t n_tensors = gguf_get_n_tensors(meta_base.get());
+        std::vector<ggml_tensor *> tensors(n_tensors);
+        std::vector<size_t>        offs_base(n_tensors, SIZE_MAX);
+        for (int64_t i = 0; i < n_tensors; ++i) {
+            const char * name = gguf_get_tensor_name(meta_base.get(), i);
+            auto it = model_tensors.find(name);
+            if (it != model_tensors.end()) {
+                tensors[i] = it->second;
+            } else {
+                tensors[i]   = ggml_get_tensor(ctx_base, name);
+                offs_base[i] = gguf_get_data_offset(meta_base.get()) + gguf_get_tensor_offset(meta_base.get(), i);
+            }
+            gguf_add_tensor(meta.get(), tensors[i]);
+        }
+
+        std::ifstream fin;
+        llama_ft_write_gguf(filename, meta.get(), [&](int64_t i, std::vector<uint8_t> & buf) {
+            buf.resize(ggml_nbytes(tensors[i]));
+            if (offs_base[i] == SIZE_MAX) {
+                ggml_backend_tensor_get(tensors[i], buf.data(), 0, buf.size());
+                return (const void *) buf.data();
+            }
+            if (!fin.is_open()) {
+                fin.open(fname_base, std::ios::binary);
+            }
+            fin.seekg(offs_base[i]);
+            if (!fin.read((char *) buf.data(), buf.size())) {
+                throw std::runtime_error(format("failed to read tensor '%s' from '%s'", tensors[i]->name, fname_base.c_str()));
+            }
+            return (const void *) buf.data();
+        });
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to save the model to '%s': %s\n", __func__, filename, err.what());
+        return false;
+    }
+
+    LLAMA_LOG_INFO("%s: saved the model to '%s'\n", __func__, filename);
+
+    return true;
+}
+
+bool llama_model_finetune_save_delta(struct llama_model* model, const char* filename) {
+    if (!model || !filename) {
+        return false;
+    }
+
+    if (model->paths.size() != 1) {
+        LLAMA_LOG_ERROR("%s: saving is only supported for models loaded from a single file\n", __func__);
+        return false;
+    }
+    const std::string & fname_base = model->paths[0];
+
+    try {
+        const LLM_KV kv(model->arch);
+
+        gguf_context_ptr meta(gguf_init_empty());
+        gguf_set_val_str(meta.get(), kv(LLM_KV_OVERLAY_BASE).c_str(),      fname_base.c_str());
+        gguf_set_val_u64(meta.get(), kv(LLM_KV_OVERLAY_BASE_HASH).c_str(), llama_model_header_hash(fname_base));
+
+        // only the tensors that training updates can differ from the base
+        std::vector<ggml_tensor *> tensors;
+        llama_ft_weights_from_model(*model).foreach([&](ggml_tensor * t) {
+            if (llama_ft_is_trainable(t)) {
+                gguf_add_tensor(meta.get(), t);
+                tensors.push_back(t);
+            }
+        });
+
+        llama_ft_write_gguf(filename, meta.get(), [&](int64_t i, std::vector<uint8_t> & buf) {
+            buf.resize(ggml_nbytes(tensors[i]));
+            ggml_backend_tensor_get(tensors[i], buf.data(), 0, buf.size());
+            return (const void *) buf.data();
+        });
+
+        LLAMA_LOG_INFO("%s: saved %zu tensors as an overlay of '%s' to '%s'\n", __func__, tensors.size(), fname_base.c_str(), filename);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to save the model to '%s': %s\n", __func__, filename, err.what());
+        return false;
+    }
+
     return true;
 }
 
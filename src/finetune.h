@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 // Forward declarations
 struct llama_model;
@@ -17,25 +18,63 @@ extern "C" {
 struct llama_finetune_params {
     float learning_rate;
     float weight_decay;
-    int batch_size;
+    int batch_size;       // sequences per optimizer step
+    int micro_batch_size; // sequences per forward/backward pass, the gradients of batch_size/micro_batch_size passes are accumulated
     int epochs;
+    int seq_len;          // tokens per training sequence, 0 = n_ctx of the context
+    uint32_t seed;        // RNG seed for data shuffling and rollout sampling
+    bool adamw_8bit;      // store the AdamW moments as blockwise-quantized 8-bit values, ~1/4 of the f32 optimizer memory
+    bool grad_checkpointing; // keep only the layer boundaries for the backward pass and recompute the rest, saves memory for ~1/3 more compute
     bool use_graph_reasoning;
+
+    // training checkpoints, the trainable weights, optimizer state, RNG and data position are stored in a GGUF file
+    const char * checkpoint_path; // nullptr = no checkpoints
+    int checkpoint_interval;      // optimizer steps between checkpoints, 0 = only at the end of training
+    bool checkpoint_resume;       // continue from checkpoint_path if it exists
+
+    // data-parallel training: every process trains on its shard of the data with batch_size sequences (or one prompt) per step,
+    // the gradients are averaged over all processes before each optimizer step, needs the RPC backend
+    const char * dp_endpoint; // host:port that rank 0 listens on and the other ranks connect to, nullptr = single process
+    int dp_rank;
+    int dp_n_ranks;
+
+    // per-step stats as JSON lines: time of the data loading, forward, backward, optimizer and checkpoint phases,
+    // tokens/s, FLOP/s and the peak compute buffer size, with data parallelism every rank writes its own stats
+    const char * stats_path; // nullptr = no stats
+
+    // held-out evaluation (SFT): the last windows of the token stream are not trained on, their loss and perplexity
+    // are computed with a forward-only graph over the live weights
+    float eval_split;    // fraction of the windows to hold out, 0 = no evaluation
+    int   eval_interval; // optimizer steps between evaluations, 0 = at the end of every epoch
+    int   eval_patience; // stop after this many evaluations without a new best loss, 0 = never stop early
+
+    // group-relative policy optimization (GRPO), used when use_graph_reasoning is set
+    // the token stream is split into prompts at end-of-generation tokens
+    int grpo_group_size;      // completions sampled per prompt (G)
+    int grpo_max_new_tokens;  // max. completion length
+    float grpo_temperature;   // sampling temperature for the rollouts
+    float grpo_kl_coef;       // weight of the KL penalty against the frozen reference model
 };
 
 // Default parameters
 struct llama_finetune_params llama_finetune_default_params();
 
 // Initialize model for finetuning
+// fails if the model cannot be trained in place (mmap-ed weights, unsupported architecture or tensor types)
 bool llama_model_finetune_init(struct llama_model* model);
 
 // Finetune on token sequence
-bool llama_finetune(struct llama_context* ctx, 
+bool llama_finetune(struct llama_context* ctx,
                    const int* tokens, int n_tokens,
                    const struct llama_finetune_params* params);
 
 // Save finetuned model
 bool llama_model_finetune_save(struct llama_model* model, const char* filename);
 
+// Save only the trained tensors as an overlay of the file the model was loaded from
+// the overlay refers to the base model by path and header hash and is loaded like a regular model file
+bool llama_model_finetune_save_delta(struct llama_model* model, const char* filename);
+
 #ifdef __cplusplus
 }
 #endif
@@ -6,8 +6,10 @@
 #include "llama-model.h"
 #include "llama-kv-cache.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <functional>
 #include <stdexcept>
 #include <cinttypes>
 
@@ -34,10 +36,15 @@ llama_context::llama_context(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.n_kv_block       = params.n_kv_block;
+    cparams.defrag_step_us   = params.defrag_step_us;
+    cparams.n_state_ckpt     = params.n_state_ckpt;
+    cparams.state_ckpt_step  = std::max(1u, params.state_ckpt_step);
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
     cparams.no_perf          = params.no_perf;
+    cparams.kv_scores        = params.kv_scores;
     cparams.pooling_type     = params.pooling_type;
     cparams.warmup           = false;
 
@@ -184,22 +191,38 @@ llama_context::llama_context(
 
         cparams.n_ctx = GGML_PAD(cparams.n_ctx, kv_self->get_padding(cparams));
 
+        if (cparams.n_kv_block > 0) {
+            // the paged KV cache is made of whole blocks
+            cparams.n_ctx = GGML_PAD(cparams.n_ctx, cparams.n_kv_block);
+        }
+
         LLAMA_LOG_DEBUG("%s: n_ctx = %u (padded)\n", __func__, cparams.n_ctx);
 
         uint32_t kv_size = cparams.n_ctx;
-        ggml_type type_k = params.type_k;
-        ggml_type type_v = params.type_v;
+
+        std::vector<ggml_type> type_k(hparams.n_layer, params.type_k);
+        std::vector<ggml_type> type_v(hparams.n_layer, params.type_v);
+
+        if (params.type_k_layer) {
+            type_k.assign(params.type_k_layer, params.type_k_layer + hparams.n_layer);
+        }
+
+        if (params.type_v_layer) {
+            type_v.assign(params.type_v_layer, params.type_v_layer + hparams.n_layer);
+        }
 
         if (llama_model_is_recurrent(&model)) {
             // Mamba needs at least as many KV cells as there are sequences kept at any time
             kv_size = std::max((uint32_t) 1, params.n_seq_max);
             // it's probably best to keep as much precision as possible for the states
-            type_k = GGML_TYPE_F32; // required by ggml_ssm_conv for Mamba's conv_states
-            type_v = GGML_TYPE_F32; // required by ggml_ssm_scan for Mamba's ssm_states
+            std::fill(type_k.begin(), type_k.end(), GGML_TYPE_F32); // required by ggml_ssm_conv for Mamba's conv_states
+            std::fill(type_v.begin(), type_v.end(), GGML_TYPE_F32); // required by ggml_ssm_scan for Mamba's ssm_states
         }
 
-        GGML_ASSERT(hparams.n_embd_head_k % ggml_blck_size(type_k) == 0);
-        GGML_ASSERT(hparams.n_embd_head_v % ggml_blck_size(type_v) == 0);
+        for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+            GGML_ASSERT(hparams.n_embd_head_k % ggml_blck_size(type_k[il]) == 0);
+            GGML_ASSERT(hparams.n_embd_head_v % ggml_blck_size(type_v[il]) == 0);
+        }
 
         if (!kv_self->init(model, cparams, type_k, type_v, kv_size, cparams.offload_kqv)) {
             throw std::runtime_error("failed to initialize self-attention cache");
@@ -209,10 +232,13 @@ llama_context::llama_context(
             const size_t memory_size_k = kv_self->size_k_bytes();
             const size_t memory_size_v = kv_self->size_v_bytes();
 
+            const bool mixed_k = std::adjacent_find(type_k.begin(), type_k.end(), std::not_equal_to<ggml_type>()) != type_k.end();
+            const bool mixed_v = std::adjacent_find(type_v.begin(), type_v.end(), std::not_equal_to<ggml_type>()) != type_v.end();
+
             LLAMA_LOG_INFO("%s: KV self size  = %7.2f MiB, K (%s): %7.2f MiB, V (%s): %7.2f MiB\n", __func__,
                     (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f),
-                    ggml_type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f),
-                    ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
+                    mixed_k ? "mixed" : ggml_type_name(type_k[0]), (float)memory_size_k / (1024.0f * 1024.0f),
+                    mixed_v ? "mixed" : ggml_type_name(type_v[0]), (float)memory_size_v / (1024.0f * 1024.0f));
         }
     }
 
@@ -305,6 +331,8 @@ llama_context::llama_context(
 
         // simulate full KV cache
         kv_self->n = kv_self->size;
+        kv_self->gather_info.ids.clear();
+        kv_self->slot_cells.clear();
 
         cross.v_embd.clear();
 
@@ -588,13 +616,64 @@ llm_graph_result_ptr llama_context::build_kv_self_shift(
     return res;
 }
 
+void llama_context::build_kv_self_cpy(
+        ggml_context * ctx0,
+        ggml_cgraph * gf,
+        uint32_t i,
+        uint32_t id,
+        uint32_t nm) const {
+    const auto & hparams = model.hparams;
+
+    for (uint32_t il = 0; il < hparams.n_layer; ++il) { // NOLINT
+        const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+        const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
+
+        ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv_self->k_l[il],
+                n_embd_k_gqa, nm,
+                ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa),
+                ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa*i));
+
+        ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv_self->k_l[il],
+                n_embd_k_gqa, nm,
+                ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa),
+                ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa*id));
+
+        ggml_tensor * view_v_src;
+        ggml_tensor * view_v_dst;
+
+        if (!kv_self->v_trans) {
+            // NOTE: the V cache is not transposed when using flash attention
+            view_v_src = ggml_view_2d(ctx0, kv_self->v_l[il],
+                    n_embd_v_gqa, nm,
+                    ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa),
+                    ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa*i));
+
+            view_v_dst = ggml_view_2d(ctx0, kv_self->v_l[il],
+                    n_embd_v_gqa, nm,
+                    ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa),
+                    ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa*id));
+        } else {
+            view_v_src = ggml_view_2d(ctx0, kv_self->v_l[il],
+                    nm, n_embd_v_gqa,
+                    ggml_row_size(kv_self->v_l[il]->type, kv_self->size),
+                    ggml_row_size(kv_self->v_l[il]->type, i));
+
+            view_v_dst = ggml_view_2d(ctx0, kv_self->v_l[il],
+                    nm, n_embd_v_gqa,
+                    ggml_row_size(kv_self->v_l[il]->type, kv_self->size),
+                    ggml_row_size(kv_self->v_l[il]->type, id));
+        }
+
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_k_src, view_k_dst));
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_v_src, view_v_dst));
+    }
+}
+
 llm_graph_result_ptr llama_context::build_kv_self_defrag(
         ggml_context * ctx0,
         ggml_cgraph * gf) const {
     auto res = std::make_unique<llm_graph_result>();
 
-    const auto & hparams = model.hparams;
-
     const auto & ids = kv_self->defrag_info.ids;
 
 #if 0
@@ -607,6 +686,8 @@ llm_graph_result_ptr llama_context::build_kv_self_defrag(
     // likely not worth the effort, as we have ggml_graph based defrag
     //
 
+    const auto & hparams = model.hparams;
+
     const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa();
     const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa();
 
@@ -681,55 +762,45 @@ llm_graph_result_ptr llama_context::build_kv_self_defrag(
             nm++;
         }
 
-        for (uint32_t il = 0; il < hparams.n_layer; ++il) { // NOLINT
-            const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
-            const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
+        build_kv_self_cpy(ctx0, gf, i, id, nm);
 
-            ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv_self->k_l[il],
-                    n_embd_k_gqa, nm,
-                    ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa),
-                    ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa*i));
+        i += nm - 1;
+    }
 
-            ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv_self->k_l[il],
-                    n_embd_k_gqa, nm,
-                    ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa),
-                    ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa*id));
+    //LLAMA_LOG_INFO("gf->n_nodes = %d\n", gf->n_nodes);
+#endif
 
-            ggml_tensor * view_v_src;
-            ggml_tensor * view_v_dst;
+    return res;
+}
 
-            if (cparams.flash_attn) {
-                // NOTE: the V cache is not transposed when using flash attention
-                view_v_src = ggml_view_2d(ctx0, kv_self->v_l[il],
-                        n_embd_v_gqa, nm,
-                        ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa),
-                        ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa*i));
+llm_graph_result_ptr llama_context::build_kv_self_copy(
+        ggml_context * ctx0,
+        ggml_cgraph * gf,
+        uint32_t & i0,
+        uint32_t   n_max_nodes) const {
+    auto res = std::make_unique<llm_graph_result>();
 
-                view_v_dst = ggml_view_2d(ctx0, kv_self->v_l[il],
-                        n_embd_v_gqa, nm,
-                        ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa),
-                        ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa*id));
-            } else {
-                view_v_src = ggml_view_2d(ctx0, kv_self->v_l[il],
-                        nm, n_embd_v_gqa,
-                        ggml_row_size(kv_self->v_l[il]->type, kv_self->size),
-                        ggml_row_size(kv_self->v_l[il]->type, i));
-
-                view_v_dst = ggml_view_2d(ctx0, kv_self->v_l[il],
-                        nm, n_embd_v_gqa,
-                        ggml_row_size(kv_self->v_l[il]->type, kv_self->size),
-                        ggml_row_size(kv_self->v_l[il]->type, id));
-            }
+    const auto & ids = kv_self->copy_info.ids;
+
+    // each run of cells needs 6 nodes per layer, 4 views and 2 copies
+    const uint32_t max_runs = (n_max_nodes - 2*model.hparams.n_layer)/(6*model.hparams.n_layer);
+
+    uint32_t n_runs = 0;
+
+    for (; i0 < ids.size() && n_runs < max_runs; ++n_runs) {
+        const uint32_t i  = ids[i0].first;
+        const uint32_t id = ids[i0].second;
 
-            ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_k_src, view_k_dst));
-            ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_v_src, view_v_dst));
+        uint32_t nm = 1;
+
+        while (i0 + nm < ids.size() && ids[i0 + nm].first == i + nm && ids[i0 + nm].second == id + nm) {
+            nm++;
         }
 
-        i += nm - 1;
-    }
+        build_kv_self_cpy(ctx0, gf, i, id, nm);
 
-    //LLAMA_LOG_INFO("gf->n_nodes = %d\n", gf->n_nodes);
-#endif
+        i0 += nm;
+    }
 
     return res;
 }
@@ -739,6 +810,29 @@ void llama_context::kv_self_update() {
 
     bool need_reserve = false;
 
+    // copy the shared cells that were split by copy-on-write, before their positions are shifted
+    if (!kv->copy_info.ids.empty()) {
+        LLAMA_LOG_DEBUG("%s: copying %zu shared KV cells\n", __func__, kv->copy_info.ids.size());
+
+        for (uint32_t i0 = 0; i0 < kv->copy_info.ids.size(); ) {
+            ggml_backend_sched_reset(sched.get());
+
+            auto * gf = graph_init();
+
+            auto res = build_kv_self_copy(ctx_compute.get(), gf, i0, graph_max_nodes());
+
+            ggml_backend_sched_alloc_graph(sched.get(), gf);
+
+            res->set_inputs(nullptr);
+
+            graph_compute(gf, false);
+        }
+
+        kv->copy_info.ids.clear();
+
+        need_reserve = true;
+    }
+
     if (kv->has_shift) {
         if (!kv->get_can_shift()) {
             GGML_ABORT("The current context does not support K-shift");
@@ -776,7 +870,15 @@ void llama_context::kv_self_update() {
     if (kv->do_defrag) {
         LLAMA_LOG_DEBUG("%s: defragmenting KV cache\n", __func__);
 
-        if (kv->defrag_prepare(graph_max_nodes())) {
+        // incremental defrag: move as many cells as the last steps moved within defrag_step_us
+        uint32_t max_cells = UINT32_MAX;
+        if (cparams.defrag_step_us > 0) {
+            max_cells = t_defrag_cell_us > 0.0 ? std::max(1u, (uint32_t) (cparams.defrag_step_us/t_defrag_cell_us)) : 32;
+        }
+
+        if (kv->defrag_prepare(graph_max_nodes(), max_cells)) {
+            const int64_t t_start_us = ggml_time_us();
+
             ggml_backend_sched_reset(sched.get());
 
             auto * gf = graph_init();
@@ -789,10 +891,19 @@ void llama_context::kv_self_update() {
 
             graph_compute(gf, false);
 
-            need_reserve = true;
+            if (cparams.defrag_step_us > 0) {
+                ggml_backend_sched_synchronize(sched.get());
+
+                t_defrag_cell_us = (double) (ggml_time_us() - t_start_us)/kv->defrag_info.n_cells;
+            } else {
+                // the incremental steps do not reserve the worst case graph, its cost is not bounded by defrag_step_us
+                // the cache size does not change, the next graph is allocated as usual
+                need_reserve = true;
+            }
         }
 
-        kv->do_defrag = false;
+        // an incremental defrag continues in the next update
+        kv->do_defrag = cparams.defrag_step_us > 0 && !kv->defrag_info.complete;
     }
 
     // reserve a worst case graph if needed
@@ -805,6 +916,8 @@ void llama_context::kv_self_update() {
 
         // simulate full KV cache
         kv_self->n = kv_self->size;
+        kv_self->gather_info.ids.clear();
+        kv_self->slot_cells.clear();
 
         llama_token token = model.vocab.token_bos(); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
         llama_ubatch ubatch = { true, n_tokens, n_tokens / n_seqs, n_seqs, &token, nullptr, nullptr, nullptr, nullptr, nullptr};
@@ -1043,6 +1156,15 @@ int llama_context::encode(llama_batch & inp_batch) {
         }
     }
 
+    for (int32_t i = 0; i < n_tokens; ++i) {
+        for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+            if (batch.seq_id[i][s] < 0 || batch.seq_id[i][s] >= LLAMA_MAX_SEQ) {
+                LLAMA_LOG_ERROR("%s: invalid seq_id[%d][%d] = %d > %d\n", __func__, i, s, batch.seq_id[i][s], LLAMA_MAX_SEQ);
+                return -1;
+            }
+        }
+    }
+
     // micro-batching is not possible for non-causal encoding, so we process the batch in a single shot
     GGML_ASSERT(cparams.n_ubatch >= (uint32_t) n_tokens && "encoder requires n_ubatch >= n_tokens");
 
@@ -1204,6 +1326,9 @@ int llama_context::decode(llama_batch & inp_batch) {
 
     llama_kv_cache_guard kv_guard(kv_self.get());
 
+    // the state cache of recurrent models, nullptr otherwise
+    auto * kv_rec = dynamic_cast<llama_kv_cache_recurrent *>(kv_self.get());
+
     GGML_ASSERT((!batch.token && batch.embd) || (batch.token && !batch.embd)); // NOLINT
 
     if (batch.token) {
@@ -1215,6 +1340,15 @@ int llama_context::decode(llama_batch & inp_batch) {
         }
     }
 
+    for (int64_t i = 0; i < n_tokens_all; ++i) {
+        for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+            if (batch.seq_id[i][s] < 0 || batch.seq_id[i][s] >= LLAMA_MAX_SEQ) {
+                LLAMA_LOG_ERROR("%s: invalid seq_id[%" PRId64 "][%d] = %d > %d\n", __func__, i, s, batch.seq_id[i][s], LLAMA_MAX_SEQ);
+                throw std::runtime_error("invalid seq_id");
+            }
+        }
+    }
+
     GGML_ASSERT(n_tokens_all <= cparams.n_batch);
 
     GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
@@ -1246,7 +1380,7 @@ int llama_context::decode(llama_batch & inp_batch) {
     const bool logits_all = n_outputs_all == n_tokens_all;
 
     sbatch.from_batch(batch, n_embd,
-            /* simple_split */ !kv_self->recurrent,
+            /* simple_split */ !kv_rec,
             /* logits_all   */ logits_all);
 
     // reserve output buffer
@@ -1265,7 +1399,7 @@ int llama_context::decode(llama_batch & inp_batch) {
 
         const auto & n_ubatch = cparams.n_ubatch;
 
-        if (kv_self->recurrent) {
+        if (kv_rec) {
             if (embd_pooled) {
                 // Pooled embeddings cannot be split across ubatches (yet)
                 ubatch = sbatch.split_seq(cparams.n_ubatch);
@@ -1303,12 +1437,15 @@ int llama_context::decode(llama_batch & inp_batch) {
                 return 1;
             }
 
-            if (!kv_self->recurrent) {
+            if (!kv_rec) {
                 // a heuristic, to avoid attending the full cache if it is not yet utilized
                 // after enough generations, the benefit from this heuristic disappears
                 // if we start defragmenting the cache, the benefit from this will be more important
                 const uint32_t pad = kv_self->get_padding(cparams);
                 kv_self->n = std::min(kv_self->size, std::max(pad, GGML_PAD(kv_self->cell_max(), pad)));
+
+                // with a paged cache, attend only the blocks of the ubatch sequences if they are much fewer cells
+                kv_self->gather_prepare(ubatch, pad);
             }
         }
 
@@ -1339,6 +1476,13 @@ int llama_context::decode(llama_batch & inp_batch) {
             }
         }
 
+        // checkpoint the states of the sequences, needs the results of the ubatch
+        if (kv_rec && kv_rec->ckpt_due(ubatch)) {
+            ggml_backend_sched_synchronize(sched.get());
+
+            kv_rec->ckpt_save(ubatch);
+        }
+
         // plot the computation graph in dot format (for debugging purposes)
         //if (n_past%100 == 0) {
         //    ggml_graph_dump_dot(gf, NULL, "llama.dot");
@@ -1366,6 +1510,19 @@ int llama_context::decode(llama_batch & inp_batch) {
             }
         }
 
+        // accumulate the attention received by the KV cells
+        if (auto * t_kv_score = res->get_kv_score()) {
+            ggml_backend_t backend_score = ggml_backend_sched_get_tensor_backend(sched.get(), t_kv_score);
+            GGML_ASSERT(backend_score != nullptr);
+
+            std::vector<float> kv_score(ggml_nelements(t_kv_score));
+
+            ggml_backend_tensor_get_async(backend_score, t_kv_score, kv_score.data(), 0, kv_score.size()*sizeof(float));
+            ggml_backend_synchronize(backend_score);
+
+            kv_self->score_add(kv_score.data(), kv_score.size());
+        }
+
         // extract embeddings
         if (t_embd && n_outputs > 0) {
             ggml_backend_t backend_embd = ggml_backend_sched_get_tensor_backend(sched.get(), t_embd);
@@ -1453,7 +1610,8 @@ int llama_context::decode(llama_batch & inp_batch) {
     //synchronize();
 
     // decide if we need to defrag the kv cache
-    if (cparams.causal_attn && cparams.defrag_thold > 0.0f) {
+    // a paged cache does not need contiguous free cells, so holes do not prevent allocations
+    if (cparams.causal_attn && cparams.defrag_thold > 0.0f && cparams.n_kv_block == 0) {
         // - do not defrag small contexts (i.e. < 2048 tokens)
         // - count the padding towards the number of used tokens
         const float fragmentation = kv_self->n >= 2048 ? std::max(0.0f, 1.0f - float(kv_self->used + kv_self->get_padding(cparams))/float(kv_self->n)) : 0.0f;
@@ -2083,6 +2241,11 @@ size_t llama_context::state_write_data(llama_io_write_i & io) {
         }
     }
 
+    // the cells split by copy-on-write have no data until the next update
+    if (!kv_self->copy_info.ids.empty()) {
+        kv_self_update();
+    }
+
     LLAMA_LOG_DEBUG("%s: - writing KV self\n", __func__);
     kv_self->state_write(io);
 
@@ -2176,6 +2339,10 @@ size_t llama_context::state_read_data(llama_io_read_i & io) {
 size_t llama_context::state_seq_write_data(llama_io_write_i & io, llama_seq_id seq_id) {
     GGML_UNUSED(seq_id);
 
+    if (!kv_self->copy_info.ids.empty()) {
+        kv_self_update();
+    }
+
     kv_self->state_write(io, seq_id);
 
     return io.n_bytes();
@@ -2235,15 +2402,22 @@ llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.n_kv_block                  =*/ 0,
+        /*.defrag_step_us              =*/ 0,
+        /*.n_state_ckpt                =*/ 0,
+        /*.state_ckpt_step             =*/ 256,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
         /*.type_v                      =*/ GGML_TYPE_F16,
+        /*.type_k_layer                =*/ nullptr,
+        /*.type_v_layer                =*/ nullptr,
         /*.logits_all                  =*/ false,
         /*.embeddings                  =*/ false,
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
         /*.no_perf                     =*/ true,
+        /*.kv_scores                   =*/ false,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
     };
@@ -2279,6 +2453,30 @@ llama_context * llama_init_from_model(
         return nullptr;
     }
 
+    if (params.type_v_layer && !params.flash_attn) {
+        for (int32_t il = 0; il < llama_model_n_layer(model); ++il) {
+            if (ggml_is_quantized(params.type_v_layer[il])) {
+                LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn (layer %d)\n", __func__, il);
+                return nullptr;
+            }
+        }
+    }
+
+    if (params.kv_scores && params.flash_attn) {
+        LLAMA_LOG_WARN("%s: kv_scores needs the attention weights, which flash_attn does not compute - forcing off\n", __func__);
+        params.kv_scores = false;
+    }
+
+    if (params.n_seq_max > LLAMA_MAX_SEQ) {
+        LLAMA_LOG_ERROR("%s: n_seq_max = %u must be <= %d\n", __func__, params.n_seq_max, LLAMA_MAX_SEQ);
+        return nullptr;
+    }
+
+    if (params.n_kv_block & (params.n_kv_block - 1)) {
+        LLAMA_LOG_ERROR("%s: n_kv_block = %u is not a power of 2\n", __func__, params.n_kv_block);
+        return nullptr;
+    }
+
     try {
         auto * ctx = new llama_context(*model, params);
         return ctx;
@@ -2529,6 +2727,9 @@ bool llama_kv_self_seq_rm(
         return true;
     }
 
+    // recurrent models can write a state checkpoint back to the cache
+    ctx->synchronize();
+
     return kv->seq_rm(seq_id, p0, p1);
 }
 
@@ -2579,10 +2780,10 @@ void llama_kv_cache_seq_add(
             llama_pos   p0,
             llama_pos   p1,
             llama_pos   delta) {
-    return llama_kv_self_seq_add(ctx, seq_id, p0, p1, delta);
+    llama_kv_self_seq_add(ctx, seq_id, p0, p1, delta);
 }
 
-void llama_kv_self_seq_add(
+bool llama_kv_self_seq_add(
         llama_context * ctx,
          llama_seq_id   seq_id,
             llama_pos   p0,
@@ -2590,7 +2791,7 @@ void llama_kv_self_seq_add(
             llama_pos   delta) {
     auto * kv = ctx->get_kv_self();
     if (!kv) {
-        return;
+        return true;
     }
 
     return kv->seq_add(seq_id, p0, p1, delta);
@@ -2603,10 +2804,10 @@ void llama_kv_cache_seq_div(
             llama_pos   p0,
             llama_pos   p1,
                   int   d) {
-    return llama_kv_self_seq_div(ctx, seq_id, p0, p1, d);
+    llama_kv_self_seq_div(ctx, seq_id, p0, p1, d);
 }
 
-void llama_kv_self_seq_div(
+bool llama_kv_self_seq_div(
         llama_context * ctx,
          llama_seq_id   seq_id,
             llama_pos   p0,
@@ -2614,12 +2815,27 @@ void llama_kv_self_seq_div(
                   int   d) {
     auto * kv = ctx->get_kv_self();
     if (!kv) {
-        return;
+        return true;
     }
 
     return kv->seq_div(seq_id, p0, p1, d);
 }
 
+int32_t llama_kv_self_seq_evict(
+        llama_context * ctx,
+         llama_seq_id   seq_id,
+              int32_t   n_sink,
+              int32_t   n_heavy,
+              int32_t   n_recent,
+            llama_pos * pos_kept) {
+    auto * kv = ctx->get_kv_self();
+    if (!kv) {
+        return -1;
+    }
+
+    return kv->seq_evict(seq_id, n_sink, n_heavy, n_recent, pos_kept);
+}
+
 // deprecated
 llama_pos llama_kv_cache_seq_pos_max(llama_context * ctx, llama_seq_id seq_id) {
     return llama_kv_self_seq_pos_max(ctx, seq_id);
@@ -2634,6 +2850,15 @@ llama_pos llama_kv_self_seq_pos_max(llama_context * ctx, llama_seq_id seq_id) {
     return kv->seq_pos_max(seq_id);
 }
 
+llama_pos llama_kv_self_seq_pos_rollback(llama_context * ctx, llama_seq_id seq_id, llama_pos pos) {
+    const auto * kv = ctx->get_kv_self();
+    if (!kv) {
+        return pos;
+    }
+
+    return kv->seq_pos_rollback(seq_id, pos);
+}
+
 // deprecated
 void llama_kv_cache_defrag(llama_context * ctx) {
     return llama_kv_self_defrag(ctx);
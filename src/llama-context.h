@@ -181,6 +181,22 @@ private:
             ggml_context * ctx0,
             ggml_cgraph * gf) const;
 
+    // copy the pending copy-on-write cells, starting at copy_info.ids[i0], as many as fit in n_max_nodes
+    // i0 is moved past the copied cells
+    llm_graph_result_ptr build_kv_self_copy(
+            ggml_context * ctx0,
+            ggml_cgraph * gf,
+            uint32_t & i0,
+            uint32_t   n_max_nodes) const;
+
+    // copy the K and V data of the cells [i, i + nm) to [id, id + nm)
+    void build_kv_self_cpy(
+            ggml_context * ctx0,
+            ggml_cgraph * gf,
+            uint32_t i,
+            uint32_t id,
+            uint32_t nm) const;
+
     // TODO: read/write lora adapters and cvec
     size_t state_write_data(llama_io_write_i & io);
     size_t state_read_data (llama_io_read_i  & io);
@@ -251,6 +267,9 @@ private:
 
     bool has_evaluated_once = false;
 
+    // time to move one KV cell in the last incremental defrag step, 0 = not measured yet
+    double t_defrag_cell_us = 0.0;
+
     // perf
     mutable int64_t t_start_us  = 0;
     mutable int64_t t_load_us   = 0;
@@ -4,6 +4,12 @@
 
 #include <cstdint>
 
+// max. number of sequences of a context, the KV cache keeps the sequences of each cell in a bitset of this size
+// set with the LLAMA_MAX_SEQ CMake option
+#ifndef LLAMA_MAX_SEQ
+#define LLAMA_MAX_SEQ 64
+#endif
+
 struct llama_cparams {
     uint32_t n_ctx;           // context size used during inference
     uint32_t n_batch;
@@ -24,11 +30,17 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    uint32_t n_kv_block; // 0 = contiguous KV cache
+    uint32_t defrag_step_us; // 0 = defragment in one update
+    uint32_t n_state_ckpt;   // 0 = no state checkpoints
+    uint32_t state_ckpt_step;
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
     bool flash_attn;
     bool no_perf;
+    bool kv_scores;
     bool warmup;
 
     enum llama_pooling_type pooling_type;
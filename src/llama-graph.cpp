@@ -5,6 +5,7 @@
 #include "llama-cparams.h"
 #include "llama-kv-cache.h"
 
+#include <array>
 #include <cassert>
 #include <cmath>
 #include <cstring>
@@ -108,7 +109,11 @@ void llm_graph_input_pos_bucket_kv::set_input(const llama_ubatch * ubatch) {
         for (int h = 0; h < 1; ++h) {
             for (int j = 0; j < n_tokens; ++j) {
                 for (int i = 0; i < n_kv; ++i) {
-                    data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(kv_self->cells[i].pos, ubatch->pos[j], hparams.n_rel_attn_bkts, false);
+                    // the padding of the gathered cells is masked
+                    const uint32_t  cell_id = kv_self->cell_id(i);
+                    const llama_pos pos     = cell_id < kv_self->size ? kv_self->cells[cell_id].pos : 0;
+
+                    data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(pos, ubatch->pos[j], hparams.n_rel_attn_bkts, false);
                 }
             }
         }
@@ -274,7 +279,7 @@ void llm_graph_input_s_copy::set_input(const llama_ubatch * ubatch) {
 
             //////////////////////////////////////////////
             // TODO: this should not mutate the KV cache !
-            llama_kv_cell & kv_cell = const_cast<class llama_kv_cache_unified *>(kv_self)->cells[i];
+            llama_kv_cell & kv_cell = const_cast<class llama_kv_cache_recurrent *>(kv_self)->cells[cell_id];
 
             // prevent out-of-bound sources
             if (kv_cell.src < 0 || (uint32_t) kv_cell.src >= kv_self->size) {
@@ -307,7 +312,7 @@ void llm_graph_input_s_mask::set_input(const llama_ubatch * ubatch) {
 
             //////////////////////////////////////////////
             // TODO: this should not mutate the KV cache !
-            llama_kv_cell & kv_cell = const_cast<class llama_kv_cache_unified *>(kv_self)->cells[i];
+            llama_kv_cell & kv_cell = const_cast<class llama_kv_cache_recurrent *>(kv_self)->cells[cell_id];
 
             data[i] = (float) (kv_cell.src >= 0);
 
@@ -417,6 +422,19 @@ void llm_graph_input_attn_no_cache::set_input(const llama_ubatch * ubatch) {
 }
 
 void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
+    if (self_kv_idxs) {
+        GGML_ASSERT(ggml_backend_buffer_is_host(self_kv_idxs->buffer));
+
+        int32_t * data = (int32_t *) self_kv_idxs->data;
+
+        for (uint32_t i = 0; i < kv_self->n; ++i) {
+            const uint32_t cell_id = kv_self->cell_id(i);
+
+            // the padding is masked, any valid row will do
+            data[i] = cell_id < kv_self->size ? cell_id : 0;
+        }
+    }
+
     if (self_kq_mask || self_kq_mask_swa) {
         const int64_t n_kv         = kv_self->n;
         const int64_t n_tokens     = ubatch->n_tokens;
@@ -455,15 +473,30 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
                 for (int j = 0; j < n_seq_tokens; ++j) {
                     const llama_pos pos = ubatch->pos[s*n_seq_tokens + j];
                     for (int i = 0; i < n_kv; ++i) {
+                        const uint32_t cell_id = kv_self->cell_id(i);
+
+                        // padding of the cells gathered by the paged KV cache
+                        if (cell_id >= kv_self->size) {
+                            if (data) {
+                                data[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = -INFINITY;
+                            }
+                            if (data_swa) {
+                                data_swa[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = -INFINITY;
+                            }
+                            continue;
+                        }
+
+                        const llama_kv_cell & cell = kv_self->cells[cell_id];
+
                         float f;
                         // mask the token if:
-                        if (!kv_self->cells[i].has_seq_id(seq_id) // not the correct sequence
-                            || (cparams.causal_attn && kv_self->cells[i].pos > pos) // for causal, mask future tokens
+                        if (!cell.has_seq_id(seq_id) // not the correct sequence
+                            || (cparams.causal_attn && cell.pos > pos) // for causal, mask future tokens
                         ) {
                             f = -INFINITY;
                         } else {
                             if (hparams.use_alibi) {
-                                f = -std::abs(kv_self->cells[i].pos - pos);
+                                f = -std::abs(cell.pos - pos);
                             } else {
                                 f = 0.0f;
                             }
@@ -478,11 +511,11 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
                         if (data_swa) {
                             if (hparams.n_attn_chunk) {
                                 llama_pos pos_chunk_start = (pos / hparams.n_attn_chunk) * hparams.n_attn_chunk;
-                                if (kv_self->cells[i].pos < pos_chunk_start || pos < pos_chunk_start) {
+                                if (cell.pos < pos_chunk_start || pos < pos_chunk_start) {
                                     f = -INFINITY;
                                 }
                             } else {
-                                if (pos - kv_self->cells[i].pos >= (int32_t)hparams.n_swa) {
+                                if (pos - cell.pos >= (int32_t)hparams.n_swa) {
                                     f = -INFINITY;
                                 }
                             }
@@ -1079,7 +1112,7 @@ ggml_tensor * llm_graph_context::build_inp_cls() const {
 }
 
 ggml_tensor * llm_graph_context::build_inp_s_copy() const {
-    const llama_kv_cache_unified * kv_self = static_cast<const llama_kv_cache_unified *>(memory);
+    const llama_kv_cache_recurrent * kv_self = static_cast<const llama_kv_cache_recurrent *>(memory);
 
     auto inp = std::make_unique<llm_graph_input_s_copy>(kv_self);
 
@@ -1096,7 +1129,7 @@ ggml_tensor * llm_graph_context::build_inp_s_copy() const {
 }
 
 ggml_tensor * llm_graph_context::build_inp_s_mask() const {
-    const llama_kv_cache_unified * kv_self = static_cast<const llama_kv_cache_unified *>(memory);
+    const llama_kv_cache_recurrent * kv_self = static_cast<const llama_kv_cache_recurrent *>(memory);
 
     auto inp = std::make_unique<llm_graph_input_s_mask>(kv_self);
 
@@ -1189,7 +1222,8 @@ ggml_tensor * llm_graph_context::build_attn_mha(
          ggml_tensor * kq_b,
          ggml_tensor * kq_mask,
              bool      v_trans,
-             float     kq_scale) const {
+             float     kq_scale,
+             bool      kv_score) const {
   //const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
   //const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
@@ -1260,6 +1294,17 @@ ggml_tensor * llm_graph_context::build_attn_mha(
 
         kq = ggml_soft_max_ext(ctx0, kq, kq_mask, kq_scale, hparams.f_max_alibi_bias);
 
+        if (kv_score) {
+            // [n_kv, n_tokens, n_head] -> [n_tokens*n_head, n_kv] -> [n_kv]
+            ggml_tensor * score = ggml_cont(ctx0, ggml_permute(ctx0, kq, 2, 0, 1, 3));
+            score = ggml_sum_rows(ctx0, ggml_reshape_2d(ctx0, score, n_tokens*n_head, n_kv));
+            score = ggml_reshape_1d(ctx0, score, n_kv);
+
+            res->t_kv_score = res->t_kv_score ? ggml_add(ctx0, res->t_kv_score, score) : score;
+            ggml_set_output(res->t_kv_score);
+            ggml_build_forward_expand(gf, res->t_kv_score);
+        }
+
         if (!v_trans) {
             // note: avoid this branch
             v = ggml_cont(ctx0, ggml_transpose(ctx0, v));
@@ -1367,6 +1412,11 @@ llm_graph_input_attn_kv_unified * llm_graph_context::build_attn_inp_kv_unified()
         inp->self_kq_mask_swa_cnv = cparams.flash_attn ? ggml_cast(ctx0, inp->self_kq_mask_swa, GGML_TYPE_F16) : inp->self_kq_mask_swa;
     }
 
+    if (!kv_self->gather_info.ids.empty()) {
+        inp->self_kv_idxs = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_kv);
+        ggml_set_input(inp->self_kv_idxs);
+    }
+
     return (llm_graph_input_attn_kv_unified *) res->add_input(std::move(inp));
 }
 
@@ -1395,39 +1445,65 @@ ggml_tensor * llm_graph_context::build_attn(
 
     const auto n_tokens = q_cur->ne[2];
 
-    const bool v_trans = !cparams.flash_attn;
+    const bool v_trans = kv_self->v_trans;
 
     // store to KV cache
     {
-        GGML_ASSERT(!kv_self->recurrent);
+        GGML_ASSERT(kv_self->size == n_ctx);
 
-        const auto kv_head = kv_self->head;
+        v_cur = ggml_reshape_2d(ctx0, v_cur, n_embd_v_gqa, n_tokens);
 
-        GGML_ASSERT(kv_self->size == n_ctx);
+        // runs of tokens that go to consecutive cells, (first token, first cell, number of tokens)
+        // the slot of a paged cache can be split in many runs, otherwise it is one run at the head of the cache
+        std::vector<std::array<int64_t, 3>> runs;
+        if (!kv_self->slot_cells.empty()) {
+            const auto & slot_cells = kv_self->slot_cells;
+            for (int64_t i = 0; i < n_tokens; ++i) {
+                if (!runs.empty() && runs.back()[1] + runs.back()[2] == slot_cells[i]) {
+                    runs.back()[2]++;
+                } else {
+                    runs.push_back({ i, slot_cells[i], 1 });
+                }
+            }
+        } else {
+            runs.push_back({ 0, kv_self->head, n_tokens });
+        }
 
-        ggml_tensor * k_cache_view = ggml_view_1d(ctx0, kv_self->k_l[il], n_tokens*n_embd_k_gqa, ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa)*kv_head);
-        //cb(k_cache_view, "k_cache_view", il);
+        for (const auto & run : runs) {
+            const int64_t t0   = run[0];
+            const int64_t c0   = run[1];
+            const int64_t n_rt = run[2];
 
-        // note: storing RoPE-ed version of K in the KV cache
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_cur, k_cache_view));
+            ggml_tensor * k_run = k_cur;
+            ggml_tensor * v_run = v_cur;
 
-        v_cur = ggml_reshape_2d(ctx0, v_cur, n_embd_v_gqa, n_tokens);
+            if (n_rt < n_tokens) {
+                k_run = ggml_view_3d(ctx0, k_cur, k_cur->ne[0], k_cur->ne[1], n_rt, k_cur->nb[1], k_cur->nb[2], t0*k_cur->nb[2]);
+                v_run = ggml_view_2d(ctx0, v_cur, n_embd_v_gqa, n_rt, v_cur->nb[1], t0*v_cur->nb[1]);
+            }
 
-        ggml_tensor * v_cache_view = nullptr;
+            ggml_tensor * k_cache_view = ggml_view_1d(ctx0, kv_self->k_l[il], n_rt*n_embd_k_gqa, ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa)*c0);
+            //cb(k_cache_view, "k_cache_view", il);
 
-        if (!v_trans) {
-            v_cache_view = ggml_view_1d(ctx0, kv_self->v_l[il], n_tokens*n_embd_v_gqa, ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa)*kv_head);
-        } else {
-            // note: the V cache is transposed when not using flash attention
-            v_cache_view = ggml_view_2d(ctx0, kv_self->v_l[il], n_tokens, n_embd_v_gqa,
-                    (  n_ctx)*ggml_element_size(kv_self->v_l[il]),
-                    (kv_head)*ggml_element_size(kv_self->v_l[il]));
+            // note: storing RoPE-ed version of K in the KV cache
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_run, k_cache_view));
 
-            v_cur = ggml_transpose(ctx0, v_cur);
-        }
-        //cb(v_cache_view, "v_cache_view", il);
+            ggml_tensor * v_cache_view = nullptr;
+
+            if (!v_trans) {
+                v_cache_view = ggml_view_1d(ctx0, kv_self->v_l[il], n_rt*n_embd_v_gqa, ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa)*c0);
+            } else {
+                // note: the V cache is transposed when not using flash attention
+                v_cache_view = ggml_view_2d(ctx0, kv_self->v_l[il], n_rt, n_embd_v_gqa,
+                        (n_ctx)*ggml_element_size(kv_self->v_l[il]),
+                        (   c0)*ggml_element_size(kv_self->v_l[il]));
 
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, v_cur, v_cache_view));
+                v_run = ggml_transpose(ctx0, v_run);
+            }
+            //cb(v_cache_view, "v_cache_view", il);
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, v_run, v_cache_view));
+        }
     }
 
     const bool is_swa = hparams.is_swa(il);
@@ -1444,27 +1520,49 @@ ggml_tensor * llm_graph_context::build_attn(
     ggml_tensor * q = ggml_permute(ctx0, q_cur, 0, 2, 1, 3);
     //cb(q, "q", il);
 
-    ggml_tensor * k =
-        ggml_view_3d(ctx0, kv_self->k_l[il],
+    ggml_tensor * k = nullptr;
+    ggml_tensor * v = nullptr;
+
+    if (inp->get_kv_idxs()) {
+        // paged KV cache: gather the cells of the blocks of the ubatch sequences (as F32)
+        GGML_ASSERT(!v_trans);
+
+        ggml_tensor * k_rows = ggml_get_rows(ctx0, ggml_reshape_2d(ctx0, kv_self->k_l[il], n_embd_k_gqa, kv_self->size), inp->get_kv_idxs());
+        ggml_tensor * v_rows = ggml_get_rows(ctx0, ggml_reshape_2d(ctx0, kv_self->v_l[il], n_embd_v_gqa, kv_self->size), inp->get_kv_idxs());
+
+        k = ggml_view_3d(ctx0, k_rows,
                 n_embd_head_k, n_kv, n_head_kv,
-                ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa),
-                ggml_row_size(kv_self->k_l[il]->type, n_embd_head_k),
+                k_rows->nb[1],
+                ggml_row_size(k_rows->type, n_embd_head_k),
                 0);
-    //cb(k, "k", il);
 
-    ggml_tensor * v = !v_trans ?
-        ggml_view_3d(ctx0, kv_self->v_l[il],
+        v = ggml_view_3d(ctx0, v_rows,
                 n_embd_head_v, n_kv, n_head_kv,
-                ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa),
-                ggml_row_size(kv_self->v_l[il]->type, n_embd_head_v),
-                0) :
-        ggml_view_3d(ctx0, kv_self->v_l[il],
-                n_kv, n_embd_head_v, n_head_kv,
-                ggml_element_size(kv_self->v_l[il])*n_ctx,
-                ggml_element_size(kv_self->v_l[il])*n_ctx*n_embd_head_v,
+                v_rows->nb[1],
+                ggml_row_size(v_rows->type, n_embd_head_v),
+                0);
+    } else {
+        k = ggml_view_3d(ctx0, kv_self->k_l[il],
+                n_embd_head_k, n_kv, n_head_kv,
+                ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa),
+                ggml_row_size(kv_self->k_l[il]->type, n_embd_head_k),
                 0);
 
-    ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_trans, kq_scale);
+        v = !v_trans ?
+            ggml_view_3d(ctx0, kv_self->v_l[il],
+                    n_embd_head_v, n_kv, n_head_kv,
+                    ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa),
+                    ggml_row_size(kv_self->v_l[il]->type, n_embd_head_v),
+                    0) :
+            ggml_view_3d(ctx0, kv_self->v_l[il],
+                    n_kv, n_embd_head_v, n_head_kv,
+                    ggml_element_size(kv_self->v_l[il])*n_ctx,
+                    ggml_element_size(kv_self->v_l[il])*n_ctx*n_embd_head_v,
+                    0);
+    }
+    //cb(k, "k", il);
+
+    ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_trans, kq_scale, cparams.kv_scores);
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1549,7 +1647,7 @@ ggml_tensor * llm_graph_context::build_copy_mask_state(
          ggml_tensor * state_mask,
              int32_t   n_state,
              int32_t   n_seqs) const {
-    const llama_kv_cache_unified * kv_self = static_cast<const llama_kv_cache_unified *>(memory);
+    const llama_kv_cache_recurrent * kv_self = static_cast<const llama_kv_cache_recurrent *>(memory);
 
     const auto n_kv    = kv_self->n;
     const auto kv_head = kv_self->head;
@@ -1581,7 +1679,7 @@ ggml_tensor * llm_graph_context::build_rwkv_token_shift_load(
          ggml_tensor * state_mask,
   const llama_ubatch & ubatch,
                  int   il) const {
-    const llama_kv_cache_unified * kv_self = static_cast<const llama_kv_cache_unified *>(memory);
+    const llama_kv_cache_recurrent * kv_self = static_cast<const llama_kv_cache_recurrent *>(memory);
 
     const auto token_shift_count = hparams.token_shift_count;
 
@@ -1602,7 +1700,7 @@ ggml_tensor * llm_graph_context::build_rwkv_token_shift_store(
          ggml_tensor * token_shift,
   const llama_ubatch & ubatch,
                  int   il) const {
-    const llama_kv_cache_unified * kv_self = static_cast<const llama_kv_cache_unified *>(memory);
+    const llama_kv_cache_recurrent * kv_self = static_cast<const llama_kv_cache_recurrent *>(memory);
 
     const auto token_shift_count = hparams.token_shift_count;
     const auto n_embd = hparams.n_embd;
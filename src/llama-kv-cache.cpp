@@ -11,37 +11,121 @@
 #include <map>
 #include <stdexcept>
 
+//
+// llama_kv_seq_pos
+//
+
+static bool seq_pos_less(const llama_kv_seq_pos::entry & a, const llama_kv_seq_pos::entry & b) {
+    return a.first < b.first;
+}
+
+std::vector<llama_kv_seq_pos::entry>::iterator llama_kv_seq_pos::lower_bound(llama_pos p) {
+    return std::lower_bound(data.begin(), data.end(), entry { p, 0 }, seq_pos_less);
+}
+
+std::vector<llama_kv_seq_pos::entry>::const_iterator llama_kv_seq_pos::lower_bound(llama_pos p) const {
+    return std::lower_bound(data.begin(), data.end(), entry { p, 0 }, seq_pos_less);
+}
+
+void llama_kv_seq_pos::insert(llama_pos pos, uint32_t i) {
+    // the new cells usually come after the other cells of the sequence
+    if (data.empty() || data.back().first <= pos) {
+        data.emplace_back(pos, i);
+        return;
+    }
+
+    data.insert(std::upper_bound(data.begin(), data.end(), entry { pos, 0 }, seq_pos_less), { pos, i });
+}
+
+void llama_kv_seq_pos::erase(llama_pos pos, uint32_t i) {
+    for (auto it = lower_bound(pos); it != data.end() && it->first == pos; ++it) {
+        if (it->second == i) {
+            data.erase(it);
+            return;
+        }
+    }
+}
+
+void llama_kv_seq_pos::erase(llama_pos p0, llama_pos p1) {
+    if (p0 < p1) {
+        data.erase(lower_bound(p0), lower_bound(p1));
+    }
+}
+
+void llama_kv_seq_pos::move(llama_pos pos, uint32_t i_src, uint32_t i_dst) {
+    for (auto it = lower_bound(pos); it != data.end() && it->first == pos; ++it) {
+        if (it->second == i_src) {
+            it->second = i_dst;
+            return;
+        }
+    }
+}
+
+void llama_kv_seq_pos::sort() {
+    if (!std::is_sorted(data.begin(), data.end(), seq_pos_less)) {
+        std::sort(data.begin(), data.end(), seq_pos_less);
+    }
+}
+
+//
+// llama_kv_cache_unified
+//
+
 llama_kv_cache_unified::llama_kv_cache_unified(const llama_hparams & hparams, callbacks cbs) : hparams(hparams), cbs(std::move(cbs)) {
 }
 
 bool llama_kv_cache_unified::init(
-        const llama_model & model,
-      const llama_cparams & cparams,
-                ggml_type   type_k,
-                ggml_type   type_v,
-                 uint32_t   kv_size,
-                     bool   offload) {
+                   const llama_model & model,
+                 const llama_cparams & cparams,
+        const std::vector<ggml_type> & type_k,
+        const std::vector<ggml_type> & type_v,
+                            uint32_t   kv_size,
+                                bool   offload) {
     const int32_t n_layer = hparams.n_layer;
 
     has_shift = false;
 
-    recurrent = llama_model_is_recurrent(&model);
+    const bool recurrent = llama_model_is_recurrent(&model);
+
     v_trans   = !recurrent && !cparams.flash_attn;
     can_shift = !recurrent && model.arch != LLM_ARCH_DEEPSEEK2; // not supported due to MLA
 
     LLAMA_LOG_INFO("%s: kv_size = %d, offload = %d, type_k = '%s', type_v = '%s', n_layer = %d, can_shift = %d\n",
-            __func__, kv_size, offload, ggml_type_name(type_k), ggml_type_name(type_v), n_layer, can_shift);
+            __func__, kv_size, offload, ggml_type_name(type_k[0]), ggml_type_name(type_v[0]), n_layer, can_shift);
 
     head = 0;
     size = kv_size;
     used = 0;
 
-    this->type_k = type_k;
-    this->type_v = type_v;
-
     cells.clear();
     cells.resize(kv_size);
 
+    // the index of each sequence can hold all the cells, the sequences above n_seq_max grow it on demand
+    for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        seq_pos[s].clear();
+
+        if (!recurrent && s < (llama_seq_id) cparams.n_seq_max) {
+            seq_pos[s].reserve(kv_size);
+        }
+    }
+
+    // recurrent models keep one cell per sequence, there is nothing to page
+    n_block = recurrent ? 0 : cparams.n_kv_block;
+
+    blocks.clear();
+    block_tables.clear();
+
+    if (n_block > 0) {
+        if (kv_size % n_block != 0) {
+            LLAMA_LOG_ERROR("%s: kv_size = %u is not a multiple of the block size %u\n", __func__, kv_size, n_block);
+            return false;
+        }
+
+        blocks.resize(kv_size/n_block);
+
+        LLAMA_LOG_INFO("%s: paged, n_block = %u, %zu blocks\n", __func__, n_block, blocks.size());
+    }
+
     // create a context for each buffer type
     std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
     auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
@@ -86,8 +170,8 @@ bool llama_kv_cache_unified::init(
             buft = ggml_backend_cpu_buffer_type();
         }
 
-        LLAMA_LOG_DEBUG("%s: layer %3d: n_embd_k_gqa = %d, n_embd_v_gqa = %d, dev = %s\n", __func__,
-                i, n_embd_k_gqa, n_embd_v_gqa, dev_name);
+        LLAMA_LOG_DEBUG("%s: layer %3d: n_embd_k_gqa = %d, n_embd_v_gqa = %d, type_k = '%s', type_v = '%s', dev = %s\n", __func__,
+                i, n_embd_k_gqa, n_embd_v_gqa, ggml_type_name(type_k[i]), ggml_type_name(type_v[i]), dev_name);
 
         ggml_context * ctx = ctx_for_buft(buft);
         if (!ctx) {
@@ -95,8 +179,8 @@ bool llama_kv_cache_unified::init(
             return false;
         }
 
-        ggml_tensor * k = ggml_new_tensor_1d(ctx, type_k, n_embd_k_gqa*kv_size);
-        ggml_tensor * v = ggml_new_tensor_1d(ctx, type_v, n_embd_v_gqa*kv_size);
+        ggml_tensor * k = ggml_new_tensor_1d(ctx, type_k[i], n_embd_k_gqa*kv_size);
+        ggml_tensor * v = ggml_new_tensor_1d(ctx, type_v[i], n_embd_v_gqa*kv_size);
         ggml_format_name(k, "cache_k_l%d", i);
         ggml_format_name(v, "cache_v_l%d", i);
         k_l.push_back(k);
@@ -125,7 +209,7 @@ int32_t llama_kv_cache_unified::get_n_tokens() const {
     int32_t result = 0;
 
     for (uint32_t i = 0; i < size; i++) {
-        result += cells[i].seq_id.size();
+        result += cells[i].seq_id.count();
     }
 
     return result;
@@ -146,8 +230,11 @@ size_t llama_kv_cache_unified::total_size() const {
 
 llama_pos llama_kv_cache_unified::pos_max() const {
     llama_pos pos_max = -1;
-    for (const auto & cell : cells) {
-        pos_max = std::max(pos_max, cell.pos);
+
+    for (const auto & idx : seq_pos) {
+        if (!idx.empty()) {
+            pos_max = std::max(pos_max, idx.max());
+        }
     }
 
     return pos_max;
@@ -156,13 +243,24 @@ llama_pos llama_kv_cache_unified::pos_max() const {
 void llama_kv_cache_unified::clear() {
     for (int32_t i = 0; i < (int32_t) size; ++i) {
         cells[i].pos = -1;
-        cells[i].seq_id.clear();
+        cells[i].seq_id.reset();
         cells[i].src = -1;
         cells[i].tail = -1;
     }
     head = 0;
     used = 0;
 
+    for (auto & idx : seq_pos) {
+        idx.clear();
+    }
+
+    for (auto & block : blocks) {
+        block.seq_id.reset();
+    }
+    block_tables.clear();
+
+    copy_info.ids.clear();
+
     for (auto & buf : bufs) {
         ggml_backend_buffer_clear(buf.get(), 0);
     }
@@ -179,57 +277,37 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
         p1 = std::numeric_limits<llama_pos>::max();
     }
 
-    // models like Mamba or RWKV can't have a state partially erased
-    if (recurrent) {
-        if (seq_id >= (int64_t) size) {
-            // could be fatal
-            return false;
-        }
-        if (0 <= seq_id) {
-            int32_t & tail_id = cells[seq_id].tail;
-            if (tail_id >= 0) {
-                const llama_kv_cell & cell = cells[tail_id];
-                // partial intersection is invalid
-                if ((0 < p0 && p0 <= cell.pos) || (0 < p1 && p1 <= cell.pos)) {
-                    return false;
-                }
-                // invalidate tails which will be cleared
-                if (p0 <= cell.pos && cell.pos < p1) {
-                    tail_id = -1;
-                }
-            }
+    // range of the modified cells
+    uint32_t c0 = size;
+    uint32_t c1 = 0;
+
+    for (const uint32_t i : seq_cells(seq_id, p0, p1)) {
+        if (seq_id < 0) {
+            cells[i].seq_id.reset();
         } else {
-            // seq_id is negative, then the range should include everything or nothing
-            if (p0 != p1 && (p0 != 0 || p1 != std::numeric_limits<llama_pos>::max())) {
-                return false;
-            }
+            cells[i].seq_id.reset(seq_id);
         }
 
-        return true;
-    }
+        c0 = std::min(c0, i);
+        c1 = std::max(c1, i + 1);
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].pos >= p0 && cells[i].pos < p1) {
-            if (seq_id < 0) {
-                cells[i].seq_id.clear();
-            } else if (cells[i].has_seq_id(seq_id)) {
-                cells[i].seq_id.erase(seq_id);
-            } else {
-                continue;
+        if (cells[i].is_empty()) {
+            // keep count of the number of used cells
+            if (cells[i].pos >= 0) {
+                used--;
             }
-            if (cells[i].is_empty()) {
-                // keep count of the number of used cells
-                if (cells[i].pos >= 0) {
-                    used--;
-                }
 
-                cells[i].pos = -1;
-                cells[i].src = -1;
+            cells[i].pos = -1;
+            cells[i].src = -1;
 
-                if (new_head == size) {
-                    new_head = i;
-                }
-            }
+            new_head = std::min(new_head, i);
+        }
+    }
+
+    // all the cells in [p0, p1) of the sequences are removed
+    for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        if (seq_id < 0 || s == seq_id) {
+            seq_pos[s].erase(p0, p1);
         }
     }
 
@@ -238,6 +316,8 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
         head = new_head;
     }
 
+    blocks_update(c0, c1);
+
     return true;
 }
 
@@ -246,6 +326,8 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
         return;
     }
 
+    GGML_ASSERT(seq_id_dst >= 0 && seq_id_dst < LLAMA_MAX_SEQ);
+
     if (p0 < 0) {
         p0 = 0;
     }
@@ -254,52 +336,30 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
         p1 = std::numeric_limits<llama_pos>::max();
     }
 
-    if (recurrent) {
-        if ((uint32_t) seq_id_dst < size && (uint32_t) seq_id_src < size) {
-            llama_kv_cell & tail_src = cells[seq_id_src];
-            llama_kv_cell & tail_dst = cells[seq_id_dst];
-            if (tail_dst.tail >= 0) {
-                // clear destination seq_id if it wasn't empty
-                llama_kv_cell & cell_dst = cells[tail_dst.tail];
-
-                cell_dst.seq_id.erase(seq_id_dst);
-                tail_dst.tail = -1;
-                if (cell_dst.seq_id.empty()) {
-                    cell_dst.pos = -1;
-                    cell_dst.delta = -1;
-                    cell_dst.src = -1;
-                    used -= 1;
-                }
-            }
-            if (tail_src.tail >= 0) {
-                llama_kv_cell & cell_src = cells[tail_src.tail];
+    head = 0;
 
-                cell_src.seq_id.insert(seq_id_dst);
-                tail_dst.tail = tail_src.tail;
-            }
-        }
+    uint32_t c0 = size;
+    uint32_t c1 = 0;
 
-        return;
-    }
+    for (const uint32_t i : seq_cells(seq_id_src, p0, p1)) {
+        if (cells[i].seq_id.test(seq_id_dst)) {
+            continue;
+        }
 
-    // otherwise, this is the KV of a Transformer-like model
-    head = 0;
+        cells[i].seq_id.set(seq_id_dst);
+        seq_pos_add(i, seq_id_dst);
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id_src) && cells[i].pos >= p0 && cells[i].pos < p1) {
-            cells[i].seq_id.insert(seq_id_dst);
-        }
+        c0 = std::min(c0, i);
+        c1 = std::max(c1, i + 1);
     }
+
+    blocks_update(c0, c1);
 }
 
 void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
     uint32_t new_head = size;
 
     for (uint32_t i = 0; i < size; ++i) {
-        if (recurrent && (llama_seq_id) i != seq_id) {
-            cells[i].tail = -1;
-        }
-
         if (!cells[i].has_seq_id(seq_id)) {
             if (cells[i].pos >= 0) {
                 used--;
@@ -307,14 +367,20 @@ void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
 
             cells[i].pos = -1;
             cells[i].src = -1;
-            cells[i].seq_id.clear();
+            cells[i].seq_id.reset();
 
             if (new_head == size){
                 new_head = i;
             }
         } else {
-            cells[i].seq_id.clear();
-            cells[i].seq_id.insert(seq_id);
+            cells[i].seq_id.reset();
+            cells[i].seq_id.set(seq_id);
+        }
+    }
+
+    for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        if (s != seq_id) {
+            seq_pos[s].clear();
         }
     }
 
@@ -322,11 +388,25 @@ void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
     if (new_head != size && new_head < head) {
         head = new_head;
     }
+
+    blocks_update(0, size);
+}
+
+template <typename F>
+bool llama_kv_cache_unified::cow_fits(const std::vector<uint32_t> & ids, F && skip) const {
+    uint32_t n_cow = 0;
+    for (uint32_t i : ids) {
+        if (cells[i].seq_id.count() > 1 && !skip(i)) {
+            n_cow++;
+        }
+    }
+
+    return n_cow <= size - used;
 }
 
-void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
+bool llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
     if (delta == 0) {
-        return;
+        return true;
     }
 
     uint32_t new_head = size;
@@ -341,50 +421,64 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
 
     // If there is no range then return early to avoid looping over the
     if (p0 == p1) {
-        return;
+        return true;
     }
 
-    if (recurrent) {
-        // for Mamba-like or RWKV models, only the pos needs to be shifted
-        if (0 <= seq_id && seq_id < (int64_t) size) {
-            const int32_t tail_id = cells[seq_id].tail;
-            if (tail_id >= 0) {
-                llama_kv_cell & cell = cells[tail_id];
-                if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
-                    cell.pos += delta;
-                }
-            }
-        }
-        return;
+    // the cells are collected first, copy-on-write can add cells that must not be visited
+    std::vector<uint32_t> ids = seq_cells(seq_id, p0, p1);
+
+    // the cells that are shifted out are not copied
+    if (!cow_fits(ids, [&](uint32_t i) { return cells[i].pos + delta < 0; })) {
+        LLAMA_LOG_WARN("%s: no free cells to copy the shared cells of seq_id %d, the positions are not changed\n", __func__, seq_id);
+        return false;
     }
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id) && cells[i].pos >= p0 && cells[i].pos < p1) {
-            has_shift = true;
-            cells[i].pos   += delta;
-            cells[i].delta += delta;
-
-            if (cells[i].pos < 0) {
-                if (!cells[i].is_empty()) {
-                    used--;
-                }
+    // range of the cells that are shifted out
+    uint32_t c0 = size;
+    uint32_t c1 = 0;
+
+    for (uint32_t & i : ids) {
+        if (cells[i].pos + delta < 0) {
+            if (cells[i].seq_id.count() > 1) {
+                // the other sequences keep the cell
+                cells[i].seq_id.reset(seq_id);
+            } else {
+                used--;
                 cells[i].pos = -1;
-                cells[i].seq_id.clear();
-                if (new_head == size) {
-                    new_head = i;
-                }
+                cells[i].seq_id.reset();
+                new_head = std::min(new_head, i);
             }
+
+            c0 = std::min(c0, i);
+            c1 = std::max(c1, i + 1);
+
+            // the cell can be taken by cell_cow for one of the next cells, it must not be indexed again
+            i = size;
+
+            continue;
         }
+
+        i = cell_cow(i, seq_id);
+
+        has_shift = true;
+        cells[i].pos   += delta;
+        cells[i].delta += delta;
     }
 
+    seq_pos_update(seq_id, p0, p1, ids);
+
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     head = new_head != size ? new_head : 0;
+
+    blocks_update(c0, c1);
+
+    return true;
 }
 
-void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+bool llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
     if (d == 1) {
-        return;
+        return true;
     }
 
     if (p0 < 0) {
@@ -397,53 +491,53 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
 
     // If there is no range then return early to avoid looping over the cache.
     if (p0 == p1) {
-        return;
+        return true;
     }
 
-    if (recurrent) {
-        // for Mamba-like or RWKV models, only the pos needs to be changed
-        if (0 <= seq_id && seq_id < (int64_t) size) {
-            const int32_t tail_id = cells[seq_id].tail;
-            if (tail_id >= 0) {
-                llama_kv_cell & cell = cells[tail_id];
-                if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
-                    cell.pos /= d;
-                }
-            }
-        }
+    // the cells are collected first, copy-on-write can add cells that must not be visited
+    std::vector<uint32_t> ids = seq_cells(seq_id, p0, p1);
 
-        return;
+    if (!cow_fits(ids, [](uint32_t) { return false; })) {
+        LLAMA_LOG_WARN("%s: no free cells to copy the shared cells of seq_id %d, the positions are not changed\n", __func__, seq_id);
+        return false;
     }
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id) && cells[i].pos >= p0 && cells[i].pos < p1) {
-            has_shift = true;
+    for (uint32_t & i : ids) {
+        i = cell_cow(i, seq_id);
 
-            {
-                llama_pos p_old = cells[i].pos;
-                cells[i].pos   /= d;
-                cells[i].delta += cells[i].pos - p_old;
-            }
+        has_shift = true;
+
+        {
+            llama_pos p_old = cells[i].pos;
+            cells[i].pos   /= d;
+            cells[i].delta += cells[i].pos - p_old;
         }
     }
+
+    seq_pos_update(seq_id, p0, p1, ids);
+
+    return true;
 }
 
 llama_pos llama_kv_cache_unified::seq_pos_max(llama_seq_id seq_id) const {
     llama_pos result = 0;
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id)) {
-            result = std::max(result, cells[i].pos);
-        }
+    if (seq_id >= 0 && seq_id < LLAMA_MAX_SEQ && !seq_pos[seq_id].empty()) {
+        result = std::max(result, seq_pos[seq_id].max());
     }
 
     return result;
 }
 
+llama_pos llama_kv_cache_unified::seq_pos_rollback(llama_seq_id seq_id, llama_pos pos) const {
+    GGML_UNUSED(seq_id);
+
+    // any cells can be removed
+    return pos;
+}
+
 void llama_kv_cache_unified::defrag() {
-    if (!recurrent) {
-        do_defrag = true;
-    }
+    do_defrag = true;
 }
 
 void llama_kv_cache_unified::restore() {
@@ -451,17 +545,13 @@ void llama_kv_cache_unified::restore() {
         return;
     }
 
-    // TODO: tmp - move to llama_kv_cache_recurrent
-    if (recurrent) {
-        seq_rm(-1, -1, -1);
-        return;
-    }
-
     uint32_t new_head = size;
 
     for (auto & range : pending.ranges) {
         for (uint32_t i = range.c0; i < range.c1; ++i) {
-            cells[i].seq_id.clear();
+            seq_pos_rm(i, -1);
+
+            cells[i].seq_id.reset();
 
             // keep count of the number of used cells
             if (cells[i].pos >= 0) {
@@ -473,6 +563,8 @@ void llama_kv_cache_unified::restore() {
         }
 
         new_head = std::min(new_head, range.c0);
+
+        blocks_update(range.c0, range.c1);
     }
 
     if (new_head != size && new_head < head) {
@@ -481,11 +573,6 @@ void llama_kv_cache_unified::restore() {
 }
 
 void llama_kv_cache_unified::commit() {
-    // TODO: tmp - move to llama_kv_cache_recurrent
-    if (recurrent) {
-        return;
-    }
-
     if (pending.ranges.empty()) {
         LLAMA_LOG_WARN("%s: no pending KV cache updates to commit - might indicate a bug (ref: %s)\n",
                 __func__, "https://github.com/ggml-org/llama.cpp/pull/12695");
@@ -499,188 +586,131 @@ bool llama_kv_cache_unified::get_can_shift() const {
     return can_shift;
 }
 
-bool llama_kv_cache_unified::find_slot(
-       const llama_ubatch & ubatch) {
-    const uint32_t n_tokens = ubatch.n_tokens;
-    const uint32_t n_seqs   = ubatch.n_seqs;
-    const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
+int32_t llama_kv_cache_unified::seq_evict(llama_seq_id seq_id, int32_t n_sink, int32_t n_heavy, int32_t n_recent, llama_pos * pos_kept) {
+    if (!can_shift || seq_id < 0 || seq_id >= LLAMA_MAX_SEQ) {
+        return -1;
+    }
 
-    // if we have enough unused cells before the current head ->
-    //   better to start searching from the beginning of the cache, hoping to fill it
-    if (head > used + 2*ubatch.n_tokens) {
-        head = 0;
+    // cells of the sequence, ordered by position
+    const std::vector<llama_kv_seq_pos::entry> cur = seq_pos[seq_id].data;
+
+    const int32_t n_cur = cur.size();
+
+    n_sink   = std::min(std::max(n_sink,   0), n_cur);
+    n_recent = std::min(std::max(n_recent, 0), n_cur - n_sink);
+
+    std::vector<bool> keep(n_cur, false);
+
+    for (int32_t k = 0; k < n_sink; ++k) {
+        keep[k] = true;
     }
 
-    if (recurrent) {
-        // For recurrent state architectures (like Mamba or RWKV),
-        // each cache cell can store the state for a whole sequence.
-        // A slot should be always be contiguous.
+    for (int32_t k = n_cur - n_recent; k < n_cur; ++k) {
+        keep[k] = true;
+    }
 
-        // can only process batches with an equal number of new tokens in each sequence
-        GGML_ASSERT(ubatch.equal_seqs);
+    // the heavy hitters among the cells in between, ties go to the more recent cells
+    {
+        std::vector<int32_t> mid;
+        for (int32_t k = n_sink; k < n_cur - n_recent; ++k) {
+            mid.push_back(k);
+        }
 
-        int32_t min = size - 1;
-        int32_t max = 0;
+        n_heavy = std::min(std::max(n_heavy, 0), (int32_t) mid.size());
 
-        // everything should fit if all seq_ids are smaller than the max
-        for (uint32_t s = 0; s < n_seqs; ++s) {
-            const uint32_t n_seq_id = ubatch.n_seq_id[s];
-            for (uint32_t j = 0; j < n_seq_id; ++j) {
-                const llama_seq_id seq_id = ubatch.seq_id[s][j];
+        std::partial_sort(mid.begin(), mid.begin() + n_heavy, mid.end(), [&](int32_t a, int32_t b) {
+            const float sa = cells[cur[a].second].score;
+            const float sb = cells[cur[b].second].score;
 
-                if (seq_id < 0 || (uint32_t) seq_id >= size) {
-                    // too big seq_id
-                    // TODO: would it be possible to resize the cache instead?
-                    LLAMA_LOG_ERROR("%s: seq_id=%d >= n_seq_max=%d Try using a bigger --parallel value\n", __func__, seq_id, size);
-                    return false;
-                }
-                if (j > 0) {
-                    llama_kv_cell & seq = cells[seq_id];
-                    if (seq.tail >= 0) {
-                        llama_kv_cell & cell = cells[seq.tail];
-                        // clear cells from seq_ids that become shared
-                        // (should not normally happen, but let's handle it anyway)
-                        cell.seq_id.erase(seq_id);
-                        seq.tail = -1;
-                        if (cell.seq_id.empty()) {
-                            cell.pos = -1;
-                            cell.src = -1;
-                            used -= 1;
-                        }
-                    }
-                }
-            }
+            return sa != sb ? sa > sb : a > b;
+        });
+
+        for (int32_t k = 0; k < n_heavy; ++k) {
+            keep[mid[k]] = true;
         }
+    }
 
-#ifndef NDEBUG
-        {
-            std::vector<int32_t> tails_verif;
-            tails_verif.assign(size, -1);
-            for (uint32_t i = 0; i < size; ++i) {
-                llama_kv_cell & cell = cells[i];
-                for (llama_seq_id seq_id : cell.seq_id) {
-                    if (tails_verif[seq_id] != -1) {
-                        LLAMA_LOG_ERROR("%s: duplicate tail for seq_id %d in cell %d and %d\n", __func__, seq_id, i, tails_verif[seq_id]);
-                    }
-                    tails_verif[seq_id] = i;
-                }
-            }
-            for (uint32_t i = 0; i < size; ++i) {
-                if (tails_verif[i] != cells[i].tail) {
-                    LLAMA_LOG_ERROR("%s: wrong tail for seq_id %d, (%d instead of %d)\n", __func__, i, cells[i].tail, tails_verif[i]);
-                }
+    // the kept cells that are shared with other sequences are copied when they are shifted
+    {
+        std::vector<uint32_t> ids;
+        for (int32_t k = 0; k < n_cur; ++k) {
+            if (keep[k]) {
+                ids.push_back(cur[k].second);
             }
         }
-#endif
 
-        // find next empty cell
-        uint32_t next_empty_cell = head;
-
-        for (uint32_t i = 0; i < size; ++i) {
-            if (next_empty_cell >= size) { next_empty_cell -= size; }
-            llama_kv_cell & cell = cells[next_empty_cell];
-            if (cell.is_empty()) { break; }
-            next_empty_cell += 1;
+        if (!cow_fits(ids, [](uint32_t) { return false; })) {
+            LLAMA_LOG_WARN("%s: no free cells to copy the shared cells of seq_id %d\n", __func__, seq_id);
+            return -1;
         }
+    }
 
-        // find usable cell range
-        for (uint32_t s = 0; s < n_seqs; ++s) {
-            const llama_seq_id seq_id = ubatch.seq_id[s][0];
-            llama_kv_cell & seq_meta = cells[seq_id];
-            bool has_cell = false;
-            if (seq_meta.tail >= 0) {
-                llama_kv_cell & cell = cells[seq_meta.tail];
-                GGML_ASSERT(cell.has_seq_id(seq_id));
-                // does this seq_id "own" the cell?
-                if (cell.seq_id.size() == 1) { has_cell = true; }
-            }
-            if (!has_cell) {
-                llama_kv_cell & empty_cell = cells[next_empty_cell];
-                GGML_ASSERT(empty_cell.is_empty());
-                // copy old tail into the empty cell
-                if (seq_meta.tail >= 0) {
-                    llama_kv_cell & orig_cell = cells[seq_meta.tail];
-                    empty_cell.pos = orig_cell.pos;
-                    empty_cell.src = orig_cell.src;
-                    orig_cell.seq_id.erase(seq_id);
-                    empty_cell.seq_id.insert(seq_id); // will be overwritten
-                }
-                seq_meta.tail = next_empty_cell;
-                // find next empty cell
-                if (s + 1 < n_seqs) {
-                    next_empty_cell += 1;
-                    for (uint32_t i = 0; i < size; ++i) {
-                        if (next_empty_cell >= size) { next_empty_cell -= size; }
-                        llama_kv_cell & cell = cells[next_empty_cell];
-                        if (cell.is_empty()) { break; }
-                        next_empty_cell += 1;
-                    }
-                }
-            }
-            if (min > seq_meta.tail) { min = seq_meta.tail; }
-            if (max < seq_meta.tail) { max = seq_meta.tail; }
+    // remove the runs of evicted cells and shift the runs of kept cells to close the gaps, from left to right
+    int32_t n_kept = 0;
+
+    llama_pos p_next = n_cur > 0 ? cur[0].first : 0;
+
+    for (int32_t k0 = 0; k0 < n_cur; ) {
+        int32_t k1 = k0 + 1;
+        while (k1 < n_cur && keep[k1] == keep[k0]) {
+            k1++;
         }
 
-        // gather and re-order
-        for (uint32_t s = 0; s < n_seqs; ++s) {
-            int32_t dst_id = s + min;
-            int32_t src_id = cells[ubatch.seq_id[s][0]].tail;
-            if (dst_id != src_id) {
-                llama_kv_cell & dst_cell = cells[dst_id];
-                llama_kv_cell & src_cell = cells[src_id];
+        const llama_pos p0 = cur[k0].first;
+        const llama_pos p1 = cur[k1 - 1].first + 1;
 
-                std::swap(dst_cell.pos, src_cell.pos);
-                std::swap(dst_cell.src, src_cell.src);
-                std::swap(dst_cell.seq_id, src_cell.seq_id);
+        if (keep[k0]) {
+            seq_add(seq_id, p0, p1, p_next - p0);
 
-                // swap tails (assuming they NEVER overlap)
-                for (const llama_seq_id seq_id : src_cell.seq_id) {
-                    cells[seq_id].tail = src_id;
-                }
-                for (const llama_seq_id seq_id : dst_cell.seq_id) {
-                    cells[seq_id].tail = dst_id;
+            for (int32_t k = k0; k < k1; ++k) {
+                if (pos_kept) {
+                    pos_kept[n_kept] = cur[k].first;
                 }
+                n_kept++;
             }
+
+            p_next += p1 - p0;
+        } else {
+            seq_rm(seq_id, p0, p1);
         }
 
-        // update the pos of the used seqs
-        for (uint32_t s = 0; s < n_seqs; ++s) {
-            const llama_pos last_pos = ubatch.pos[n_seq_tokens * s + n_seq_tokens - 1];
-            int32_t cell_id = s + min;
-            llama_kv_cell & cell = cells[cell_id];
+        k0 = k1;
+    }
 
-            if (cell.pos >= 0 && last_pos != cell.pos + (llama_pos) n_seq_tokens) {
-                // What should happen when the pos backtracks or skips a value?
-                // Clearing the state mid-batch would require special-casing which isn't done.
-                LLAMA_LOG_WARN("%s: non-consecutive token position %d after %d for sequence %d with %u new tokens\n",
-                    __func__, last_pos, cell.pos, ubatch.seq_id[s][0], n_seq_tokens);
-            }
-            cell.pos = last_pos;
-            cell.seq_id.clear();
-            for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
-                const llama_seq_id seq_id = ubatch.seq_id[s][j];
-                cell.seq_id.insert(seq_id);
-                cells[seq_id].tail = cell_id;
-            }
-        }
+    return n_kept;
+}
 
-        // allow getting the range of used cells, from head to head + n
-        head = min;
-        n    = max - min + 1;
-        used = std::count_if(cells.begin(), cells.end(),
-            [](const llama_kv_cell& cell){ return !cell.is_empty(); });
+void llama_kv_cache_unified::score_add(const float * scores, uint32_t n) {
+    for (uint32_t j = 0; j < n; ++j) {
+        const uint32_t i = cell_id(j);
 
-        // sanity check
-        return n >= n_seqs;
+        if (i < size) {
+            cells[i].score += scores[j];
+        }
     }
+}
+
+bool llama_kv_cache_unified::find_slot(
+       const llama_ubatch & ubatch) {
+    const uint32_t n_tokens = ubatch.n_tokens;
+    const uint32_t n_seqs   = ubatch.n_seqs;
+    const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
 
-    // otherwise, one cell per token.
+    // if we have enough unused cells before the current head ->
+    //   better to start searching from the beginning of the cache, hoping to fill it
+    if (head > used + 2*ubatch.n_tokens) {
+        head = 0;
+    }
 
     if (n_tokens > size) {
         LLAMA_LOG_ERROR("%s: n_tokens = %d > size = %d\n", __func__, n_tokens, size);
         return false;
     }
 
+    if (n_block > 0) {
+        return find_slot_paged(ubatch);
+    }
+
     uint32_t n_tested = 0;
 
     while (true) {
@@ -713,10 +743,12 @@ bool llama_kv_cache_unified::find_slot(
     for (uint32_t s = 0; s < n_seqs; s++) {
         for (uint32_t i = 0; i < n_seq_tokens; ++i) {
             uint32_t k = s*n_seq_tokens + i;
-            cells[head + k].pos = ubatch.pos[k];
+            cells[head + k].pos   = ubatch.pos[k];
+            cells[head + k].score = 0.0f;
 
             for (int32_t j = 0; j < ubatch.n_seq_id[s]; j++) {
-                cells[head + k].seq_id.insert(ubatch.seq_id[s][j]);
+                cells[head + k].seq_id.set(ubatch.seq_id[s][j]);
+                seq_pos_add(head + k, ubatch.seq_id[s][j]);
             }
         }
     }
@@ -728,29 +760,324 @@ bool llama_kv_cache_unified::find_slot(
     return true;
 }
 
-uint32_t llama_kv_cache_unified::get_padding(const llama_cparams & cparams) const {
-    // the FA kernels require padding to avoid extra runtime boundary checks
-    return cparams.flash_attn ? 256u : 32u;
-}
-
-uint32_t llama_kv_cache_unified::cell_max() const {
-    for (uint32_t i = size; i > 0; --i) {
-        const llama_kv_cell & cell = cells[i - 1];
+bool llama_kv_cache_unified::find_slot_paged(const llama_ubatch & ubatch) {
+    const uint32_t n_tokens     = ubatch.n_tokens;
+    const uint32_t n_seqs       = ubatch.n_seqs;
+    const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
 
-        if (cell.pos >= 0 && !cell.is_empty()) {
-            return i;
-        }
+    // any empty cell can be used, so the slot fits as long as there are enough of them
+    if (used + n_tokens > size) {
+        return false;
     }
 
-    return 0;
-}
+    slot_cells.resize(n_tokens);
 
-size_t llama_kv_cache_unified::size_k_bytes() const {
-    size_t size_k_bytes = 0;
+    // the searches below only move forward within the ubatch
+    uint32_t b_free = 0; // blocks before b_free are in use
+    uint32_t i_free = 0; // cells before i_free are in use
 
-    for (const auto & k : k_l) {
-        size_k_bytes += ggml_nbytes(k);
-    }
+    for (uint32_t s = 0; s < n_seqs; s++) {
+        const llama_seq_id seq_id = ubatch.seq_id[s][0];
+
+        for (uint32_t i = 0; i < n_seq_tokens; ++i) {
+            const uint32_t k = s*n_seq_tokens + i;
+
+            const uint32_t cell_id = find_empty_cell(seq_id, b_free, i_free);
+
+            GGML_ASSERT(cell_id < size);
+
+            llama_kv_cell & cell = cells[cell_id];
+            llama_kv_block & block = blocks[cell_id/n_block];
+
+            cell.pos   = ubatch.pos[k];
+            cell.score = 0.0f;
+
+            for (int32_t j = 0; j < ubatch.n_seq_id[s]; j++) {
+                const llama_seq_id id = ubatch.seq_id[s][j];
+
+                cell.seq_id.set(id);
+                seq_pos_add(cell_id, id);
+
+                if (!block.seq_id.test(id)) {
+                    block.seq_id.set(id);
+                    block_tables[id].push_back(cell_id/n_block);
+                }
+            }
+
+            slot_cells[k] = cell_id;
+
+            if (!pending.ranges.empty() && pending.ranges.back().c1 == cell_id) {
+                pending.ranges.back().c1++;
+            } else {
+                pending.ranges.push_back({cell_id, cell_id + 1});
+            }
+        }
+    }
+
+    used += n_tokens;
+
+    return true;
+}
+
+uint32_t llama_kv_cache_unified::find_empty_cell(llama_seq_id seq_id, uint32_t & b_free, uint32_t & i_free) const {
+    if (n_block > 0) {
+        // the next empty cell in the last block of the sequence
+        const auto it = block_tables.find(seq_id);
+        if (it != block_tables.end() && !it->second.empty()) {
+            const uint32_t b = it->second.back();
+
+            for (uint32_t i = b*n_block; i < (b + 1)*n_block; ++i) {
+                if (cells[i].is_empty()) {
+                    return i;
+                }
+            }
+        }
+
+        // otherwise the lowest free block, to keep the used cells at the start of the cache
+        for (; b_free < blocks.size(); ++b_free) {
+            if (blocks[b_free].seq_id.none()) {
+                return b_free*n_block;
+            }
+        }
+    }
+
+    // otherwise any empty cell, with a paged cache the remaining free cells are in the blocks of other sequences
+    for (; i_free < size; ++i_free) {
+        if (cells[i_free].is_empty()) {
+            return i_free;
+        }
+    }
+
+    return size;
+}
+
+uint32_t llama_kv_cache_unified::cell_cow(uint32_t i, llama_seq_id seq_id) {
+    if (cells[i].seq_id.count() < 2) {
+        return i;
+    }
+
+    uint32_t b_free = 0;
+    uint32_t i_free = 0;
+
+    // shifting the cell in place would change the positions of all its sequences
+    const uint32_t j = find_empty_cell(seq_id, b_free, i_free);
+    GGML_ASSERT(j != size && "no free cell for copy-on-write, check cow_fits first");
+
+    cells[j].pos   = cells[i].pos;
+    cells[j].delta = cells[i].delta;
+    cells[j].score = cells[i].score;
+    cells[j].seq_id.set(seq_id);
+    cells[i].seq_id.reset(seq_id);
+
+    used++;
+
+    // the data is copied by the next update, before a K-shift
+    copy_info.ids.emplace_back(i, j);
+
+    if (n_block > 0) {
+        block_update(i/n_block);
+        block_update(j/n_block);
+    }
+
+    return j;
+}
+
+void llama_kv_cache_unified::seq_pos_add(uint32_t i, llama_seq_id seq_id) {
+    if (seq_id >= 0) {
+        seq_pos[seq_id].insert(cells[i].pos, i);
+        return;
+    }
+
+    for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        if (cells[i].seq_id.test(s)) {
+            seq_pos[s].insert(cells[i].pos, i);
+        }
+    }
+}
+
+void llama_kv_cache_unified::seq_pos_rm(uint32_t i, llama_seq_id seq_id) {
+    if (seq_id >= 0) {
+        seq_pos[seq_id].erase(cells[i].pos, i);
+        return;
+    }
+
+    for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        if (cells[i].seq_id.test(s)) {
+            seq_pos[s].erase(cells[i].pos, i);
+        }
+    }
+}
+
+void llama_kv_cache_unified::seq_pos_update(llama_seq_id seq_id, llama_pos p0, llama_pos p1, const std::vector<uint32_t> & ids) {
+    for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        if (seq_id >= 0 && s != seq_id) {
+            continue;
+        }
+
+        auto & idx = seq_pos[s];
+
+        const auto it0 = idx.lower_bound(p0);
+        const auto it1 = std::max(it0, idx.lower_bound(p1));
+
+        GGML_ASSERT(seq_id < 0 || it1 - it0 == (ptrdiff_t) ids.size());
+
+        // rewrite the range in place, the cells of other sequences keep their positions
+        auto out = it0;
+        for (auto it = it0; it != it1; ++it) {
+            const uint32_t i = seq_id >= 0 ? ids[it - it0] : it->second;
+
+            if (i < size && cells[i].has_seq_id(s)) {
+                *out++ = { cells[i].pos, i };
+            }
+        }
+
+        idx.data.erase(out, it1);
+        idx.sort();
+    }
+}
+
+std::vector<uint32_t> llama_kv_cache_unified::seq_cells(llama_seq_id seq_id, llama_pos p0, llama_pos p1) const {
+    std::vector<uint32_t> res;
+
+    if (seq_id >= LLAMA_MAX_SEQ) {
+        return res;
+    }
+
+    if (seq_id < 0) {
+        for (uint32_t i = 0; i < size; ++i) {
+            if ((seq_id < 0 ? !cells[i].is_empty() : cells[i].has_seq_id(seq_id)) && cells[i].pos >= p0 && cells[i].pos < p1) {
+                res.push_back(i);
+            }
+        }
+
+        return res;
+    }
+
+    const auto & idx = seq_pos[seq_id];
+
+    for (auto it = idx.lower_bound(p0); it != idx.data.end() && it->first < p1; ++it) {
+        res.push_back(it->second);
+    }
+
+    return res;
+}
+
+void llama_kv_cache_unified::block_update(uint32_t b) {
+    llama_seq_mask seq_id;
+    for (uint32_t i = b*n_block; i < (b + 1)*n_block; ++i) {
+        seq_id |= cells[i].seq_id;
+    }
+
+    auto & block = blocks[b];
+
+    const llama_seq_mask changed = seq_id ^ block.seq_id;
+
+    for (llama_seq_id id = 0; changed.any() && id < LLAMA_MAX_SEQ; ++id) {
+        if (!changed.test(id)) {
+            continue;
+        }
+
+        if (seq_id.test(id)) {
+            block_tables[id].push_back(b);
+        } else {
+            auto & table = block_tables[id];
+            table.erase(std::find(table.begin(), table.end(), b));
+            if (table.empty()) {
+                block_tables.erase(id);
+            }
+        }
+    }
+
+    block.seq_id = seq_id;
+}
+
+void llama_kv_cache_unified::blocks_update(uint32_t c0, uint32_t c1) {
+    if (n_block == 0 || c0 >= c1) {
+        return;
+    }
+
+    for (uint32_t b = c0/n_block; b <= (c1 - 1)/n_block; ++b) {
+        block_update(b);
+    }
+}
+
+bool llama_kv_cache_unified::gather_prepare(const llama_ubatch & ubatch, uint32_t pad) {
+    auto & ids = gather_info.ids;
+
+    ids.clear();
+
+    // the gathered cells are rows of the K and V tensors, a transposed V cannot be gathered
+    if (n_block == 0 || v_trans) {
+        return false;
+    }
+
+    std::vector<bool> used_block(blocks.size(), false);
+    uint32_t n_used_blocks = 0;
+
+    for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
+        for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
+            const auto it = block_tables.find(ubatch.seq_id[s][j]);
+            if (it == block_tables.end()) {
+                continue;
+            }
+
+            for (const uint32_t b : it->second) {
+                if (!used_block[b]) {
+                    used_block[b] = true;
+                    n_used_blocks++;
+                }
+            }
+        }
+    }
+
+    const uint32_t n_gather = GGML_PAD(n_used_blocks*n_block, pad);
+
+    // the gather copies the K and V rows, it is only worth it if most of the cells [0, n) are skipped
+    if (4*n_gather > n) {
+        return false;
+    }
+
+    ids.reserve(n_gather);
+
+    for (uint32_t b = 0; b < blocks.size(); ++b) {
+        if (used_block[b]) {
+            for (uint32_t i = b*n_block; i < (b + 1)*n_block; ++i) {
+                ids.push_back(i);
+            }
+        }
+    }
+
+    // the padding is masked
+    ids.resize(n_gather, size);
+
+    n = n_gather;
+
+    return true;
+}
+
+uint32_t llama_kv_cache_unified::get_padding(const llama_cparams & cparams) const {
+    // the FA kernels require padding to avoid extra runtime boundary checks
+    return cparams.flash_attn ? 256u : 32u;
+}
+
+uint32_t llama_kv_cache_unified::cell_max() const {
+    for (uint32_t i = size; i > 0; --i) {
+        const llama_kv_cell & cell = cells[i - 1];
+
+        if (cell.pos >= 0 && !cell.is_empty()) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+size_t llama_kv_cache_unified::size_k_bytes() const {
+    size_t size_k_bytes = 0;
+
+    for (const auto & k : k_l) {
+        size_k_bytes += ggml_nbytes(k);
+    }
 
     return size_k_bytes;
 }
@@ -765,7 +1092,7 @@ size_t llama_kv_cache_unified::size_v_bytes() const {
     return size_v_bytes;
 }
 
-bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
+bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes, uint32_t max_cells) {
     const uint32_t n_layer = hparams.n_layer;
 
     const uint32_t n_kv   = cell_max();
@@ -775,9 +1102,12 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
 
     //const int64_t t_start = ggml_time_us();
 
-    // number of cells moved
+    // number of cell runs moved
     uint32_t n_moves = 0;
 
+    // number of cells moved
+    uint32_t n_cells = 0;
+
     // each move requires 6*n_layer tensors (see graph_build_kv_self_defrag)
     //   - source view, destination view, copy operation
     //   - x2 for keys and values
@@ -796,6 +1126,8 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
     ids.clear();
     ids.resize(n_kv, n_kv);
 
+    defrag_info.complete = true;
+
     for (uint32_t i0 = 0; i0 < n_used; ++i0) {
         const auto & cell0 = cells[i0];
 
@@ -860,10 +1192,21 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
                 continue;
             }
 
+            if (n_cells == max_cells) {
+                stop = true;
+                break;
+            }
+
             // this cell goes to (i0 + nf)
             ids[i1] = i0 + nf;
 
             // move the cell meta data
+            for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+                if (cell1.seq_id.test(s)) {
+                    seq_pos[s].move(cell1.pos, i1, i0 + nf);
+                }
+            }
+
             cells[i0 + nf] = cell1;
 
             // clear the old cell and move the head there
@@ -875,6 +1218,7 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
                 cont = true;
             }
 
+            n_cells++;
             nf++;
 
             if (nf == nh) {
@@ -882,7 +1226,8 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
             }
         }
 
-        if (stop || n_moves == max_moves) {
+        if (stop || n_moves == max_moves || n_cells == max_cells) {
+            defrag_info.complete = false;
             break;
         }
 
@@ -891,11 +1236,16 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
         i0 += nh - 1;
     }
 
+    defrag_info.n_cells = n_cells;
+
     if (n_moves == 0) {
+        defrag_info.complete = true;
         return false;
     }
 
-    LLAMA_LOG_DEBUG("(tmp log) KV defrag cell moves: %u\n", n_moves);
+    blocks_update(0, n_kv);
+
+    LLAMA_LOG_DEBUG("(tmp log) KV defrag cell moves: %u, cells: %u\n", n_moves, n_cells);
 
     LLAMA_LOG_DEBUG("expected gf nodes: %u\n", 6*n_moves*n_layer);
 
@@ -946,7 +1296,7 @@ void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_i
 
     bool res = true;
     res = res && state_read_meta(io, cell_count, seq_id);
-    res = res && state_read_data(io, cell_count);
+    res = res && state_read_data(io, cell_count, seq_id);
 
     if (!res) {
         if (seq_id == -1) {
@@ -963,14 +1313,16 @@ void llama_kv_cache_unified::state_write_meta(llama_io_write_i & io, const std::
         for (uint32_t i = range.first; i < range.second; ++i) {
             const auto & cell = cells[i];
             const llama_pos pos      = cell.pos;
-            const uint32_t  n_seq_id = seq_id == -1 ? cell.seq_id.size() : 0;
+            const uint32_t  n_seq_id = seq_id == -1 ? cell.seq_id.count() : 0;
 
             io.write(&pos,      sizeof(pos));
             io.write(&n_seq_id, sizeof(n_seq_id));
 
             if (n_seq_id) {
-                for (auto seq_id : cell.seq_id) {
-                    io.write(&seq_id, sizeof(seq_id));
+                for (llama_seq_id id = 0; id < LLAMA_MAX_SEQ; ++id) {
+                    if (cell.seq_id.test(id)) {
+                        io.write(&id, sizeof(id));
+                    }
                 }
             }
         }
@@ -1092,13 +1444,23 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
         }
         commit();
 
-        // DEBUG CHECK: kv.head should be our first cell, kv.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
-        // Assume that this is one contiguous block of cells
-        GGML_ASSERT(head + cell_count <= size);
-        GGML_ASSERT(cells[head].pos == batch.pos[0]);
-        GGML_ASSERT(cells[head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-        GGML_ASSERT(cells[head].has_seq_id(dest_seq_id));
-        GGML_ASSERT(cells[head + cell_count - 1].has_seq_id(dest_seq_id));
+        if (n_block > 0) {
+            // DEBUG CHECK: the cells of the slot are not contiguous, check the first and the last one
+            if (cell_count > 0) {
+                GGML_ASSERT(cells[slot_cells.front()].pos == batch.pos[0]);
+                GGML_ASSERT(cells[slot_cells.back()].pos == batch.pos[cell_count - 1]);
+                GGML_ASSERT(cells[slot_cells.front()].has_seq_id(dest_seq_id));
+                GGML_ASSERT(cells[slot_cells.back()].has_seq_id(dest_seq_id));
+            }
+        } else {
+            // DEBUG CHECK: kv.head should be our first cell, kv.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
+            // Assume that this is one contiguous block of cells
+            GGML_ASSERT(head + cell_count <= size);
+            GGML_ASSERT(cells[head].pos == batch.pos[0]);
+            GGML_ASSERT(cells[head + cell_count - 1].pos == batch.pos[cell_count - 1]);
+            GGML_ASSERT(cells[head].has_seq_id(dest_seq_id));
+            GGML_ASSERT(cells[head + cell_count - 1].has_seq_id(dest_seq_id));
+        }
     } else {
         // whole KV cache restore
 
@@ -1124,48 +1486,47 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
                 llama_seq_id seq_id;
                 io.read_to(&seq_id, sizeof(seq_id));
 
-                // TODO: llama_kv_cache_unified should have a notion of max sequences
-                //if (seq_id < 0 || (uint32_t) seq_id >= llama_n_seq_max(ctx)) {
-                if (seq_id < 0) {
-                    //LLAMA_LOG_ERROR("%s: invalid seq_id, %d is out of range [0, %u)\n", __func__, seq_id, llama_n_seq_max(ctx));
-                    LLAMA_LOG_ERROR("%s: invalid seq_id, %d is out of range [0, inf)\n", __func__, seq_id);
+                if (seq_id < 0 || seq_id >= LLAMA_MAX_SEQ) {
+                    LLAMA_LOG_ERROR("%s: invalid seq_id, %d is out of range [0, %d)\n", __func__, seq_id, LLAMA_MAX_SEQ);
                     return false;
                 }
 
-                cell.seq_id.insert(seq_id);
-
-                if (recurrent) {
-                    int32_t & tail = cells[seq_id].tail;
-                    if (tail != -1) {
-                        LLAMA_LOG_ERROR("%s: duplicate tail for seq_id %d in cell %d and %d\n", __func__, seq_id, i, tail);
-                        return false;
-                    }
-                    tail = i;
-                }
+                cell.seq_id.set(seq_id);
             }
+
+            seq_pos_add(i, -1);
         }
 
         head = 0;
         used = cell_count;
-    }
 
-    if (recurrent) {
-        for (uint32_t i = 0; i < cell_count; ++i) {
-            uint32_t cell_id = head + i;
-            // make sure the recurrent states will keep their restored state
-            cells[cell_id].src = cell_id;
-        }
+        blocks_update(0, cell_count);
     }
 
     return true;
 }
 
-bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell_count) {
+bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell_count, llama_seq_id dest_seq_id) {
     uint32_t v_trans;
     uint32_t n_layer;
     io.read_to(&v_trans, sizeof(v_trans));
     io.read_to(&n_layer, sizeof(n_layer));
 
+    // destination ranges of the cells, (first cell, number of cells)
+    // a single sequence restored into a paged cache goes to the cells found by find_slot, otherwise to the cells from head
+    std::vector<std::pair<uint32_t, uint32_t>> cell_ranges;
+    if (n_block > 0 && dest_seq_id != -1) {
+        for (const uint32_t cell_id : slot_cells) {
+            if (!cell_ranges.empty() && cell_ranges.back().first + cell_ranges.back().second == cell_id) {
+                cell_ranges.back().second++;
+            } else {
+                cell_ranges.emplace_back(cell_id, 1);
+            }
+        }
+    } else if (cell_count) {
+        cell_ranges.emplace_back(head, cell_count);
+    }
+
     if (n_layer != hparams.n_layer) {
         LLAMA_LOG_ERROR("%s: mismatched layer count (%u instead of %u)\n", __func__, n_layer, hparams.n_layer);
         return false;
@@ -1201,9 +1562,9 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
             return false;
         }
 
-        if (cell_count) {
-            // Read and set the keys for the whole cell range
-            ggml_backend_tensor_set(k_l[il], io.read(cell_count * k_size_row), head * k_size_row, cell_count * k_size_row);
+        // Read and set the keys for each cell range
+        for (const auto & range : cell_ranges) {
+            ggml_backend_tensor_set(k_l[il], io.read(range.second * k_size_row), range.first * k_size_row, range.second * k_size_row);
         }
     }
 
@@ -1229,9 +1590,9 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
                 return false;
             }
 
-            if (cell_count) {
-                // Read and set the values for the whole cell range
-                ggml_backend_tensor_set(v_l[il], io.read(cell_count * v_size_row), head * v_size_row, cell_count * v_size_row);
+            // Read and set the values for each cell range
+            for (const auto & range : cell_ranges) {
+                ggml_backend_tensor_set(v_l[il], io.read(range.second * v_size_row), range.first * v_size_row, range.second * v_size_row);
             }
         }
     } else {
@@ -1265,11 +1626,11 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
                 return false;
             }
 
-            if (cell_count) {
-                // For each row in the transposed matrix, read the values for the whole cell range
-                for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
-                    const size_t dst_offset = (head + j * size) * v_size_el;
-                    ggml_backend_tensor_set(v_l[il], io.read(cell_count * v_size_el), dst_offset, cell_count * v_size_el);
+            // For each row in the transposed matrix, read the values for each cell range
+            for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
+                for (const auto & range : cell_ranges) {
+                    const size_t dst_offset = (range.first + j * size) * v_size_el;
+                    ggml_backend_tensor_set(v_l[il], io.read(range.second * v_size_el), dst_offset, range.second * v_size_el);
                 }
             }
         }
@@ -1279,69 +1640,772 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
 }
 
 //
-// kv cache view
+// llama_kv_cache_recurrent
 //
 
-llama_kv_cache_view llama_kv_cache_view_init(const llama_kv_cache & kv, int32_t n_seq_max) {
-    llama_kv_cache_view result = {
-        /*.n_cells            = */ 0,
-        /*.n_seq_max          = */ n_seq_max,
-        /*.token_count        = */ 0,
-        /*.used_cells         = */ kv.get_used_cells(),
-        /*.max_contiguous     = */ 0,
-        /*.max_contiguous_idx = */ -1,
-        /*.cells              = */ nullptr,
-        /*.cells_sequences    = */ nullptr,
-    };
+bool llama_kv_cache_recurrent::init(
+                   const llama_model & model,
+                 const llama_cparams & cparams,
+        const std::vector<ggml_type> & type_k,
+        const std::vector<ggml_type> & type_v,
+                            uint32_t   kv_size,
+                                bool   offload) {
+    if (!llama_kv_cache_unified::init(model, cparams, type_k, type_v, kv_size, offload)) {
+        return false;
+    }
 
-    return result;
-}
+    n_ckpt    = cparams.n_state_ckpt;
+    ckpt_step = cparams.state_ckpt_step;
 
-void llama_kv_cache_view_free(llama_kv_cache_view * view) {
-    if (view->cells != nullptr) {
-        free(view->cells);
-        view->cells = nullptr;
+    for (auto & cs : ckpts) {
+        cs.clear();
     }
-    if (view->cells_sequences != nullptr) {
-        free(view->cells_sequences);
-        view->cells_sequences = nullptr;
+
+    if (n_ckpt > 0) {
+        LLAMA_LOG_INFO("%s: state checkpoints: %u per sequence, every %u tokens, %.2f MiB each\n", __func__,
+                n_ckpt, ckpt_step, ckpt_size()/1024.0/1024.0);
     }
+
+    return true;
 }
 
-void llama_kv_cache_view_update(llama_kv_cache_view * view, const llama_kv_cache * kv) {
-    // TODO: rework this in the future, for now quick hack
-    const llama_kv_cache_unified * kvu = dynamic_cast<const llama_kv_cache_unified *>(kv);
-    if (kvu == nullptr) {
-        LLAMA_LOG_ERROR("%s: the kv_cache_view currently works only with llama_kv_cache_unified\n", __func__);
-        return;
-    }
+llama_pos llama_kv_cache_recurrent::pos_max() const {
+    llama_pos pos_max = -1;
 
-    if (uint32_t(view->n_cells) < kvu->size || view->cells == nullptr) {
-        view->n_cells = int32_t(kvu->size);
-        void * p = realloc(view->cells, sizeof(llama_kv_cache_view_cell) * view->n_cells);
-        GGML_ASSERT(p != nullptr && "Failed to alloc kv_cache_view cells");
-        view->cells = (llama_kv_cache_view_cell *)p;
-        p = realloc(view->cells_sequences, sizeof(llama_seq_id) * view->n_seq_max * view->n_cells);
-        GGML_ASSERT(p != nullptr && "Failed to alloc kv_cache_view cells sequences");
-        view->cells_sequences = (llama_seq_id *)p;
+    for (const auto & cell : cells) {
+        pos_max = std::max(pos_max, cell.pos);
     }
 
-    const std::vector<llama_kv_cell> & kv_cells = kvu->cells;
-    llama_kv_cache_view_cell * c_curr = view->cells;
-    llama_seq_id * cs_curr = view->cells_sequences;
-    int32_t used_cells = 0;
-    int32_t token_count = 0;
-    int32_t curr_contig_idx = -1;
-    uint32_t max_contig = 0;
-    int32_t max_contig_idx = -1;
+    return pos_max;
+}
 
-    for (int32_t i = 0; i < int32_t(kvu->size); i++, c_curr++, cs_curr += view->n_seq_max) {
-        const size_t curr_size = kv_cells[i].seq_id.size();
-        token_count += curr_size;
-        c_curr->pos = kv_cells[i].pos + kv_cells[i].delta;
+void llama_kv_cache_recurrent::clear() {
+    llama_kv_cache_unified::clear();
 
-        if (curr_size > 0) {
-            if (curr_contig_idx >= 0 && uint32_t(i - curr_contig_idx) > max_contig) {
+    for (auto & cs : ckpts) {
+        cs.clear();
+    }
+}
+
+void llama_kv_cache_recurrent::defrag() {
+    // one cell per sequence, nothing to defragment
+}
+
+void llama_kv_cache_recurrent::restore() {
+    // the states are updated in place by the graph, there are no pending cells
+}
+
+void llama_kv_cache_recurrent::commit() {
+}
+
+bool llama_kv_cache_recurrent::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    if (seq_id >= (int64_t) size) {
+        // could be fatal
+        return false;
+    }
+
+    if (seq_id < 0) {
+        // the range should include everything or nothing
+        if (p0 != p1 && (p0 != 0 || p1 != std::numeric_limits<llama_pos>::max())) {
+            return false;
+        }
+
+        if (p0 != p1) {
+            for (llama_seq_id s = 0; s < (llama_seq_id) size; ++s) {
+                seq_rm(s, -1, -1);
+            }
+        }
+
+        return true;
+    }
+
+    int32_t & tail_id = cells[seq_id].tail;
+
+    if (tail_id >= 0) {
+        const llama_pos pos = cells[tail_id].pos;
+
+        if (p0 <= pos && p1 <= pos) {
+            // a state cannot be partially erased
+            return false;
+        }
+
+        if (p0 <= pos) {
+            if (p0 > 0) {
+                // the last positions can be removed by going back to a checkpoint
+                if (!ckpt_restore(seq_id, p0 - 1)) {
+                    return false;
+                }
+            } else {
+                cell_rm_seq(tail_id, seq_id);
+                tail_id = -1;
+            }
+        }
+    }
+
+    auto & cs = ckpts[seq_id];
+
+    cs.erase(std::remove_if(cs.begin(), cs.end(), [&](const llama_kv_state_ckpt & c) {
+        return p0 <= c.pos && c.pos < p1;
+    }), cs.end());
+
+    return true;
+}
+
+void llama_kv_cache_recurrent::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
+    if (seq_id_src == seq_id_dst) {
+        return;
+    }
+
+    if ((uint32_t) seq_id_dst >= size || (uint32_t) seq_id_src >= size) {
+        return;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    GGML_UNUSED(p0);
+
+    llama_kv_cell & tail_src = cells[seq_id_src];
+    llama_kv_cell & tail_dst = cells[seq_id_dst];
+
+    if (tail_dst.tail >= 0) {
+        // clear destination seq_id if it wasn't empty
+        cell_rm_seq(tail_dst.tail, seq_id_dst);
+        tail_dst.tail = -1;
+    }
+
+    // the cell is shared, its state is copied by find_slot when one of the sequences is updated
+    if (tail_src.tail >= 0) {
+        cells[tail_src.tail].seq_id.set(seq_id_dst);
+        tail_dst.tail = tail_src.tail;
+    }
+
+    // the checkpoints share their data
+    auto & cs_dst = ckpts[seq_id_dst];
+
+    cs_dst.clear();
+
+    for (const auto & c : ckpts[seq_id_src]) {
+        if (c.pos < p1) {
+            cs_dst.push_back(c);
+        }
+    }
+}
+
+void llama_kv_cache_recurrent::seq_keep(llama_seq_id seq_id) {
+    for (uint32_t i = 0; i < size; ++i) {
+        if ((llama_seq_id) i != seq_id) {
+            cells[i].tail = -1;
+        }
+
+        if (!cells[i].has_seq_id(seq_id)) {
+            if (cells[i].pos >= 0) {
+                used--;
+            }
+
+            cells[i].pos = -1;
+            cells[i].src = -1;
+            cells[i].seq_id.reset();
+        } else {
+            cells[i].seq_id.reset();
+            cells[i].seq_id.set(seq_id);
+        }
+    }
+
+    for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        if (s != seq_id) {
+            ckpts[s].clear();
+        }
+    }
+}
+
+bool llama_kv_cache_recurrent::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
+    if (delta == 0) {
+        return true;
+    }
+
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    if (seq_id < 0 || seq_id >= (int64_t) size) {
+        return true;
+    }
+
+    // only the positions change
+    const int32_t tail_id = cells[seq_id].tail;
+    if (tail_id >= 0) {
+        llama_kv_cell & cell = cells[tail_id];
+        if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
+            cell.pos += delta;
+        }
+    }
+
+    for (auto & c : ckpts[seq_id]) {
+        if (p0 <= c.pos && c.pos < p1) {
+            c.pos += delta;
+        }
+    }
+
+    return true;
+}
+
+bool llama_kv_cache_recurrent::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+    if (d == 1) {
+        return true;
+    }
+
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    if (seq_id < 0 || seq_id >= (int64_t) size) {
+        return true;
+    }
+
+    // only the positions change
+    const int32_t tail_id = cells[seq_id].tail;
+    if (tail_id >= 0) {
+        llama_kv_cell & cell = cells[tail_id];
+        if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
+            cell.pos /= d;
+        }
+    }
+
+    for (auto & c : ckpts[seq_id]) {
+        if (p0 <= c.pos && c.pos < p1) {
+            c.pos /= d;
+        }
+    }
+
+    return true;
+}
+
+llama_pos llama_kv_cache_recurrent::seq_pos_max(llama_seq_id seq_id) const {
+    llama_pos result = 0;
+
+    for (uint32_t i = 0; i < size; ++i) {
+        if (cells[i].has_seq_id(seq_id)) {
+            result = std::max(result, cells[i].pos);
+        }
+    }
+
+    return result;
+}
+
+llama_pos llama_kv_cache_recurrent::seq_pos_rollback(llama_seq_id seq_id, llama_pos pos) const {
+    if (seq_id < 0 || seq_id >= (int64_t) size) {
+        return -1;
+    }
+
+    const int32_t tail_id = cells[seq_id].tail;
+
+    // nothing to remove after pos
+    if (tail_id < 0 || cells[tail_id].pos <= pos) {
+        return pos;
+    }
+
+    llama_pos res = -1;
+
+    for (const auto & c : ckpts[seq_id]) {
+        if (c.pos <= pos) {
+            res = c.pos;
+        }
+    }
+
+    return res;
+}
+
+int32_t llama_kv_cache_recurrent::seq_evict(llama_seq_id seq_id, int32_t n_sink, int32_t n_heavy, int32_t n_recent, llama_pos * pos_kept) {
+    GGML_UNUSED(seq_id);
+    GGML_UNUSED(n_sink);
+    GGML_UNUSED(n_heavy);
+    GGML_UNUSED(n_recent);
+    GGML_UNUSED(pos_kept);
+
+    return -1;
+}
+
+bool llama_kv_cache_recurrent::find_slot(const llama_ubatch & ubatch) {
+    const uint32_t n_seqs       = ubatch.n_seqs;
+    const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
+
+    // if we have enough unused cells before the current head ->
+    //   better to start searching from the beginning of the cache, hoping to fill it
+    if (head > used + 2*ubatch.n_tokens) {
+        head = 0;
+    }
+
+    // For recurrent state architectures (like Mamba or RWKV),
+    // each cache cell can store the state for a whole sequence.
+    // A slot should be always be contiguous.
+
+    // can only process batches with an equal number of new tokens in each sequence
+    GGML_ASSERT(ubatch.equal_seqs);
+
+    int32_t min = size - 1;
+    int32_t max = 0;
+
+    // everything should fit if all seq_ids are smaller than the max
+    for (uint32_t s = 0; s < n_seqs; ++s) {
+        const uint32_t n_seq_id = ubatch.n_seq_id[s];
+        for (uint32_t j = 0; j < n_seq_id; ++j) {
+            const llama_seq_id seq_id = ubatch.seq_id[s][j];
+
+            if (seq_id < 0 || (uint32_t) seq_id >= size) {
+                // too big seq_id
+                // TODO: would it be possible to resize the cache instead?
+                LLAMA_LOG_ERROR("%s: seq_id=%d >= n_seq_max=%d Try using a bigger --parallel value\n", __func__, seq_id, size);
+                return false;
+            }
+            if (j > 0) {
+                llama_kv_cell & seq = cells[seq_id];
+                if (seq.tail >= 0) {
+                    llama_kv_cell & cell = cells[seq.tail];
+                    // clear cells from seq_ids that become shared
+                    // (should not normally happen, but let's handle it anyway)
+                    cell.seq_id.reset(seq_id);
+                    seq.tail = -1;
+                    if (cell.seq_id.none()) {
+                        cell.pos = -1;
+                        cell.src = -1;
+                        used -= 1;
+                    }
+                }
+            }
+        }
+    }
+
+#ifndef NDEBUG
+    {
+        std::vector<int32_t> tails_verif;
+        tails_verif.assign(size, -1);
+        for (uint32_t i = 0; i < size; ++i) {
+            llama_kv_cell & cell = cells[i];
+            for (llama_seq_id seq_id = 0; seq_id < LLAMA_MAX_SEQ; ++seq_id) {
+                if (!cell.seq_id.test(seq_id)) {
+                    continue;
+                }
+                if (tails_verif[seq_id] != -1) {
+                    LLAMA_LOG_ERROR("%s: duplicate tail for seq_id %d in cell %d and %d\n", __func__, seq_id, i, tails_verif[seq_id]);
+                }
+                tails_verif[seq_id] = i;
+            }
+        }
+        for (uint32_t i = 0; i < size; ++i) {
+            if (tails_verif[i] != cells[i].tail) {
+                LLAMA_LOG_ERROR("%s: wrong tail for seq_id %d, (%d instead of %d)\n", __func__, i, cells[i].tail, tails_verif[i]);
+            }
+        }
+    }
+#endif
+
+    // find next empty cell
+    uint32_t next_empty_cell = head;
+
+    for (uint32_t i = 0; i < size; ++i) {
+        if (next_empty_cell >= size) { next_empty_cell -= size; }
+        llama_kv_cell & cell = cells[next_empty_cell];
+        if (cell.is_empty()) { break; }
+        next_empty_cell += 1;
+    }
+
+    // find usable cell range
+    for (uint32_t s = 0; s < n_seqs; ++s) {
+        const llama_seq_id seq_id = ubatch.seq_id[s][0];
+        llama_kv_cell & seq_meta = cells[seq_id];
+        bool has_cell = false;
+        if (seq_meta.tail >= 0) {
+            llama_kv_cell & cell = cells[seq_meta.tail];
+            GGML_ASSERT(cell.has_seq_id(seq_id));
+            // does this seq_id "own" the cell?
+            if (cell.seq_id.count() == 1) { has_cell = true; }
+        }
+        if (!has_cell) {
+            llama_kv_cell & empty_cell = cells[next_empty_cell];
+            GGML_ASSERT(empty_cell.is_empty());
+            // copy old tail into the empty cell
+            if (seq_meta.tail >= 0) {
+                llama_kv_cell & orig_cell = cells[seq_meta.tail];
+                empty_cell.pos = orig_cell.pos;
+                empty_cell.src = orig_cell.src;
+                orig_cell.seq_id.reset(seq_id);
+                empty_cell.seq_id.set(seq_id); // will be overwritten
+            }
+            seq_meta.tail = next_empty_cell;
+            // find next empty cell
+            if (s + 1 < n_seqs) {
+                next_empty_cell += 1;
+                for (uint32_t i = 0; i < size; ++i) {
+                    if (next_empty_cell >= size) { next_empty_cell -= size; }
+                    llama_kv_cell & cell = cells[next_empty_cell];
+                    if (cell.is_empty()) { break; }
+                    next_empty_cell += 1;
+                }
+            }
+        }
+        if (min > seq_meta.tail) { min = seq_meta.tail; }
+        if (max < seq_meta.tail) { max = seq_meta.tail; }
+    }
+
+    // gather and re-order
+    for (uint32_t s = 0; s < n_seqs; ++s) {
+        int32_t dst_id = s + min;
+        int32_t src_id = cells[ubatch.seq_id[s][0]].tail;
+        if (dst_id != src_id) {
+            llama_kv_cell & dst_cell = cells[dst_id];
+            llama_kv_cell & src_cell = cells[src_id];
+
+            std::swap(dst_cell.pos, src_cell.pos);
+            std::swap(dst_cell.src, src_cell.src);
+            std::swap(dst_cell.seq_id, src_cell.seq_id);
+
+            // swap tails (assuming they NEVER overlap)
+            for (llama_seq_id seq_id = 0; seq_id < LLAMA_MAX_SEQ; ++seq_id) {
+                if (src_cell.seq_id.test(seq_id)) {
+                    cells[seq_id].tail = src_id;
+                }
+                if (dst_cell.seq_id.test(seq_id)) {
+                    cells[seq_id].tail = dst_id;
+                }
+            }
+        }
+    }
+
+    // update the pos of the used seqs
+    for (uint32_t s = 0; s < n_seqs; ++s) {
+        const llama_pos last_pos = ubatch.pos[n_seq_tokens * s + n_seq_tokens - 1];
+        int32_t cell_id = s + min;
+        llama_kv_cell & cell = cells[cell_id];
+
+        if (cell.pos >= 0 && last_pos != cell.pos + (llama_pos) n_seq_tokens) {
+            // What should happen when the pos backtracks or skips a value?
+            // Clearing the state mid-batch would require special-casing which isn't done.
+            LLAMA_LOG_WARN("%s: non-consecutive token position %d after %d for sequence %d with %u new tokens\n",
+                __func__, last_pos, cell.pos, ubatch.seq_id[s][0], n_seq_tokens);
+        }
+        cell.pos = last_pos;
+        cell.seq_id.reset();
+        for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
+            const llama_seq_id seq_id = ubatch.seq_id[s][j];
+            cell.seq_id.set(seq_id);
+            cells[seq_id].tail = cell_id;
+        }
+    }
+
+    // allow getting the range of used cells, from head to head + n
+    head = min;
+    n    = max - min + 1;
+    used = std::count_if(cells.begin(), cells.end(),
+        [](const llama_kv_cell& cell){ return !cell.is_empty(); });
+
+    // sanity check
+    return n >= n_seqs;
+}
+
+bool llama_kv_cache_recurrent::ckpt_due(const llama_ubatch & ubatch) const {
+    for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
+        for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
+            if (ckpt_due(ubatch.seq_id[s][j])) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void llama_kv_cache_recurrent::ckpt_save(const llama_ubatch & ubatch) {
+    const uint32_t n_layer = hparams.n_layer;
+
+    for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
+        // the sequences of the ubatch sequence share its cell
+        const int32_t cell_id = cells[ubatch.seq_id[s][0]].tail;
+
+        std::shared_ptr<std::vector<uint8_t>> data;
+
+        for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
+            const llama_seq_id seq_id = ubatch.seq_id[s][j];
+
+            if (!ckpt_due(seq_id)) {
+                continue;
+            }
+
+            if (!data) {
+                data = std::make_shared<std::vector<uint8_t>>(ckpt_size());
+
+                uint8_t * dst = data->data();
+
+                for (uint32_t il = 0; il < n_layer; ++il) {
+                    const size_t k_size_row = ggml_row_size(k_l[il]->type, hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s());
+                    const size_t v_size_row = ggml_row_size(v_l[il]->type, hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s());
+
+                    ggml_backend_tensor_get(k_l[il], dst, cell_id*k_size_row, k_size_row);
+                    dst += k_size_row;
+
+                    ggml_backend_tensor_get(v_l[il], dst, cell_id*v_size_row, v_size_row);
+                    dst += v_size_row;
+                }
+            }
+
+            auto & cs = ckpts[seq_id];
+
+            cs.push_back({ cells[cell_id].pos, data });
+
+            if (cs.size() > n_ckpt) {
+                // drop the checkpoint that leaves the smallest gap, the first and the last ones are kept if possible
+                size_t k_rm = 0;
+
+                if (cs.size() > 2) {
+                    k_rm = 1;
+                    for (size_t k = 2; k + 1 < cs.size(); ++k) {
+                        if (cs[k + 1].pos - cs[k - 1].pos < cs[k_rm + 1].pos - cs[k_rm - 1].pos) {
+                            k_rm = k;
+                        }
+                    }
+                }
+
+                cs.erase(cs.begin() + k_rm);
+            }
+        }
+    }
+}
+
+bool llama_kv_cache_recurrent::state_read_meta(llama_io_read_i & io, uint32_t cell_count, llama_seq_id dest_seq_id) {
+    if (dest_seq_id != -1) {
+        // single sequence, find_slot gives it a cell of its own
+        if (!llama_kv_cache_unified::state_read_meta(io, cell_count, dest_seq_id)) {
+            return false;
+        }
+    } else {
+        // whole KV cache restore
+
+        if (cell_count > size) {
+            LLAMA_LOG_ERROR("%s: not enough cells in kv cache\n", __func__);
+            return false;
+        }
+
+        clear();
+
+        for (uint32_t i = 0; i < cell_count; ++i) {
+            llama_kv_cell & cell = cells[i];
+
+            llama_pos pos;
+            uint32_t  n_seq_id;
+
+            io.read_to(&pos,      sizeof(pos));
+            io.read_to(&n_seq_id, sizeof(n_seq_id));
+
+            cell.pos = pos;
+
+            for (uint32_t j = 0; j < n_seq_id; ++j) {
+                llama_seq_id seq_id;
+                io.read_to(&seq_id, sizeof(seq_id));
+
+                if (seq_id < 0 || (uint32_t) seq_id >= size) {
+                    LLAMA_LOG_ERROR("%s: invalid seq_id, %d is out of range [0, %u)\n", __func__, seq_id, size);
+                    return false;
+                }
+
+                cell.seq_id.set(seq_id);
+
+                int32_t & tail = cells[seq_id].tail;
+                if (tail != -1) {
+                    LLAMA_LOG_ERROR("%s: duplicate tail for seq_id %d in cell %d and %d\n", __func__, seq_id, i, tail);
+                    return false;
+                }
+                tail = i;
+            }
+        }
+
+        head = 0;
+        used = cell_count;
+    }
+
+    for (uint32_t i = 0; i < cell_count; ++i) {
+        uint32_t cell_id = head + i;
+        // make sure the recurrent states will keep their restored state
+        cells[cell_id].src = cell_id;
+    }
+
+    return true;
+}
+
+void llama_kv_cache_recurrent::cell_rm_seq(uint32_t i, llama_seq_id seq_id) {
+    llama_kv_cell & cell = cells[i];
+
+    cell.seq_id.reset(seq_id);
+
+    if (cell.is_empty()) {
+        if (cell.pos >= 0) {
+            used--;
+        }
+
+        cell.pos = -1;
+        cell.src = -1;
+    }
+}
+
+bool llama_kv_cache_recurrent::ckpt_due(llama_seq_id seq_id) const {
+    if (n_ckpt == 0) {
+        return false;
+    }
+
+    const int32_t tail_id = cells[seq_id].tail;
+    if (tail_id < 0) {
+        return false;
+    }
+
+    const auto & cs = ckpts[seq_id];
+
+    const llama_pos pos_last = cs.empty() ? -1 : cs.back().pos;
+
+    return cells[tail_id].pos - pos_last >= (llama_pos) ckpt_step;
+}
+
+bool llama_kv_cache_recurrent::ckpt_restore(llama_seq_id seq_id, llama_pos pos) {
+    auto & cs = ckpts[seq_id];
+
+    const auto it = std::find_if(cs.begin(), cs.end(), [&](const llama_kv_state_ckpt & c) { return c.pos == pos; });
+    if (it == cs.end()) {
+        return false;
+    }
+
+    int32_t & tail_id = cells[seq_id].tail;
+
+    // the state of a shared cell is kept for the other sequences
+    if (cells[tail_id].seq_id.count() > 1) {
+        uint32_t j = 0;
+        while (j < size && !cells[j].is_empty()) {
+            j++;
+        }
+
+        if (j == size) {
+            return false;
+        }
+
+        cells[tail_id].seq_id.reset(seq_id);
+        cells[j].seq_id.set(seq_id);
+        used++;
+
+        tail_id = j;
+    }
+
+    llama_kv_cell & cell = cells[tail_id];
+
+    cell.pos = pos;
+    cell.src = tail_id; // keep the restored state
+
+    const uint8_t * src = it->data->data();
+
+    for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+        const size_t k_size_row = ggml_row_size(k_l[il]->type, hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s());
+        const size_t v_size_row = ggml_row_size(v_l[il]->type, hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s());
+
+        ggml_backend_tensor_set(k_l[il], src, tail_id*k_size_row, k_size_row);
+        src += k_size_row;
+
+        ggml_backend_tensor_set(v_l[il], src, tail_id*v_size_row, v_size_row);
+        src += v_size_row;
+    }
+
+    cs.erase(it + 1, cs.end());
+
+    return true;
+}
+
+size_t llama_kv_cache_recurrent::ckpt_size() const {
+    size_t res = 0;
+
+    for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+        res += ggml_row_size(k_l[il]->type, hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s());
+        res += ggml_row_size(v_l[il]->type, hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s());
+    }
+
+    return res;
+}
+
+//
+// kv cache view
+//
+
+llama_kv_cache_view llama_kv_cache_view_init(const llama_kv_cache & kv, int32_t n_seq_max) {
+    llama_kv_cache_view result = {
+        /*.n_cells            = */ 0,
+        /*.n_seq_max          = */ n_seq_max,
+        /*.token_count        = */ 0,
+        /*.used_cells         = */ kv.get_used_cells(),
+        /*.max_contiguous     = */ 0,
+        /*.max_contiguous_idx = */ -1,
+        /*.cells              = */ nullptr,
+        /*.cells_sequences    = */ nullptr,
+    };
+
+    return result;
+}
+
+void llama_kv_cache_view_free(llama_kv_cache_view * view) {
+    if (view->cells != nullptr) {
+        free(view->cells);
+        view->cells = nullptr;
+    }
+    if (view->cells_sequences != nullptr) {
+        free(view->cells_sequences);
+        view->cells_sequences = nullptr;
+    }
+}
+
+void llama_kv_cache_view_update(llama_kv_cache_view * view, const llama_kv_cache * kv) {
+    // TODO: rework this in the future, for now quick hack
+    const llama_kv_cache_unified * kvu = dynamic_cast<const llama_kv_cache_unified *>(kv);
+    if (kvu == nullptr) {
+        LLAMA_LOG_ERROR("%s: the kv_cache_view currently works only with llama_kv_cache_unified\n", __func__);
+        return;
+    }
+
+    if (uint32_t(view->n_cells) < kvu->size || view->cells == nullptr) {
+        view->n_cells = int32_t(kvu->size);
+        void * p = realloc(view->cells, sizeof(llama_kv_cache_view_cell) * view->n_cells);
+        GGML_ASSERT(p != nullptr && "Failed to alloc kv_cache_view cells");
+        view->cells = (llama_kv_cache_view_cell *)p;
+        p = realloc(view->cells_sequences, sizeof(llama_seq_id) * view->n_seq_max * view->n_cells);
+        GGML_ASSERT(p != nullptr && "Failed to alloc kv_cache_view cells sequences");
+        view->cells_sequences = (llama_seq_id *)p;
+    }
+
+    const std::vector<llama_kv_cell> & kv_cells = kvu->cells;
+    llama_kv_cache_view_cell * c_curr = view->cells;
+    llama_seq_id * cs_curr = view->cells_sequences;
+    int32_t used_cells = 0;
+    int32_t token_count = 0;
+    int32_t curr_contig_idx = -1;
+    uint32_t max_contig = 0;
+    int32_t max_contig_idx = -1;
+
+    for (int32_t i = 0; i < int32_t(kvu->size); i++, c_curr++, cs_curr += view->n_seq_max) {
+        const size_t curr_size = kv_cells[i].seq_id.count();
+        token_count += curr_size;
+        c_curr->pos = kv_cells[i].pos + kv_cells[i].delta;
+
+        if (curr_size > 0) {
+            if (curr_contig_idx >= 0 && uint32_t(i - curr_contig_idx) > max_contig) {
                 max_contig = i - curr_contig_idx;
                 max_contig_idx = curr_contig_idx;
             }
@@ -1351,12 +2415,14 @@ void llama_kv_cache_view_update(llama_kv_cache_view * view, const llama_kv_cache
         }
 
         int seq_idx = 0;
-        for (const llama_seq_id it : kv_cells[i].seq_id) {
+        for (llama_seq_id it = 0; it < LLAMA_MAX_SEQ; ++it) {
             if (seq_idx >= view->n_seq_max) {
                 break;
             }
-            cs_curr[seq_idx] = it;
-            seq_idx++;
+            if (kv_cells[i].seq_id.test(it)) {
+                cs_curr[seq_idx] = it;
+                seq_idx++;
+            }
         }
         if (seq_idx != 0) {
             used_cells++;
@@ -3,14 +3,18 @@
 #include "llama.h"
 #include "llama-io.h"
 #include "llama-memory.h"
+#include "llama-cparams.h"
 
 #include "ggml-cpp.h"
 
 #include <functional>
+#include <map>
+#include <memory>
 #include <set>
+#include <array>
+#include <bitset>
 #include <vector>
 
-struct llama_cparams;
 struct llama_hparams;
 struct llama_ubatch;
 
@@ -25,6 +29,13 @@ struct llama_kv_cache : public llama_memory_i {
 
     virtual bool get_can_shift() const = 0;
 
+    // keep the first n_sink, the n_heavy most attended and the last n_recent cells of the sequence, evict the rest
+    // returns the number of kept cells, -1 if the cache cannot be shifted
+    virtual int32_t seq_evict(llama_seq_id seq_id, int32_t n_sink, int32_t n_heavy, int32_t n_recent, llama_pos * pos_kept) = 0;
+
+    // largest position p <= pos such that seq_rm(seq_id, p + 1, -1) succeeds, -1 if there is none
+    virtual llama_pos seq_pos_rollback(llama_seq_id seq_id, llama_pos pos) const = 0;
+
     bool get_can_edit() const override { return get_can_shift(); }
 };
 
@@ -43,20 +54,25 @@ private:
     llama_kv_cache * kv;
 };
 
+// set of sequences, bit i = sequence i
+using llama_seq_mask = std::bitset<LLAMA_MAX_SEQ>;
+
 struct llama_kv_cell {
     llama_pos pos   = -1;
     llama_pos delta =  0;
     int32_t   src   = -1; // used by recurrent state models to copy states
     int32_t   tail  = -1;
 
-    std::set<llama_seq_id> seq_id;
+    float score = 0.0f; // attention received by the cell, accumulated when kv_scores is enabled
+
+    llama_seq_mask seq_id;
 
     bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return id >= 0 && id < LLAMA_MAX_SEQ && seq_id.test(id);
     }
 
     bool is_empty() const {
-        return seq_id.empty();
+        return seq_id.none();
     }
 
     bool is_same_seq(const llama_kv_cell & other) const {
@@ -64,6 +80,46 @@ struct llama_kv_cell {
     }
 };
 
+// a fixed-size group of cells of the paged KV cache
+// the block is referenced by the sequences that have cells in it, cells shared by several sequences are copied before
+// they are modified for one of them (copy-on-write)
+struct llama_kv_block {
+    llama_seq_mask seq_id; // sequences with at least one cell in the block (the reference count), empty = free block
+};
+
+// position index of the cells of a sequence: the (pos, cell) pairs ordered by position, the cells with the same
+// position are in no particular order
+// the pairs are kept in a flat array that is reserved for the whole cache, so the cache updates do not allocate
+struct llama_kv_seq_pos {
+    using entry = std::pair<llama_pos, uint32_t>;
+
+    std::vector<entry> data;
+
+    void reserve(uint32_t n) { data.reserve(n); }
+    void clear()             { data.clear(); }
+
+    bool empty() const { return data.empty(); }
+
+    // largest position, the index must not be empty
+    llama_pos max() const { return data.back().first; }
+
+    // first entry with a position >= p
+    std::vector<entry>::iterator       lower_bound(llama_pos p);
+    std::vector<entry>::const_iterator lower_bound(llama_pos p) const;
+
+    void insert(llama_pos pos, uint32_t i);
+    void erase (llama_pos pos, uint32_t i);
+
+    // remove the entries with a position in [p0, p1)
+    void erase(llama_pos p0, llama_pos p1);
+
+    // the cell at position pos moved from cell i_src to cell i_dst
+    void move(llama_pos pos, uint32_t i_src, uint32_t i_dst);
+
+    // restore the order after the positions of some entries were changed in place
+    void sort();
+};
+
 // ring-buffer of cached KV data
 // TODO: pimpl
 // TODO: add notion of max sequences
@@ -81,21 +137,20 @@ public:
     virtual ~llama_kv_cache_unified() = default;
 
     // TODO: become constructor
-    bool init(
-            const llama_model & model,   // TODO: do not reference the model
-          const llama_cparams & cparams,
-                    ggml_type   type_k,
-                    ggml_type   type_v,
-                     uint32_t   kv_size,
-                         bool   offload);
+    virtual bool init(
+                   const llama_model & model,   // TODO: do not reference the model
+                 const llama_cparams & cparams,
+        const std::vector<ggml_type> & type_k,  // per layer
+        const std::vector<ggml_type> & type_v,  // per layer
+                            uint32_t   kv_size,
+                                bool   offload);
 
     int32_t get_n_tokens()   const override;
     int32_t get_used_cells() const override;
 
     size_t total_size() const;
 
-    // TODO: better data structures to reduce the cost of this operation
-    llama_pos pos_max() const;
+    virtual llama_pos pos_max() const;
 
     void clear() override;
     void defrag() override;
@@ -106,18 +161,34 @@ public:
     bool seq_rm  (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1) override;
     void seq_cp  (llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) override;
     void seq_keep(llama_seq_id seq_id) override;
-    void seq_add (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, llama_pos delta) override;
-    void seq_div (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, int d) override;
+    bool seq_add (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, llama_pos delta) override;
+    bool seq_div (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, int d) override;
 
     llama_pos seq_pos_max(llama_seq_id seq_id) const override;
+    llama_pos seq_pos_rollback(llama_seq_id seq_id, llama_pos pos) const override;
 
     bool get_can_shift() const override;
 
+    int32_t seq_evict(llama_seq_id seq_id, int32_t n_sink, int32_t n_heavy, int32_t n_recent, llama_pos * pos_kept) override;
+
+    // add the attention received by the attended cells [0, n) of the last ubatch, see cell_id
+    void score_add(const float * scores, uint32_t n);
+
     // find an empty slot of size "n_tokens" in the cache
     // updates the cache head
     // Note: On success, it's important that cache.head points
     // to the first cell of the slot.
-    bool find_slot(const llama_ubatch & batch);
+    // In paged mode the cells of the slot are not contiguous, see slot_cells.
+    virtual bool find_slot(const llama_ubatch & batch);
+
+    // paged mode: set up the gather of the blocks of the ubatch sequences if they are a small part of the cells [0, n)
+    // updates n, return true if the attention of the ubatch gathers its cells
+    bool gather_prepare(const llama_ubatch & ubatch, uint32_t pad);
+
+    // index of the cell at position i of the attended cells, >= size for padding
+    uint32_t cell_id(uint32_t i) const {
+        return gather_info.ids.empty() ? i : gather_info.ids[i];
+    }
 
     // TODO: maybe not needed
     uint32_t get_padding(const llama_cparams & cparams) const;
@@ -132,10 +203,26 @@ public:
 
     struct {
         std::vector<uint32_t> ids;
+
+        uint32_t n_cells  = 0;    // cells moved by the last defrag_prepare
+        bool     complete = true; // all the holes were filled
     } defrag_info;
 
+    // paged attention
+
+    struct {
+        std::vector<uint32_t> ids; // cells attended by the current ubatch, empty = cells [0, n)
+    } gather_info;
+
+    // copy-on-write
+
+    struct {
+        std::vector<std::pair<uint32_t, uint32_t>> ids; // pending data copies, (source cell, destination cell)
+    } copy_info;
+
     // return true if cells have been moved
-    bool defrag_prepare(int32_t n_max_nodes);
+    // at most max_cells cells are moved, the compaction can be continued by the next call
+    bool defrag_prepare(int32_t n_max_nodes, uint32_t max_cells = UINT32_MAX);
 
     // commit/restore cache
 
@@ -163,9 +250,6 @@ public:
     bool has_shift = false;
     bool do_defrag = false;
 
-    // TODO: remove this and implement llama_kv_cache_recurrent instead
-    bool recurrent = false; // with recurrent state models, a cell can hold the state for more than one past token
-
     bool v_trans   = true;  // the value tensor is transposed
     bool can_shift = false;
 
@@ -181,28 +265,146 @@ public:
 
     std::vector<llama_kv_cell> cells;
 
+    // per-sequence position index, the (pos, cell) pairs of the cells of each sequence ordered by position
+    // the sequence operations visit only the cells of their sequence, not used with recurrent models
+    std::array<llama_kv_seq_pos, LLAMA_MAX_SEQ> seq_pos;
+
+    // paged mode: the cells are grouped in blocks of n_block cells that are allocated to the sequences on demand,
+    // a sequence appends to the last block of its block table and takes the lowest free block when that is full
+    uint32_t n_block = 0; // 0 = not paged
+
+    std::vector<llama_kv_block> blocks;
+
+    std::map<llama_seq_id, std::vector<uint32_t>> block_tables; // blocks of each sequence, in allocation order
+
+    // paged mode: destination cell of each token of the ubatch passed to find_slot, empty for the worst-case graph
+    std::vector<uint32_t> slot_cells;
+
     std::vector<ggml_tensor *> k_l; // per layer
     std::vector<ggml_tensor *> v_l;
 
-private:
-    ggml_type type_k = GGML_TYPE_F16;
-    ggml_type type_v = GGML_TYPE_F16;
+protected:
+    virtual bool state_read_meta(llama_io_read_i & io, uint32_t cell_count, llama_seq_id dest_seq_id = -1);
 
+private:
     std::vector<ggml_context_ptr>        ctxs;
     std::vector<ggml_backend_buffer_ptr> bufs;
 
+    // add/remove cell i to/from the position index of seq_id, -1 = all sequences of the cell
+    void seq_pos_add(uint32_t i, llama_seq_id seq_id);
+    void seq_pos_rm (uint32_t i, llama_seq_id seq_id);
+
+    // update the position index of seq_id (-1 = all sequences) in [p0, p1) after the positions of its cells changed
+    // ids are the cells of the range in index order, with the cells of seq_id copied by cell_cow replaced by the copies
+    // and the cells removed from seq_id replaced by size, the entries of the cells not in the sequence are removed
+    void seq_pos_update(llama_seq_id seq_id, llama_pos p0, llama_pos p1, const std::vector<uint32_t> & ids);
+
+    // cells of seq_id (-1 = any sequence) with a position in [p0, p1)
+    std::vector<uint32_t> seq_cells(llama_seq_id seq_id, llama_pos p0, llama_pos p1) const;
+
+    // paged mode: sync the block tables with the seq_id sets of the cells of block b
+    void block_update(uint32_t b);
+
+    // paged mode: call block_update for the blocks of the cells [c0, c1)
+    void blocks_update(uint32_t c0, uint32_t c1);
+
+    bool find_slot_paged(const llama_ubatch & ubatch);
+
+    // empty cell for the next token of seq_id, size if there is none
+    // paged mode: the next empty cell of its last block, the lowest free block or any empty cell
+    // the searches start at b_free and i_free, they are moved to the first block and cell that can still be free
+    uint32_t find_empty_cell(llama_seq_id seq_id, uint32_t & b_free, uint32_t & i_free) const;
+
+    // copy-on-write: move seq_id out of cell i if the cell is shared with other sequences, return the cell of seq_id
+    // there must be an empty cell for the copy, see cow_fits
+    // the position index of seq_id is not updated, see seq_pos_update
+    uint32_t cell_cow(uint32_t i, llama_seq_id seq_id);
+
+    // true if there are enough empty cells to copy the shared cells among ids, cells with skip(i) are not counted
+    template <typename F>
+    bool cow_fits(const std::vector<uint32_t> & ids, F && skip) const;
+
     void state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id = -1) const;
     void state_write_data(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) const;
 
-    bool state_read_meta(llama_io_read_i & io, uint32_t cell_count, llama_seq_id dest_seq_id = -1);
-    bool state_read_data(llama_io_read_i & io, uint32_t cell_count);
+    bool state_read_data(llama_io_read_i & io, uint32_t cell_count, llama_seq_id dest_seq_id = -1);
+};
+
+// state checkpoint of a sequence of a recurrent model
+struct llama_kv_state_ckpt {
+    llama_pos pos = -1; // position of the last token of the state
+
+    std::shared_ptr<const std::vector<uint8_t>> data; // the state rows of all the layers, shared by the sequences of the cell
 };
 
-// TODO: temporary reusing llama_kv_cache_unified -- implement recurrent cache and simplify llama_kv_cache_unified
-//class llama_kv_cache_recurrent : public llama_kv_cache_unified {
-//public:
-//    using llama_kv_cache_unified::llama_kv_cache_unified;
-//};
+// state cache of the recurrent models (Mamba, RWKV)
+// every sequence has one cell that holds the state of its whole past, seq_cp shares the cell and the state is copied only
+// when one of the sequences is updated
+// the states can be checkpointed at the end of the ubatches, in host memory, to roll the sequences back to earlier positions
+// cells[seq_id].tail is the cell that holds the state of seq_id, cells[i].src the cell the state of cell i is copied from
+class llama_kv_cache_recurrent : public llama_kv_cache_unified {
+public:
+    using llama_kv_cache_unified::llama_kv_cache_unified;
+
+    bool init(
+                   const llama_model & model,
+                 const llama_cparams & cparams,
+        const std::vector<ggml_type> & type_k,
+        const std::vector<ggml_type> & type_v,
+                            uint32_t   kv_size,
+                                bool   offload) override;
+
+    llama_pos pos_max() const override;
+
+    void clear() override;
+    void defrag() override;
+
+    void restore() override;
+    void commit() override;
+
+    bool seq_rm  (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1) override;
+    void seq_cp  (llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) override;
+    void seq_keep(llama_seq_id seq_id) override;
+    bool seq_add (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, llama_pos delta) override;
+    bool seq_div (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, int d) override;
+
+    llama_pos seq_pos_max(llama_seq_id seq_id) const override;
+    llama_pos seq_pos_rollback(llama_seq_id seq_id, llama_pos pos) const override;
+
+    int32_t seq_evict(llama_seq_id seq_id, int32_t n_sink, int32_t n_heavy, int32_t n_recent, llama_pos * pos_kept) override;
+
+    // one cell per sequence of the ubatch, the cells are contiguous from head
+    bool find_slot(const llama_ubatch & ubatch) override;
+
+    // checkpoints
+
+    // true if a sequence of the ubatch passed to find_slot is due for a checkpoint
+    bool ckpt_due(const llama_ubatch & ubatch) const;
+
+    // checkpoint the states of the sequences of the ubatch, its computation must be complete
+    void ckpt_save(const llama_ubatch & ubatch);
+
+protected:
+    bool state_read_meta(llama_io_read_i & io, uint32_t cell_count, llama_seq_id dest_seq_id = -1) override;
+
+private:
+    // set by init from llama_cparams
+    uint32_t n_ckpt    = 0; // max. checkpoints per sequence, 0 = no checkpoints
+    uint32_t ckpt_step = 1; // min. tokens between two checkpoints of a sequence
+
+    std::array<std::vector<llama_kv_state_ckpt>, LLAMA_MAX_SEQ> ckpts; // checkpoints of each sequence, ordered by position
+
+    // remove seq_id from cell i, the cell is freed if it has no sequence left
+    void cell_rm_seq(uint32_t i, llama_seq_id seq_id);
+
+    bool ckpt_due(llama_seq_id seq_id) const;
+
+    // roll seq_id back to its checkpoint at position pos, the state is written to a cell of its own
+    bool ckpt_restore(llama_seq_id seq_id, llama_pos pos);
+
+    // size of the state of one cell
+    size_t ckpt_size() const;
+};
 
 //
 // kv cache view
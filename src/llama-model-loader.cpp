@@ -5,6 +5,7 @@
 #include <array>
 #include <cinttypes>
 #include <cstring>
+#include <fstream>
 #include <future>
 
 static const size_t kiB = 1024;
@@ -21,6 +22,53 @@ const char * llama_file_version_name(llama_fver version) {
     return "unknown";
 }
 
+uint64_t llama_model_header_hash(const std::string & fname) {
+    struct gguf_init_params params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ NULL,
+    };
+    gguf_context_ptr ctx_gguf { gguf_init_from_file(fname.c_str(), params) };
+    if (!ctx_gguf) {
+        throw std::runtime_error(format("failed to read GGUF header from %s", fname.c_str()));
+    }
+
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    auto update = [&hash](const std::vector<uint8_t> & buf) {
+        for (uint8_t c : buf) {
+            hash = (hash ^ c) * 0x100000001b3ULL;
+        }
+    };
+
+    llama_file file(fname.c_str(), "rb");
+    const size_t data_offset = gguf_get_data_offset(ctx_gguf.get());
+
+    std::vector<uint8_t> buf(data_offset);
+    file.read_raw(buf.data(), buf.size());
+    update(buf);
+
+    for (int64_t i = 0; i < gguf_get_n_tensors(ctx_gguf.get()); ++i) {
+        buf.resize(std::min<size_t>(gguf_get_tensor_size(ctx_gguf.get(), i), 4096));
+        file.seek(data_offset + gguf_get_tensor_offset(ctx_gguf.get(), i), SEEK_SET);
+        file.read_raw(buf.data(), buf.size());
+        update(buf);
+    }
+
+    return hash;
+}
+
+// the base of an overlay is stored as it was given when the overlay was saved, relative paths are also looked up next to the overlay
+static std::string llama_overlay_base_path(const std::string & fname_overlay, const std::string & fname_base) {
+    if (fname_base.empty() || fname_base[0] == '/' || std::ifstream(fname_base).good()) {
+        return fname_base;
+    }
+    const size_t pos = fname_overlay.find_last_of("/\\");
+    if (pos == std::string::npos) {
+        return fname_base;
+    }
+    return fname_overlay.substr(0, pos + 1) + fname_base;
+}
+
 static std::string llama_model_ftype_name(llama_ftype ftype) {
     if (ftype & LLAMA_FTYPE_GUESSED) {
         return llama_model_ftype_name((enum llama_ftype) (ftype & ~LLAMA_FTYPE_GUESSED)) + " (guessed)";
@@ -472,10 +520,31 @@ llama_model_loader::llama_model_loader(
         throw std::runtime_error(format("%s: failed to load model from %s\n", __func__, fname.c_str()));
     }
 
+    // an overlay holds only the modified tensors of a base model,
+    // the base is loaded as the main file and the overlay tensors replace its tensors below
+    gguf_context_ptr meta_overlay;
+    ggml_context_ptr ctx_overlay;
+    {
+        std::string base;
+        if (get_key(llm_kv(LLM_KV_OVERLAY_BASE), base, false)) {
+            fname_base = llama_overlay_base_path(fname, base);
+            meta_overlay = std::move(meta);
+            ctx_overlay.reset(ctx);
+
+            LLAMA_LOG_INFO("%s: %s is an overlay, loading the base model from %s\n", __func__, fname.c_str(), fname_base.c_str());
+
+            meta.reset(gguf_init_from_file(fname_base.c_str(), params));
+            if (!meta) {
+                throw std::runtime_error(format("%s: failed to load base model from %s\n", __func__, fname_base.c_str()));
+            }
+        }
+    }
+    const std::string & fname_main = fname_base.empty() ? fname : fname_base;
+
     get_key(llm_kv(LLM_KV_GENERAL_ARCHITECTURE), arch_name, false);
     llm_kv = LLM_KV(llm_arch_from_string(arch_name));
 
-    files.emplace_back(new llama_file(fname.c_str(), "rb"));
+    files.emplace_back(new llama_file(fname_main.c_str(), "rb"));
     contexts.emplace_back(ctx);
 
     // Save tensors data offset of the main file.
@@ -501,12 +570,12 @@ llama_model_loader::llama_model_loader(
         const std::string kv_split_no = llm_kv(LLM_KV_SPLIT_NO);
         get_key(kv_split_no, idx);
         if (idx != 0) {
-            throw std::runtime_error(format("illegal split file idx: %d (file: %s), model must be loaded with the first split", idx, fname.c_str()));
+            throw std::runtime_error(format("illegal split file idx: %d (file: %s), model must be loaded with the first split", idx, fname_main.c_str()));
         }
 
         // generate list of splits if needed
         if (splits.empty()) {
-            splits = llama_get_list_splits(fname, idx, n_split);
+            splits = llama_get_list_splits(fname_main, idx, n_split);
         }
 
         // in case user give a custom list of splits, check if it matches the expected number
@@ -572,6 +641,38 @@ llama_model_loader::llama_model_loader(
         LLAMA_LOG_INFO("%s: additional %d GGUFs metadata loaded.\n",  __func__, n_split - 1);
     }
 
+    if (meta_overlay) {
+        const int kid = gguf_find_key(meta_overlay.get(), llm_kv(LLM_KV_OVERLAY_BASE_HASH).c_str());
+        if (kid < 0 || gguf_get_kv_type(meta_overlay.get(), kid) != GGUF_TYPE_UINT64) {
+            throw std::runtime_error(format("missing key %s in overlay %s", llm_kv(LLM_KV_OVERLAY_BASE_HASH).c_str(), fname.c_str()));
+        }
+        if (gguf_get_val_u64(meta_overlay.get(), kid) != llama_model_header_hash(fname_main)) {
+            throw std::runtime_error(format("overlay %s was not made for the base model %s", fname.c_str(), fname_main.c_str()));
+        }
+
+        files.emplace_back(new llama_file(fname.c_str(), "rb"));
+        const uint16_t idx = files.size() - 1;
+
+        int n_overlaid = 0;
+        for (ggml_tensor * cur = ggml_get_first_tensor(ctx_overlay.get()); cur; cur = ggml_get_next_tensor(ctx_overlay.get(), cur)) {
+            auto it = weights_map.find(cur->name);
+            if (it == weights_map.end()) {
+                throw std::runtime_error(format("overlay tensor '%s' is not in the base model", ggml_get_name(cur)));
+            }
+            const ggml_tensor * base = it->second.tensor;
+            if (base->type != cur->type || !ggml_are_same_shape(base, cur)) {
+                throw std::runtime_error(format("overlay tensor '%s' has type %s [%s], expected %s [%s]", ggml_get_name(cur),
+                            ggml_type_name(cur->type),  llama_format_tensor_shape(cur).c_str(),
+                            ggml_type_name(base->type), llama_format_tensor_shape(base).c_str()));
+            }
+            it->second = llama_tensor_weight(files.back().get(), idx, meta_overlay.get(), cur);
+            n_overlaid++;
+        }
+        contexts.emplace_back(std::move(ctx_overlay));
+
+        LLAMA_LOG_INFO("%s: %d tensors loaded from the overlay\n", __func__, n_overlaid);
+    }
+
     n_kv      = gguf_get_n_kv(meta.get());
     n_tensors = weights_map.size();
 
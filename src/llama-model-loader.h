@@ -23,6 +23,11 @@ enum llama_fver {
 
 const char * llama_file_version_name(llama_fver version);
 
+// hash of the GGUF header (metadata and tensor infos) and of the first bytes of every tensor of a model file,
+// cheap to compute for large models, but only a sample of the weights: changes past the first 4 KiB of a tensor are not seen
+// an overlay file stores the hash of its base model to detect that the base has been replaced
+uint64_t llama_model_header_hash(const std::string & fname);
+
 struct llama_model_loader {
     // Holds information on a model weight
     struct llama_tensor_weight {
@@ -87,6 +92,9 @@ struct llama_model_loader {
     std::string arch_name;
     LLM_KV      llm_kv    = LLM_KV(LLM_ARCH_UNKNOWN);
 
+    // set if fname is an overlay, the metadata and the tensors that are not in the overlay are loaded from this file
+    std::string fname_base;
+
     size_t size_done = 0;
     size_t size_data = 0;
     std::vector<std::pair<size_t, size_t>> mmaps_used;
@@ -347,6 +347,9 @@ struct llama_model {
     // gguf metadata
     std::unordered_map<std::string, std::string> gguf_kv;
 
+    // files the model was loaded from, the metadata is copied from them when saving a finetuned model
+    std::vector<std::string> paths;
+
     // list of devices used in this model
     std::vector<ggml_backend_dev_t> devices;
 
@@ -15,6 +15,7 @@
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <filesystem>
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
@@ -97,6 +98,8 @@ static int llama_model_load(const std::string & fname, std::vector<std::string>
         ml.print_info();
 
         model.hparams.vocab_only = params.vocab_only;
+        // the files of the base model when loading an overlay
+        model.paths = splits.empty() ? std::vector<std::string>{ ml.fname_base.empty() ? fname : ml.fname_base } : splits;
 
         try {
             model.load_arch(ml);
@@ -253,6 +256,29 @@ struct llama_model * llama_model_load_from_splits(
     return llama_model_load_from_file_impl(splits.front(), splits, params);
 }
 
+uint64_t llama_model_file_hash(const char * path_model) {
+    try {
+        // the header hash only samples the tensor data, so a finetune that keeps the shapes of its base and changes
+        // only later rows can hash equal to it - the size and the modification time of the file tell them apart
+        const uint64_t values[3] = {
+            llama_model_header_hash(path_model),
+            (uint64_t) std::filesystem::file_size(path_model),
+            (uint64_t) std::filesystem::last_write_time(path_model).time_since_epoch().count(),
+        };
+
+        // FNV-1a
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        const uint8_t * p = (const uint8_t *) values;
+        for (size_t i = 0; i < sizeof(values); ++i) {
+            hash = (hash ^ p[i]) * 0x100000001b3ULL;
+        }
+        return hash;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to hash model: %s\n", __func__, err.what());
+        return 0;
+    }
+}
+
 //
 // chat templates
 //
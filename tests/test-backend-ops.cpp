@@ -763,7 +763,7 @@ struct test_case {
 
         ggml_tensor * out = build_graph(ctx.get());
 
-        if ((op_name != nullptr && op_desc(out) != op_name) || out->op == GGML_OP_OPT_STEP_ADAMW) {
+        if ((op_name != nullptr && op_desc(out) != op_name) || out->op == GGML_OP_OPT_STEP_ADAMW || out->op == GGML_OP_OPT_STEP_ADAMW_8BIT) {
             //printf("  %s: skipping\n", op_desc(out).c_str());
             return true;
         }
@@ -3437,6 +3437,59 @@ struct test_opt_step_adamw : public test_case {
     }
 };
 
+// GGML_OP_OPT_STEP_ADAMW_8BIT
+struct test_opt_step_adamw_8bit : public test_case {
+    const std::array<int64_t, 4> ne;
+
+    std::string vars() override {
+        return VARS_TO_STR1(ne);
+    }
+
+    test_opt_step_adamw_8bit(std::array<int64_t, 4> ne = {10, 5, 4, 3})
+        : ne(ne) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        const int64_t nb = (ne[0] + GGML_OPT_ADAMW_8BIT_BLOCK - 1)/GGML_OPT_ADAMW_8BIT_BLOCK;
+
+        ggml_tensor * a = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, ne[0], ne[1], ne[2], ne[3]);
+        ggml_set_param(ctx, a); // Despite tensor a having gradients the output tensor will not.
+        ggml_set_name(a, "a");
+
+        ggml_tensor * grad = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, ne[0], ne[1], ne[2], ne[3]);
+        ggml_set_name(grad, "grad");
+
+        ggml_tensor * grad_m = ggml_new_tensor_4d(ctx, GGML_TYPE_I8, ne[0], ne[1], ne[2], ne[3]);
+        ggml_set_name(grad_m, "grad_m");
+
+        ggml_tensor * grad_v = ggml_new_tensor_4d(ctx, GGML_TYPE_I8, ne[0], ne[1], ne[2], ne[3]);
+        ggml_set_name(grad_v, "grad_v");
+
+        ggml_tensor * m_scale = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, nb, ne[1], ne[2], ne[3]);
+        ggml_set_name(m_scale, "m_scale");
+
+        ggml_tensor * v_scale = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, nb, ne[1], ne[2], ne[3]);
+        ggml_set_name(v_scale, "v_scale");
+
+        ggml_tensor * adamw_params = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 7);
+        ggml_set_name(adamw_params, "adamw_params");
+
+        ggml_tensor * out = ggml_opt_step_adamw_8bit(ctx, a, grad, grad_m, grad_v, m_scale, v_scale, adamw_params);
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+
+    void initialize_tensors(ggml_context * ctx) override {
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+            init_tensor_uniform(t, 0.0f, 1.0f); // v_scale and adamw_params need non-negative values.
+        }
+    }
+
+    bool grad_precise() override {
+        return true;
+    }
+};
+
 enum llm_norm_type {
     LLM_NORM,
     LLM_NORM_RMS,
@@ -4472,6 +4525,8 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
     test_cases.emplace_back(new test_cross_entropy_loss_back(GGML_TYPE_F32, {30000, 1, 1, 1}));
 
     test_cases.emplace_back(new test_opt_step_adamw(GGML_TYPE_F32, {10, 5, 4, 3}));
+    test_cases.emplace_back(new test_opt_step_adamw_8bit({10, 5, 4, 3}));
+    test_cases.emplace_back(new test_opt_step_adamw_8bit({150, 3, 2, 1})); // partial last block
 
     // these tests are disabled to save execution time, but they can be handy for debugging
 #if 0
@@ -0,0 +1,515 @@
+// checks the bookkeeping of the KV cache against linear scans of its cells
+// the models are tiny random llama and mamba models written by the test, with the vocab passed as the first argument
+
+#include "llama.h"
+#include "llama-batch.h"
+#include "llama-kv-cache.h"
+
+#include "ggml.h"
+#include "gguf.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+static const std::string path_model           = "test-kv-cache.gguf";
+static const std::string path_model_recurrent = "test-kv-cache-recurrent.gguf";
+
+// tiny model with random weights and the vocab of path_vocab, llama or mamba (recurrent)
+static void write_model(const char * path_vocab, bool recurrent) {
+    const int n_embd = 32, n_layer = 2;
+
+    gguf_context * vocab = gguf_init_from_file(path_vocab, { /*.no_alloc =*/ true, /*.ctx =*/ nullptr });
+    assert(vocab);
+
+    const int64_t n_vocab = gguf_get_arr_n(vocab, gguf_find_key(vocab, "tokenizer.ggml.tokens"));
+
+    gguf_context * gguf = gguf_init_empty();
+    gguf_set_kv(gguf, vocab);
+
+    ggml_context * ctx = ggml_init({ /*.mem_size =*/ 64ull*1024*1024, /*.mem_buffer =*/ nullptr, /*.no_alloc =*/ false });
+    assert(ctx);
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, recurrent ? 0.1f : 0.02f);
+
+    // fill = 0 for random values
+    auto add = [&](const std::string & name, int64_t ne0, int64_t ne1, float fill) {
+        ggml_tensor * t = ne1 == 1 ? ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0) : ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1);
+        ggml_set_name(t, name.c_str());
+
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            data[i] = fill != 0.0f ? fill : dist(rng);
+        }
+
+        gguf_add_tensor(gguf, t);
+    };
+
+    add("token_embd.weight",  n_embd, n_vocab, 0.0f);
+    add("output_norm.weight", n_embd, 1,       1.0f);
+    add("output.weight",      n_embd, n_vocab, 0.0f);
+
+    if (!recurrent) {
+        const int n_head = 4, n_head_kv = 2, n_ff = 64;
+
+        gguf_set_val_str(gguf, "general.architecture", "llama");
+        gguf_set_val_u32(gguf, "llama.context_length", 1024);
+        gguf_set_val_u32(gguf, "llama.embedding_length", n_embd);
+        gguf_set_val_u32(gguf, "llama.feed_forward_length", n_ff);
+        gguf_set_val_u32(gguf, "llama.attention.head_count", n_head);
+        gguf_set_val_u32(gguf, "llama.attention.head_count_kv", n_head_kv);
+        gguf_set_val_u32(gguf, "llama.block_count", n_layer);
+        gguf_set_val_u32(gguf, "llama.rope.dimension_count", n_embd/n_head);
+        gguf_set_val_f32(gguf, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+
+        for (int il = 0; il < n_layer; ++il) {
+            const std::string blk = "blk." + std::to_string(il) + ".";
+
+            add(blk + "attn_norm.weight",   n_embd, 1, 1.0f);
+            add(blk + "attn_q.weight",      n_embd, n_embd, 0.0f);
+            add(blk + "attn_k.weight",      n_embd, n_embd/n_head*n_head_kv, 0.0f);
+            add(blk + "attn_v.weight",      n_embd, n_embd/n_head*n_head_kv, 0.0f);
+            add(blk + "attn_output.weight", n_embd, n_embd, 0.0f);
+            add(blk + "ffn_norm.weight",    n_embd, 1, 1.0f);
+            add(blk + "ffn_gate.weight",    n_embd, n_ff, 0.0f);
+            add(blk + "ffn_up.weight",      n_embd, n_ff, 0.0f);
+            add(blk + "ffn_down.weight",    n_ff,   n_embd, 0.0f);
+        }
+    } else {
+        const int d_conv = 4, d_inner = 64, d_state = 8, dt_rank = 4;
+
+        gguf_set_val_str(gguf, "general.architecture", "mamba");
+        gguf_set_val_u32(gguf, "mamba.context_length", 1024);
+        gguf_set_val_u32(gguf, "mamba.embedding_length", n_embd);
+        gguf_set_val_u32(gguf, "mamba.feed_forward_length", 0);
+        gguf_set_val_u32(gguf, "mamba.attention.head_count", 0);
+        gguf_set_val_u32(gguf, "mamba.block_count", n_layer);
+        gguf_set_val_u32(gguf, "mamba.ssm.conv_kernel", d_conv);
+        gguf_set_val_u32(gguf, "mamba.ssm.inner_size", d_inner);
+        gguf_set_val_u32(gguf, "mamba.ssm.state_size", d_state);
+        gguf_set_val_u32(gguf, "mamba.ssm.time_step_rank", dt_rank);
+        gguf_set_val_f32(gguf, "mamba.attention.layer_norm_rms_epsilon", 1e-5f);
+
+        for (int il = 0; il < n_layer; ++il) {
+            const std::string blk = "blk." + std::to_string(il) + ".";
+
+            add(blk + "attn_norm.weight",  n_embd,  1, 1.0f);
+            add(blk + "ssm_in.weight",     n_embd,  2*d_inner, 0.0f);
+            add(blk + "ssm_conv1d.weight", d_conv,  d_inner, 0.0f);
+            add(blk + "ssm_conv1d.bias",   d_inner, 1, 0.0f);
+            add(blk + "ssm_x.weight",      d_inner, dt_rank + 2*d_state, 0.0f);
+            add(blk + "ssm_dt.weight",     dt_rank, d_inner, 0.0f);
+            add(blk + "ssm_dt.bias",       d_inner, 1, 0.0f);
+            add(blk + "ssm_a",             d_state, d_inner, -0.5f);
+            add(blk + "ssm_d",             d_inner, 1, 1.0f);
+            add(blk + "ssm_out.weight",    d_inner, n_embd, 0.0f);
+        }
+    }
+
+    assert(gguf_write_to_file(gguf, (recurrent ? path_model_recurrent : path_model).c_str(), false));
+
+    ggml_free(ctx);
+    gguf_free(gguf);
+    gguf_free(vocab);
+}
+
+// (seq_id, pos, cell) of all the cells, from a linear scan
+using cell_list = std::vector<std::tuple<llama_seq_id, llama_pos, uint32_t>>;
+
+static cell_list scan_cells(const llama_kv_cache_unified & kv) {
+    cell_list res;
+
+    for (uint32_t i = 0; i < kv.size; ++i) {
+        for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+            if (kv.cells[i].has_seq_id(s)) {
+                res.emplace_back(s, kv.cells[i].pos, i);
+            }
+        }
+    }
+
+    std::sort(res.begin(), res.end());
+
+    return res;
+}
+
+// the position index and seq_pos_max must match the linear scan
+static void check_seq_pos(const llama_kv_cache_unified & kv) {
+    cell_list idx;
+
+    for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        const auto & data = kv.seq_pos[s].data;
+
+        for (size_t k = 1; k < data.size(); ++k) {
+            assert(data[k - 1].first <= data[k].first);
+        }
+
+        for (const auto & e : data) {
+            idx.emplace_back(s, e.first, e.second);
+        }
+
+        llama_pos pos_max = 0;
+        for (uint32_t i = 0; i < kv.size; ++i) {
+            if (kv.cells[i].has_seq_id(s)) {
+                pos_max = std::max(pos_max, kv.cells[i].pos);
+            }
+        }
+
+        assert(kv.seq_pos_max(s) == pos_max);
+    }
+
+    std::sort(idx.begin(), idx.end());
+
+    assert(idx == scan_cells(kv));
+}
+
+static void test_seq_pos(llama_model * model, uint32_t n_kv_block) {
+    printf("test-kv-cache: seq_pos, n_kv_block = %u\n", n_kv_block);
+
+    const int n_seq = 4;
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx      = 256;
+    cparams.n_batch    = 256;
+    cparams.n_seq_max  = n_seq;
+    cparams.n_kv_block = n_kv_block;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx);
+
+    auto * kv = dynamic_cast<llama_kv_cache_unified *>(llama_get_kv_self(ctx));
+    assert(kv);
+
+    std::mt19937 rng(1234);
+
+    auto rand_seq = [&]() { return (llama_seq_id) (rng() % n_seq); };
+    auto rand_pos = [&]() { return (llama_pos) (rng() % 80) - 10; };
+
+    for (int it = 0; it < 4000; ++it) {
+        const int op = rng() % 8;
+
+        if (op < 3) {
+            // tokens of one or two sequences, usually after the last position of the first one
+            const uint32_t n_tokens = 1 + rng() % 8;
+
+            llama_seq_id seq_ids[2] = { rand_seq(), rand_seq() };
+            llama_seq_id * seq_id_ptr = seq_ids;
+            int32_t n_seq_id = rng() % 4 == 0 && seq_ids[0] != seq_ids[1] ? 2 : 1;
+
+            const llama_pos p0 = rng() % 4 == 0 ? rand_pos() + 10 : kv->seq_pos_max(seq_ids[0]) + 1;
+
+            std::vector<llama_pos>    pos(n_tokens);
+            std::vector<int32_t>      n_seq_ids(n_tokens, n_seq_id);
+            std::vector<llama_seq_id *> seq_id(n_tokens, seq_id_ptr);
+
+            for (uint32_t k = 0; k < n_tokens; ++k) {
+                pos[k] = p0 + k;
+            }
+
+            llama_ubatch ubatch = {};
+            ubatch.equal_seqs   = true;
+            ubatch.n_tokens     = n_tokens;
+            ubatch.n_seq_tokens = n_tokens;
+            ubatch.n_seqs       = 1;
+            ubatch.pos          = pos.data();
+            ubatch.n_seq_id     = n_seq_ids.data();
+            ubatch.seq_id       = seq_id.data();
+
+            if (kv->find_slot(ubatch)) {
+                kv->commit();
+            }
+        } else if (op == 3) {
+            // seq_rm must remove exactly the cells of the range
+            const llama_seq_id s = rng() % 8 == 0 ? -1 : rand_seq();
+            const llama_pos p0 = rand_pos();
+            const llama_pos p1 = rng() % 4 == 0 ? -1 : rand_pos();
+
+            cell_list expected;
+            for (const auto & c : scan_cells(*kv)) {
+                const llama_pos pos = std::get<1>(c);
+                const bool in_range = pos >= std::max(p0, 0) && (p1 < 0 || pos < p1);
+
+                if (!((s < 0 || std::get<0>(c) == s) && in_range)) {
+                    expected.push_back(c);
+                }
+            }
+
+            kv->seq_rm(s, p0, p1);
+
+            assert(scan_cells(*kv) == expected);
+        } else if (op == 4) {
+            kv->seq_cp(rand_seq(), rand_seq(), rand_pos(), rng() % 2 ? -1 : rand_pos());
+        } else if (op == 5) {
+            kv->seq_add(rand_seq(), rand_pos(), rng() % 2 ? -1 : rand_pos(), (llama_pos) (rng() % 21) - 10);
+        } else if (op == 6) {
+            kv->seq_div(rand_seq(), rand_pos(), rng() % 2 ? -1 : rand_pos(), 1 + rng() % 3);
+        } else if (rng() % 16 == 0) {
+            kv->seq_keep(rand_seq());
+        }
+
+        check_seq_pos(*kv);
+    }
+
+    llama_free(ctx);
+}
+
+// decode tokens[p0, p1) in seq_id, return the logits of the last token
+static std::vector<float> decode(llama_context * ctx, const std::vector<llama_token> & tokens, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    llama_batch batch = llama_batch_init(p1 - p0, 0, 1);
+
+    for (llama_pos p = p0; p < p1; ++p) {
+        const int32_t k = batch.n_tokens++;
+
+        batch.token[k]     = tokens[p];
+        batch.pos[k]       = p;
+        batch.n_seq_id[k]  = 1;
+        batch.seq_id[k][0] = seq_id;
+        batch.logits[k]    = p == p1 - 1;
+    }
+
+    assert(llama_decode(ctx, batch) == 0);
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+    const float * logits = llama_get_logits_ith(ctx, -1);
+
+    llama_batch_free(batch);
+
+    return std::vector<float>(logits, logits + n_vocab);
+}
+
+static std::vector<uint8_t> state_seq(llama_context * ctx, llama_seq_id seq_id) {
+    std::vector<uint8_t> state(llama_state_seq_get_size(ctx, seq_id));
+    assert(llama_state_seq_get_data(ctx, state.data(), state.size(), seq_id) == state.size());
+    return state;
+}
+
+static float max_diff(const std::vector<float> & a, const std::vector<float> & b) {
+    assert(a.size() == b.size());
+
+    float res = 0.0f;
+    for (size_t i = 0; i < a.size(); ++i) {
+        res = std::max(res, std::fabs(a[i] - b[i]));
+    }
+    return res;
+}
+
+// incremental defrag: a fragmented cache is compacted over several bounded steps
+static void test_defrag(llama_model * model) {
+    printf("test-kv-cache: defrag\n");
+
+    const int n_seq = 4;
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx          = 256;
+    cparams.n_batch        = 256;
+    cparams.n_seq_max      = n_seq;
+    cparams.defrag_step_us = 1; // at least one cell per step
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    std::mt19937 rng(91011);
+
+    std::vector<std::vector<llama_token>> tokens(n_seq, std::vector<llama_token>(64));
+    for (auto & seq : tokens) {
+        for (auto & t : seq) {
+            t = rng() % n_vocab;
+        }
+    }
+
+    // the sequences are decoded in turns, their cells interleave
+    auto decode_seqs = [&](llama_context * ctx, const std::vector<llama_seq_id> & seq_ids) {
+        for (llama_pos p = 0; p < 48; p += 8) {
+            for (llama_seq_id s : seq_ids) {
+                decode(ctx, tokens[s], s, p, p + 8);
+            }
+        }
+    };
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx);
+
+    auto * kv = dynamic_cast<llama_kv_cache_unified *>(llama_get_kv_self(ctx));
+    assert(kv);
+
+    decode_seqs(ctx, { 0, 1, 2, 3 });
+
+    // every other run of 8 cells becomes a hole
+    assert(llama_kv_self_seq_rm(ctx, 1, -1, -1));
+    assert(llama_kv_self_seq_rm(ctx, 3, -1, -1));
+    assert(llama_kv_self_used_cells(ctx) == 96);
+
+    llama_kv_self_defrag(ctx);
+
+    int n_steps = 0;
+    do {
+        llama_kv_self_update(ctx);
+        n_steps++;
+
+        assert(n_steps < 1000);
+        assert(kv->defrag_info.n_cells > 0 || kv->defrag_info.complete);
+
+        check_seq_pos(*kv);
+    } while (!kv->defrag_info.complete);
+
+    printf("test-kv-cache: defrag, %d steps\n", n_steps);
+
+    assert(n_steps > 1);
+    assert(!kv->do_defrag);
+
+    for (uint32_t i = 0; i < kv->size; ++i) {
+        assert(kv->cells[i].is_empty() == (i >= 96));
+    }
+
+    // the moved cells keep their data
+    const std::vector<float> logits0 = decode(ctx, tokens[0], 0, 48, 49);
+    const std::vector<float> logits2 = decode(ctx, tokens[2], 2, 48, 49);
+
+    llama_free(ctx);
+
+    llama_context * ctx_ref = llama_init_from_model(model, cparams);
+    assert(ctx_ref);
+
+    decode_seqs(ctx_ref, { 0, 2 });
+
+    const std::vector<float> logits0_ref = decode(ctx_ref, tokens[0], 0, 48, 49);
+    const std::vector<float> logits2_ref = decode(ctx_ref, tokens[2], 2, 48, 49);
+
+    llama_free(ctx_ref);
+
+    assert(max_diff(logits0, logits0_ref) < 1e-4f);
+    assert(max_diff(logits2, logits2_ref) < 1e-4f);
+}
+
+// recurrent cache: shared cells with copy-on-update and the rollback to the state checkpoints
+static void test_recurrent(llama_model * model) {
+    printf("test-kv-cache: recurrent\n");
+
+    const uint32_t n_ubatch = 8;
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = 256;
+    cparams.n_batch         = 64;
+    cparams.n_ubatch        = n_ubatch;
+    cparams.n_seq_max       = 2;
+    cparams.n_state_ckpt    = 4;
+    cparams.state_ckpt_step = n_ubatch;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx);
+
+    auto * kv = dynamic_cast<llama_kv_cache_recurrent *>(llama_get_kv_self(ctx));
+    assert(kv);
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    std::mt19937 rng(5678);
+
+    std::vector<llama_token> tokens(64);
+    for (auto & t : tokens) {
+        t = rng() % n_vocab;
+    }
+
+    // checkpoints at the end of the ubatches: 7, 15, 23 and 31
+    decode(ctx, tokens, 0, 0, 32);
+    assert(llama_kv_self_seq_pos_max(ctx, 0) == 31);
+
+    // the copy shares the cell of the state
+    llama_kv_self_seq_cp(ctx, 0, 1, -1, -1);
+
+    const int32_t tail = kv->cells[0].tail;
+    assert(tail >= 0);
+    assert(kv->cells[1].tail == tail);
+    assert(kv->cells[tail].has_seq_id(0) && kv->cells[tail].has_seq_id(1));
+    assert(llama_kv_self_used_cells(ctx) == 1);
+
+    // updating one of the sequences copies the state, the other one keeps it
+    const std::vector<uint8_t> state0 = state_seq(ctx, 0);
+
+    decode(ctx, tokens, 1, 32, 40);
+
+    assert(kv->cells[0].tail != kv->cells[1].tail);
+    assert(!kv->cells[kv->cells[0].tail].has_seq_id(1));
+    assert(!kv->cells[kv->cells[1].tail].has_seq_id(0));
+    assert(llama_kv_self_seq_pos_max(ctx, 0) == 31);
+    assert(llama_kv_self_seq_pos_max(ctx, 1) == 39);
+    assert(state_seq(ctx, 0) == state0);
+
+    // rollback to the last checkpoint at or before the position
+    assert(llama_kv_self_seq_pos_rollback(ctx, 0, 40) == 40);
+    assert(llama_kv_self_seq_pos_rollback(ctx, 0, 31) == 31);
+    assert(llama_kv_self_seq_pos_rollback(ctx, 0, 20) == 15);
+    assert(llama_kv_self_seq_pos_rollback(ctx, 0,  6) == -1);
+
+    // there is no state to go back to
+    assert(!llama_kv_self_seq_rm(ctx, 0, 20, -1));
+    assert(llama_kv_self_seq_pos_max(ctx, 0) == 31);
+
+    // the sequence continues from the checkpoint as if the later tokens were never decoded
+    assert(llama_kv_self_seq_rm(ctx, 0, 16, -1));
+    assert(llama_kv_self_seq_pos_max(ctx, 0) == 15);
+    assert(llama_kv_self_seq_pos_rollback(ctx, 0, 20) == 20);
+
+    const std::vector<float> logits = decode(ctx, tokens, 0, 16, 17);
+
+    // seq 1 keeps its copies of the checkpoints
+    assert(llama_kv_self_seq_pos_rollback(ctx, 1, 30) == 23);
+
+    llama_free(ctx);
+
+    llama_context * ctx_ref = llama_init_from_model(model, cparams);
+    assert(ctx_ref);
+
+    decode(ctx_ref, tokens, 0, 0, 16);
+    const std::vector<float> logits_ref = decode(ctx_ref, tokens, 0, 16, 17);
+
+    llama_free(ctx_ref);
+
+    assert(max_diff(logits, logits_ref) < 1e-5f);
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    llama_backend_init();
+    llama_log_set([](ggml_log_level level, const char * text, void *) {
+        if (level >= GGML_LOG_LEVEL_ERROR) {
+            fputs(text, stderr);
+        }
+    }, nullptr);
+
+    write_model(argv[1], false);
+    write_model(argv[1], true);
+
+    llama_model * model = llama_model_load_from_file(path_model.c_str(), llama_model_default_params());
+    assert(model);
+
+    test_seq_pos(model, 0);
+    test_seq_pos(model, 16);
+    test_defrag(model);
+
+    llama_model_free(model);
+
+    model = llama_model_load_from_file(path_model_recurrent.c_str(), llama_model_default_params());
+    assert(model);
+
+    test_recurrent(model);
+
+    llama_model_free(model);
+
+    std::remove(path_model.c_str());
+    std::remove(path_model_recurrent.c_str());
+
+    printf("test-kv-cache: OK\n");
+
+    return 0;
+}
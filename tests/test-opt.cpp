@@ -673,6 +673,387 @@ static std::pair<int, int> test_gradient_accumulation(
     return std::make_pair(npass, ntest);
 }
 
+struct helper_grad_callback_data {
+    struct ggml_tensor * weights;
+    float grad_expected;
+
+    int  n_grad  = 0;
+    int  n_final = 0;
+    bool ok      = true;
+};
+
+// checks the gradient and negates it, the optimizer step must then increase the weights instead of decreasing them
+static void helper_grad_callback(struct ggml_tensor * param, struct ggml_tensor * grad, void * userdata) {
+    helper_grad_callback_data * data = (helper_grad_callback_data *) userdata;
+    if (!param) {
+        data->ok = data->ok && grad == nullptr && data->n_final + 1 == data->n_grad;
+        data->n_final++;
+        return;
+    }
+    data->ok = data->ok && param == data->weights && data->n_grad == data->n_final;
+    data->n_grad++;
+
+    float g;
+    ggml_backend_tensor_get(grad, &g, 0, sizeof(float));
+    data->ok = data->ok && g == data->grad_expected;
+    g = -g;
+    ggml_backend_tensor_set(grad, &g, 0, sizeof(float));
+}
+
+static std::pair<int, int> test_grad_callback(ggml_backend_sched_t backend_sched, ggml_backend_t backend) {
+    int ntest = 0;
+    int npass = 0;
+
+    for (int32_t opt_period : {1, 2}) {
+        struct helper_ctx_data cd = helper_get_ctx_data(
+            backend_sched, backend, /*init_opt_ctx =*/ false, /*optimizer_defaults =*/ false, /*nbatch_logical =*/ opt_period);
+
+        // the loss is the sum of the outputs, each physical batch adds 1 to the gradient of the weights
+        helper_grad_callback_data data;
+        data.weights       = cd.weights;
+        data.grad_expected = opt_period;
+
+        cd.opt_params.grad_callback    = helper_grad_callback;
+        cd.opt_params.grad_callback_ud = &data;
+        cd.opt_ctx = ggml_opt_init(cd.opt_params);
+
+        const int nsteps = 2;
+        for (int idata = 0; idata < nsteps*opt_period; ++idata) {
+            const float idataf = idata;
+            ggml_backend_tensor_set(cd.inputs, &idataf, 0, sizeof(float));
+            ggml_opt_forward_backward(cd.opt_ctx, cd.result);
+        }
+
+        const std::string options = ", opt_period=" + std::to_string(opt_period);
+        {
+            const bool subtest_ok = data.ok && data.n_grad == nsteps && data.n_final == nsteps;
+            helper_after_test(__func__, false, options, "calls", subtest_ok, ntest, npass);
+        }
+        {
+            float weights;
+            ggml_backend_tensor_get(cd.weights, &weights, 0, sizeof(float));
+            const bool subtest_ok = weights == (ndata/2) + nsteps;
+            helper_after_test(__func__, false, options, "weights", subtest_ok, ntest, npass);
+        }
+
+        helper_free_ctx_data(cd);
+    }
+
+    return std::make_pair(npass, ntest);
+}
+
+static std::pair<int, int> test_timings(ggml_backend_sched_t backend_sched, ggml_backend_t backend) {
+    int ntest = 0;
+    int npass = 0;
+
+    for (int32_t opt_period : {1, 2}) {
+        struct helper_ctx_data cd = helper_get_ctx_data(
+            backend_sched, backend, /*init_opt_ctx =*/ false, /*optimizer_defaults =*/ false, /*nbatch_logical =*/ opt_period);
+
+        cd.opt_params.timings = true;
+        cd.opt_ctx = ggml_opt_init(cd.opt_params);
+
+        // forward pass only, then optimizer steps which are split into phases
+        const float idataf0 = 0.0f;
+        ggml_backend_tensor_set(cd.inputs, &idataf0, 0, sizeof(float));
+        ggml_opt_forward(cd.opt_ctx, nullptr);
+
+        struct ggml_opt_timings timings_fwd;
+        ggml_opt_get_timings(cd.opt_ctx, &timings_fwd);
+
+        const int nsteps = 2;
+        for (int idata = 0; idata < nsteps*opt_period; ++idata) {
+            const float idataf = idata;
+            ggml_backend_tensor_set(cd.inputs, &idataf, 0, sizeof(float));
+            ggml_opt_forward_backward(cd.opt_ctx, cd.result);
+        }
+
+        struct ggml_opt_timings timings;
+        ggml_opt_get_timings(cd.opt_ctx, &timings);
+
+        const std::string options = ", opt_period=" + std::to_string(opt_period);
+        {
+            const bool subtest_ok =
+                timings_fwd.n_eval == 1 && timings_fwd.flops > 0.0 && timings_fwd.t_backward_us == 0 && timings_fwd.t_opt_us == 0 &&
+                timings.n_eval == 1 + nsteps*opt_period && timings.flops > (1 + nsteps*opt_period)*timings_fwd.flops &&
+                timings.t_forward_us >= timings_fwd.t_forward_us && timings.t_backward_us >= 0 && timings.t_opt_us >= 0;
+            helper_after_test(__func__, false, options, "timings", subtest_ok, ntest, npass);
+        }
+        {
+            // the split evaluation must not change the result, each step moves the weights by the learning rate
+            float weights;
+            ggml_backend_tensor_get(cd.weights, &weights, 0, sizeof(float));
+            const bool subtest_ok = weights == (ndata/2) - nsteps;
+            helper_after_test(__func__, false, options, "weights", subtest_ok, ntest, npass);
+        }
+        {
+            ggml_opt_reset_timings(cd.opt_ctx);
+            ggml_opt_get_timings(cd.opt_ctx, &timings);
+            const bool subtest_ok = timings.n_eval == 0 && timings.flops == 0.0 &&
+                timings.t_forward_us == 0 && timings.t_backward_us == 0 && timings.t_opt_us == 0;
+            helper_after_test(__func__, false, options, "reset", subtest_ok, ntest, npass);
+        }
+
+        helper_free_ctx_data(cd);
+    }
+
+    return std::make_pair(npass, ntest);
+}
+
+static std::pair<int, int> test_checkpointing(ggml_backend_t backend) {
+    int ntest = 0;
+    int npass = 0;
+
+    // Deep elementwise network f(x) = silu(w_n*...silu(w_1*x)), checkpointed every ncheckpoint layers.
+    // The gradients must be the same as without checkpoints while fewer activations are kept alive.
+
+    constexpr int64_t ne_x        = 4096;
+    constexpr int     nlayer      = 16;
+    constexpr int     ncheckpoint = 4;
+
+    struct ggml_context * ctx_static;
+    {
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ (nlayer + 1)*ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+        ctx_static = ggml_init(params);
+    }
+
+    struct ggml_tensor * x = ggml_new_tensor_1d(ctx_static, GGML_TYPE_F32, ne_x);
+    ggml_set_name(x, "x");
+
+    std::vector<struct ggml_tensor *> weights(nlayer);
+    for (int il = 0; il < nlayer; ++il) {
+        weights[il] = ggml_new_tensor_1d(ctx_static, GGML_TYPE_F32, ne_x);
+        ggml_format_name(weights[il], "w%d", il);
+        ggml_set_param(ctx_static, weights[il]);
+    }
+
+    ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors(ctx_static, backend);
+    {
+        std::mt19937 gen(12345);
+        std::uniform_real_distribution<float> ud{0.5f, 1.5f};
+        std::vector<float> tmp(ne_x);
+        for (float & v : tmp) {
+            v = ud(gen);
+        }
+        ggml_backend_tensor_set(x, tmp.data(), 0, ggml_nbytes(x));
+        for (struct ggml_tensor * w : weights) {
+            for (float & v : tmp) {
+                v = ud(gen);
+            }
+            ggml_backend_tensor_set(w, tmp.data(), 0, ggml_nbytes(w));
+        }
+    }
+
+    std::vector<std::vector<float>> grads[2];
+    size_t buffer_size[2];
+
+    for (const bool checkpointing : {false, true}) {
+        struct ggml_context * ctx_compute;
+        {
+            struct ggml_init_params params = {
+                /*.mem_size   =*/ GGML_DEFAULT_GRAPH_SIZE*ggml_tensor_overhead() + 3*ggml_graph_overhead(),
+                /*.mem_buffer =*/ nullptr,
+                /*.no_alloc   =*/ true,
+            };
+            ctx_compute = ggml_init(params);
+        }
+
+        std::vector<struct ggml_tensor *> checkpoints;
+        struct ggml_tensor * cur = x;
+        for (int il = 0; il < nlayer; ++il) {
+            cur = ggml_silu(ctx_compute, ggml_mul(ctx_compute, cur, weights[il]));
+            if ((il + 1) % ncheckpoint == 0) {
+                checkpoints.push_back(cur);
+            }
+        }
+        struct ggml_tensor * outputs = cur;
+
+        ggml_backend_sched_t backend_sched = ggml_backend_sched_new(&backend, nullptr, 1, GGML_DEFAULT_GRAPH_SIZE, false);
+
+        struct ggml_opt_params opt_params = ggml_opt_default_params(backend_sched, ctx_compute, x, outputs, GGML_OPT_LOSS_TYPE_SUM);
+        opt_params.opt_period = 999999; // only accumulate gradients
+        if (checkpointing) {
+            opt_params.checkpoints   = checkpoints.data();
+            opt_params.n_checkpoints = checkpoints.size();
+        }
+        ggml_opt_context_t opt_ctx = ggml_opt_init(opt_params);
+
+        ggml_opt_forward_backward(opt_ctx, nullptr);
+
+        for (struct ggml_tensor * w : weights) {
+            std::vector<float> grad(ne_x);
+            ggml_backend_tensor_get(ggml_opt_grad_acc(opt_ctx, w), grad.data(), 0, ggml_nbytes(w));
+            grads[checkpointing].push_back(grad);
+        }
+        buffer_size[checkpointing] = ggml_backend_sched_get_buffer_size(backend_sched, backend);
+
+        ggml_opt_free(opt_ctx);
+        ggml_backend_sched_free(backend_sched);
+        ggml_free(ctx_compute);
+    }
+
+    {
+        bool subtest_ok = true;
+        for (int il = 0; il < nlayer; ++il) {
+            for (int64_t i = 0; i < ne_x; ++i) {
+                subtest_ok = subtest_ok && almost_equal(grads[1][il][i], grads[0][il][i], 1e-6);
+            }
+        }
+        printf("  %s(subtest=grads): ", __func__);
+        if (subtest_ok) {
+            printf("\033[1;32mOK\033[0m\n");
+            npass++;
+        } else {
+            printf("\033[1;31mFAIL\033[0m\n");
+        }
+        ntest++;
+    }
+    {
+        const bool subtest_ok = buffer_size[1] < buffer_size[0];
+        printf("  %s(subtest=memory, %zu vs. %zu bytes): ", __func__, buffer_size[1], buffer_size[0]);
+        if (subtest_ok) {
+            printf("\033[1;32mOK\033[0m\n");
+            npass++;
+        } else {
+            printf("\033[1;31mFAIL\033[0m\n");
+        }
+        ntest++;
+    }
+
+    ggml_backend_buffer_free(buf);
+    ggml_free(ctx_static);
+
+    return std::make_pair(npass, ntest);
+}
+
+static ggml_opt_optimizer_params helper_get_adamw_8bit_opt_pars(void * userdata) {
+    ggml_opt_optimizer_params result = ggml_opt_get_default_optimizer_params(userdata);
+    result.adamw.alpha = 0.01f;
+    result.adamw.wd    = 0.01f;
+    return result;
+}
+
+static std::pair<int, int> test_adamw_8bit(ggml_backend_sched_t backend_sched, ggml_backend_t backend) {
+    int ntest = 0;
+    int npass = 0;
+
+    // Minimize sum((w - t)^2) with targets spanning several orders of magnitude.
+    // The rows are not a multiple of the quantization block size so the last block of each row is partial.
+    // The trajectory with 8-bit moments must stay close to the one with f32 moments.
+
+    constexpr int64_t ne0   = 1000;
+    constexpr int64_t ne1   = 4;
+    constexpr int     nstep = 100;
+
+    std::vector<float> targets(ne0*ne1);
+    {
+        std::mt19937 gen(12345);
+        std::uniform_real_distribution<float> ud_exp{-3.0f, 1.0f};
+        std::bernoulli_distribution           bd_sign{0.5};
+        for (float & t : targets) {
+            t = (bd_sign(gen) ? -1.0f : 1.0f) * powf(10.0f, ud_exp(gen));
+        }
+    }
+
+    std::vector<float> weights[2];
+    double             loss[2];
+
+    for (const bool adamw_8bit : {false, true}) {
+        struct ggml_context * ctx_static;
+        struct ggml_context * ctx_compute;
+        {
+            struct ggml_init_params params = {
+                /*.mem_size   =*/ 2*ggml_tensor_overhead(),
+                /*.mem_buffer =*/ nullptr,
+                /*.no_alloc   =*/ true,
+            };
+            ctx_static = ggml_init(params);
+        }
+        {
+            struct ggml_init_params params = {
+                /*.mem_size   =*/ GGML_DEFAULT_GRAPH_SIZE*ggml_tensor_overhead() + 3*ggml_graph_overhead(),
+                /*.mem_buffer =*/ nullptr,
+                /*.no_alloc   =*/ true,
+            };
+            ctx_compute = ggml_init(params);
+        }
+
+        struct ggml_tensor * t = ggml_new_tensor_2d(ctx_static, GGML_TYPE_F32, ne0, ne1);
+        ggml_set_name(t, "t");
+
+        struct ggml_tensor * w = ggml_new_tensor_2d(ctx_static, GGML_TYPE_F32, ne0, ne1);
+        ggml_set_name(w, "w");
+        ggml_set_param(ctx_static, w);
+
+        struct ggml_tensor * outputs = ggml_sqr(ctx_compute, ggml_sub(ctx_compute, w, t));
+
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors(ctx_static, backend);
+        ggml_backend_tensor_set(t, targets.data(), 0, ggml_nbytes(t));
+        {
+            std::vector<float> zero(ne0*ne1, 0.0f);
+            ggml_backend_tensor_set(w, zero.data(), 0, ggml_nbytes(w));
+        }
+
+        struct ggml_opt_params opt_params = ggml_opt_default_params(backend_sched, ctx_compute, t, outputs, GGML_OPT_LOSS_TYPE_SUM);
+        opt_params.adamw_8bit   = adamw_8bit;
+        opt_params.get_opt_pars = helper_get_adamw_8bit_opt_pars;
+        ggml_opt_context_t opt_ctx = ggml_opt_init(opt_params);
+        ggml_opt_result_t  result  = ggml_opt_result_init();
+
+        for (int step = 0; step < nstep; ++step) {
+            ggml_opt_result_reset(result);
+            ggml_opt_forward_backward(opt_ctx, result);
+        }
+        ggml_opt_result_loss(result, &loss[adamw_8bit], nullptr);
+
+        weights[adamw_8bit].resize(ne0*ne1);
+        ggml_backend_tensor_get(w, weights[adamw_8bit].data(), 0, ggml_nbytes(w));
+
+        ggml_opt_result_free(result);
+        ggml_opt_free(opt_ctx);
+        ggml_backend_buffer_free(buf);
+        ggml_free(ctx_static);
+        ggml_free(ctx_compute);
+    }
+
+    {
+        // rms deviation between the trajectories relative to the rms distance traveled from w = 0
+        double sum_diff2 = 0.0;
+        double sum_w2    = 0.0;
+        for (int64_t i = 0; i < ne0*ne1; ++i) {
+            sum_diff2 += (weights[1][i] - weights[0][i])*(weights[1][i] - weights[0][i]);
+            sum_w2    += weights[0][i]*weights[0][i];
+        }
+        const double rel_diff = sqrt(sum_diff2/sum_w2);
+        const bool subtest_ok = rel_diff < 0.1;
+        printf("  %s(subtest=weights, rel_diff=%.2e): ", __func__, rel_diff);
+        if (subtest_ok) {
+            printf("\033[1;32mOK\033[0m\n");
+            npass++;
+        } else {
+            printf("\033[1;31mFAIL\033[0m\n");
+        }
+        ntest++;
+    }
+    {
+        const bool subtest_ok = almost_equal(loss[1], loss[0], 1e-2*loss[0]);
+        printf("  %s(subtest=loss, %.4f vs. %.4f): ", __func__, loss[1], loss[0]);
+        if (subtest_ok) {
+            printf("\033[1;32mOK\033[0m\n");
+            npass++;
+        } else {
+            printf("\033[1;31mFAIL\033[0m\n");
+        }
+        ntest++;
+    }
+
+    return std::make_pair(npass, ntest);
+}
+
 static ggml_opt_optimizer_params helper_get_regression_opt_pars(void * userdata) {
     ggml_opt_optimizer_params result = ggml_opt_get_default_optimizer_params(userdata);
     result.adamw.alpha = 0.1f;
@@ -817,6 +1198,26 @@ static std::pair<int, int> test_backend(ggml_backend_sched_t backend_sched, ggml
             ntest += partial.second;
         }
     }
+    {
+        std::pair<int, int> partial = test_grad_callback(backend_sched, backend);
+        npass += partial.first;
+        ntest += partial.second;
+    }
+    {
+        std::pair<int, int> partial = test_timings(backend_sched, backend);
+        npass += partial.first;
+        ntest += partial.second;
+    }
+    {
+        std::pair<int, int> partial = test_checkpointing(backend);
+        npass += partial.first;
+        ntest += partial.second;
+    }
+    {
+        std::pair<int, int> partial = test_adamw_8bit(backend_sched, backend);
+        npass += partial.first;
+        ntest += partial.second;
+    }
     {
         std::pair<int, int> partial = test_regression(backend_sched, backend);
         npass += partial.first;
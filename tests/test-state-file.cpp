@@ -0,0 +1,182 @@
+#include "state-file.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+static const std::string path = "test-state-file.tmp";
+
+static std::vector<uint8_t> read_file(const std::string & fname) {
+    std::vector<uint8_t> data;
+    FILE * f = fopen(fname.c_str(), "rb");
+    assert(f);
+    uint8_t buf[4096];
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0; ) {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(f);
+    return data;
+}
+
+static void write_file(const std::string & fname, const std::vector<uint8_t> & data) {
+    FILE * f = fopen(fname.c_str(), "wb");
+    assert(f);
+    assert(fwrite(data.data(), 1, data.size(), f) == data.size());
+    fclose(f);
+}
+
+// like the K/V data: 16-bit values whose high bytes repeat
+static std::vector<uint8_t> make_compressible(size_t n, std::mt19937 & rng) {
+    std::vector<uint8_t> data(n);
+    for (size_t i = 0; i < n; i++) {
+        data[i] = i % 2 == 0 ? rng() % 4 : 0x3c;
+    }
+    // a run and a short period, for matches that overlap their source
+    for (size_t i = n/2; i < n/2 + n/8; i++) {
+        data[i] = 0;
+    }
+    for (size_t i = n/4; i < n/4 + n/8; i++) {
+        data[i] = "abc"[i % 3];
+    }
+    return data;
+}
+
+static std::vector<uint8_t> make_random(size_t n, std::mt19937 & rng) {
+    std::vector<uint8_t> data(n);
+    for (auto & x : data) {
+        x = rng();
+    }
+    return data;
+}
+
+static void test_round_trip(const char * name, const std::vector<uint8_t> & state, bool compress) {
+    printf("test-state-file: round trip %s, n_state = %zu, compress = %d\n", name, state.size(), compress);
+
+    const std::vector<llama_token> tokens = { 1, 15043, 3186, 29991 };
+
+    const size_t n_written = common_state_seq_save_file(path, tokens, state, compress);
+    assert(n_written > 0);
+
+    // the compressible inputs go through the LZ4 encoder and decoder
+    if (compress && strncmp(name, "compressible", 12) == 0) {
+        assert(n_written < state.size()/2);
+    }
+
+    std::vector<llama_token> tokens_out;
+    std::vector<uint8_t>     state_out;
+
+    assert(common_state_seq_load_file(path, tokens_out, state_out, tokens.size()) == n_written);
+    assert(tokens_out == tokens);
+    assert(state_out  == state);
+
+    tokens_out.clear();
+    assert(common_state_seq_load_file_tokens(path, tokens_out, tokens.size()) > 0);
+    assert(tokens_out == tokens);
+
+    // more tokens than the capacity
+    assert(common_state_seq_load_file(path, tokens_out, state_out, tokens.size() - 1) == 0);
+}
+
+static void test_truncated(const std::vector<uint8_t> & state) {
+    printf("test-state-file: truncated files, n_state = %zu\n", state.size());
+
+    const std::vector<llama_token> tokens = { 1, 2, 3 };
+
+    assert(common_state_seq_save_file(path, tokens, state, true) > 0);
+
+    const std::vector<uint8_t> data = read_file(path);
+
+    for (size_t n = 0; n < data.size(); n++) {
+        write_file(path, std::vector<uint8_t>(data.begin(), data.begin() + n));
+
+        std::vector<llama_token> tokens_out;
+        std::vector<uint8_t>     state_out;
+        assert(common_state_seq_load_file(path, tokens_out, state_out, tokens.size()) == 0);
+    }
+}
+
+static void test_corrupt(const std::vector<uint8_t> & state, std::mt19937 & rng) {
+    printf("test-state-file: corrupt files, n_state = %zu\n", state.size());
+
+    const std::vector<llama_token> tokens = { 1, 2, 3 };
+
+    assert(common_state_seq_save_file(path, tokens, state, true) > 0);
+
+    const std::vector<uint8_t> data = read_file(path);
+
+    // magic, version, n_tokens, tokens, n_state, then the chunks with n_raw and n_data
+    const size_t off_n_tokens = 2*sizeof(uint32_t);
+    const size_t off_n_state  = off_n_tokens + sizeof(uint32_t) + tokens.size()*sizeof(llama_token);
+    const size_t off_chunk    = off_n_state + sizeof(uint64_t);
+
+    auto load_with = [&](size_t offset, const void * value, size_t size) {
+        std::vector<uint8_t> corrupt = data;
+        memcpy(corrupt.data() + offset, value, size);
+        write_file(path, corrupt);
+
+        std::vector<llama_token> tokens_out;
+        std::vector<uint8_t>     state_out;
+        return common_state_seq_load_file(path, tokens_out, state_out, 1u << 20);
+    };
+
+    // sizes that must be rejected before they are allocated
+    const uint32_t n_tokens_max = UINT32_MAX;
+    assert(load_with(off_n_tokens, &n_tokens_max, sizeof(n_tokens_max)) == 0);
+
+    const uint64_t n_state_max = UINT64_MAX/2;
+    assert(load_with(off_n_state, &n_state_max, sizeof(n_state_max)) == 0);
+
+    const uint64_t n_state_more = state.size() + 1;
+    assert(load_with(off_n_state, &n_state_more, sizeof(n_state_more)) == 0);
+
+    const uint32_t n_raw_max = COMMON_STATE_SEQ_CHUNK + 1;
+    assert(load_with(off_chunk, &n_raw_max, sizeof(n_raw_max)) == 0);
+
+    const uint32_t n_data_max = UINT32_MAX;
+    assert(load_with(off_chunk + sizeof(uint32_t), &n_data_max, sizeof(n_data_max)) == 0);
+
+    // random bytes in the compressed data must not read or write out of bounds, the state keeps its size if it loads
+    for (int i = 0; i < 1000; i++) {
+        std::vector<uint8_t> corrupt = data;
+        for (int j = 0; j < 4; j++) {
+            corrupt[off_chunk + 2*sizeof(uint32_t) + rng() % (corrupt.size() - off_chunk - 2*sizeof(uint32_t))] = rng();
+        }
+        write_file(path, corrupt);
+
+        std::vector<llama_token> tokens_out;
+        std::vector<uint8_t>     state_out;
+        if (common_state_seq_load_file(path, tokens_out, state_out, tokens.size()) > 0) {
+            assert(state_out.size() == state.size());
+        }
+    }
+}
+
+int main(void) {
+    std::mt19937 rng(42);
+
+    for (bool compress : { false, true }) {
+        test_round_trip("empty", {}, compress);
+        test_round_trip("random", make_random(1000, rng), compress);
+        test_round_trip("compressible", make_compressible(1000, rng), compress);
+        test_round_trip("compressible, odd size", make_compressible(65536 + 3, rng), compress);
+        test_round_trip("compressible, several chunks", make_compressible(5*COMMON_STATE_SEQ_CHUNK/2, rng), compress);
+        test_round_trip("random, several chunks", make_random(3*COMMON_STATE_SEQ_CHUNK/2, rng), compress);
+    }
+
+    test_truncated(make_compressible(3000, rng));
+    test_truncated(make_random(300, rng));
+
+    test_corrupt(make_compressible(3000, rng), rng);
+
+    std::remove(path.c_str());
+
+    printf("test-state-file: OK\n");
+
+    return 0;
+}